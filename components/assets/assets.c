@@ -0,0 +1,107 @@
+/*
+ * assets.c
+ *
+ * Image layout (little-endian, written by tools/pack_assets.py):
+ *   0  u32 magic      ASSETS_MAGIC ("AST1")
+ *   4  u16 version    ASSETS_VERSION
+ *   6  u16 count      index entries
+ *   8  u32 size       image size in bytes
+ *  12  u32 crc        CRC-32 of bytes 16..size
+ *  16  index, `count` entries of 32 bytes:
+ *        char name[24]  NUL-padded
+ *        u32 offset     from the start of the image
+ *        u32 size       without the trailing NUL
+ *  then the file data, each file followed by a NUL and padded to 4 bytes.
+ * The whole partition is mapped once into the data cache; the index is
+ * small, so lookups are a linear scan with no copying.
+ */
+#include "assets.h"
+
+#include <stdint.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+
+static const char *TAG = "assets";
+
+#ifndef ASSETS_PARTITION_LABEL
+#define ASSETS_PARTITION_LABEL "assets"
+#endif
+#define ASSETS_MAGIC 0x31545341u /* "AST1" */
+#define ASSETS_VERSION 1
+#define ASSETS_NAME_LEN 24
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;
+    uint32_t size;
+    uint32_t crc;
+} assets_header_t;
+
+typedef struct __attribute__((packed)) {
+    char name[ASSETS_NAME_LEN];
+    uint32_t offset;
+    uint32_t size;
+} assets_entry_t;
+
+static const uint8_t *s_base;
+static const assets_entry_t *s_index;
+static uint16_t s_count;
+static esp_partition_mmap_handle_t s_map;
+
+bool assets_init(void)
+{
+    if (s_base) return true;
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, ASSETS_PARTITION_LABEL);
+    if (!part)
+    {
+        ESP_LOGW(TAG, "no \"%s\" partition", ASSETS_PARTITION_LABEL);
+        return false;
+    }
+    const void *ptr = NULL;
+    esp_err_t err = esp_partition_mmap(part, 0, part->size, ESP_PARTITION_MMAP_DATA, &ptr, &s_map);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "mmap of \"%s\" failed: %s", ASSETS_PARTITION_LABEL, esp_err_to_name(err));
+        return false;
+    }
+
+    const assets_header_t *h = ptr;
+    const char *why = NULL;
+    if (h->magic != ASSETS_MAGIC || h->version != ASSETS_VERSION) why = "no asset image";
+    else if (h->size > part->size || h->size < sizeof(*h) + (size_t)h->count * sizeof(assets_entry_t)) why = "bad size";
+    else if (esp_rom_crc32_le(0, (const uint8_t *)ptr + sizeof(*h), h->size - sizeof(*h)) != h->crc) why = "CRC mismatch";
+    if (!why)
+    {
+        const assets_entry_t *e = (const assets_entry_t *)(h + 1);
+        for (int i = 0; i < h->count && !why; ++i)
+            if (e[i].offset > h->size || e[i].size >= h->size - e[i].offset || memchr(e[i].name, '\0', ASSETS_NAME_LEN) == NULL)
+                why = "bad index entry";
+    }
+    if (why)
+    {
+        ESP_LOGW(TAG, "\"%s\" partition not usable: %s", ASSETS_PARTITION_LABEL, why);
+        esp_partition_munmap(s_map);
+        return false;
+    }
+
+    s_base = ptr;
+    s_index = (const assets_entry_t *)(h + 1);
+    s_count = h->count;
+    ESP_LOGI(TAG, "%u assets mapped (%lu bytes)", (unsigned)s_count, (unsigned long)h->size);
+    return true;
+}
+
+const char *assets_get(const char *name, size_t *len)
+{
+    if (!s_base || !name) return NULL;
+    for (int i = 0; i < s_count; ++i)
+    {
+        if (strncmp(s_index[i].name, name, ASSETS_NAME_LEN) != 0) continue;
+        if (len) *len = s_index[i].size;
+        return (const char *)s_base + s_index[i].offset;
+    }
+    return NULL;
+}
@@ -0,0 +1,38 @@
+/*
+ * assets.h
+ *
+ * Read-only files (web page, CA bundle) packed at build time by
+ * tools/pack_assets.py into the "assets" partition and memory-mapped at
+ * boot. Lookups return pointers straight into the flash cache: nothing is
+ * copied to the heap and no filesystem is involved.
+ */
+
+#ifndef ASSETS_H
+#define ASSETS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Map the asset partition and check its index and CRC. Returns false (and
+ * every lookup then fails) if the partition is missing, empty or damaged.
+ */
+bool assets_init(void);
+
+/**
+ * Find asset `name` (e.g. "index.htm"). Returns a pointer into mapped
+ * flash, valid for the lifetime of the firmware, and its size in `len`;
+ * the data is followed by a NUL, so text assets can be used as C strings.
+ * NULL if there is no such asset.
+ */
+const char *assets_get(const char *name, size_t *len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ASSETS_H
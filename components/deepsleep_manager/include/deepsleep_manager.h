@@ -9,11 +9,17 @@ extern "C" {
 /*
  * deepsleep_manager
  * -----------------
- * High-level API for managing a persisted deep-sleep configuration stored
- * in the data partition as `sleep.txt` (three lines):
- *   1) interval_ms   - deep-sleep wake interval in milliseconds (0 == disabled)
- *   2) idle_timeout  - how long the device remains active before entering sleep
- *   3) enabled_flag  - 1 == enabled, 0 == disabled
+ * High-level API for managing a persisted deep-sleep configuration kept in
+ * the config store (see config_store.h):
+ *   interval_ms   - deep-sleep wake interval in milliseconds (0 == disabled)
+ *   idle_timeout  - how long the device remains active before entering sleep
+ *   enabled_flag  - 1 == enabled, 0 == disabled
+ *   batch_wakes   - timer wakes per upload; the others only sample (see rtc_batch.h)
+ * A `sleep.txt` left by older firmware is imported on the first boot.
+ *
+ * The setters write through to flash and return false if that failed; the
+ * new value is in effect regardless and the write is retried in the
+ * background.
  *
  * This module provides helpers to read and persist those values and to
  * coordinate entering deep sleep. The design separates setting the
@@ -22,8 +28,9 @@ extern "C" {
  * to begin the idle timer (for example after network initialization).
  */
 
-// Initialize the deep-sleep manager; reads saved interval from filesystem (`sleep.txt`).
-// storage_root should be the mounted data partition root (for example "/filesystem").
+// Initialize the deep-sleep manager; imports `sleep.txt` from storage_root if the
+// config store has no settings yet. storage_root should be the mounted data
+// partition root (for example "/filesystem"). Call after config_store_init().
 bool deepsleep_manager_init(const char *storage_root);
 
 // Set and persist the deep sleep interval (milliseconds)
@@ -43,10 +50,16 @@ uint64_t deepsleep_manager_get_interval_ms(void);
 void deepsleep_manager_maybe_sleep_after_publish(void);
 
 // Enable/disable deep-sleep without changing the configured interval.
-// Persisted as the third line of sleep.txt: '1' == enabled, '0' == disabled.
+// Persisted in the config store (CONFIG_SLEEP_ENABLED).
 bool deepsleep_manager_set_enabled(bool enabled);
 bool deepsleep_manager_is_enabled(void);
 
+// Upload on every `wakes`-th timer wake only (0 or 1 = every wake); the
+// application takes a sample into the RTC batch on the others and sleeps
+// again at once. Persisted in the config store (CONFIG_SLEEP_BATCH_WAKES).
+bool deepsleep_manager_set_batch_wakes(uint32_t wakes);
+uint32_t deepsleep_manager_get_batch_wakes(void);
+
 // Start the idle countdown (based on the configured idle timeout) without
 // changing persistence. Should be called once the system is network-ready
 // to begin the idle timer that will eventually call maybe_sleep.
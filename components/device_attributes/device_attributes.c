@@ -0,0 +1,251 @@
+/*
+ * device_attributes.c
+ *
+ * Change-only client-attribute publisher. Each key holds its value already
+ * rendered as JSON text, so change detection is a string compare and a
+ * publish is a concatenation of the dirty keys. The snapshot and the
+ * "published" mask live in RTC memory: after a deep-sleep wake nothing is
+ * read from NVS and nothing is republished unless it changed. On a cold
+ * boot the firmware identity is read from NVS once and every key is sent
+ * once.
+ *
+ * The one-time OTA confirmation ("fw_state":"UPDATED") is sent from here as
+ * well, since it depends on the firmware identity this module owns.
+ */
+#include "device_attributes.h"
+#include "mqtt.h"
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_netif.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+#include "nvs.h"
+
+static const char *TAG = "device_attr";
+
+/* Changes are collected for this long before one publish. */
+#ifndef DEVICE_ATTR_DEBOUNCE_MS
+#define DEVICE_ATTR_DEBOUNCE_MS 2000
+#endif
+
+/* Quantisation of noisy values so they do not publish on every sample. */
+#ifndef DEVICE_ATTR_RSSI_STEP
+#define DEVICE_ATTR_RSSI_STEP 5
+#endif
+#ifndef DEVICE_ATTR_HEAP_STEP_KB
+#define DEVICE_ATTR_HEAP_STEP_KB 4
+#endif
+
+#define DEVICE_ATTR_VALUE_LEN 48
+#define DEVICE_ATTR_RTC_MAGIC 0x44415431u /* "DAT1" */
+
+static const char *const s_keys[DEVICE_ATTR_COUNT] = {
+    [DEVICE_ATTR_FW_TITLE] = "current_fw_title",
+    [DEVICE_ATTR_FW_VERSION] = "current_fw_version",
+    [DEVICE_ATTR_IP] = "ip",
+    [DEVICE_ATTR_RSSI] = "rssi",
+    [DEVICE_ATTR_FREE_HEAP] = "free_heap_kb",
+    [DEVICE_ATTR_RESET_REASON] = "reset_reason",
+    [DEVICE_ATTR_DISTANCE_OK] = "sensor_distance_ok",
+    [DEVICE_ATTR_ADC_OK] = "sensor_adc_ok",
+};
+
+typedef struct {
+    uint32_t magic;
+    uint32_t published;      /* bit per key: the server has the current value */
+    bool fw_confirmed;       /* OTA confirmation sent (or not needed) */
+    char fw_version_raw[DEVICE_ATTR_VALUE_LEN];
+    char values[DEVICE_ATTR_COUNT][DEVICE_ATTR_VALUE_LEN]; /* JSON text, "" = unset */
+} device_attr_snapshot_t;
+
+static RTC_DATA_ATTR device_attr_snapshot_t s_snap;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t s_debounce = NULL;
+static uint32_t s_changed; /* bit per key: value changed since it was last rendered for a publish */
+
+static void device_attributes_publish_dirty(void)
+{
+    if (!mqtt_is_connected()) return; /* the connect callback sends them */
+
+    char payload[DEVICE_ATTR_COUNT * (DEVICE_ATTR_VALUE_LEN + 24) + 2];
+    size_t off = 0;
+    uint32_t sent = 0;
+    portENTER_CRITICAL(&s_lock);
+    for (int k = 0; k < DEVICE_ATTR_COUNT; ++k)
+    {
+        if ((s_snap.published & (1u << k)) || s_snap.values[k][0] == '\0') continue;
+        off += (size_t)snprintf(payload + off, sizeof(payload) - off, "%c\"%s\":%s", sent ? ',' : '{', s_keys[k], s_snap.values[k]);
+        sent |= 1u << k;
+    }
+    s_changed &= ~sent;
+    portEXIT_CRITICAL(&s_lock);
+    if (!sent) return;
+    snprintf(payload + off, sizeof(payload) - off, "}");
+    if (!mqtt_publish_attributes(payload))
+    {
+        ESP_LOGW(TAG, "attributes not queued, retrying on the next change or reconnect");
+        return;
+    }
+    // keys updated while the payload was being queued stay unpublished
+    portENTER_CRITICAL(&s_lock);
+    s_snap.published |= sent & ~s_changed;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+static void device_attributes_debounce_cb(void *arg)
+{
+    (void)arg;
+    device_attributes_publish_dirty();
+}
+
+// Store the rendered value; schedule a publish when it differs.
+static void device_attributes_update(device_attr_t key, const char *json_value)
+{
+    if (key < 0 || key >= DEVICE_ATTR_COUNT) return;
+    bool changed = false;
+    portENTER_CRITICAL(&s_lock);
+    if (strcmp(s_snap.values[key], json_value) != 0)
+    {
+        snprintf(s_snap.values[key], DEVICE_ATTR_VALUE_LEN, "%s", json_value);
+        s_snap.published &= ~(1u << key);
+        s_changed |= 1u << key;
+        changed = true;
+    }
+    portEXIT_CRITICAL(&s_lock);
+    // the first change starts the window; later ones ride along
+    if (changed && s_debounce && !esp_timer_is_active(s_debounce))
+        esp_timer_start_once(s_debounce, (uint64_t)DEVICE_ATTR_DEBOUNCE_MS * 1000);
+}
+
+void device_attributes_set_str(device_attr_t key, const char *value)
+{
+    char json[DEVICE_ATTR_VALUE_LEN];
+    size_t o = 0;
+    json[o++] = '"';
+    for (const char *p = value ? value : ""; *p && o < sizeof(json) - 3; ++p)
+    {
+        if (*p == '"' || *p == '\\') json[o++] = '\\';
+        json[o++] = *p;
+    }
+    json[o++] = '"';
+    json[o] = '\0';
+    device_attributes_update(key, json);
+}
+
+void device_attributes_set_int(device_attr_t key, int32_t value)
+{
+    char json[16];
+    snprintf(json, sizeof(json), "%ld", (long)value);
+    device_attributes_update(key, json);
+}
+
+void device_attributes_set_bool(device_attr_t key, bool value)
+{
+    device_attributes_update(key, value ? "true" : "false");
+}
+
+void device_attributes_refresh(void)
+{
+    esp_netif_t *sta = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
+    esp_netif_ip_info_t ip;
+    if (sta && esp_netif_get_ip_info(sta, &ip) == ESP_OK && ip.ip.addr != 0)
+    {
+        char buf[16];
+        snprintf(buf, sizeof(buf), IPSTR, IP2STR(&ip.ip));
+        device_attributes_set_str(DEVICE_ATTR_IP, buf);
+    }
+
+    wifi_ap_record_t ap;
+    if (esp_wifi_sta_get_ap_info(&ap) == ESP_OK)
+    {
+        int rssi = ap.rssi - (((ap.rssi % DEVICE_ATTR_RSSI_STEP) + DEVICE_ATTR_RSSI_STEP) % DEVICE_ATTR_RSSI_STEP);
+        device_attributes_set_int(DEVICE_ATTR_RSSI, rssi);
+    }
+
+    uint32_t heap_kb = esp_get_free_heap_size() / 1024;
+    device_attributes_set_int(DEVICE_ATTR_FREE_HEAP, (int32_t)(heap_kb - heap_kb % DEVICE_ATTR_HEAP_STEP_KB));
+}
+
+static const char *device_attributes_reset_reason(void)
+{
+    switch (esp_reset_reason())
+    {
+    case ESP_RST_POWERON: return "poweron";
+    case ESP_RST_EXT: return "external";
+    case ESP_RST_SW: return "software";
+    case ESP_RST_PANIC: return "panic";
+    case ESP_RST_INT_WDT: return "int_wdt";
+    case ESP_RST_TASK_WDT: return "task_wdt";
+    case ESP_RST_WDT: return "wdt";
+    case ESP_RST_DEEPSLEEP: return "deepsleep";
+    case ESP_RST_BROWNOUT: return "brownout";
+    case ESP_RST_SDIO: return "sdio";
+    default: return "unknown";
+    }
+}
+
+// Send the OTA confirmation telemetry once after booting a new image and
+// record it in NVS so ThingsBoard knows the update succeeded.
+static void device_attributes_confirm_fw(void)
+{
+    nvs_handle_t nh;
+    if (nvs_open("ota", NVS_READWRITE, &nh) != ESP_OK) return;
+    char payload[128];
+    snprintf(payload, sizeof(payload), "{\"fw_state\":\"UPDATED\",\"current_fw_version\":\"%s\"}", s_snap.fw_version_raw);
+    mqtt_publish_ota_state(payload);
+    nvs_set_i32(nh, "confirmed", 1);
+    nvs_commit(nh);
+    nvs_close(nh);
+    s_snap.fw_confirmed = true;
+    ESP_LOGI(TAG, "Published OTA confirmation telemetry for version=%s", s_snap.fw_version_raw);
+}
+
+static void device_attributes_on_connected(bool session_resumed, void *ctx)
+{
+    (void)session_resumed;
+    (void)ctx;
+    if (!s_snap.fw_confirmed) device_attributes_confirm_fw();
+    if (s_debounce) esp_timer_stop(s_debounce);
+    device_attributes_publish_dirty();
+}
+
+void device_attributes_init(void)
+{
+    if (s_snap.magic != DEVICE_ATTR_RTC_MAGIC || esp_reset_reason() != ESP_RST_DEEPSLEEP)
+    {
+        memset(&s_snap, 0, sizeof(s_snap));
+        s_snap.magic = DEVICE_ATTR_RTC_MAGIC;
+
+        // firmware identity persisted by the OTA manager (namespace "ota")
+        char title[DEVICE_ATTR_VALUE_LEN] = "";
+        nvs_handle_t nh;
+        s_snap.fw_confirmed = true;
+        if (nvs_open("ota", NVS_READONLY, &nh) == ESP_OK)
+        {
+            size_t vsz = sizeof(s_snap.fw_version_raw);
+            size_t tsz = sizeof(title);
+            nvs_get_str(nh, "version", s_snap.fw_version_raw, &vsz);
+            nvs_get_str(nh, "title", title, &tsz);
+            int32_t confirmed = 0;
+            s_snap.fw_confirmed = s_snap.fw_version_raw[0] == '\0' ||
+                                  (nvs_get_i32(nh, "confirmed", &confirmed) == ESP_OK && confirmed != 0);
+            nvs_close(nh);
+        }
+        if (title[0]) device_attributes_set_str(DEVICE_ATTR_FW_TITLE, title);
+        if (s_snap.fw_version_raw[0]) device_attributes_set_str(DEVICE_ATTR_FW_VERSION, s_snap.fw_version_raw);
+    }
+    device_attributes_set_str(DEVICE_ATTR_RESET_REASON, device_attributes_reset_reason());
+
+    const esp_timer_create_args_t args = {
+        .callback = device_attributes_debounce_cb,
+        .name = "attr_debounce",
+    };
+    if (esp_timer_create(&args, &s_debounce) != ESP_OK)
+        ESP_LOGW(TAG, "debounce timer unavailable; changes go out on the next connect");
+    mqtt_register_connected_callback(device_attributes_on_connected, NULL);
+}
@@ -0,0 +1,50 @@
+/*
+ * device_attributes.h
+ *
+ * ThingsBoard client attributes kept as a RAM snapshot with dirty
+ * tracking. Setters only mark keys whose value changed; the changed keys
+ * are published together after a short debounce, and nothing is sent on
+ * reconnect unless something changed.
+ */
+
+#ifndef DEVICE_ATTRIBUTES_H
+#define DEVICE_ATTRIBUTES_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    DEVICE_ATTR_FW_TITLE = 0,   /* current_fw_title */
+    DEVICE_ATTR_FW_VERSION,     /* current_fw_version */
+    DEVICE_ATTR_IP,             /* ip */
+    DEVICE_ATTR_RSSI,           /* rssi (dBm, rounded to 5) */
+    DEVICE_ATTR_FREE_HEAP,      /* free_heap_kb (rounded to 4 KB) */
+    DEVICE_ATTR_RESET_REASON,   /* reset_reason */
+    DEVICE_ATTR_DISTANCE_OK,    /* sensor_distance_ok */
+    DEVICE_ATTR_ADC_OK,         /* sensor_adc_ok */
+    DEVICE_ATTR_COUNT
+} device_attr_t;
+
+/**
+ * Load the snapshot: after a deep-sleep wake from RTC memory, otherwise
+ * from NVS (firmware identity) and the reset reason. This is the only NVS
+ * read. Also hooks the MQTT connect event. Call after nvs_flash_init().
+ */
+void device_attributes_init(void);
+
+void device_attributes_set_str(device_attr_t key, const char *value);
+void device_attributes_set_int(device_attr_t key, int32_t value);
+void device_attributes_set_bool(device_attr_t key, bool value);
+
+/** Sample IP address, RSSI and free heap and update their keys. */
+void device_attributes_refresh(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DEVICE_ATTRIBUTES_H
@@ -0,0 +1,144 @@
+/*
+ * egress_governor.c
+ *
+ * One token bucket per traffic class. Buckets refill continuously at
+ * `rate` bytes per second up to `burst` bytes; the fill level is kept in
+ * byte-microseconds so slow rates do not lose fractions between calls.
+ * Callers that can defer (the MQTT sender keeps the message queued) use
+ * egress_try_consume(); blocking senders (Telegram) use
+ * egress_consume_wait().
+ */
+#include "egress_governor.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+static const char *TAG = "egress";
+
+/* Default budgets, bytes per second / burst bytes. */
+#ifndef EGRESS_TELEMETRY_RATE
+#define EGRESS_TELEMETRY_RATE 1024
+#endif
+#ifndef EGRESS_TELEMETRY_BURST
+#define EGRESS_TELEMETRY_BURST 8192
+#endif
+#ifndef EGRESS_ALERT_RATE
+#define EGRESS_ALERT_RATE 2048
+#endif
+#ifndef EGRESS_ALERT_BURST
+#define EGRESS_ALERT_BURST 4096
+#endif
+#ifndef EGRESS_TELEGRAM_RATE
+#define EGRESS_TELEGRAM_RATE 512
+#endif
+#ifndef EGRESS_TELEGRAM_BURST
+#define EGRESS_TELEGRAM_BURST 2048
+#endif
+#ifndef EGRESS_OTA_STATUS_RATE
+#define EGRESS_OTA_STATUS_RATE 256
+#endif
+#ifndef EGRESS_OTA_STATUS_BURST
+#define EGRESS_OTA_STATUS_BURST 1024
+#endif
+
+#define US_PER_S 1000000LL
+
+typedef struct {
+    uint32_t rate;        /* bytes per second, 0 = unlimited */
+    uint32_t burst;       /* bucket size in bytes */
+    int64_t level;        /* byte-microseconds currently available */
+    int64_t last_us;      /* last refill */
+    egress_class_stats_t stats;
+} egress_bucket_t;
+
+static egress_bucket_t s_buckets[EGRESS_CLASS_COUNT] = {
+    [EGRESS_CLASS_TELEMETRY] = { EGRESS_TELEMETRY_RATE, EGRESS_TELEMETRY_BURST, -1, 0, {0} },
+    [EGRESS_CLASS_ALERT] = { EGRESS_ALERT_RATE, EGRESS_ALERT_BURST, -1, 0, {0} },
+    [EGRESS_CLASS_TELEGRAM] = { EGRESS_TELEGRAM_RATE, EGRESS_TELEGRAM_BURST, -1, 0, {0} },
+    [EGRESS_CLASS_OTA_STATUS] = { EGRESS_OTA_STATUS_RATE, EGRESS_OTA_STATUS_BURST, -1, 0, {0} },
+};
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static const char *const s_class_names[EGRESS_CLASS_COUNT] = { "telemetry", "alert", "telegram", "ota_status" };
+
+// Bring the bucket up to date; a level of -1 marks a bucket that starts full.
+static void egress_refill_locked(egress_bucket_t *b, int64_t now)
+{
+    int64_t cap = (int64_t)b->burst * US_PER_S;
+    if (b->level < 0)
+        b->level = cap;
+    else
+        b->level += (now - b->last_us) * b->rate;
+    if (b->level > cap) b->level = cap;
+    b->last_us = now;
+}
+
+uint32_t egress_try_consume(egress_class_t cls, size_t bytes)
+{
+    if (cls < 0 || cls >= EGRESS_CLASS_COUNT) return 0;
+    egress_bucket_t *b = &s_buckets[cls];
+    uint32_t wait_ms = 0;
+    portENTER_CRITICAL(&s_lock);
+    if (b->rate != 0)
+    {
+        egress_refill_locked(b, esp_timer_get_time());
+        int64_t cost = (int64_t)(bytes < b->burst ? bytes : b->burst) * US_PER_S;
+        if (b->level >= cost)
+        {
+            b->level -= cost;
+        }
+        else
+        {
+            wait_ms = (uint32_t)((cost - b->level) / b->rate / 1000) + 1;
+            b->stats.deferred++;
+        }
+    }
+    if (wait_ms == 0)
+    {
+        b->stats.sent_msgs++;
+        b->stats.sent_bytes += (uint32_t)bytes;
+    }
+    portEXIT_CRITICAL(&s_lock);
+    return wait_ms;
+}
+
+bool egress_consume_wait(egress_class_t cls, size_t bytes, uint32_t timeout_ms)
+{
+    int64_t deadline = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+    for (;;)
+    {
+        uint32_t wait_ms = egress_try_consume(cls, bytes);
+        if (wait_ms == 0) return true;
+        int64_t left_ms = (deadline - esp_timer_get_time()) / 1000;
+        if (left_ms <= 0 || wait_ms > left_ms)
+        {
+            portENTER_CRITICAL(&s_lock);
+            s_buckets[cls].stats.rejected++;
+            portEXIT_CRITICAL(&s_lock);
+            ESP_LOGW(TAG, "%s budget exhausted; giving up on %u bytes", s_class_names[cls], (unsigned)bytes);
+            return false;
+        }
+        vTaskDelay(pdMS_TO_TICKS(wait_ms) ? pdMS_TO_TICKS(wait_ms) : 1);
+    }
+}
+
+void egress_set_budget(egress_class_t cls, uint32_t bytes_per_s, uint32_t burst_bytes)
+{
+    if (cls < 0 || cls >= EGRESS_CLASS_COUNT) return;
+    portENTER_CRITICAL(&s_lock);
+    s_buckets[cls].rate = bytes_per_s;
+    s_buckets[cls].burst = burst_bytes ? burst_bytes : 1;
+    s_buckets[cls].level = -1;
+    portEXIT_CRITICAL(&s_lock);
+    ESP_LOGI(TAG, "%s budget: %lu B/s, burst %lu B", s_class_names[cls], (unsigned long)bytes_per_s, (unsigned long)burst_bytes);
+}
+
+void egress_get_stats(egress_class_t cls, egress_class_stats_t *out)
+{
+    if (!out || cls < 0 || cls >= EGRESS_CLASS_COUNT) return;
+    portENTER_CRITICAL(&s_lock);
+    *out = s_buckets[cls].stats;
+    portEXIT_CRITICAL(&s_lock);
+}
@@ -0,0 +1,63 @@
+/*
+ * egress_governor.h
+ *
+ * Token-bucket rate limiter shared by everything that sends data off the
+ * device (MQTT publish queue, Telegram replies). Each traffic class has its
+ * own budget in bytes per second plus a burst allowance, so a command storm
+ * or an OTA progress stream cannot starve the other classes of the link.
+ */
+
+#ifndef EGRESS_GOVERNOR_H
+#define EGRESS_GOVERNOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    EGRESS_CLASS_TELEMETRY = 0, /* periodic telemetry and backlog replay */
+    EGRESS_CLASS_ALERT,         /* alerts */
+    EGRESS_CLASS_TELEGRAM,      /* Telegram bot messages */
+    EGRESS_CLASS_OTA_STATUS,    /* OTA state/progress telemetry */
+    EGRESS_CLASS_COUNT
+} egress_class_t;
+
+/** Traffic that is not metered (RPC replies, attributes). */
+#define EGRESS_CLASS_NONE EGRESS_CLASS_COUNT
+
+typedef struct {
+    uint32_t sent_msgs;
+    uint32_t sent_bytes;
+    uint32_t deferred;   /* times a send was held back for lack of budget */
+    uint32_t rejected;   /* sends given up after waiting (egress_consume_wait) */
+} egress_class_stats_t;
+
+/**
+ * Take `bytes` from the budget of `cls`. Returns 0 when the send may go
+ * ahead, otherwise the number of milliseconds until it would fit; nothing is
+ * consumed in that case. A message larger than the burst allowance is
+ * charged the burst size so it can never be starved. Never blocks.
+ */
+uint32_t egress_try_consume(egress_class_t cls, size_t bytes);
+
+/**
+ * Like egress_try_consume() but waits (sleeping the calling task) up to
+ * `timeout_ms` for the budget. Returns false when it timed out.
+ */
+bool egress_consume_wait(egress_class_t cls, size_t bytes, uint32_t timeout_ms);
+
+/** Change the budget of `cls`; `bytes_per_s` == 0 removes the limit. */
+void egress_set_budget(egress_class_t cls, uint32_t bytes_per_s, uint32_t burst_bytes);
+
+/** Copy the counters of `cls` into `out`. */
+void egress_get_stats(egress_class_t cls, egress_class_stats_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // EGRESS_GOVERNOR_H
@@ -0,0 +1,1127 @@
+/*
+ * history.c
+ *
+ * Log-structured sample store on the raw "history" partition. The
+ * partition is split into one ring per tier (raw samples, 1-minute and
+ * 1-hour rollups), each a run of consecutive sectors. Every sector of a
+ * ring is one segment: a 16-byte header {magic, segment seq, erase count,
+ * CRC} followed by HISTORY_BLOCKS compressed blocks of HISTORY_BLOCK_SIZE
+ * bytes. Segments are filled in sector order: when the head segment is
+ * full the next sector of the ring (its oldest segment) is erased and
+ * becomes the new head with seq + 1. Every sector is therefore erased once
+ * per lap, and a block is written once, into already-erased flash.
+ *
+ * Rows are compressed in the style of Facebook's Gorilla TSDB, like the
+ * binary telemetry stream: timestamps as delta-of-delta, seq as the gap
+ * to the previous seq, values as the delta to the column's previous
+ * value, each zigzag-mapped and written with a short prefix code. A steady
+ * sampling period, a consecutive seq and an unchanged column cost one bit
+ * each. Block layout (little-endian header):
+ *   0  u16 magic      HISTORY_BLOCK_MAGIC
+ *   2  u16 samples    rows in the block
+ *   4  u16 bits       bit stream length
+ *   6  u16 crc        CRC-16 of bytes 0..5 and 8..end of the bit stream
+ *   8  u32 first_seq  seq of the first row
+ *  12  i64 t0         timestamp of the first row
+ *  20  bit stream, MSB first; per row:
+ *        code(dod)                         dod = (t - prev_t) - prev_delta
+ *        code(seq - prev_seq - 1)
+ *        '0' | '1' + 8 bits                flags unchanged / new flags
+ *        '0' | '1' + <width> bits          presence mask unchanged / new mask
+ *        code(v - prev_v)                  for each present column
+ *      starting from prev_t = t0, prev_delta = 0, prev_seq = first_seq - 1
+ *      and zero flags, mask and values. code() is '0' for 0, else '10',
+ *      '110', '1110' or '1111' followed by 6, 13, 20 or 40 bits of the
+ *      zigzag-mapped value.
+ * Raw rows have the HISTORY_MAX_CHANNELS values as columns. Rollup rows
+ * have seq = bucket number, ts = bucket start and the columns {count,
+ * min[], max[], mean[], n[]}, n[c] being the samples that had channel c;
+ * a channel with gaps is averaged and counted over its own samples.
+ *
+ * Rollups are accumulated as samples arrive: each rollup tier keeps one
+ * open bucket (count, per-channel min/max/sum) and writes it out when a
+ * sample for a later bucket comes in. The open blocks and buckets are kept
+ * in RTC memory (not initialised at reset, checked by CRC), so they
+ * survive deep sleep, panics and restarts; only a power loss drops them. A
+ * block is written to flash when the next row no longer fits. Its place
+ * on flash is fixed when it is opened, so a read cursor that is in the
+ * open block stays valid when the block is sealed.
+ *
+ * Each ring keeps a RAM index of the first timestamp of every segment,
+ * built from the block headers at boot, so queries find their start with a
+ * scan of the index and a look at 8 block headers instead of decoding from
+ * the oldest row. Only wall-clock times are indexed: rows logged before
+ * the clock was set carry ms since boot, which do not order against
+ * anything else, so segments and blocks that start with one are passed
+ * over when seeking.
+ *
+ * Recovery after power loss reads a ring's segment headers, takes the
+ * valid one with the highest seq as the head and scans it for the first
+ * erased block. A sector whose header is missing or damaged (e.g. power
+ * lost between erase and header write) counts as free; a torn block fails
+ * its CRC and is skipped by readers. After a deep sleep the head positions
+ * are kept in RTC memory and only checked, not rebuilt.
+ */
+#include "history.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+static const char *TAG = "history";
+
+#ifndef HISTORY_PARTITION_LABEL
+#define HISTORY_PARTITION_LABEL "history"
+#endif
+/* Sectors of the rollup rings; the raw ring gets the rest. */
+#ifndef HISTORY_MINUTE_SECTORS
+#define HISTORY_MINUTE_SECTORS 48
+#endif
+#ifndef HISTORY_HOUR_SECTORS
+#define HISTORY_HOUR_SECTORS 8
+#endif
+
+#define HISTORY_SECTOR_SIZE 4096
+/* "HS<id>2": one segment magic per ring */
+#define HISTORY_SEGMENT_MAGIC(id) (0x32005348u | ((uint32_t)(id) << 16))
+#define HISTORY_HDR_SIZE 16
+#define HISTORY_BLOCKS 8
+#define HISTORY_BLOCK_SIZE ((HISTORY_SECTOR_SIZE - HISTORY_HDR_SIZE) / HISTORY_BLOCKS)
+#define HISTORY_BLOCK_MAGIC 0x4248u       /* "HB" */
+#define HISTORY_BLOCK_HDR_SIZE 20
+#define HISTORY_STREAM_BITS ((HISTORY_BLOCK_SIZE - HISTORY_BLOCK_HDR_SIZE) * 8)
+#define HISTORY_RTC_MAGIC 0x48495354u
+#define HISTORY_STAGE_MAGIC 0x48535447u
+#define HISTORY_BUCKET_MAGIC 0x48424B54u
+/* Bytes fetched per flash read while decoding. */
+#define HISTORY_READ_WINDOW 32
+
+/* Rollup row columns */
+#define COL_COUNT 0
+#define COL_MIN(c) (1 + (c))
+#define COL_MAX(c) (1 + HISTORY_MAX_CHANNELS + (c))
+#define COL_MEAN(c) (1 + 2 * HISTORY_MAX_CHANNELS + (c))
+#define COL_N(c) (1 + 3 * HISTORY_MAX_CHANNELS + (c))
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t erase_count;
+    uint32_t crc;
+} history_segment_hdr_t;
+
+typedef struct __attribute__((packed)) {
+    uint16_t magic;
+    uint16_t samples;
+    uint16_t bits;
+    uint16_t crc;
+    uint32_t first_seq;
+    int64_t t0;
+} history_block_hdr_t;
+
+_Static_assert(sizeof(history_block_hdr_t) == HISTORY_BLOCK_HDR_SIZE, "block header layout");
+_Static_assert(HISTORY_ROW_VALUES <= 32, "row presence mask is 32 bits");
+
+typedef struct {
+    uint32_t magic;
+    uint32_t head_sector;        /* relative to the ring's first sector */
+    uint32_t head_seq;
+    uint32_t tail_seq;
+    uint32_t head_block;
+    uint32_t max_erase_count;
+} history_state_t;
+
+/* The open block and the encoder state behind it. */
+typedef struct {
+    uint32_t magic;
+    uint32_t crc;                /* CRC-32 of everything after this field */
+    uint32_t target_seq;         /* where the block will be sealed */
+    uint32_t target_block;
+    int64_t last_delta;
+    history_row_t last;
+    union {
+        history_block_hdr_t hdr;
+        uint8_t raw[HISTORY_BLOCK_SIZE];
+    } block;
+} history_stage_t;
+
+/* Open rollup bucket. */
+typedef struct {
+    uint32_t magic;
+    uint32_t crc;                /* CRC-32 of everything after this field */
+    int64_t bucket;              /* ts_ms / period */
+    uint32_t count;
+    uint8_t flags;
+    uint8_t present;
+    uint32_t n[HISTORY_MAX_CHANNELS];
+    int32_t min[HISTORY_MAX_CHANNELS];
+    int32_t max[HISTORY_MAX_CHANNELS];
+    int64_t sum[HISTORY_MAX_CHANNELS];
+} history_bucket_t;
+
+typedef struct {
+    char id;                     /* segment magic letter */
+    uint8_t width;               /* columns per row */
+    uint32_t period_ms;          /* rollup bucket length, 0 for raw */
+    uint32_t first_sector;
+    uint32_t sectors;
+    history_stats_t stats;
+} history_ring_t;
+
+static history_ring_t s_rings[HISTORY_TIER_COUNT] = {
+    [HISTORY_TIER_RAW] = { .id = 'T', .width = HISTORY_MAX_CHANNELS },
+    /* lower case since rollup rows carry n[]; 'M'/'H' segments of the older rows are reused as free */
+    [HISTORY_TIER_MINUTE] = { .id = 'm', .width = HISTORY_ROW_VALUES, .period_ms = 60 * 1000 },
+    [HISTORY_TIER_HOUR] = { .id = 'h', .width = HISTORY_ROW_VALUES, .period_ms = 60 * 60 * 1000 },
+};
+static const esp_partition_t *s_part = NULL;
+static const char *const *s_channels;
+static uint8_t s_channel_count;
+/* First timestamp per sector, INT64_MIN when unknown, empty or not wall-clock. */
+static int64_t *s_index[HISTORY_TIER_COUNT];
+static RTC_DATA_ATTR history_state_t s_state[HISTORY_TIER_COUNT];
+static RTC_NOINIT_ATTR history_stage_t s_stage[HISTORY_TIER_COUNT];
+static RTC_NOINIT_ATTR history_bucket_t s_bucket[HISTORY_TIER_COUNT];
+static SemaphoreHandle_t s_lock = NULL;
+
+static history_tier_t ring_tier(const history_ring_t *r)
+{
+    return (history_tier_t)(r - s_rings);
+}
+
+static uint32_t hdr_crc(const history_segment_hdr_t *h)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)h, offsetof(history_segment_hdr_t, crc));
+}
+
+// CRC-32 of a RTC structure after its {magic, crc} prefix.
+static uint32_t rtc_crc(const void *p, size_t size)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)p + 8, size - 8);
+}
+
+static size_t sector_offset(const history_ring_t *r, uint32_t sector)
+{
+    return (size_t)(r->first_sector + sector) * HISTORY_SECTOR_SIZE;
+}
+
+static size_t block_offset(const history_ring_t *r, uint32_t sector, uint32_t block)
+{
+    return sector_offset(r, sector) + HISTORY_HDR_SIZE + (size_t)block * HISTORY_BLOCK_SIZE;
+}
+
+static bool read_hdr(const history_ring_t *r, uint32_t sector, history_segment_hdr_t *h)
+{
+    if (esp_partition_read(s_part, sector_offset(r, sector), h, sizeof(*h)) != ESP_OK) return false;
+    return h->magic == HISTORY_SEGMENT_MAGIC(r->id) && h->crc == hdr_crc(h);
+}
+
+static bool block_hdr_erased(const history_block_hdr_t *h)
+{
+    const uint8_t *p = (const uint8_t *)h;
+    for (size_t i = 0; i < sizeof(*h); ++i)
+        if (p[i] != 0xFF) return false;
+    return true;
+}
+
+// Flags of a block's first row. Its time and seq codes are '0' by
+// construction, so the flags field starts at bit 2 of the stream.
+static uint8_t block_first_flags(const uint8_t *stream)
+{
+    if (!(stream[0] & 0x20)) return 0;
+    return (uint8_t)(((stream[0] & 0x1F) << 3) | (stream[1] >> 5));
+}
+
+// Index entry of a block: its t0 if it starts with a wall-clock row.
+static int64_t block_index_ts(const history_block_hdr_t *h, const uint8_t *stream)
+{
+    return (block_first_flags(stream) & HISTORY_FLAG_WALLCLOCK) ? h->t0 : INT64_MIN;
+}
+
+// Header and the first stream bytes of a sealed block; false if there is none.
+static bool read_block_start(const history_ring_t *r, uint32_t sector, uint32_t block, history_block_hdr_t *h, uint8_t stream[2])
+{
+    uint8_t buf[HISTORY_BLOCK_HDR_SIZE + 2];
+    if (esp_partition_read(s_part, block_offset(r, sector, block), buf, sizeof(buf)) != ESP_OK) return false;
+    memcpy(h, buf, sizeof(*h));
+    memcpy(stream, buf + HISTORY_BLOCK_HDR_SIZE, 2);
+    return h->magic == HISTORY_BLOCK_MAGIC;
+}
+
+// Sector holding segment `seq`; segments occupy consecutive sectors.
+static uint32_t seq_sector(const history_ring_t *r, uint32_t seq)
+{
+    const history_state_t *st = &s_state[ring_tier(r)];
+    uint32_t back = st->head_seq - seq;
+    return (st->head_sector + r->sectors - back % r->sectors) % r->sectors;
+}
+
+// Erase `sector` and make it segment `seq`.
+static bool start_segment(history_ring_t *r, uint32_t sector, uint32_t seq)
+{
+    history_state_t *st = &s_state[ring_tier(r)];
+    history_segment_hdr_t old;
+    uint32_t erase_count = read_hdr(r, sector, &old) ? old.erase_count + 1 : 1;
+    if (esp_partition_erase_range(s_part, sector_offset(r, sector), HISTORY_SECTOR_SIZE) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "erase of sector %lu failed", (unsigned long)(r->first_sector + sector));
+        return false;
+    }
+    r->stats.erases++;
+    s_index[ring_tier(r)][sector] = INT64_MIN;
+    history_segment_hdr_t h = { .magic = HISTORY_SEGMENT_MAGIC(r->id), .seq = seq, .erase_count = erase_count };
+    h.crc = hdr_crc(&h);
+    if (esp_partition_write(s_part, sector_offset(r, sector), &h, sizeof(h)) != ESP_OK) return false;
+    if (erase_count > st->max_erase_count) st->max_erase_count = erase_count;
+    return true;
+}
+
+// First erased block of the head segment.
+static uint32_t scan_head_block(const history_ring_t *r, uint32_t sector)
+{
+    for (uint32_t block = 0; block < HISTORY_BLOCKS; ++block)
+    {
+        history_block_hdr_t h;
+        if (esp_partition_read(s_part, block_offset(r, sector, block), &h, sizeof(h)) != ESP_OK) return HISTORY_BLOCKS;
+        if (block_hdr_erased(&h)) return block;
+    }
+    return HISTORY_BLOCKS;
+}
+
+// Rebuild the head/tail of a ring from flash.
+static bool ring_recover(history_ring_t *r)
+{
+    history_state_t *st = &s_state[ring_tier(r)];
+    bool found = false;
+    uint32_t head_sector = 0, head_seq = 0, tail_seq = 0, max_erase = 0;
+    for (uint32_t s = 0; s < r->sectors; ++s)
+    {
+        history_segment_hdr_t h;
+        if (!read_hdr(r, s, &h)) continue;
+        if (h.erase_count > max_erase) max_erase = h.erase_count;
+        if (!found || (int32_t)(h.seq - head_seq) > 0) { head_seq = h.seq; head_sector = s; }
+        if (!found || (int32_t)(h.seq - tail_seq) < 0) tail_seq = h.seq;
+        found = true;
+    }
+
+    memset(st, 0, sizeof(*st));
+    st->magic = HISTORY_RTC_MAGIC;
+    st->max_erase_count = max_erase;
+    if (!found)
+    {
+        ESP_LOGI(TAG, "no '%c' history found; formatting its first segment", r->id);
+        st->head_sector = 0;
+        st->head_seq = st->tail_seq = 1;
+        return start_segment(r, 0, 1);
+    }
+    // anything older than one lap behind the head is stale
+    if (head_seq - tail_seq >= r->sectors) tail_seq = head_seq - r->sectors + 1;
+    st->head_sector = head_sector;
+    st->head_seq = head_seq;
+    st->tail_seq = tail_seq;
+    st->head_block = scan_head_block(r, head_sector);
+    ESP_LOGI(TAG, "recovered '%c' head: segment %lu (sector %lu) block %lu, oldest segment %lu", r->id,
+             (unsigned long)head_seq, (unsigned long)head_sector, (unsigned long)st->head_block, (unsigned long)tail_seq);
+    return true;
+}
+
+// Cheap check of the RTC copy: the head header matches and the head block is still erased.
+static bool ring_state_valid(const history_ring_t *r)
+{
+    const history_state_t *st = &s_state[ring_tier(r)];
+    if (st->magic != HISTORY_RTC_MAGIC || st->head_sector >= r->sectors || st->head_block > HISTORY_BLOCKS) return false;
+    history_segment_hdr_t h;
+    if (!read_hdr(r, st->head_sector, &h) || h.seq != st->head_seq) return false;
+    if (st->head_block == HISTORY_BLOCKS) return true;
+    history_block_hdr_t b;
+    return esp_partition_read(s_part, block_offset(r, st->head_sector, st->head_block), &b, sizeof(b)) == ESP_OK &&
+           block_hdr_erased(&b);
+}
+
+// Position of the next block to be written.
+static void next_block(const history_ring_t *r, uint32_t *seq, uint32_t *block)
+{
+    const history_state_t *st = &s_state[ring_tier(r)];
+    if (st->head_block < HISTORY_BLOCKS)
+    {
+        *seq = st->head_seq;
+        *block = st->head_block;
+    }
+    else
+    {
+        *seq = st->head_seq + 1;
+        *block = 0;
+    }
+}
+
+/* ---- bit stream ---- */
+
+static uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+// Encoded length of code(v); 0 when it does not fit the widest code.
+static unsigned code_bits(int64_t v)
+{
+    uint64_t z = zigzag(v);
+    if (z == 0) return 1;
+    if (z < (1u << 6)) return 8;
+    if (z < (1u << 13)) return 16;
+    if (z < (1u << 20)) return 24;
+    return z < (1ull << 40) ? 44 : 0;
+}
+
+static void put_bits(history_stage_t *sg, uint64_t value, unsigned count)
+{
+    uint8_t *stream = sg->block.raw + HISTORY_BLOCK_HDR_SIZE;
+    while (count--)
+    {
+        uint32_t bit = sg->block.hdr.bits++;
+        if ((value >> count) & 1) stream[bit >> 3] |= (uint8_t)(0x80 >> (bit & 7));
+    }
+}
+
+static void put_code(history_stage_t *sg, int64_t v)
+{
+    uint64_t z = zigzag(v);
+    if (z == 0) put_bits(sg, 0x0, 1);
+    else if (z < (1u << 6)) { put_bits(sg, 0x2, 2); put_bits(sg, z, 6); }
+    else if (z < (1u << 13)) { put_bits(sg, 0x6, 3); put_bits(sg, z, 13); }
+    else if (z < (1u << 20)) { put_bits(sg, 0xE, 4); put_bits(sg, z, 20); }
+    else { put_bits(sg, 0xF, 4); put_bits(sg, z, 40); }
+}
+
+// Bits `row` takes after the open block's last row; 0 if it cannot follow it.
+static unsigned row_bits(const history_ring_t *r, const history_row_t *row)
+{
+    const history_stage_t *sg = &s_stage[ring_tier(r)];
+    const history_row_t *p = &sg->last;
+    unsigned n = code_bits(row->ts_ms - p->ts_ms - sg->last_delta);
+    unsigned seq = code_bits((int64_t)row->seq - p->seq - 1);
+    if (!n || !seq) return 0;
+    n += seq;
+    n += row->flags == p->flags ? 1 : 9;
+    n += row->present == p->present ? 1 : 1 + r->width;
+    for (int c = 0; c < r->width; ++c)
+        if (row->present & (1u << c)) n += code_bits((int64_t)row->values[c] - p->values[c]);
+    return n;
+}
+
+static void encode_row(const history_ring_t *r, const history_row_t *row)
+{
+    history_stage_t *sg = &s_stage[ring_tier(r)];
+    history_row_t *p = &sg->last;
+    int64_t delta = row->ts_ms - p->ts_ms;
+    put_code(sg, delta - sg->last_delta);
+    put_code(sg, (int64_t)row->seq - p->seq - 1);
+    if (row->flags == p->flags) put_bits(sg, 0, 1);
+    else { put_bits(sg, 1, 1); put_bits(sg, row->flags, 8); }
+    if (row->present == p->present) put_bits(sg, 0, 1);
+    else { put_bits(sg, 1, 1); put_bits(sg, row->present, r->width); }
+    for (int c = 0; c < r->width; ++c)
+        if (row->present & (1u << c))
+        {
+            put_code(sg, (int64_t)row->values[c] - p->values[c]);
+            p->values[c] = row->values[c];
+        }
+    sg->last_delta = delta;
+    p->ts_ms = row->ts_ms;
+    p->seq = row->seq;
+    p->flags = row->flags;
+    p->present = row->present;
+    sg->block.hdr.samples++;
+}
+
+static void stage_open(const history_ring_t *r, const history_row_t *first)
+{
+    history_stage_t *sg = &s_stage[ring_tier(r)];
+    memset(sg, 0, sizeof(*sg));
+    sg->magic = HISTORY_STAGE_MAGIC;
+    next_block(r, &sg->target_seq, &sg->target_block);
+    sg->block.hdr.magic = HISTORY_BLOCK_MAGIC;
+    sg->block.hdr.first_seq = first->seq;
+    sg->block.hdr.t0 = first->ts_ms;
+    sg->last.ts_ms = first->ts_ms;
+    sg->last.seq = first->seq - 1;
+}
+
+static uint16_t block_crc(const uint8_t *raw)
+{
+    const history_block_hdr_t *h = (const history_block_hdr_t *)raw;
+    uint16_t crc = esp_rom_crc16_le(0, raw, offsetof(history_block_hdr_t, crc));
+    return esp_rom_crc16_le(crc, raw + offsetof(history_block_hdr_t, first_seq),
+                            HISTORY_BLOCK_HDR_SIZE - offsetof(history_block_hdr_t, first_seq) + (h->bits + 7) / 8);
+}
+
+// Write the open block to its place on flash. Caller holds s_lock.
+static bool stage_seal_locked(history_ring_t *r)
+{
+    history_stage_t *sg = &s_stage[ring_tier(r)];
+    history_state_t *st = &s_state[ring_tier(r)];
+    if (sg->block.hdr.samples == 0) return true;
+    bool ok = true;
+    if (sg->target_seq != st->head_seq)
+    {
+        uint32_t sector = (st->head_sector + 1) % r->sectors;
+        ok = start_segment(r, sector, sg->target_seq);
+        if (ok)
+        {
+            st->head_sector = sector;
+            st->head_seq = sg->target_seq;
+            st->head_block = 0;
+            // the erased sector held the oldest segment once the ring is full
+            if (st->head_seq - st->tail_seq >= r->sectors) st->tail_seq = st->head_seq - r->sectors + 1;
+        }
+    }
+    uint16_t samples = sg->block.hdr.samples;
+    uint32_t used = HISTORY_BLOCK_HDR_SIZE + (sg->block.hdr.bits + 7) / 8;
+    if (ok)
+    {
+        sg->block.hdr.crc = block_crc(sg->block.raw);
+        ok = esp_partition_write(s_part, block_offset(r, st->head_sector, sg->target_block), sg->block.raw,
+                                 HISTORY_BLOCK_SIZE) == ESP_OK;
+        // a failed program may have left bits behind: never reuse the block
+        st->head_block = sg->target_block + 1;
+    }
+    if (ok)
+    {
+        if (sg->target_block == 0)
+            s_index[ring_tier(r)][st->head_sector] = block_index_ts(&sg->block.hdr, sg->block.raw + HISTORY_BLOCK_HDR_SIZE);
+        r->stats.sealed_samples += samples;
+        r->stats.sealed_bytes += used;
+        ESP_LOGD(TAG, "sealed '%c' block %lu/%lu: %u rows in %lu bytes", r->id, (unsigned long)st->head_seq,
+                 (unsigned long)sg->target_block, (unsigned)samples, (unsigned long)used);
+    }
+    else ESP_LOGW(TAG, "writing a '%c' block of %u rows failed", r->id, (unsigned)samples);
+    sg->magic = 0;
+    sg->block.hdr.samples = 0;
+    return ok;
+}
+
+// Add a row to the ring's open block. Caller holds s_lock.
+static bool ring_append_locked(history_ring_t *r, const history_row_t *row)
+{
+    history_stage_t *sg = &s_stage[ring_tier(r)];
+    bool ok = true;
+    unsigned bits = sg->block.hdr.samples ? row_bits(r, row) : 0;
+    if (sg->block.hdr.samples && (bits == 0 || sg->block.hdr.bits + bits > HISTORY_STREAM_BITS))
+        ok = stage_seal_locked(r);
+    if (sg->block.hdr.samples == 0) stage_open(r, row);
+    encode_row(r, row);
+    sg->crc = rtc_crc(sg, sizeof(*sg));
+    return ok;
+}
+
+// Keep the open block from before the reset if it still belongs at the head.
+static void stage_restore(const history_ring_t *r)
+{
+    history_stage_t *sg = &s_stage[ring_tier(r)];
+    uint32_t seq, block;
+    next_block(r, &seq, &block);
+    if (sg->magic == HISTORY_STAGE_MAGIC && sg->crc == rtc_crc(sg, sizeof(*sg)) && sg->block.hdr.samples > 0 &&
+        sg->target_seq == seq && sg->target_block == block)
+    {
+        ESP_LOGI(TAG, "kept open '%c' block with %u rows", r->id, (unsigned)sg->block.hdr.samples);
+        return;
+    }
+    memset(sg, 0, sizeof(*sg));
+}
+
+/* ---- rollups ---- */
+
+static void bucket_to_row(const history_ring_t *r, const history_bucket_t *b, history_row_t *row)
+{
+    memset(row, 0, sizeof(*row));
+    row->ts_ms = b->bucket * r->period_ms;
+    row->seq = (uint32_t)b->bucket;
+    row->present = 1u << COL_COUNT;
+    row->flags = b->flags;
+    row->values[COL_COUNT] = (int32_t)b->count;
+    for (int c = 0; c < HISTORY_MAX_CHANNELS; ++c)
+    {
+        if (!b->n[c]) continue;
+        row->present |= (1u << COL_MIN(c)) | (1u << COL_MAX(c)) | (1u << COL_MEAN(c)) | (1u << COL_N(c));
+        row->values[COL_N(c)] = (int32_t)b->n[c];
+        row->values[COL_MIN(c)] = b->min[c];
+        row->values[COL_MAX(c)] = b->max[c];
+        // rounded to nearest
+        int64_t half = (int64_t)b->n[c] / 2;
+        row->values[COL_MEAN(c)] = (int32_t)((b->sum[c] + (b->sum[c] < 0 ? -half : half)) / (int64_t)b->n[c]);
+    }
+}
+
+// Write the open bucket of a rollup tier as one row. Caller holds s_lock.
+static bool bucket_emit_locked(history_ring_t *r)
+{
+    history_bucket_t *b = &s_bucket[ring_tier(r)];
+    if (b->count == 0) return true;
+    history_row_t row;
+    bucket_to_row(r, b, &row);
+    b->count = 0;
+    return ring_append_locked(r, &row);
+}
+
+// Fold a sample into the open bucket of a rollup tier. Caller holds s_lock.
+static bool bucket_add_locked(history_ring_t *r, const history_record_t *rec)
+{
+    history_bucket_t *b = &s_bucket[ring_tier(r)];
+    int64_t bucket = rec->ts_ms / r->period_ms;
+    bool ok = true;
+    if (b->count && (bucket != b->bucket || (rec->flags & HISTORY_FLAG_WALLCLOCK) != (b->flags & HISTORY_FLAG_WALLCLOCK)))
+        ok = bucket_emit_locked(r);
+    if (b->count == 0)
+    {
+        memset(b, 0, sizeof(*b));
+        b->magic = HISTORY_BUCKET_MAGIC;
+        b->bucket = bucket;
+    }
+    b->count++;
+    b->flags |= rec->flags;
+    for (int c = 0; c < HISTORY_MAX_CHANNELS; ++c)
+    {
+        if (!(rec->present & (1u << c))) continue;
+        int32_t v = rec->values[c];
+        if (!b->n[c] || v < b->min[c]) b->min[c] = v;
+        if (!b->n[c] || v > b->max[c]) b->max[c] = v;
+        b->sum[c] += v;
+        b->n[c]++;
+    }
+    b->crc = rtc_crc(b, sizeof(*b));
+    return ok;
+}
+
+static void bucket_restore(const history_ring_t *r)
+{
+    history_bucket_t *b = &s_bucket[ring_tier(r)];
+    if (b->magic == HISTORY_BUCKET_MAGIC && b->crc == rtc_crc(b, sizeof(*b))) return;
+    memset(b, 0, sizeof(*b));
+}
+
+// First wall-clock timestamp of every segment of a ring, from its first block.
+static void index_build(const history_ring_t *r)
+{
+    int64_t *index = s_index[ring_tier(r)];
+    for (uint32_t s = 0; s < r->sectors; ++s)
+    {
+        history_segment_hdr_t h;
+        history_block_hdr_t b;
+        uint8_t stream[2];
+        index[s] = INT64_MIN;
+        if (read_hdr(r, s, &h) && read_block_start(r, s, 0, &b, stream)) index[s] = block_index_ts(&b, stream);
+    }
+}
+
+bool history_init(const char *const *channels, uint8_t count)
+{
+    if (s_part) return true;
+    if (!channels || count == 0 || count > HISTORY_MAX_CHANNELS) return false;
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, HISTORY_PARTITION_LABEL);
+    uint32_t total = part ? part->size / HISTORY_SECTOR_SIZE : 0;
+    uint32_t minute = HISTORY_MINUTE_SECTORS, hour = HISTORY_HOUR_SECTORS;
+    // a small partition is shared out in the same spirit
+    if (total < minute + hour + 2)
+    {
+        minute = total / 4;
+        hour = total / 8;
+    }
+    if (!part || hour < 2)
+    {
+        ESP_LOGW(TAG, "no usable \"%s\" partition; sensor history disabled", HISTORY_PARTITION_LABEL);
+        return false;
+    }
+    if (!s_lock) s_lock = xSemaphoreCreateMutex();
+    if (!s_lock) return false;
+    for (int t = 0; t < HISTORY_TIER_COUNT; ++t)
+    {
+        free(s_index[t]);
+        s_index[t] = NULL;
+    }
+    s_index[HISTORY_TIER_RAW] = malloc((total - minute - hour) * sizeof(int64_t));
+    s_index[HISTORY_TIER_MINUTE] = malloc(minute * sizeof(int64_t));
+    s_index[HISTORY_TIER_HOUR] = malloc(hour * sizeof(int64_t));
+    if (!s_index[HISTORY_TIER_RAW] || !s_index[HISTORY_TIER_MINUTE] || !s_index[HISTORY_TIER_HOUR]) return false;
+    s_part = part;
+    s_channels = channels;
+    s_channel_count = count;
+    s_rings[HISTORY_TIER_RAW].first_sector = 0;
+    s_rings[HISTORY_TIER_RAW].sectors = total - minute - hour;
+    s_rings[HISTORY_TIER_MINUTE].first_sector = total - minute - hour;
+    s_rings[HISTORY_TIER_MINUTE].sectors = minute;
+    s_rings[HISTORY_TIER_HOUR].first_sector = total - hour;
+    s_rings[HISTORY_TIER_HOUR].sectors = hour;
+
+    bool deep_sleep = esp_reset_reason() == ESP_RST_DEEPSLEEP;
+    for (int t = 0; t < HISTORY_TIER_COUNT; ++t)
+    {
+        history_ring_t *r = &s_rings[t];
+        if (!(deep_sleep && ring_state_valid(r)) && !ring_recover(r))
+        {
+            s_part = NULL;
+            return false;
+        }
+        index_build(r);
+        stage_restore(r);
+        if (r->period_ms) bucket_restore(r);
+    }
+    ESP_LOGI(TAG, "history on %s: raw %lu, minute %lu, hour %lu sectors", part->label,
+             (unsigned long)s_rings[HISTORY_TIER_RAW].sectors, (unsigned long)minute, (unsigned long)hour);
+    return true;
+}
+
+bool history_append(const history_record_t *rec)
+{
+    if (!s_part || !rec) return false;
+    history_row_t row = {
+        .ts_ms = rec->ts_ms,
+        .seq = rec->seq,
+        .present = rec->present & ((1u << HISTORY_MAX_CHANNELS) - 1),
+        .flags = rec->flags,
+    };
+    memcpy(row.values, rec->values, sizeof(rec->values));
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    bool ok = ring_append_locked(&s_rings[HISTORY_TIER_RAW], &row);
+    for (int t = HISTORY_TIER_MINUTE; t < HISTORY_TIER_COUNT; ++t)
+        ok &= bucket_add_locked(&s_rings[t], rec);
+    xSemaphoreGive(s_lock);
+    if (!ok) ESP_LOGW(TAG, "append of seq %lu lost older rows", (unsigned long)rec->seq);
+    return ok;
+}
+
+void history_get_stats(history_tier_t tier, history_stats_t *out)
+{
+    if (!out) return;
+    memset(out, 0, sizeof(*out));
+    if (!s_part || tier >= HISTORY_TIER_COUNT) return;
+    const history_ring_t *r = &s_rings[tier];
+    const history_state_t *st = &s_state[tier];
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    *out = r->stats;
+    out->sectors = r->sectors;
+    out->capacity = r->sectors * HISTORY_BLOCKS;
+    out->blocks = (st->head_seq - st->tail_seq) * HISTORY_BLOCKS + st->head_block;
+    out->staged = s_stage[tier].block.hdr.samples;
+    out->max_erase_count = st->max_erase_count;
+    xSemaphoreGive(s_lock);
+}
+
+bool history_cursor_oldest(history_cursor_t *cur, history_tier_t tier)
+{
+    if (!s_part || !cur || tier >= HISTORY_TIER_COUNT) return false;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    memset(cur, 0, sizeof(*cur));
+    cur->tier = (uint8_t)tier;
+    cur->segment_seq = s_state[tier].tail_seq;
+    xSemaphoreGive(s_lock);
+    return true;
+}
+
+/* ---- streaming decoder ---- */
+
+/* Reads a block bit by bit, from the open block in RAM or through a small
+ * window onto flash. */
+typedef struct {
+    const uint8_t *ram;
+    size_t offset;               /* block start on the partition */
+    uint32_t bit;                /* position in the bit stream */
+    uint32_t end;                /* stream length in bits */
+    uint32_t win_start;          /* stream byte held in win[0] */
+    uint32_t win_len;
+    bool err;
+    uint8_t win[HISTORY_READ_WINDOW];
+} bit_reader_t;
+
+static uint64_t get_bits(bit_reader_t *r, unsigned count)
+{
+    uint64_t v = 0;
+    while (count--)
+    {
+        if (r->bit >= r->end)
+        {
+            r->err = true;
+            return 0;
+        }
+        uint32_t byte = r->bit >> 3;
+        uint8_t b;
+        if (r->ram) b = r->ram[HISTORY_BLOCK_HDR_SIZE + byte];
+        else
+        {
+            if (byte < r->win_start || byte >= r->win_start + r->win_len)
+            {
+                uint32_t left = (r->end + 7) / 8 - byte;
+                r->win_start = byte;
+                r->win_len = left < sizeof(r->win) ? left : sizeof(r->win);
+                if (esp_partition_read(s_part, r->offset + HISTORY_BLOCK_HDR_SIZE + byte, r->win, r->win_len) != ESP_OK)
+                {
+                    r->err = true;
+                    return 0;
+                }
+            }
+            b = r->win[byte - r->win_start];
+        }
+        v = (v << 1) | ((b >> (7 - (r->bit & 7))) & 1);
+        r->bit++;
+    }
+    return v;
+}
+
+static int64_t get_code(bit_reader_t *r)
+{
+    static const unsigned payload[] = { 6, 13, 20, 40 };
+    if (get_bits(r, 1) == 0) return 0;
+    unsigned i = 0;
+    while (i < 3 && get_bits(r, 1)) i++;
+    uint64_t z = get_bits(r, payload[i]);
+    return (int64_t)(z >> 1) ^ -(int64_t)(z & 1);
+}
+
+// CRC check of a sealed block, read in window-sized pieces.
+static bool block_check(size_t offset, const history_block_hdr_t *h)
+{
+    uint8_t buf[HISTORY_READ_WINDOW];
+    uint16_t crc = esp_rom_crc16_le(0, (const uint8_t *)h, offsetof(history_block_hdr_t, crc));
+    crc = esp_rom_crc16_le(crc, (const uint8_t *)&h->first_seq, HISTORY_BLOCK_HDR_SIZE - offsetof(history_block_hdr_t, first_seq));
+    for (uint32_t pos = 0, len = (h->bits + 7) / 8; pos < len;)
+    {
+        uint32_t n = len - pos < sizeof(buf) ? len - pos : sizeof(buf);
+        if (esp_partition_read(s_part, offset + HISTORY_BLOCK_HDR_SIZE + pos, buf, n) != ESP_OK) return false;
+        crc = esp_rom_crc16_le(crc, buf, n);
+        pos += n;
+    }
+    return crc == h->crc;
+}
+
+static void cursor_next_block(history_cursor_t *cur)
+{
+    if (++cur->block >= HISTORY_BLOCKS)
+    {
+        cur->segment_seq++;
+        cur->block = 0;
+    }
+    cur->sample = 0;
+    cur->bit = 0;
+}
+
+// Decode the row at `cur` into cur->last and advance.
+static bool ring_read(history_cursor_t *cur)
+{
+    if (!s_part || cur->tier >= HISTORY_TIER_COUNT) return false;
+    history_ring_t *ring = &s_rings[cur->tier];
+    const history_state_t *st = &s_state[cur->tier];
+    const history_stage_t *sg = &s_stage[cur->tier];
+    bool found = false;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    // the ring moved past the cursor: continue at the oldest row left
+    if ((int32_t)(cur->segment_seq - st->tail_seq) < 0)
+    {
+        uint8_t tier = cur->tier;
+        memset(cur, 0, sizeof(*cur));
+        cur->tier = tier;
+        cur->segment_seq = st->tail_seq;
+    }
+    while (!found)
+    {
+        bit_reader_t r = { 0 };
+        history_block_hdr_t h;
+        bool open = sg->block.hdr.samples && cur->segment_seq == sg->target_seq && cur->block == sg->target_block;
+        if (open)
+        {
+            r.ram = sg->block.raw;
+            h = sg->block.hdr;
+        }
+        else
+        {
+            int32_t ahead = (int32_t)(cur->segment_seq - st->head_seq);
+            if (ahead > 0 || (ahead == 0 && cur->block >= st->head_block)) break;
+            r.offset = block_offset(ring, seq_sector(ring, cur->segment_seq), cur->block);
+            if (esp_partition_read(s_part, r.offset, &h, sizeof(h)) != ESP_OK) break;
+            bool valid = h.magic == HISTORY_BLOCK_MAGIC && h.bits <= HISTORY_STREAM_BITS;
+            if (valid && cur->bit == 0) valid = block_check(r.offset, &h);
+            if (!valid)
+            {
+                if (!block_hdr_erased(&h)) ring->stats.corrupt++;
+                cursor_next_block(cur);
+                continue;
+            }
+        }
+        if (cur->sample >= h.samples)
+        {
+            if (open) break;
+            cursor_next_block(cur);
+            continue;
+        }
+        if (cur->bit == 0)
+        {
+            memset(&cur->last, 0, sizeof(cur->last));
+            cur->last.ts_ms = h.t0;
+            cur->last.seq = h.first_seq - 1;
+            cur->last_delta = 0;
+        }
+
+        r.bit = cur->bit;
+        r.end = h.bits;
+        history_row_t *p = &cur->last;
+        int64_t delta = cur->last_delta + get_code(&r);
+        p->ts_ms += delta;
+        p->seq += 1 + (uint32_t)get_code(&r);
+        if (get_bits(&r, 1)) p->flags = (uint8_t)get_bits(&r, 8);
+        if (get_bits(&r, 1)) p->present = (uint32_t)get_bits(&r, ring->width);
+        for (int c = 0; c < ring->width; ++c)
+            if (p->present & (1u << c)) p->values[c] = (int32_t)((uint32_t)p->values[c] + (uint32_t)get_code(&r));
+        if (r.err)
+        {
+            ring->stats.corrupt++;
+            cursor_next_block(cur);
+            continue;
+        }
+        cur->last_delta = delta;
+        cur->bit = r.bit;
+        cur->sample++;
+        found = true;
+    }
+    xSemaphoreGive(s_lock);
+    return found;
+}
+
+bool history_read(history_cursor_t *cur, history_record_t *out)
+{
+    if (!cur || !out || cur->tier != HISTORY_TIER_RAW || !ring_read(cur)) return false;
+    const history_row_t *p = &cur->last;
+    memset(out, 0, sizeof(*out));
+    out->ts_ms = p->ts_ms;
+    out->seq = p->seq;
+    out->present = (uint8_t)p->present;
+    out->flags = p->flags;
+    for (int c = 0; c < HISTORY_MAX_CHANNELS; ++c)
+        if (p->present & (1u << c)) out->values[c] = p->values[c];
+    return true;
+}
+
+static void row_to_rollup(const history_row_t *p, history_rollup_t *out)
+{
+    memset(out, 0, sizeof(*out));
+    out->ts_ms = p->ts_ms;
+    out->count = (uint32_t)p->values[COL_COUNT];
+    out->flags = p->flags;
+    for (int c = 0; c < HISTORY_MAX_CHANNELS; ++c)
+    {
+        if (!(p->present & (1u << COL_MEAN(c)))) continue;
+        out->present |= (uint8_t)(1u << c);
+        out->n[c] = (uint32_t)p->values[COL_N(c)];
+        out->min[c] = p->values[COL_MIN(c)];
+        out->max[c] = p->values[COL_MAX(c)];
+        out->mean[c] = p->values[COL_MEAN(c)];
+    }
+}
+
+bool history_read_rollup(history_cursor_t *cur, history_rollup_t *out)
+{
+    if (!cur || !out || cur->tier == HISTORY_TIER_RAW || !ring_read(cur)) return false;
+    row_to_rollup(&cur->last, out);
+    return true;
+}
+
+/* ---- queries ---- */
+
+// Index entry of segment `seq`: INT64_MIN if it does not start with a
+// wall-clock row, INT64_MAX for a head holding only newer, unsealed rows.
+static int64_t segment_first_ts(const history_ring_t *r, uint32_t seq)
+{
+    const history_state_t *st = &s_state[ring_tier(r)];
+    // a head without a sealed block only has rows newer than all others
+    if (seq == st->head_seq && st->head_block == 0) return INT64_MAX;
+    return s_index[ring_tier(r)][seq_sector(r, seq)];
+}
+
+bool history_cursor_seek(history_cursor_t *cur, history_tier_t tier, int64_t ts_ms)
+{
+    if (!s_part || !cur || tier >= HISTORY_TIER_COUNT) return false;
+    const history_ring_t *r = &s_rings[tier];
+    const history_state_t *st = &s_state[tier];
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    // newest segment starting with a wall-clock row at or before ts_ms (offset
+    // from the tail); segments starting with ms since boot are passed over
+    uint32_t off = st->head_seq - st->tail_seq;
+    while (off > 0)
+    {
+        int64_t first = segment_first_ts(r, st->tail_seq + off);
+        if (first != INT64_MIN && first <= ts_ms) break;
+        off--;
+    }
+    memset(cur, 0, sizeof(*cur));
+    cur->tier = (uint8_t)tier;
+    cur->segment_seq = st->tail_seq + off;
+    // then the last wall-clock block of that segment starting at or before ts_ms
+    uint32_t sector = seq_sector(r, cur->segment_seq);
+    uint32_t end = cur->segment_seq == st->head_seq ? st->head_block : HISTORY_BLOCKS;
+    for (uint32_t b = 1; b < end; ++b)
+    {
+        history_block_hdr_t h;
+        uint8_t stream[2];
+        if (!read_block_start(r, sector, b, &h, stream)) continue;
+        int64_t first = block_index_ts(&h, stream);
+        if (first == INT64_MIN) continue;
+        if (first > ts_ms) break;
+        cur->block = (uint16_t)b;
+    }
+    xSemaphoreGive(s_lock);
+    return true;
+}
+
+// Wall-clock time of the oldest indexed row of a tier, INT64_MAX when there is none.
+static int64_t tier_oldest_ts(history_tier_t tier)
+{
+    const history_ring_t *r = &s_rings[tier];
+    const history_state_t *st = &s_state[tier];
+    const history_stage_t *sg = &s_stage[tier];
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    int64_t ts = INT64_MIN;
+    for (uint32_t seq = st->tail_seq; ts == INT64_MIN && seq != st->head_seq + 1; ++seq) ts = segment_first_ts(r, seq);
+    if (ts == INT64_MIN) ts = INT64_MAX;
+    if (ts == INT64_MAX && sg->block.hdr.samples)
+    {
+        int64_t open = block_index_ts(&sg->block.hdr, sg->block.raw + HISTORY_BLOCK_HDR_SIZE);
+        if (open != INT64_MIN) ts = open;
+    }
+    xSemaphoreGive(s_lock);
+    return ts;
+}
+
+// Coarsest tier that fits the step and reaches back to t0; else the one reaching furthest.
+static history_tier_t query_tier(int64_t t0_ms, uint32_t step_ms)
+{
+    history_tier_t best = HISTORY_TIER_RAW;
+    int64_t best_ts = INT64_MAX;
+    for (int t = HISTORY_TIER_COUNT - 1; t >= 0; --t)
+    {
+        uint32_t period = s_rings[t].period_ms;
+        if (period && (period > step_ms || step_ms % period)) continue;
+        int64_t oldest = tier_oldest_ts((history_tier_t)t);
+        if (oldest <= t0_ms) return (history_tier_t)t;
+        if (oldest < best_ts)
+        {
+            best = (history_tier_t)t;
+            best_ts = oldest;
+        }
+    }
+    return best;
+}
+
+typedef struct {
+    history_agg_t agg;
+    uint32_t step_ms;
+    history_query_cb_t cb;
+    void *ctx;
+    int points;
+    bool stopped;
+    bool open;                   /* a step is being accumulated */
+    int64_t start;
+    int64_t sum;
+    uint32_t n;
+    int32_t min;
+    int32_t max;
+} query_acc_t;
+
+static void query_flush(query_acc_t *q)
+{
+    if (!q->open || q->stopped) return;
+    q->open = false;
+    int32_t v;
+    switch (q->agg)
+    {
+    case HISTORY_AGG_MIN: v = q->min; break;
+    case HISTORY_AGG_MAX: v = q->max; break;
+    case HISTORY_AGG_COUNT: v = (int32_t)q->n; break;
+    default:
+    {
+        int64_t half = q->n / 2;
+        v = (int32_t)((q->sum + (q->sum < 0 ? -half : half)) / (int64_t)q->n);
+        break;
+    }
+    }
+    q->points++;
+    if (!q->cb(q->start, v, q->n, q->ctx)) q->stopped = true;
+}
+
+// Fold a source row (n samples with this min/max/mean) into its step.
+static void query_add(query_acc_t *q, int64_t ts, int32_t min, int32_t max, int32_t mean, uint32_t n)
+{
+    int64_t start = ts;
+    if (q->step_ms) start = ts - ((ts % q->step_ms) + q->step_ms) % q->step_ms;
+    if (q->open && start != q->start) query_flush(q);
+    if (q->stopped || n == 0) return;
+    if (!q->open)
+    {
+        q->open = true;
+        q->start = start;
+        q->sum = 0;
+        q->n = 0;
+        q->min = min;
+        q->max = max;
+    }
+    if (min < q->min) q->min = min;
+    if (max > q->max) q->max = max;
+    q->sum += (int64_t)mean * n;
+    q->n += n;
+    if (q->step_ms == 0) query_flush(q);
+}
+
+int history_query(const char *metric, int64_t t0_ms, int64_t t1_ms, uint32_t step_ms, history_agg_t agg,
+                  history_query_cb_t cb, void *user_ctx)
+{
+    if (!s_part || !metric || !cb) return -1;
+    int ch = -1;
+    for (int i = 0; i < s_channel_count; ++i)
+        if (strcmp(metric, s_channels[i]) == 0) ch = i;
+    if (ch < 0) return -1;
+
+    query_acc_t q = { .agg = agg, .step_ms = step_ms, .cb = cb, .ctx = user_ctx };
+    history_tier_t tier = query_tier(t0_ms, step_ms);
+    history_cursor_t cur;
+    history_cursor_seek(&cur, tier, t0_ms);
+    if (tier == HISTORY_TIER_RAW)
+    {
+        history_record_t rec;
+        while (!q.stopped && history_read(&cur, &rec))
+        {
+            if (!(rec.flags & HISTORY_FLAG_WALLCLOCK) || rec.ts_ms < t0_ms || !(rec.present & (1u << ch))) continue;
+            if (rec.ts_ms >= t1_ms) break;
+            int32_t v = rec.values[ch];
+            query_add(&q, rec.ts_ms, v, v, v, 1);
+        }
+    }
+    else
+    {
+        uint32_t period = s_rings[tier].period_ms;
+        history_rollup_t ru;
+        bool more = true;
+        while (!q.stopped)
+        {
+            more = more && history_read_rollup(&cur, &ru);
+            if (!more)
+            {
+                // the bucket still being filled comes last
+                history_bucket_t b;
+                xSemaphoreTake(s_lock, portMAX_DELAY);
+                b = s_bucket[tier];
+                xSemaphoreGive(s_lock);
+                if (b.count == 0) break;
+                history_row_t row;
+                bucket_to_row(&s_rings[tier], &b, &row);
+                row_to_rollup(&row, &ru);
+            }
+            if ((ru.flags & HISTORY_FLAG_WALLCLOCK) && ru.ts_ms + period > t0_ms && ru.ts_ms < t1_ms && (ru.present & (1u << ch)))
+                query_add(&q, ru.ts_ms, ru.min[ch], ru.max[ch], ru.mean[ch], ru.n[ch]);
+            if (!more || ((ru.flags & HISTORY_FLAG_WALLCLOCK) && ru.ts_ms >= t1_ms)) break;
+        }
+    }
+    query_flush(&q);
+    return q.points;
+}
@@ -0,0 +1,170 @@
+/*
+ * history.h
+ *
+ * Local sensor history: append-only logs of compressed sample blocks on
+ * the raw "history" data partition. Raw samples keep a few hours; 1-minute
+ * and 1-hour rollups (min/max/mean), computed as samples arrive, keep
+ * weeks and months. Each tier is its own ring. Keeps samples when the
+ * device is offline so they can be inspected or replayed later.
+ */
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Value slots per record. */
+#define HISTORY_MAX_CHANNELS 4
+
+/* Record flags */
+#define HISTORY_FLAG_WALLCLOCK 0x01  /* ts_ms is Unix time, else ms since boot */
+#define HISTORY_FLAG_URGENT    0x02  /* was sent on the urgent telemetry lane */
+
+/* Values per stored row: the sample count, then per channel its sample count and min/max/mean. */
+#define HISTORY_ROW_VALUES (1 + 4 * HISTORY_MAX_CHANNELS)
+
+typedef enum {
+    HISTORY_TIER_RAW,
+    HISTORY_TIER_MINUTE,
+    HISTORY_TIER_HOUR,
+    HISTORY_TIER_COUNT
+} history_tier_t;
+
+/** One sample, as appended and as read back. */
+typedef struct {
+    int64_t ts_ms;
+    uint32_t seq;                            /* telemetry sequence number */
+    int32_t values[HISTORY_MAX_CHANNELS];
+    uint8_t present;                         /* bit i: values[i] is valid */
+    uint8_t flags;
+} history_record_t;
+
+/** One rollup bucket of the minute or hour tier. */
+typedef struct {
+    int64_t ts_ms;                           /* start of the bucket */
+    uint32_t count;                          /* samples in the bucket */
+    uint32_t n[HISTORY_MAX_CHANNELS];        /* samples with channel i present */
+    int32_t min[HISTORY_MAX_CHANNELS];
+    int32_t max[HISTORY_MAX_CHANNELS];
+    int32_t mean[HISTORY_MAX_CHANNELS];
+    uint8_t present;                         /* bit i: channel i was seen */
+    uint8_t flags;                           /* WALLCLOCK; URGENT if any sample was */
+} history_rollup_t;
+
+/* A stored row of any tier; decoder state inside the cursor. */
+typedef struct {
+    int64_t ts_ms;
+    uint32_t seq;
+    uint32_t present;
+    uint8_t flags;
+    int32_t values[HISTORY_ROW_VALUES];
+} history_row_t;
+
+typedef struct {
+    uint32_t blocks;         /* sealed blocks currently stored */
+    uint32_t capacity;       /* blocks the tier can hold */
+    uint32_t staged;         /* rows in the open block, not yet on flash */
+    uint32_t sectors;
+    uint32_t erases;         /* sector erases since boot */
+    uint32_t max_erase_count; /* highest per-sector erase count seen */
+    uint32_t corrupt;        /* torn or damaged blocks skipped */
+    uint32_t sealed_samples; /* rows in the blocks sealed since boot */
+    uint32_t sealed_bytes;   /* flash bytes those blocks used */
+} history_stats_t;
+
+/**
+ * Read position in one tier; start with history_cursor_oldest(). Besides
+ * the position it carries the decoder state, so reading never needs a
+ * whole block in RAM.
+ */
+typedef struct {
+    uint8_t tier;
+    uint32_t segment_seq;    /* segment being read */
+    uint16_t block;          /* block within the segment */
+    uint16_t sample;         /* samples already read from the block */
+    uint32_t bit;            /* read position in the block */
+    int64_t last_delta;      /* decoder state */
+    history_row_t last;
+} history_cursor_t;
+
+/* Aggregates for history_query() */
+typedef enum {
+    HISTORY_AGG_MEAN,
+    HISTORY_AGG_MIN,
+    HISTORY_AGG_MAX,
+    HISTORY_AGG_COUNT,
+} history_agg_t;
+
+/**
+ * One query result: start of the step, the aggregate and the number of
+ * samples behind it. Return false to stop the query.
+ */
+typedef bool (*history_query_cb_t)(int64_t ts_ms, int32_t value, uint32_t samples, void *user_ctx);
+
+/**
+ * Open the "history" partition, split it into the tier rings and find
+ * their append positions. After a deep sleep the positions are taken from
+ * RTC memory; otherwise (or if that does not check out) they are rebuilt
+ * by scanning the segment headers and the newest segments. `channels`
+ * names values[0..count-1] for history_query(); the array must outlive
+ * the component.
+ */
+bool history_init(const char *const *channels, uint8_t count);
+
+/**
+ * Append one sample and fold it into the open minute and hour buckets; a
+ * bucket is written to its tier when the first sample of a later bucket
+ * arrives. Rows are compressed into open blocks, which are kept in RTC
+ * memory (they survive deep sleep and resets, not power loss) and written
+ * to flash once full. When a ring's head segment is full its oldest
+ * segment is erased and reused.
+ */
+bool history_append(const history_record_t *rec);
+
+void history_get_stats(history_tier_t tier, history_stats_t *out);
+
+/** Position a cursor at the oldest row stored in `tier`. */
+bool history_cursor_oldest(history_cursor_t *cur, history_tier_t tier);
+
+/**
+ * Position a cursor in `tier` at the start of the block that holds the
+ * first row at or after Unix time `ts_ms`, using the per-segment time index
+ * and the block headers; rows before `ts_ms` in that block are still
+ * returned. Rows logged before the clock was set do not take part in the
+ * search and may come before or after the cursor.
+ */
+bool history_cursor_seek(history_cursor_t *cur, history_tier_t tier, int64_t ts_ms);
+
+/**
+ * Read the raw sample at `cur` and advance it. Samples of the open block
+ * are included; damaged blocks are skipped. Returns false at the end of
+ * the log or if `cur` is not on the raw tier.
+ */
+bool history_read(history_cursor_t *cur, history_record_t *out);
+
+/** Same as history_read() for a cursor on the minute or hour tier. */
+bool history_read_rollup(history_cursor_t *cur, history_rollup_t *out);
+
+/**
+ * Aggregate channel `metric` over Unix time [t0_ms, t1_ms) in steps of
+ * `step_ms` (aligned to multiples of the step) and stream the points to
+ * `cb`, oldest first; steps without samples are left out, and so are rows
+ * logged before the clock was set. The coarsest tier that is no coarser
+ * than the step and still covers t0 is read, so long ranges touch few
+ * rows; the open rollup bucket is included. `step_ms` 0 returns the raw
+ * samples. Returns the number of points, or -1 for an unknown metric.
+ */
+int history_query(const char *metric, int64_t t0_ms, int64_t t1_ms, uint32_t step_ms, history_agg_t agg,
+                  history_query_cb_t cb, void *user_ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // HISTORY_H
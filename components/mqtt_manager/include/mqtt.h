@@ -9,6 +9,8 @@
 #define MQTT_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -21,7 +23,11 @@ extern "C" {
 void mqtt_app_start(const char *uri, const char *access_token);
 
 /**
- * Start the MQTT client reading the access token from a file on the filesystem.
+ * Start the MQTT client reading the access token from a config file (as read
+ * at boot by boot_config_load()).
+ * The first line holds the access token. Optional further lines list brokers
+ * as "<priority> <uri> [token]" (lower priority preferred); when present
+ * they replace `uri` and the client fails over between them.
  * Returns true when the file was read and client start was attempted.
  */
 bool mqtt_app_start_from_file(const char *uri, const char *token_file_path);
@@ -29,15 +35,166 @@ bool mqtt_app_start_from_file(const char *uri, const char *token_file_path);
 /** Stop and cleanup the MQTT client. */
 void mqtt_app_stop(void);
 
-/** Publish a telemetry JSON payload to ThingsBoard v1/devices/me/telemetry. */
+/**
+ * Outgoing messages are queued in bounded priority lanes and sent by a
+ * single sender task, so publishing never blocks the caller on the network.
+ * Lanes are drained highest priority first.
+ */
+typedef enum {
+    MQTT_PRIO_ALERT = 0,   /* alerts */
+    MQTT_PRIO_OTA,         /* OTA state; own lane so its egress budget cannot hold up alerts */
+    MQTT_PRIO_ATTRIBUTES,  /* client attributes */
+    MQTT_PRIO_TELEMETRY,   /* periodic telemetry */
+    MQTT_PRIO_COUNT
+} mqtt_prio_t;
+
+/** What happens when a publish arrives for a full lane. */
+typedef enum {
+    MQTT_QUEUE_DROP_OLDEST = 0,  /* discard the oldest pending message */
+    MQTT_QUEUE_COALESCE_LATEST,  /* merge into the newest pending message (JSON keys) */
+} mqtt_queue_policy_t;
+
+/** Queue a telemetry JSON payload for ThingsBoard v1/devices/me/telemetry. */
 void mqtt_publish_telemetry(const char *json_payload);
 
-/** Publish client attributes JSON to ThingsBoard v1/devices/me/attributes. */
-void mqtt_publish_attributes(const char *json_payload);
+/** Delivery state of a message queued with mqtt_publish_telemetry_confirmed(). */
+typedef enum {
+    MQTT_DELIVERY_PENDING = 0,  /* queued, or sent and waiting for its PUBACK */
+    MQTT_DELIVERY_ACKED,        /* the broker acknowledged it */
+    MQTT_DELIVERY_LOST,         /* dropped by the lane or the outbox, or no longer tracked */
+} mqtt_delivery_t;
+
+/**
+ * Queue telemetry JSON like mqtt_publish_telemetry(), but at QoS 1 with the
+ * full topic (no v5 alias) and no expiry, and track it until its PUBACK.
+ * Returns a ticket for mqtt_delivery_state(), or 0 if it was not queued
+ * (client not started, too large, or too many tracked messages pending).
+ */
+uint32_t mqtt_publish_telemetry_confirmed(const char *json_payload);
+
+/** State of a tracked message. Resolved tickets are recycled, so poll while waiting. */
+mqtt_delivery_t mqtt_delivery_state(uint32_t ticket);
+
+/**
+ * Queue client attributes JSON for ThingsBoard v1/devices/me/attributes.
+ * Returns false if it was not queued (client not started, payload too big).
+ */
+bool mqtt_publish_attributes(const char *json_payload);
+
+/** Queue telemetry JSON on the alert lane (sent ahead of attributes/telemetry). */
+void mqtt_publish_alert(const char *json_payload);
+
+/** Queue an OTA state telemetry JSON (fw_state/fw_error) on the OTA lane. */
+void mqtt_publish_ota_state(const char *json_payload);
+
+/**
+ * Queue an arbitrary (possibly binary) payload for `topic` on `lane`.
+ * Returns false when the message does not fit a queue slot or the client
+ * has not been started.
+ */
+bool mqtt_publish_raw(const char *topic, const void *data, size_t len, int qos, mqtt_prio_t lane);
+
+/**
+ * Wait up to `timeout_ms` until every queued message has been handed to the
+ * broker and acknowledged. Use before rebooting or sleeping. Returns true
+ * when nothing is left pending.
+ */
+bool mqtt_publish_flush(uint32_t timeout_ms);
+
+/**
+ * Free slots in `lane`. Bulk producers (replays, batch uploads) wait for
+ * room here instead of pushing into a full lane, where the overflow policy
+ * would drop or merge messages.
+ */
+uint32_t mqtt_queue_free(mqtt_prio_t lane);
+
+/** Select the overflow policy of a lane (default: attributes coalesce, the rest drop oldest). */
+bool mqtt_queue_set_policy(mqtt_prio_t lane, mqtt_queue_policy_t policy);
+
+/** True while the MQTT client is connected to the broker. */
+bool mqtt_is_connected(void);
+
+/**
+ * How long the client has been without a broker connection, in ms: 0 while
+ * connected, UINT32_MAX when the client was never started.
+ */
+uint32_t mqtt_disconnected_ms(void);
+
+/**
+ * Called on the MQTT task after each successful connect, once the
+ * subscriptions are in place. `session_resumed` is true when the broker
+ * kept the previous session (fast resume after deep sleep). Callbacks must
+ * not block; publishing is fine (it only queues).
+ */
+typedef void (*mqtt_connected_cb_t)(bool session_resumed, void *user_ctx);
+
+/** Register a connect callback. Returns false when the table is full. */
+bool mqtt_register_connected_callback(mqtt_connected_cb_t cb, void *user_ctx);
+
+/**
+ * Called on the MQTT task when a shared attribute the handler registered
+ * for arrives, either as an update or in the response to the attribute
+ * request sent on connect. `value_json` is the attribute value as JSON
+ * text (a string value keeps its quotes).
+ */
+typedef void (*mqtt_attribute_handler_t)(const char *key, const char *value_json, void *user_ctx);
+
+/** Register a handler for shared attribute `key`. Returns false when the table is full. */
+bool mqtt_register_attribute_handler(const char *key, mqtt_attribute_handler_t handler, void *user_ctx);
 
 /** Return the access token used to start the MQTT client (not NULL once started). */
 const char *mqtt_get_access_token(void);
 
+/**
+ * Handler for a ThingsBoard server-side RPC method.
+ * `params` is the JSON text of the request's "params" member ("null" when
+ * absent). The handler writes a JSON reply into `response` (at most
+ * `response_len` bytes including the NUL) and returns true on success. When
+ * it returns false an error object is sent instead, unless the handler
+ * already wrote one. Handlers run on the MQTT task and must not block.
+ */
+typedef bool (*mqtt_rpc_handler_t)(const char *params, char *response, size_t response_len, void *user_ctx);
+
+/**
+ * Register (or replace) the handler for RPC `method`. Requests arrive on
+ * v1/devices/me/rpc/request/<id> and are answered on
+ * v1/devices/me/rpc/response/<id>. Returns false when the registry is full.
+ */
+bool mqtt_rpc_register(const char *method, mqtt_rpc_handler_t handler, void *user_ctx);
+
+/* Publish latency histogram: number of buckets and their inclusive upper
+ * bounds in milliseconds (the last bucket collects everything slower). */
+#define MQTT_LATENCY_BUCKETS 8
+#define MQTT_LATENCY_BUCKET_BOUNDS_MS { 50, 100, 250, 500, 1000, 2500, 5000, UINT32_MAX }
+
+/** Publish/acknowledge counters maintained by the MQTT manager. */
+typedef struct {
+    uint32_t published;      /* publishes accepted by the client */
+    uint32_t acked;          /* QoS>0 publishes matched with their PUBACK */
+    uint32_t in_flight;      /* QoS>0 publishes still waiting for a PUBACK */
+    uint32_t retransmitted;  /* publishes still unacknowledged across a reconnect */
+    uint32_t dropped;        /* refused, deleted from the outbox or never acknowledged */
+    uint32_t reason_codes;   /* non-success reason/return codes reported by the broker */
+    int32_t last_reason_code;
+    int32_t alias_bytes_saved; /* net bytes saved by MQTT v5 topic aliases */
+    uint32_t queue_depth;    /* messages waiting in the publish queue */
+    uint32_t queue_dropped;  /* messages discarded by the queue (full lane, oversized) */
+    uint32_t queue_coalesced; /* pending messages overwritten by a newer one */
+    int32_t broker_index;    /* active entry of the broker list, -1 before start */
+    uint32_t failovers;      /* broker switches since boot */
+    uint32_t latency_min_ms;
+    uint32_t latency_max_ms;
+    uint32_t latency_avg_ms;
+    uint32_t latency_hist[MQTT_LATENCY_BUCKETS];
+    /* per publish-queue lane, from entering the queue to PUBACK (QoS 0: to hand-off) */
+    uint32_t lane_delivered[MQTT_PRIO_COUNT];
+    uint32_t lane_latency_avg_ms[MQTT_PRIO_COUNT];
+    uint32_t lane_latency_max_ms[MQTT_PRIO_COUNT];
+} mqtt_publish_stats_t;
+
+/** Copy a snapshot of the publish statistics into `out`. */
+void mqtt_get_publish_stats(mqtt_publish_stats_t *out);
+
 #ifdef __cplusplus
 }
 #endif
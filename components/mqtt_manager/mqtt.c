@@ -6,18 +6,24 @@
  * handle and exposes a small API used by the rest of the application.
  */
 #include "mqtt.h"
+#include "mqtt_internal.h"
 #include "ota_manager.h"
+#include "boot_config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "esp_log.h"
 #include "esp_err.h"
 #include "mqtt_client.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "nvs_flash.h"
-#include "nvs.h"
 #include "esp_app_format.h"
+#include "esp_attr.h"
+#include "esp_mac.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include <cJSON.h>
 
 static const char *TAG = "mqtt";
 
@@ -25,103 +31,366 @@ static esp_mqtt_client_handle_t client = NULL;
 // Stored access token (owned by mqtt manager). Allocated when mqtt_app_start_from_file
 static char *g_access_token = NULL;
 
+/* Largest inbound payload that will be reassembled from fragments. Larger
+ * messages are dropped (and logged) instead of growing the heap without
+ * bound. Override at build time if bigger attribute pushes are expected. */
+#ifndef MQTT_RX_MAX_PAYLOAD
+#define MQTT_RX_MAX_PAYLOAD (8 * 1024)
+#endif
+
+/* Longest topic kept for a message being reassembled. */
+#ifndef MQTT_RX_MAX_TOPIC
+#define MQTT_RX_MAX_TOPIC 128
+#endif
+
+/* Reassembly state for the inbound message currently being received.
+ * esp-mqtt delivers all fragments of one message back to back from its own
+ * task, so a single slot is enough. The payload buffer is pooled: it is kept
+ * between messages and only grows (capped by MQTT_RX_MAX_PAYLOAD), so steady
+ * traffic does not touch the heap at all. */
+typedef struct {
+    char topic[MQTT_RX_MAX_TOPIC];
+    char *buf;
+    size_t cap;
+    size_t total;
+    size_t received;
+    bool active;
+} mqtt_rx_state_t;
+
+static mqtt_rx_state_t s_rx = {0};
+
+// Set after the first MQTT_EVENT_CONNECTED; later connects are reconnects.
+static bool s_connected_once = false;
+static volatile bool s_connected = false;
+static int64_t s_down_since_us = 0; /* start of the current outage, 0 while connected */
+
+/* Shared-attribute keys other components can subscribe to. */
+#ifndef MQTT_MAX_ATTRIBUTE_HANDLERS
+#define MQTT_MAX_ATTRIBUTE_HANDLERS 4
+#endif
+
+static struct {
+    char key[32];
+    mqtt_attribute_handler_t handler;
+    void *ctx;
+} s_attr_handlers[MQTT_MAX_ATTRIBUTE_HANDLERS];
+
+bool mqtt_register_attribute_handler(const char *key, mqtt_attribute_handler_t handler, void *user_ctx)
+{
+    if (!key || !handler || strlen(key) >= sizeof(s_attr_handlers[0].key)) return false;
+    for (int i = 0; i < MQTT_MAX_ATTRIBUTE_HANDLERS; ++i)
+    {
+        if (s_attr_handlers[i].handler == NULL || strcmp(s_attr_handlers[i].key, key) == 0)
+        {
+            strcpy(s_attr_handlers[i].key, key);
+            s_attr_handlers[i].ctx = user_ctx;
+            s_attr_handlers[i].handler = handler;
+            return true;
+        }
+    }
+    ESP_LOGE(TAG, "attribute handler table full, cannot register %s", key);
+    return false;
+}
+
+// Hand registered keys of an attribute update ({"key":..}) or of a request
+// response ({"shared":{"key":..}}) to their handlers.
+static void mqtt_dispatch_attributes(const char *data)
+{
+    if (s_attr_handlers[0].handler == NULL) return;
+    cJSON *root = cJSON_Parse(data);
+    if (!root) return;
+    cJSON *shared = cJSON_GetObjectItemCaseSensitive(root, "shared");
+    cJSON *attrs = cJSON_IsObject(shared) ? shared : root;
+    for (int i = 0; i < MQTT_MAX_ATTRIBUTE_HANDLERS && s_attr_handlers[i].handler; ++i)
+    {
+        cJSON *item = cJSON_GetObjectItemCaseSensitive(attrs, s_attr_handlers[i].key);
+        if (!item) continue;
+        char *value = cJSON_PrintUnformatted(item);
+        if (value)
+        {
+            s_attr_handlers[i].handler(s_attr_handlers[i].key, value, s_attr_handlers[i].ctx);
+            cJSON_free(value);
+        }
+    }
+    cJSON_Delete(root);
+}
+
+// Deliver a complete (NUL-terminated) inbound message to its consumer.
+static void mqtt_dispatch_message(const char *topic, const char *data, size_t len)
+{
+    ESP_LOGI(TAG, "MQTT data on topic: %s (%u bytes)", topic, (unsigned)len);
+    // Server-side RPC requests are answered directly on the open session
+    if (strncmp(topic, MQTT_RPC_REQUEST_TOPIC_PREFIX, strlen(MQTT_RPC_REQUEST_TOPIC_PREFIX)) == 0)
+    {
+        mqtt_rpc_handle_request(client, topic, data);
+        return;
+    }
+    // If this is an attributes message from ThingsBoard, forward the payload
+    if (strstr(topic, "attributes/response") != NULL || strstr(topic, "attributes") != NULL)
+    {
+        // Forward ThingsBoard attribute updates or attribute responses to ota_manager
+        ota_manager_handle_attribute_update(data);
+        mqtt_dispatch_attributes(data);
+    }
+}
+
+// Make sure the pooled receive buffer can hold `need` bytes plus a NUL.
+static bool mqtt_rx_reserve(size_t need)
+{
+    if (s_rx.buf && s_rx.cap >= need + 1) return true;
+    /* round up to 512 bytes so a series of slightly growing payloads does
+     * not realloc on every message */
+    size_t newcap = ((need + 1) + 511) & ~(size_t)511;
+    char *nb = realloc(s_rx.buf, newcap);
+    if (!nb) return false;
+    s_rx.buf = nb;
+    s_rx.cap = newcap;
+    return true;
+}
+
+static void mqtt_rx_release(void)
+{
+    free(s_rx.buf);
+    memset(&s_rx, 0, sizeof(s_rx));
+}
+
+/*
+ * Handle one MQTT_EVENT_DATA. Payloads bigger than the client's receive
+ * buffer arrive as several events: the first carries the topic and
+ * current_data_offset == 0, the following ones only carry the next chunk of
+ * data. Fragments are copied into the pooled buffer and the message is only
+ * dispatched once total_data_len bytes have been collected.
+ */
+static void mqtt_handle_data_event(esp_mqtt_event_handle_t event)
+{
+    if (event->data_len < 0 || event->total_data_len < 0 || event->current_data_offset < 0) return;
+    size_t offset = (size_t)event->current_data_offset;
+    size_t chunk = (size_t)event->data_len;
+    size_t total = (size_t)event->total_data_len;
+
+    if (offset == 0)
+    {
+        if (s_rx.active)
+        {
+            ESP_LOGW(TAG, "dropping incomplete message on %s (%u/%u bytes)", s_rx.topic, (unsigned)s_rx.received, (unsigned)s_rx.total);
+        }
+        s_rx.active = false;
+        if (event->topic_len <= 0 || (size_t)event->topic_len >= sizeof(s_rx.topic))
+        {
+            ESP_LOGW(TAG, "ignoring message with unsupported topic length %d", event->topic_len);
+            return;
+        }
+        if (total > MQTT_RX_MAX_PAYLOAD)
+        {
+            ESP_LOGW(TAG, "ignoring %u byte message on %.*s (limit %u)", (unsigned)total, event->topic_len, event->topic, (unsigned)MQTT_RX_MAX_PAYLOAD);
+            return;
+        }
+        if (!mqtt_rx_reserve(total))
+        {
+            ESP_LOGE(TAG, "out of memory reserving %u bytes for inbound message", (unsigned)total);
+            return;
+        }
+        memcpy(s_rx.topic, event->topic, (size_t)event->topic_len);
+        s_rx.topic[event->topic_len] = '\0';
+        s_rx.total = total;
+        s_rx.received = 0;
+        s_rx.active = true;
+    }
+
+    // Continuation of a message we dropped (oversized, OOM) or never saw the start of
+    if (!s_rx.active) return;
+
+    if (offset != s_rx.received || total != s_rx.total || chunk > s_rx.total - s_rx.received)
+    {
+        ESP_LOGW(TAG, "out-of-order fragment on %s (offset=%u len=%u expected offset=%u total=%u); dropping message",
+                 s_rx.topic, (unsigned)offset, (unsigned)chunk, (unsigned)s_rx.received, (unsigned)s_rx.total);
+        s_rx.active = false;
+        return;
+    }
+
+    memcpy(s_rx.buf + s_rx.received, event->data, chunk);
+    s_rx.received += chunk;
+    if (s_rx.received < s_rx.total) return;
+
+    s_rx.buf[s_rx.total] = '\0';
+    s_rx.active = false;
+    mqtt_dispatch_message(s_rx.topic, s_rx.buf, s_rx.total);
+}
+
+/*
+ * Fast resume after deep-sleep wake.
+ *
+ * With MQTT_FAST_RESUME the client connects with clean_session=false and a
+ * stable client id, so the broker keeps our subscriptions (and queues QoS 1
+ * attribute updates) while the device sleeps. What was already done in the
+ * previous wake is remembered in RTC slow memory; when the broker reports
+ * session_present and the cache is still valid, the connect handler skips the
+ * resubscribe and the attribute request (client attributes are only
+ * published when they change, see device_attributes). The cache is discarded on any reset other than
+ * a deep-sleep wake and whenever the broker or token changes.
+ */
+#ifndef MQTT_FAST_RESUME
+#define MQTT_FAST_RESUME 1
+#endif
+
+#define MQTT_RESUME_MAGIC 0x4d515231u /* "MQR1" */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t config_hash;   /* broker uri + token the cache belongs to */
+    bool subscribed;        /* attribute and RPC topics subscribed in the stored session */
+    bool attributes_synced; /* initial shared-attribute request answered/sent */
+} mqtt_resume_cache_t;
+
+static RTC_DATA_ATTR mqtt_resume_cache_t s_resume;
+static bool s_resume_valid = false;
+static int64_t s_start_us = 0;
+#if MQTT_FAST_RESUME
+static char s_client_id[24];
+#endif
+
+static uint32_t fnv1a(uint32_t h, const char *str)
+{
+    while (str && *str) { h ^= (uint8_t)*str++; h *= 16777619u; }
+    return h;
+}
+
+// Validate (or reset) the RTC cache for the broker/token we are about to use.
+static void mqtt_resume_prepare(const char *uri, const char *access_token)
+{
+    uint32_t h = fnv1a(fnv1a(2166136261u, uri), access_token);
+    s_resume_valid = MQTT_FAST_RESUME && s_resume.magic == MQTT_RESUME_MAGIC && s_resume.config_hash == h &&
+                     esp_reset_reason() == ESP_RST_DEEPSLEEP;
+    if (!s_resume_valid)
+    {
+        memset(&s_resume, 0, sizeof(s_resume));
+        s_resume.magic = MQTT_RESUME_MAGIC;
+        s_resume.config_hash = h;
+    }
+    ESP_LOGI(TAG, "fast resume cache %s", s_resume_valid ? "valid" : "reset");
+}
+
+/* Callbacks run at the end of every MQTT_EVENT_CONNECTED. */
+#ifndef MQTT_MAX_CONNECTED_CALLBACKS
+#define MQTT_MAX_CONNECTED_CALLBACKS 4
+#endif
+
+static struct {
+    mqtt_connected_cb_t cb;
+    void *ctx;
+} s_connected_cbs[MQTT_MAX_CONNECTED_CALLBACKS];
+
+bool mqtt_register_connected_callback(mqtt_connected_cb_t cb, void *user_ctx)
+{
+    for (int i = 0; i < MQTT_MAX_CONNECTED_CALLBACKS; ++i)
+    {
+        if (s_connected_cbs[i].cb == NULL || s_connected_cbs[i].cb == cb)
+        {
+            s_connected_cbs[i].ctx = user_ctx;
+            s_connected_cbs[i].cb = cb;
+            return true;
+        }
+    }
+    ESP_LOGW(TAG, "no room for another connected callback");
+    return false;
+}
+
+static void mqtt_handle_connected(esp_mqtt_event_handle_t event)
+{
+    ESP_LOGI(TAG, "connected to broker in %lld ms (session_present=%d)",
+             (long long)((esp_timer_get_time() - s_start_us) / 1000), event->session_present);
+    // anything still unacknowledged from the previous session is resent now
+    if (s_connected_once) mqtt_stats_on_reconnect();
+    s_connected_once = true;
+    s_connected = true;
+    s_down_since_us = 0;
+    mqtt_failover_on_connected();
+    if (event->client) mqtt_v5_on_connected(event->client);
+    mqtt_queue_kick();
+    if (!event->client) return;
+
+    // The broker only kept our subscriptions if it says so; otherwise start over
+    bool resume = s_resume_valid && event->session_present && s_resume.subscribed;
+    if (!resume)
+    {
+        s_resume.subscribed = false;
+        s_resume.attributes_synced = false;
+    }
+
+    if (!s_resume.subscribed)
+    {
+        /* subscribe to ThingsBoard attribute updates */
+        int sub_id = esp_mqtt_client_subscribe(event->client, "v1/devices/me/attributes", 1);
+        ESP_LOGI(TAG, "Subscribed to attributes (msg_id=%d)", sub_id);
+        // subscribe to attribute responses (for explicit requests)
+        int sub_id2 = esp_mqtt_client_subscribe(event->client, "v1/devices/me/attributes/response/+", 1);
+        ESP_LOGI(TAG, "Subscribed to attribute responses (msg_id=%d)", sub_id2);
+        // subscribe to server-side RPC requests (see mqtt_rpc.c)
+        int sub_id3 = esp_mqtt_client_subscribe(event->client, MQTT_RPC_REQUEST_TOPIC_FILTER, 0);
+        ESP_LOGI(TAG, "Subscribed to RPC requests (msg_id=%d)", sub_id3);
+        s_resume.subscribed = sub_id >= 0 && sub_id2 >= 0 && sub_id3 >= 0;
+    }
+    else
+    {
+        ESP_LOGI(TAG, "fast resume: broker kept the session; skipping resubscribe");
+    }
+
+    if (!s_resume.attributes_synced)
+    {
+        // Request current attributes from ThingsBoard; the response will arrive on the response topic.
+        // With a persistent session later changes are queued for us, so one request per session is enough.
+        // Queued like everything else: the MQTT task must not publish directly (see mqtt_v5.c).
+        s_resume.attributes_synced = mqtt_queue_push(MQTT_PRIO_ALERT, EGRESS_CLASS_NONE, "v1/devices/me/attributes/request/1", 0, "{}", 2, 1, false);
+        ESP_LOGI(TAG, "Requested current attributes");
+    }
+
+    // client attributes, OTA confirmation, ... (see mqtt_register_connected_callback)
+    for (int i = 0; i < MQTT_MAX_CONNECTED_CALLBACKS && s_connected_cbs[i].cb; ++i)
+        s_connected_cbs[i].cb(resume, s_connected_cbs[i].ctx);
+}
+
 static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
 {
     esp_mqtt_event_handle_t event = event_data;
     switch (event->event_id)
     {
+    case MQTT_EVENT_BEFORE_CONNECT:
+        mqtt_failover_on_attempt();
+        break;
     case MQTT_EVENT_CONNECTED:
-        ESP_LOGI(TAG, "connected to broker");
-        /* subscribe to ThingsBoard attribute updates */
-        if (event->client)
-        {
-            int sub_id = esp_mqtt_client_subscribe(event->client, "v1/devices/me/attributes", 1);
-            ESP_LOGI(TAG, "Subscribed to attributes (msg_id=%d)", sub_id);
-            // subscribe to attribute responses (for explicit requests)
-            int sub_id2 = esp_mqtt_client_subscribe(event->client, "v1/devices/me/attributes/response/+", 1);
-            ESP_LOGI(TAG, "Subscribed to attribute responses (msg_id=%d)", sub_id2);
-            // Request current attributes from ThingsBoard; the response will arrive on the response topic
-            int pub_id = esp_mqtt_client_publish(event->client, "v1/devices/me/attributes/request/1", "{}", 0, 1, 0);
-            ESP_LOGI(TAG, "Requested current attributes (msg_id=%d)", pub_id);
-
-            // Publish our current firmware identity as client attributes so ThingsBoard
-            // can include it in shared attribute queries. Read last applied version/title
-            // from NVS (namespace "ota"). If not present, try to read the build app
-            // description if available.
-            char fw_version[64] = {0};
-            char fw_title[64] = {0};
-            nvs_handle_t nh;
-            esp_err_t nerr = nvs_open("ota", NVS_READONLY, &nh);
-            if (nerr == ESP_OK) {
-                size_t vsz = sizeof(fw_version);
-                size_t tsz = sizeof(fw_title);
-                nvs_get_str(nh, "version", fw_version, &vsz);
-                nvs_get_str(nh, "title", fw_title, &tsz);
-                nvs_close(nh);
-            }
-            // If we have at least one field, publish both (empty fields omitted by TB)
-            if (fw_version[0] != '\0' || fw_title[0] != '\0') {
-                char attr_payload[256];
-                if (fw_title[0] != '\0' && fw_version[0] != '\0') {
-                    snprintf(attr_payload, sizeof(attr_payload), "{\"current_fw_title\":\"%s\",\"current_fw_version\":\"%s\"}", fw_title, fw_version);
-                } else if (fw_version[0] != '\0') {
-                    snprintf(attr_payload, sizeof(attr_payload), "{\"current_fw_version\":\"%s\"}", fw_version);
-                } else {
-                    snprintf(attr_payload, sizeof(attr_payload), "{\"current_fw_title\":\"%s\"}", fw_title);
-                }
-                mqtt_publish_attributes(attr_payload);
-            }
-
-            // If we have a persisted version and haven't confirmed it yet, send a
-            // one-time confirmation telemetry so ThingsBoard knows the device
-            // successfully booted the new image. Use NVS key 'confirmed' to
-            // avoid repeating confirmations after subsequent reboots.
-            if (fw_version[0] != '\0') {
-                nvs_handle_t nh2;
-                if (nvs_open("ota", NVS_READWRITE, &nh2) == ESP_OK) {
-                    int32_t confirmed = 0;
-                    size_t sz = sizeof(confirmed);
-                    if (nvs_get_i32(nh2, "confirmed", &confirmed) != ESP_OK || confirmed == 0) {
-                        // send confirmation telemetry
-                        char confirm_payload[128];
-                        snprintf(confirm_payload, sizeof(confirm_payload), "{\"fw_state\":\"UPDATED\",\"current_fw_version\":\"%s\"}", fw_version);
-                        mqtt_publish_telemetry(confirm_payload);
-                        // mark confirmed
-                        confirmed = 1;
-                        nvs_set_i32(nh2, "confirmed", confirmed);
-                        nvs_commit(nh2);
-                        ESP_LOGI(TAG, "Published OTA confirmation telemetry for version=%s", fw_version);
-                    }
-                    nvs_close(nh2);
-                }
-            }
-        }
+        mqtt_handle_connected(event);
         // Attribute-driven OTA will be triggered when attribute responses arrive
         break;
     case MQTT_EVENT_DATA:
-    {
-        // event->topic, event->topic_len, event->data, event->data_len are valid
-        char topic[event->topic_len + 1];
-        char data[event->data_len + 1];
-        memcpy(topic, event->topic, event->topic_len);
-        topic[event->topic_len] = '\0';
-        memcpy(data, event->data, event->data_len);
-        data[event->data_len] = '\0';
-        ESP_LOGI(TAG, "MQTT data on topic: %s", topic);
-        // If this is an attributes message from ThingsBoard, forward the payload
-        if (strstr(topic, "attributes/response") != NULL || strstr(topic, "attributes") != NULL)
-        {
-            // Forward ThingsBoard attribute updates or attribute responses to ota_manager
-            ota_manager_handle_attribute_update(data);
-        }
+        mqtt_handle_data_event(event);
+        break;
+    case MQTT_EVENT_PUBLISHED:
+        mqtt_stats_on_ack(event->msg_id);
+        mqtt_v5_on_ack(event->msg_id);
+        mqtt_queue_on_ack(event->msg_id, true);
+        break;
+    case MQTT_EVENT_DELETED:
+        // message expired from the outbox before it could be delivered
+        mqtt_stats_on_deleted(event->msg_id);
+        mqtt_v5_on_ack(event->msg_id);
+        mqtt_queue_on_ack(event->msg_id, false);
         break;
-    }
     case MQTT_EVENT_DISCONNECTED:
         ESP_LOGW(TAG, "disconnected from broker");
-        // stop OTA poller while disconnected
+        s_connected = false;
+        if (s_down_since_us == 0) s_down_since_us = esp_timer_get_time();
+        mqtt_v5_on_connection_changed();
+        mqtt_failover_on_disconnected();
         break;
     case MQTT_EVENT_ERROR:
         ESP_LOGE(TAG, "mqtt error");
+        mqtt_failover_on_error(!s_connected);
+        // CONNACK return code (3.1.1) or reason code (v5) from the broker
+        if (event->error_handle && event->error_handle->error_type == MQTT_ERROR_TYPE_CONNECTION_REFUSED)
+        {
+            ESP_LOGW(TAG, "connection refused, reason code 0x%x", (unsigned)event->error_handle->connect_return_code);
+            mqtt_stats_on_reason_code((int)event->error_handle->connect_return_code);
+        }
         break;
     default:
         break;
@@ -132,13 +401,40 @@ void mqtt_app_stop(void)
 {
     if (client)
     {
+        mqtt_failover_stop();
+        mqtt_stats_stop_reporting();
         esp_mqtt_client_stop(client);
         esp_mqtt_client_destroy(client);
         client = NULL;
+        s_connected = false;
+        mqtt_rx_release();
         ESP_LOGI(TAG, "mqtt client stopped");
     }
 }
 
+// Fill the client configuration for one broker. esp_mqtt_set_config()
+// replaces the whole configuration, so start and failover both use this.
+static void mqtt_build_config(esp_mqtt_client_config_t *cfg, const char *uri, const char *access_token)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    /* populate nested fields according to esp-mqtt layout in ESP-IDF v5.x */
+    cfg->broker.address.uri = uri;
+    cfg->credentials.username = access_token;
+    cfg->session.keepalive = 60;
+#if MQTT_FAST_RESUME
+    /* persistent session: a stable client id derived from the station MAC */
+    if (s_client_id[0] == '\0')
+    {
+        uint8_t mac[6] = {0};
+        esp_read_mac(mac, ESP_MAC_WIFI_STA);
+        snprintf(s_client_id, sizeof(s_client_id), "esp32-%02x%02x%02x%02x%02x%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    }
+    cfg->credentials.client_id = s_client_id;
+    cfg->session.disable_clean_session = true;
+#endif
+    mqtt_v5_configure(cfg);
+}
+
 void mqtt_app_start(const char *uri, const char *access_token)
 {
     if (client)
@@ -153,11 +449,16 @@ void mqtt_app_start(const char *uri, const char *access_token)
         return;
     }
 
-    esp_mqtt_client_config_t cfg = {0};
-    /* populate nested fields according to esp-mqtt layout in ESP-IDF v5.x */
-    cfg.broker.address.uri = uri;
-    cfg.credentials.username = access_token;
-    cfg.session.keepalive = 60;
+    // without a broker list from mqtt.txt the given broker is the only one
+    if (mqtt_failover_count() == 0) mqtt_failover_add(uri, access_token, 0);
+    mqtt_failover_select(&uri, &access_token);
+
+    mqtt_resume_prepare(uri, access_token);
+    s_start_us = esp_timer_get_time();
+    s_down_since_us = s_start_us;
+
+    esp_mqtt_client_config_t cfg;
+    mqtt_build_config(&cfg, uri, access_token);
 
     client = esp_mqtt_client_init(&cfg);
     if (client == NULL)
@@ -166,7 +467,10 @@ void mqtt_app_start(const char *uri, const char *access_token)
         return;
     }
 
+    mqtt_v5_after_init(client, MQTT_FAST_RESUME);
+    mqtt_queue_start();
     esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
+    mqtt_failover_on_attempt();
     esp_err_t err = esp_mqtt_client_start(client);
     if (err != ESP_OK)
     {
@@ -175,42 +479,65 @@ void mqtt_app_start(const char *uri, const char *access_token)
     else
     {
         ESP_LOGI(TAG, "mqtt client started (uri=%s)", uri);
+        mqtt_stats_start_reporting();
+        mqtt_failover_start();
     }
 }
 
+void mqtt_reconnect_to(const char *uri, const char *access_token)
+{
+    if (!client) return;
+    esp_mqtt_client_stop(client);
+    s_connected = false;
+    if (s_down_since_us == 0) s_down_since_us = esp_timer_get_time();
+    mqtt_v5_on_connection_changed();
+
+    // the stored session belongs to the previous broker
+    mqtt_resume_prepare(uri, access_token);
+    s_start_us = esp_timer_get_time();
+    esp_mqtt_client_config_t cfg;
+    mqtt_build_config(&cfg, uri, access_token);
+    esp_err_t err = esp_mqtt_set_config(client, &cfg);
+    if (err == ESP_OK) err = esp_mqtt_client_start(client);
+    if (err != ESP_OK)
+        ESP_LOGE(TAG, "failed to restart mqtt client on %s: %s", uri, esp_err_to_name(err));
+    else
+        ESP_LOGI(TAG, "mqtt client restarted (uri=%s)", uri);
+}
+
 bool mqtt_app_start_from_file(const char *uri, const char *token_file_path)
 {
     if (uri == NULL || token_file_path == NULL)
         return false;
 
-    FILE *f = fopen(token_file_path, "r");
-    if (!f)
+    const char *text = boot_config_get(token_file_path, NULL);
+    if (!text)
     {
         ESP_LOGW(TAG, "token file not found: %s", token_file_path);
         return false;
     }
 
     char token[128] = {0};
-    if (fgets(token, sizeof(token), f) == NULL)
+    if (!boot_config_next_line(&text, token, sizeof(token)) || token[0] == '\0')
     {
-        fclose(f);
         ESP_LOGW(TAG, "empty token file: %s", token_file_path);
         return false;
     }
-    fclose(f);
 
-    /* strip newline */
-    size_t len = strlen(token);
-    while (len > 0 && (token[len - 1] == '\n' || token[len - 1] == '\r'))
+    /* optional broker list: "<priority> <uri> [token]" per line, lower
+     * priority preferred; it replaces `uri`. A broker without its own token
+     * uses the one from the first line. */
+    mqtt_failover_reset();
+    char line[256];
+    while (boot_config_next_line(&text, line, sizeof(line)))
     {
-        token[len - 1] = '\0';
-        len--;
-    }
-
-    if (len == 0)
-    {
-        ESP_LOGW(TAG, "token file contained only whitespace: %s", token_file_path);
-        return false;
+        unsigned prio = 0;
+        char b_uri[96] = {0};
+        char b_token[128] = {0};
+        if (line[0] == '#' || sscanf(line, "%u %95s %127s", &prio, b_uri, b_token) < 2)
+            continue;
+        if (!mqtt_failover_add(b_uri, b_token[0] ? b_token : token, (uint8_t)(prio > 255 ? 255 : prio)))
+            ESP_LOGW(TAG, "ignoring broker %s (list full or entry too long)", b_uri);
     }
 
     // store a copy of token for other modules
@@ -220,42 +547,101 @@ bool mqtt_app_start_from_file(const char *uri, const char *token_file_path)
     return true;
 }
 
+bool mqtt_is_connected(void)
+{
+    return client != NULL && s_connected;
+}
+
+uint32_t mqtt_disconnected_ms(void)
+{
+    if (client == NULL) return UINT32_MAX;
+    if (s_connected) return 0;
+    int64_t ms = (esp_timer_get_time() - s_down_since_us) / 1000;
+    return ms > UINT32_MAX ? UINT32_MAX : (uint32_t)ms;
+}
+
 const char *mqtt_get_access_token(void)
 {
     return g_access_token;
 }
 
+esp_mqtt_client_handle_t mqtt_get_client(void)
+{
+    return client;
+}
+
 void mqtt_publish_telemetry(const char *json_payload)
 {
-    if (!client)
-    {
-        ESP_LOGW(TAG, "cannot publish, mqtt client not started");
-        return;
-    }
     if (!json_payload)
     {
         ESP_LOGW(TAG, "mqtt_publish_telemetry called with NULL payload");
         return;
     }
+    if (mqtt_queue_push(MQTT_PRIO_TELEMETRY, EGRESS_CLASS_TELEMETRY, MQTT_TELEMETRY_TOPIC, MQTT_ALIAS_TELEMETRY, json_payload, strlen(json_payload), 1, true))
+    {
+        ESP_LOGI(TAG, "queued telemetry: %s", json_payload);
+    }
+}
 
-    const char *topic = "v1/devices/me/telemetry";
-    int msg_id = esp_mqtt_client_publish(client, topic, json_payload, 0, 1, 0);
-    ESP_LOGI(TAG, "published telemetry (msg_id=%d): %s", msg_id, json_payload);
+uint32_t mqtt_publish_telemetry_confirmed(const char *json_payload)
+{
+    if (!json_payload) return 0;
+    return mqtt_queue_push_tracked(MQTT_PRIO_TELEMETRY, EGRESS_CLASS_TELEMETRY, MQTT_TELEMETRY_TOPIC, json_payload, strlen(json_payload));
 }
 
-void mqtt_publish_attributes(const char *json_payload)
+void mqtt_publish_alert(const char *json_payload)
 {
-    if (!client)
+    if (!json_payload) return;
+    if (mqtt_queue_push(MQTT_PRIO_ALERT, EGRESS_CLASS_ALERT, MQTT_TELEMETRY_TOPIC, MQTT_ALIAS_TELEMETRY, json_payload, strlen(json_payload), 1, true))
     {
-        ESP_LOGW(TAG, "cannot publish attributes, mqtt client not started");
-        return;
+        ESP_LOGI(TAG, "queued alert: %s", json_payload);
     }
+}
+
+void mqtt_publish_ota_state(const char *json_payload)
+{
+    if (!json_payload) return;
+    // OTA state must not expire: ThingsBoard drives the OTA widget from it
+    mqtt_queue_push(MQTT_PRIO_OTA, EGRESS_CLASS_OTA_STATUS, MQTT_TELEMETRY_TOPIC, MQTT_ALIAS_TELEMETRY, json_payload, strlen(json_payload), 1, false);
+}
+
+bool mqtt_publish_attributes(const char *json_payload)
+{
     if (!json_payload)
     {
         ESP_LOGW(TAG, "mqtt_publish_attributes called with NULL payload");
-        return;
+        return false;
+    }
+    if (!mqtt_queue_push(MQTT_PRIO_ATTRIBUTES, EGRESS_CLASS_NONE, MQTT_ATTRIBUTES_TOPIC, MQTT_ALIAS_ATTRIBUTES, json_payload, strlen(json_payload), 1, false))
+    {
+        return false;
     }
-    const char *topic = "v1/devices/me/attributes";
-    int msg_id = esp_mqtt_client_publish(client, topic, json_payload, 0, 1, 0);
-    ESP_LOGI(TAG, "published attributes (msg_id=%d): %s", msg_id, json_payload);
+    ESP_LOGI(TAG, "queued attributes: %s", json_payload);
+    return true;
+}
+
+bool mqtt_publish_raw(const char *topic, const void *data, size_t len, int qos, mqtt_prio_t lane)
+{
+    egress_class_t cls = lane == MQTT_PRIO_ALERT ? EGRESS_CLASS_ALERT : lane == MQTT_PRIO_OTA ? EGRESS_CLASS_OTA_STATUS :
+                         lane == MQTT_PRIO_TELEMETRY ? EGRESS_CLASS_TELEMETRY : EGRESS_CLASS_NONE;
+    return mqtt_queue_push(lane, cls, topic, 0, data, len, qos, false);
+}
+
+int mqtt_publish_tracked(esp_mqtt_client_handle_t c, const char *topic, const char *data, int len, int qos, int retain)
+{
+    mqtt_v5_lock(c);
+    int msg_id = esp_mqtt_client_publish(c, topic, data, len, qos, retain);
+    mqtt_v5_unlock();
+    mqtt_stats_on_publish(msg_id);
+    return msg_id;
+}
+
+int mqtt_enqueue_tracked(esp_mqtt_client_handle_t c, const char *topic, const char *data, int len, int qos, int retain)
+{
+    // store=true so QoS 0 messages are kept in the outbox as well
+    mqtt_v5_lock(c);
+    int msg_id = esp_mqtt_client_enqueue(c, topic, data, len, qos, retain, true);
+    mqtt_v5_unlock();
+    mqtt_stats_on_publish(msg_id);
+    return msg_id;
 }
@@ -0,0 +1,385 @@
+/*
+ * mqtt_failover.c
+ *
+ * Multi-broker failover. mqtt.txt may list several brokers with a priority
+ * (lower value = preferred), e.g. the ThingsBoard cloud first and an
+ * on-premise broker as a stand-in. The connection always uses the best
+ * healthy broker:
+ *  - the active broker is abandoned when it fails to connect within
+ *    MQTT_FAILOVER_CONNECT_TIMEOUT_MS, after MQTT_FAILOVER_MAX_FAILURES
+ *    consecutive failed attempts, or when it keeps erroring/dropping the
+ *    connection (MQTT_FAILOVER_MAX_ERRORS within one window). It is then
+ *    held down for MQTT_FAILOVER_HOLDDOWN_MS.
+ *  - while running on a less preferred broker the better ones are probed
+ *    with a plain TCP connect every MQTT_FAILOVER_PROBE_MS, and the client
+ *    fails back once a probe succeeds MQTT_FAILOVER_PROBE_PASSES times in a row.
+ * Among brokers of equal priority the one with the lower connect latency
+ * (moving average of MQTT connects and probes) wins. With a single broker the
+ * monitor task is not started and esp-mqtt's own reconnect logic applies.
+ */
+#include "mqtt.h"
+#include "mqtt_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+
+static const char *TAG = "mqtt_failover";
+
+#ifndef MQTT_FAILOVER_MAX_BROKERS
+#define MQTT_FAILOVER_MAX_BROKERS 4
+#endif
+
+/* Monitor task period. */
+#ifndef MQTT_FAILOVER_CHECK_MS
+#define MQTT_FAILOVER_CHECK_MS 5000
+#endif
+
+/* Give up on a broker that has not connected within this time. */
+#ifndef MQTT_FAILOVER_CONNECT_TIMEOUT_MS
+#define MQTT_FAILOVER_CONNECT_TIMEOUT_MS 30000
+#endif
+
+#ifndef MQTT_FAILOVER_MAX_FAILURES
+#define MQTT_FAILOVER_MAX_FAILURES 3
+#endif
+
+/* Errors/disconnects tolerated per window before a connected broker is dropped. */
+#ifndef MQTT_FAILOVER_MAX_ERRORS
+#define MQTT_FAILOVER_MAX_ERRORS 5
+#endif
+#ifndef MQTT_FAILOVER_WINDOW_MS
+#define MQTT_FAILOVER_WINDOW_MS (10 * 60 * 1000)
+#endif
+
+#ifndef MQTT_FAILOVER_HOLDDOWN_MS
+#define MQTT_FAILOVER_HOLDDOWN_MS (2 * 60 * 1000)
+#endif
+
+#ifndef MQTT_FAILOVER_PROBE_MS
+#define MQTT_FAILOVER_PROBE_MS 60000
+#endif
+#ifndef MQTT_FAILOVER_PROBE_TIMEOUT_MS
+#define MQTT_FAILOVER_PROBE_TIMEOUT_MS 3000
+#endif
+#ifndef MQTT_FAILOVER_PROBE_PASSES
+#define MQTT_FAILOVER_PROBE_PASSES 2
+#endif
+
+typedef struct {
+    char uri[96];
+    char token[128];
+    uint8_t priority;
+    uint32_t latency_ms;        /* moving average of connect/probe latency, 0 = unknown */
+    uint16_t failures;          /* consecutive failed connect attempts */
+    uint16_t errors;            /* errors and disconnects in the current window */
+    uint8_t probe_passes;       /* consecutive successful TCP probes */
+    int64_t held_until_us;
+} mqtt_broker_t;
+
+static mqtt_broker_t s_brokers[MQTT_FAILOVER_MAX_BROKERS];
+static int s_count = 0;
+static int s_active = -1;
+static uint32_t s_failovers = 0;
+static int64_t s_attempt_us = 0;   /* start of the pending connect attempt, 0 while connected */
+static int64_t s_window_us = 0;
+static int64_t s_last_probe_us = 0;
+static TaskHandle_t s_task = NULL;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void mqtt_failover_record_latency(mqtt_broker_t *b, uint32_t ms)
+{
+    b->latency_ms = b->latency_ms ? (b->latency_ms * 3 + ms) / 4 : ms;
+}
+
+void mqtt_failover_reset(void)
+{
+    portENTER_CRITICAL(&s_lock);
+    memset(s_brokers, 0, sizeof(s_brokers));
+    s_count = 0;
+    s_active = -1;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+bool mqtt_failover_add(const char *uri, const char *token, uint8_t priority)
+{
+    if (!uri || !token || strlen(uri) >= sizeof(s_brokers[0].uri) || strlen(token) >= sizeof(s_brokers[0].token))
+        return false;
+    portENTER_CRITICAL(&s_lock);
+    bool ok = s_count < MQTT_FAILOVER_MAX_BROKERS;
+    if (ok)
+    {
+        mqtt_broker_t *b = &s_brokers[s_count++];
+        memset(b, 0, sizeof(*b));
+        strcpy(b->uri, uri);
+        strcpy(b->token, token);
+        b->priority = priority;
+    }
+    portEXIT_CRITICAL(&s_lock);
+    if (ok) ESP_LOGI(TAG, "broker %d: %s (priority %u)", s_count - 1, uri, (unsigned)priority);
+    return ok;
+}
+
+int mqtt_failover_count(void)
+{
+    return s_count;
+}
+
+// Lower priority value first, then lower latency (unknown latency sorts last).
+static bool mqtt_failover_better(const mqtt_broker_t *a, const mqtt_broker_t *b)
+{
+    if (a->priority != b->priority) return a->priority < b->priority;
+    uint32_t la = a->latency_ms ? a->latency_ms : UINT32_MAX;
+    uint32_t lb = b->latency_ms ? b->latency_ms : UINT32_MAX;
+    return la < lb;
+}
+
+// Best broker not held down, excluding `skip`. When every other broker is
+// held down the one whose hold-down ends first is used.
+static int mqtt_failover_pick(int skip, int64_t now)
+{
+    int best = -1, fallback = -1;
+    for (int i = 0; i < s_count; i++)
+    {
+        if (i == skip) continue;
+        if (s_brokers[i].held_until_us > now)
+        {
+            if (fallback < 0 || s_brokers[i].held_until_us < s_brokers[fallback].held_until_us) fallback = i;
+            continue;
+        }
+        if (best < 0 || mqtt_failover_better(&s_brokers[i], &s_brokers[best])) best = i;
+    }
+    return best >= 0 ? best : fallback;
+}
+
+bool mqtt_failover_select(const char **uri, const char **token)
+{
+    if (s_count == 0) return false;
+    if (s_active < 0) s_active = mqtt_failover_pick(-1, esp_timer_get_time());
+    *uri = s_brokers[s_active].uri;
+    *token = s_brokers[s_active].token;
+    return true;
+}
+
+int mqtt_failover_active(uint32_t *failovers)
+{
+    if (failovers) *failovers = s_failovers;
+    return s_active;
+}
+
+/* Connection events, called from the MQTT event handler. */
+
+void mqtt_failover_on_attempt(void)
+{
+    portENTER_CRITICAL(&s_lock);
+    if (s_attempt_us == 0) s_attempt_us = esp_timer_get_time();
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void mqtt_failover_on_connected(void)
+{
+    if (s_active < 0) return;
+    portENTER_CRITICAL(&s_lock);
+    mqtt_broker_t *b = &s_brokers[s_active];
+    if (s_attempt_us) mqtt_failover_record_latency(b, (uint32_t)((esp_timer_get_time() - s_attempt_us) / 1000));
+    b->failures = 0;
+    s_attempt_us = 0;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void mqtt_failover_on_error(bool connect_failed)
+{
+    if (s_active < 0) return;
+    portENTER_CRITICAL(&s_lock);
+    mqtt_broker_t *b = &s_brokers[s_active];
+    if (b->errors < UINT16_MAX) b->errors++;
+    if (connect_failed && b->failures < UINT16_MAX) b->failures++;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void mqtt_failover_on_disconnected(void)
+{
+    mqtt_failover_on_error(false);
+    mqtt_failover_on_attempt();
+}
+
+// Parse "scheme://[user@]host[:port][/path]" into host and port.
+static bool mqtt_failover_parse_uri(const char *uri, char *host, size_t host_len, uint16_t *port)
+{
+    const char *p = strstr(uri, "://");
+    if (!p) return false;
+    size_t scheme_len = (size_t)(p - uri);
+    *port = 1883;
+    if (scheme_len == 5 && strncmp(uri, "mqtts", 5) == 0) *port = 8883;
+    else if (scheme_len == 2 && strncmp(uri, "ws", 2) == 0) *port = 80;
+    else if (scheme_len == 3 && strncmp(uri, "wss", 3) == 0) *port = 443;
+    p += 3;
+    const char *at = strchr(p, '@');
+    const char *slash = strchr(p, '/');
+    if (at && (!slash || at < slash)) p = at + 1;
+    size_t n = strcspn(p, ":/");
+    if (n == 0 || n >= host_len) return false;
+    memcpy(host, p, n);
+    host[n] = '\0';
+    if (p[n] == ':') *port = (uint16_t)atoi(p + n + 1);
+    return *port != 0;
+}
+
+// Health probe: time a TCP connect to the broker's host and port.
+static bool mqtt_failover_probe(const char *uri, uint32_t *elapsed_ms)
+{
+    char host[64];
+    uint16_t port;
+    if (!mqtt_failover_parse_uri(uri, host, sizeof(host), &port)) return false;
+
+    char port_str[6];
+    snprintf(port_str, sizeof(port_str), "%u", (unsigned)port);
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res = NULL;
+    int64_t t0 = esp_timer_get_time();
+    if (getaddrinfo(host, port_str, &hints, &res) != 0 || res == NULL) return false;
+
+    bool ok = false;
+    int s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (s >= 0)
+    {
+        fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+        int rc = connect(s, res->ai_addr, res->ai_addrlen);
+        if (rc == 0)
+        {
+            ok = true;
+        }
+        else if (errno == EINPROGRESS)
+        {
+            fd_set wfds;
+            FD_ZERO(&wfds);
+            FD_SET(s, &wfds);
+            struct timeval tv = { .tv_sec = MQTT_FAILOVER_PROBE_TIMEOUT_MS / 1000,
+                                  .tv_usec = (MQTT_FAILOVER_PROBE_TIMEOUT_MS % 1000) * 1000 };
+            if (select(s + 1, NULL, &wfds, NULL, &tv) > 0)
+            {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                ok = getsockopt(s, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0;
+            }
+        }
+        close(s);
+    }
+    freeaddrinfo(res);
+    *elapsed_ms = (uint32_t)((esp_timer_get_time() - t0) / 1000);
+    return ok;
+}
+
+static void mqtt_failover_switch(int to, const char *why)
+{
+    int from = s_active;
+    ESP_LOGW(TAG, "switching broker %s -> %s (%s)", s_brokers[from].uri, s_brokers[to].uri, why);
+    portENTER_CRITICAL(&s_lock);
+    s_active = to;
+    s_brokers[to].failures = 0;
+    s_brokers[to].errors = 0;
+    s_brokers[to].probe_passes = 0;
+    s_attempt_us = esp_timer_get_time();
+    portEXIT_CRITICAL(&s_lock);
+    s_failovers++;
+    mqtt_reconnect_to(s_brokers[to].uri, s_brokers[to].token);
+}
+
+// Probe every broker preferred over the active one; return the best that
+// has passed enough consecutive probes, or -1.
+static int mqtt_failover_probe_better(int64_t now)
+{
+    int best = -1;
+    for (int i = 0; i < s_count; i++)
+    {
+        mqtt_broker_t *b = &s_brokers[i];
+        if (i == s_active || !mqtt_failover_better(b, &s_brokers[s_active]) || b->held_until_us > now) continue;
+        uint32_t ms = 0;
+        bool ok = mqtt_failover_probe(b->uri, &ms);
+        portENTER_CRITICAL(&s_lock);
+        if (ok)
+        {
+            mqtt_failover_record_latency(b, ms);
+            if (b->probe_passes < UINT8_MAX) b->probe_passes++;
+        }
+        else
+        {
+            b->probe_passes = 0;
+        }
+        portEXIT_CRITICAL(&s_lock);
+        ESP_LOGD(TAG, "probe %s: %s (%lu ms)", b->uri, ok ? "ok" : "failed", (unsigned long)ms);
+        if (b->probe_passes >= MQTT_FAILOVER_PROBE_PASSES && (best < 0 || mqtt_failover_better(b, &s_brokers[best])))
+            best = i;
+    }
+    return best;
+}
+
+static void mqtt_failover_task(void *arg)
+{
+    (void)arg;
+    s_window_us = esp_timer_get_time();
+    for (;;)
+    {
+        vTaskDelay(pdMS_TO_TICKS(MQTT_FAILOVER_CHECK_MS));
+        int64_t now = esp_timer_get_time();
+        mqtt_broker_t *cur = &s_brokers[s_active];
+
+        if (now - s_window_us >= (int64_t)MQTT_FAILOVER_WINDOW_MS * 1000)
+        {
+            portENTER_CRITICAL(&s_lock);
+            for (int i = 0; i < s_count; i++) s_brokers[i].errors = 0;
+            portEXIT_CRITICAL(&s_lock);
+            s_window_us = now;
+        }
+
+        const char *why = NULL;
+        if (!mqtt_is_connected() && s_attempt_us && now - s_attempt_us >= (int64_t)MQTT_FAILOVER_CONNECT_TIMEOUT_MS * 1000)
+            why = "connect timeout";
+        else if (cur->failures >= MQTT_FAILOVER_MAX_FAILURES)
+            why = "connect failures";
+        else if (cur->errors >= MQTT_FAILOVER_MAX_ERRORS)
+            why = "error rate";
+        if (why)
+        {
+            cur->held_until_us = now + (int64_t)MQTT_FAILOVER_HOLDDOWN_MS * 1000;
+            int next = mqtt_failover_pick(s_active, now);
+            if (next >= 0) mqtt_failover_switch(next, why);
+            else s_attempt_us = now; /* only broker: keep retrying it */
+            continue;
+        }
+
+        // fail back to a preferred broker once it answers probes again
+        if (mqtt_is_connected() && now - s_last_probe_us >= (int64_t)MQTT_FAILOVER_PROBE_MS * 1000)
+        {
+            s_last_probe_us = now;
+            int better = mqtt_failover_probe_better(now);
+            if (better >= 0) mqtt_failover_switch(better, "preferred broker healthy");
+        }
+    }
+}
+
+void mqtt_failover_start(void)
+{
+    if (s_task || s_count < 2) return;
+    s_last_probe_us = esp_timer_get_time();
+    if (xTaskCreate(mqtt_failover_task, "mqtt_failover", 4 * 1024, NULL, tskIDLE_PRIORITY + 1, &s_task) != pdPASS)
+    {
+        ESP_LOGE(TAG, "failed to create failover task");
+        s_task = NULL;
+    }
+}
+
+void mqtt_failover_stop(void)
+{
+    if (s_task)
+    {
+        vTaskDelete(s_task);
+        s_task = NULL;
+    }
+}
@@ -0,0 +1,122 @@
+/*
+ * mqtt_internal.h
+ *
+ * Private interfaces shared between the translation units of the MQTT
+ * manager component. Not part of the public API (see include/mqtt.h).
+ */
+
+#ifndef MQTT_INTERNAL_H
+#define MQTT_INTERNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "mqtt_client.h"
+#include "mqtt.h"
+#include "egress_governor.h"
+
+/* ThingsBoard device API topics */
+#define MQTT_TELEMETRY_TOPIC "v1/devices/me/telemetry"
+#define MQTT_ATTRIBUTES_TOPIC "v1/devices/me/attributes"
+
+/* Largest payload a publish queue slot can hold; larger publishes are rejected. */
+#ifndef MQTT_QUEUE_MAX_PAYLOAD
+#define MQTT_QUEUE_MAX_PAYLOAD 512
+#endif
+
+/* ThingsBoard server-side RPC topics */
+#define MQTT_RPC_REQUEST_TOPIC_FILTER "v1/devices/me/rpc/request/+"
+#define MQTT_RPC_REQUEST_TOPIC_PREFIX "v1/devices/me/rpc/request/"
+#define MQTT_RPC_RESPONSE_TOPIC_PREFIX "v1/devices/me/rpc/response/"
+
+/**
+ * Handle a complete RPC request received on `topic`. Looks up the method in
+ * the registry, runs the handler and publishes the response on the matching
+ * response topic using `client`.
+ */
+void mqtt_rpc_handle_request(esp_mqtt_client_handle_t client, const char *topic, const char *payload);
+
+/** Return the client handle (NULL when not started). */
+esp_mqtt_client_handle_t mqtt_get_client(void);
+
+/**
+ * Publish through the shared client and record the msg_id for PUBACK
+ * latency tracking. Same arguments and return value as
+ * esp_mqtt_client_publish(). Holds the v5 publish lock, so it must not be
+ * called from the MQTT event handler; queue the message there instead.
+ */
+int mqtt_publish_tracked(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len, int qos, int retain);
+
+/** Like mqtt_publish_tracked() but via esp_mqtt_client_enqueue(); never waits on the network. */
+int mqtt_enqueue_tracked(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len, int qos, int retain);
+
+/* Publish queue (mqtt_queue.c). `egress_class` selects the egress budget
+ * the message is charged to (EGRESS_CLASS_NONE: not metered). */
+bool mqtt_queue_push(mqtt_prio_t lane, egress_class_t egress_class, const char *topic, uint16_t alias, const void *data, size_t len, int qos, bool expires);
+/** mqtt_queue_push() at QoS 1 without alias or expiry; returns a ticket for mqtt_delivery_state() (0: not queued). */
+uint32_t mqtt_queue_push_tracked(mqtt_prio_t lane, egress_class_t egress_class, const char *topic, const void *data, size_t len);
+/** PUBACK (`delivered`) or outbox expiry for `msg_id`; resolves its ticket. */
+void mqtt_queue_on_ack(int msg_id, bool delivered);
+void mqtt_queue_start(void);
+void mqtt_queue_kick(void);
+uint32_t mqtt_queue_depth(void);
+
+/**
+ * Point the running client at another broker: stop it, apply `uri` and
+ * `access_token` and start it again. Queued messages are kept.
+ */
+void mqtt_reconnect_to(const char *uri, const char *access_token);
+
+/* Broker list and failover monitor (mqtt_failover.c) */
+void mqtt_failover_reset(void);
+bool mqtt_failover_add(const char *uri, const char *token, uint8_t priority);
+int mqtt_failover_count(void);
+/** Choose the broker to connect to; false when none is configured. */
+bool mqtt_failover_select(const char **uri, const char **token);
+/** Index of the active broker (-1 if none) and the number of switches so far. */
+int mqtt_failover_active(uint32_t *failovers);
+void mqtt_failover_start(void);
+void mqtt_failover_stop(void);
+void mqtt_failover_on_attempt(void);
+void mqtt_failover_on_connected(void);
+void mqtt_failover_on_error(bool connect_failed);
+void mqtt_failover_on_disconnected(void);
+
+/* Topic aliases used on MQTT v5 connections */
+#define MQTT_ALIAS_TELEMETRY 1
+#define MQTT_ALIAS_ATTRIBUTES 2
+
+/* MQTT v5 helpers (mqtt_v5.c); they fall back to 3.1.1 behaviour when the
+ * client is built without CONFIG_MQTT_PROTOCOL_5. */
+bool mqtt_v5_enabled(void);
+void mqtt_v5_configure(esp_mqtt_client_config_t *cfg);
+void mqtt_v5_after_init(esp_mqtt_client_handle_t client, bool persistent_session);
+void mqtt_v5_on_connection_changed(void);
+/** New connection: reset aliases and re-declare those the outbox will resend. MQTT task only. */
+void mqtt_v5_on_connected(esp_mqtt_client_handle_t client);
+/** PUBACK or outbox expiry for `msg_id`. */
+void mqtt_v5_on_ack(int msg_id);
+/** Serialise a publish against the client-wide v5 publish properties (no-op without v5). */
+void mqtt_v5_lock(esp_mqtt_client_handle_t client);
+void mqtt_v5_unlock(void);
+/**
+ * Hand a message to esp-mqtt using topic alias `alias` (0 == none).
+ * `expires` applies the telemetry message-expiry interval. Called from the
+ * sender task only. Returns the msg_id like esp_mqtt_client_enqueue().
+ */
+int mqtt_v5_publish(esp_mqtt_client_handle_t client, uint16_t alias, const char *topic, const char *data, int len, int qos, bool expires);
+
+/* Publish accounting hooks (mqtt_stats.c) */
+void mqtt_stats_on_publish(int msg_id);
+void mqtt_stats_on_ack(int msg_id);
+/** Tag a publish sent from queue `lane` so its PUBACK feeds that lane's latency. */
+void mqtt_stats_on_lane_sent(int msg_id, mqtt_prio_t lane, int64_t queued_us);
+void mqtt_stats_on_deleted(int msg_id);
+void mqtt_stats_on_reconnect(void);
+void mqtt_stats_on_reason_code(int reason_code);
+void mqtt_stats_on_alias_bytes(int32_t saved);
+void mqtt_stats_on_queue_drop(bool coalesced);
+void mqtt_stats_start_reporting(void);
+void mqtt_stats_stop_reporting(void);
+
+#endif // MQTT_INTERNAL_H
@@ -0,0 +1,514 @@
+/*
+ * mqtt_queue.c
+ *
+ * Bounded, prioritised publish queue. Producers (app_main, ota_manager, the
+ * connect handler, timers) only copy their message into a fixed slot and
+ * return; a single sender task drains the lanes in priority order
+ * (alerts > OTA state > attributes > telemetry) and hands messages to
+ * esp-mqtt with esp_mqtt_client_enqueue() while the client is connected and
+ * its outbox is below MQTT_QUEUE_OUTBOX_LIMIT. During reconnects messages
+ * simply wait in their lane; when a lane is full its policy decides what
+ * gives way:
+ *  - MQTT_QUEUE_DROP_OLDEST: the oldest pending message is discarded.
+ *  - MQTT_QUEUE_COALESCE_LATEST: the new message is merged into the newest
+ *    pending one for the same topic. JSON objects are merged key by key, so
+ *    a later update wins without losing keys the earlier one carried. If
+ *    either payload is not a JSON object, or the merge does not fit a slot,
+ *    the lane drops its oldest message instead. The attributes lane
+ *    coalesces by default.
+ * Payloads are copied outside the spinlock: a slot being written has id 0
+ * and the sender skips it, and producers are serialised by s_push_lock.
+ * The sender publishes from its own copy of the head message, so a producer
+ * may reuse that slot meanwhile; it then leaves the accounting to the
+ * sender, which counts the message as dropped only if it was not sent.
+ * Every message is also charged to its egress class (egress_governor). A
+ * lane whose head message is over budget is skipped until the budget
+ * refills, so deferred traffic waits in the queue instead of being dropped
+ * and lower lanes with budget left keep flowing.
+ * Messages pushed with mqtt_queue_push_tracked() get a ticket that follows
+ * them from the lane to their PUBACK, so a producer can tell delivered
+ * messages from ones the lane dropped or the outbox expired.
+ */
+#include "mqtt.h"
+#include "mqtt_internal.h"
+
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include <cJSON.h>
+
+static const char *TAG = "mqtt_queue";
+
+/* Slots per priority lane. */
+#ifndef MQTT_QUEUE_SLOTS_ALERT
+#define MQTT_QUEUE_SLOTS_ALERT 4
+#endif
+#ifndef MQTT_QUEUE_SLOTS_OTA
+#define MQTT_QUEUE_SLOTS_OTA 2
+#endif
+#ifndef MQTT_QUEUE_SLOTS_ATTRIBUTES
+#define MQTT_QUEUE_SLOTS_ATTRIBUTES 4
+#endif
+#ifndef MQTT_QUEUE_SLOTS_TELEMETRY
+#define MQTT_QUEUE_SLOTS_TELEMETRY 8
+#endif
+
+/* Stop feeding esp-mqtt while its outbox holds more than this many bytes. */
+#ifndef MQTT_QUEUE_OUTBOX_LIMIT
+#define MQTT_QUEUE_OUTBOX_LIMIT 4096
+#endif
+
+/* Sender wake-up period while waiting for a connection or outbox room. */
+#ifndef MQTT_QUEUE_RETRY_MS
+#define MQTT_QUEUE_RETRY_MS 500
+#endif
+
+/* Tracked messages (tickets) that can await their PUBACK at once. */
+#ifndef MQTT_QUEUE_TICKETS
+#define MQTT_QUEUE_TICKETS 16
+#endif
+
+#define MQTT_QUEUE_TOTAL_SLOTS (MQTT_QUEUE_SLOTS_ALERT + MQTT_QUEUE_SLOTS_OTA + MQTT_QUEUE_SLOTS_ATTRIBUTES + MQTT_QUEUE_SLOTS_TELEMETRY)
+
+typedef struct {
+    uint32_t id;        /* unique per stored message, lets the sender detect coalescing; 0 while being written */
+    char topic[64];
+    uint16_t alias;
+    uint16_t len;
+    uint8_t qos;
+    uint8_t egress_class;
+    bool expires;
+    int64_t queued_us;
+    char data[MQTT_QUEUE_MAX_PAYLOAD + 1];
+} mqtt_queue_entry_t;
+
+typedef struct {
+    mqtt_queue_entry_t *slots;
+    uint8_t capacity;
+    uint8_t head;
+    uint8_t count;
+    mqtt_queue_policy_t policy;
+} mqtt_queue_lane_t;
+
+static mqtt_queue_entry_t s_slots[MQTT_QUEUE_TOTAL_SLOTS];
+static mqtt_queue_lane_t s_lanes[MQTT_PRIO_COUNT] = {
+    [MQTT_PRIO_ALERT] = { &s_slots[0], MQTT_QUEUE_SLOTS_ALERT, 0, 0, MQTT_QUEUE_DROP_OLDEST },
+    [MQTT_PRIO_OTA] = { &s_slots[MQTT_QUEUE_SLOTS_ALERT], MQTT_QUEUE_SLOTS_OTA, 0, 0, MQTT_QUEUE_DROP_OLDEST },
+    [MQTT_PRIO_ATTRIBUTES] = { &s_slots[MQTT_QUEUE_SLOTS_ALERT + MQTT_QUEUE_SLOTS_OTA], MQTT_QUEUE_SLOTS_ATTRIBUTES, 0, 0, MQTT_QUEUE_COALESCE_LATEST },
+    [MQTT_PRIO_TELEMETRY] = { &s_slots[MQTT_QUEUE_SLOTS_ALERT + MQTT_QUEUE_SLOTS_OTA + MQTT_QUEUE_SLOTS_ATTRIBUTES], MQTT_QUEUE_SLOTS_TELEMETRY, 0, 0, MQTT_QUEUE_DROP_OLDEST },
+};
+
+typedef struct {
+    uint32_t id;        /* queue id of the message, 0 = unused */
+    int msg_id;         /* esp-mqtt msg_id once sent, -1 before */
+    mqtt_delivery_t state;
+} mqtt_ticket_t;
+
+static const char *const s_lane_names[MQTT_PRIO_COUNT] = { "alert", "ota", "attributes", "telemetry" };
+static uint32_t s_next_id = 1;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t s_push_lock = NULL;
+/* Guarded by s_lock; only producers (under s_push_lock) take new ones. */
+static mqtt_ticket_t s_tickets[MQTT_QUEUE_TICKETS];
+/* Acks that arrived before the sender recorded their msg_id; guarded by s_lock. */
+static struct {
+    int msg_id;
+    bool delivered;
+} s_early_acks[4];
+static uint8_t s_early_next;
+/* Result of a coalescing merge; guarded by s_push_lock. */
+static char s_merge_buf[MQTT_QUEUE_MAX_PAYLOAD + 1];
+static TaskHandle_t s_sender_task = NULL;
+/* Copy of the message being sent; only touched by the sender task. */
+static mqtt_queue_entry_t s_tx;
+/* Id of the message in s_tx while it is in flight, and whether a producer
+ * reused its slot meanwhile; guarded by s_lock. */
+static uint32_t s_tx_inflight;
+static bool s_tx_evicted;
+
+bool mqtt_queue_set_policy(mqtt_prio_t lane, mqtt_queue_policy_t policy)
+{
+    if (lane < 0 || lane >= MQTT_PRIO_COUNT) return false;
+    portENTER_CRITICAL(&s_lock);
+    s_lanes[lane].policy = policy;
+    portEXIT_CRITICAL(&s_lock);
+    return true;
+}
+
+// Merge the JSON object in `data` into `base` (both `{...}`) and print the
+// result to s_merge_buf. False if either is not an object or the result
+// does not fit a slot. Called with s_push_lock held.
+static bool merge_json(const char *base, size_t base_len, const void *data, size_t len)
+{
+    if (len == 0 || ((const char *)data)[0] != '{' || base[0] != '{') return false;
+    bool ok = false;
+    cJSON *dst = cJSON_ParseWithLength(base, base_len);
+    cJSON *src = cJSON_ParseWithLength((const char *)data, len);
+    if (cJSON_IsObject(dst) && cJSON_IsObject(src))
+    {
+        while (src->child)
+        {
+            cJSON *item = cJSON_DetachItemViaPointer(src, src->child);
+            cJSON_DeleteItemFromObjectCaseSensitive(dst, item->string);
+            cJSON_AddItemToObject(dst, item->string, item);
+        }
+        ok = cJSON_PrintPreallocated(dst, s_merge_buf, sizeof(s_merge_buf), false);
+    }
+    cJSON_Delete(dst);
+    cJSON_Delete(src);
+    return ok;
+}
+
+// Ticket of queue message `id`, or NULL. Caller holds s_lock.
+static mqtt_ticket_t *ticket_find(uint32_t id)
+{
+    for (int i = 0; id && i < MQTT_QUEUE_TICKETS; ++i)
+        if (s_tickets[i].id == id) return &s_tickets[i];
+    return NULL;
+}
+
+// A free ticket, else the oldest resolved one, else NULL. Caller holds s_lock.
+static mqtt_ticket_t *ticket_take(void)
+{
+    mqtt_ticket_t *best = NULL;
+    for (int i = 0; i < MQTT_QUEUE_TICKETS; ++i)
+    {
+        mqtt_ticket_t *t = &s_tickets[i];
+        if (t->id == 0) return t;
+        if (t->state != MQTT_DELIVERY_PENDING && (!best || t->id < best->id)) best = t;
+    }
+    return best;
+}
+
+// Message `id` left the queue without being sent. Caller holds s_lock.
+static void ticket_lost(uint32_t id)
+{
+    mqtt_ticket_t *t = ticket_find(id);
+    if (t) t->state = MQTT_DELIVERY_LOST;
+}
+
+// Message `id` went out as `msg_id`.
+static void ticket_sent(uint32_t id, int msg_id)
+{
+    portENTER_CRITICAL(&s_lock);
+    mqtt_ticket_t *t = ticket_find(id);
+    if (t)
+    {
+        t->msg_id = msg_id;
+        for (size_t i = 0; i < sizeof(s_early_acks) / sizeof(s_early_acks[0]); ++i)
+        {
+            if (msg_id <= 0 || s_early_acks[i].msg_id != msg_id) continue;
+            t->state = s_early_acks[i].delivered ? MQTT_DELIVERY_ACKED : MQTT_DELIVERY_LOST;
+            s_early_acks[i].msg_id = 0;
+        }
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+// Returns the queue id of the message, 0 if it was not queued.
+static uint32_t queue_push(mqtt_prio_t lane, egress_class_t egress_class, const char *topic, uint16_t alias, const void *data, size_t len, int qos, bool expires, bool track)
+{
+    if (lane < 0 || lane >= MQTT_PRIO_COUNT || topic == NULL || data == NULL) return 0;
+    if (len > MQTT_QUEUE_MAX_PAYLOAD || strlen(topic) >= sizeof(s_slots[0].topic))
+    {
+        ESP_LOGW(TAG, "message for %s too large for the publish queue (%u bytes)", topic, (unsigned)len);
+        mqtt_stats_on_queue_drop(false);
+        return 0;
+    }
+    if (s_sender_task == NULL)
+    {
+        ESP_LOGW(TAG, "cannot publish, mqtt client not started");
+        return 0;
+    }
+
+    mqtt_queue_lane_t *q = &s_lanes[lane];
+    bool dropped = false, coalesced = false;
+    xSemaphoreTake(s_push_lock, portMAX_DELAY);
+
+    // other producers wait on s_push_lock, so a ticket found free here stays free
+    portENTER_CRITICAL(&s_lock);
+    bool have_ticket = !track || ticket_take() != NULL;
+    portEXIT_CRITICAL(&s_lock);
+    if (!have_ticket)
+    {
+        xSemaphoreGive(s_push_lock);
+        ESP_LOGW(TAG, "%d tracked messages still awaiting PUBACK", MQTT_QUEUE_TICKETS);
+        return 0;
+    }
+
+    /* Only producers write slots and they hold s_push_lock, so the newest
+     * message can be read without the spinlock; the sender may still send
+     * and pop it meanwhile, which the id check below catches. */
+    mqtt_queue_entry_t *newest = NULL;
+    uint32_t newest_id = 0;
+    portENTER_CRITICAL(&s_lock);
+    if (q->count == q->capacity && q->policy == MQTT_QUEUE_COALESCE_LATEST)
+    {
+        newest = &q->slots[(q->head + q->count - 1) % q->capacity];
+        newest_id = newest->id;
+    }
+    portEXIT_CRITICAL(&s_lock);
+    bool merged = newest && strcmp(newest->topic, topic) == 0 && merge_json(newest->data, newest->len, data, len);
+
+    portENTER_CRITICAL(&s_lock);
+    mqtt_queue_entry_t *e;
+    if (q->count < q->capacity)
+    {
+        e = &q->slots[(q->head + q->count) % q->capacity];
+        q->count++;
+        merged = false; // the newest message went out while we merged
+    }
+    else if (merged && newest->id == newest_id)
+    {
+        e = newest;
+        coalesced = true;
+        // its content goes out under the new id, unless it is already being sent
+        if (newest_id != s_tx_inflight) ticket_lost(newest_id);
+    }
+    else
+    {
+        // drop-oldest: the head slot becomes the new tail
+        e = &q->slots[q->head];
+        q->head = (uint8_t)((q->head + 1) % q->capacity);
+        merged = false;
+        if (e->id && e->id == s_tx_inflight)
+        {
+            // the sender has its own copy and accounts for it
+            s_tx_evicted = true;
+        }
+        else
+        {
+            dropped = true;
+            ticket_lost(e->id);
+        }
+    }
+    e->id = 0; // hidden from the sender until it is complete
+    portEXIT_CRITICAL(&s_lock);
+
+    if (merged) data = s_merge_buf, len = strlen(s_merge_buf);
+    strcpy(e->topic, topic);
+    e->alias = alias;
+    e->len = (uint16_t)len;
+    e->qos = (uint8_t)qos;
+    e->egress_class = (uint8_t)egress_class;
+    e->expires = expires;
+    e->queued_us = esp_timer_get_time();
+    memcpy(e->data, data, len);
+    e->data[len] = '\0';
+
+    portENTER_CRITICAL(&s_lock);
+    uint32_t id = e->id = s_next_id++;
+    if (track) *ticket_take() = (mqtt_ticket_t){ .id = id, .msg_id = -1, .state = MQTT_DELIVERY_PENDING };
+    portEXIT_CRITICAL(&s_lock);
+    xSemaphoreGive(s_push_lock);
+
+    if (dropped || coalesced) mqtt_stats_on_queue_drop(coalesced);
+    xTaskNotifyGive(s_sender_task);
+    return id;
+}
+
+bool mqtt_queue_push(mqtt_prio_t lane, egress_class_t egress_class, const char *topic, uint16_t alias, const void *data, size_t len, int qos, bool expires)
+{
+    return queue_push(lane, egress_class, topic, alias, data, len, qos, expires, false) != 0;
+}
+
+uint32_t mqtt_queue_push_tracked(mqtt_prio_t lane, egress_class_t egress_class, const char *topic, const void *data, size_t len)
+{
+    return queue_push(lane, egress_class, topic, 0, data, len, 1, false, true);
+}
+
+void mqtt_queue_on_ack(int msg_id, bool delivered)
+{
+    if (msg_id <= 0) return;
+    bool matched = false;
+    portENTER_CRITICAL(&s_lock);
+    for (int i = 0; i < MQTT_QUEUE_TICKETS; ++i)
+    {
+        mqtt_ticket_t *t = &s_tickets[i];
+        if (!t->id || t->msg_id != msg_id || t->state != MQTT_DELIVERY_PENDING) continue;
+        t->state = delivered ? MQTT_DELIVERY_ACKED : MQTT_DELIVERY_LOST;
+        matched = true;
+    }
+    if (!matched)
+    {
+        // the PUBACK can beat the sender task back from publish; keep it for ticket_sent()
+        s_early_acks[s_early_next].msg_id = msg_id;
+        s_early_acks[s_early_next].delivered = delivered;
+        s_early_next = (uint8_t)((s_early_next + 1) % (sizeof(s_early_acks) / sizeof(s_early_acks[0])));
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+mqtt_delivery_t mqtt_delivery_state(uint32_t ticket)
+{
+    portENTER_CRITICAL(&s_lock);
+    mqtt_ticket_t *t = ticket_find(ticket);
+    mqtt_delivery_t state = t ? t->state : MQTT_DELIVERY_LOST;
+    portEXIT_CRITICAL(&s_lock);
+    return state;
+}
+
+// Copy the highest-priority pending message into `out` without removing it.
+// Lanes set in `skip_mask` are ignored, and so is a lane whose head is still
+// being written. The copy is made outside the spinlock and thrown away if a
+// producer reused the slot meanwhile.
+static bool queue_peek(mqtt_queue_entry_t *out, mqtt_prio_t *out_lane, uint32_t skip_mask)
+{
+    for (int l = 0; l < MQTT_PRIO_COUNT; ++l)
+    {
+        if (skip_mask & (1u << l)) continue;
+        mqtt_queue_lane_t *q = &s_lanes[l];
+        for (;;)
+        {
+            portENTER_CRITICAL(&s_lock);
+            mqtt_queue_entry_t *e = q->count ? &q->slots[q->head] : NULL;
+            uint32_t id = e ? e->id : 0;
+            portEXIT_CRITICAL(&s_lock);
+            if (id == 0) break;
+            *out = *e;
+            portENTER_CRITICAL(&s_lock);
+            bool same = q->count && &q->slots[q->head] == e && e->id == id;
+            if (same)
+            {
+                s_tx_inflight = id;
+                s_tx_evicted = false;
+            }
+            portEXIT_CRITICAL(&s_lock);
+            if (same)
+            {
+                out->id = id;
+                *out_lane = (mqtt_prio_t)l;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Remove the head of `lane` if it is still the message with `id`.
+static void queue_pop(mqtt_prio_t lane, uint32_t id)
+{
+    mqtt_queue_lane_t *q = &s_lanes[lane];
+    portENTER_CRITICAL(&s_lock);
+    if (q->count > 0 && q->slots[q->head].id == id)
+    {
+        q->head = (uint8_t)((q->head + 1) % q->capacity);
+        q->count--;
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+// The sender is done with s_tx. If it was not sent and a producer took its
+// slot meanwhile, the message is gone: count it as dropped.
+static void tx_release(bool sent)
+{
+    portENTER_CRITICAL(&s_lock);
+    bool lost = !sent && s_tx_evicted;
+    if (lost) ticket_lost(s_tx_inflight);
+    s_tx_inflight = 0;
+    s_tx_evicted = false;
+    portEXIT_CRITICAL(&s_lock);
+    if (lost) mqtt_stats_on_queue_drop(false);
+}
+
+uint32_t mqtt_queue_depth(void)
+{
+    uint32_t n = 0;
+    portENTER_CRITICAL(&s_lock);
+    for (int l = 0; l < MQTT_PRIO_COUNT; ++l) n += s_lanes[l].count;
+    portEXIT_CRITICAL(&s_lock);
+    return n;
+}
+
+uint32_t mqtt_queue_free(mqtt_prio_t lane)
+{
+    if (lane >= MQTT_PRIO_COUNT) return 0;
+    portENTER_CRITICAL(&s_lock);
+    uint32_t n = (uint32_t)(s_lanes[lane].capacity - s_lanes[lane].count);
+    portEXIT_CRITICAL(&s_lock);
+    return n;
+}
+
+static void mqtt_sender_task(void *arg)
+{
+    (void)arg;
+    uint32_t wait_ms = MQTT_QUEUE_RETRY_MS;
+    for (;;)
+    {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait_ms));
+        wait_ms = MQTT_QUEUE_RETRY_MS;
+        mqtt_prio_t lane;
+        uint32_t over_budget = 0;
+        while (queue_peek(&s_tx, &lane, over_budget))
+        {
+            esp_mqtt_client_handle_t c = mqtt_get_client();
+            if (c == NULL || !mqtt_is_connected() || esp_mqtt_client_get_outbox_size(c) > MQTT_QUEUE_OUTBOX_LIMIT)
+            {
+                tx_release(false);
+                break;
+            }
+            uint32_t budget_ms = egress_try_consume((egress_class_t)s_tx.egress_class, s_tx.len + strlen(s_tx.topic));
+            if (budget_ms > 0)
+            {
+                // defer this lane until its class has budget again
+                tx_release(false);
+                over_budget |= 1u << lane;
+                if (budget_ms < wait_ms) wait_ms = budget_ms;
+                continue;
+            }
+            int msg_id = mqtt_v5_publish(c, s_tx.alias, s_tx.topic, s_tx.data, s_tx.len, s_tx.qos, s_tx.expires);
+            if (msg_id < 0)
+            {
+                // keep it queued and retry after the next wake-up
+                tx_release(false);
+                ESP_LOGW(TAG, "esp-mqtt refused message for %s; retrying later", s_tx.topic);
+                break;
+            }
+            queue_pop(lane, s_tx.id);
+            tx_release(true);
+            ticket_sent(s_tx.id, msg_id);
+            mqtt_stats_on_lane_sent(msg_id, lane, s_tx.queued_us);
+            const char *lane_name = s_lane_names[lane];
+            // raw publishes may be binary; only JSON is worth echoing
+            if (s_tx.len > 0 && (s_tx.data[0] == '{' || s_tx.data[0] == '['))
+                ESP_LOGI(TAG, "sent %s lane message (msg_id=%d): %.*s", lane_name, msg_id, s_tx.len > 96 ? 96 : (int)s_tx.len, s_tx.data);
+            else
+                ESP_LOGI(TAG, "sent %s lane message (msg_id=%d): %u bytes to %s", lane_name, msg_id, (unsigned)s_tx.len, s_tx.topic);
+        }
+    }
+}
+
+void mqtt_queue_start(void)
+{
+    if (s_sender_task) return;
+    if (!s_push_lock) s_push_lock = xSemaphoreCreateMutex();
+    if (xTaskCreate(mqtt_sender_task, "mqtt_sender", 4 * 1024, NULL, tskIDLE_PRIORITY + 2, &s_sender_task) != pdPASS)
+    {
+        ESP_LOGE(TAG, "failed to create mqtt sender task");
+        s_sender_task = NULL;
+    }
+}
+
+bool mqtt_publish_flush(uint32_t timeout_ms)
+{
+    mqtt_publish_stats_t st;
+    TickType_t start = xTaskGetTickCount();
+    for (;;)
+    {
+        mqtt_get_publish_stats(&st);
+        esp_mqtt_client_handle_t c = mqtt_get_client();
+        bool idle = st.queue_depth == 0 && st.in_flight == 0 && (c == NULL || esp_mqtt_client_get_outbox_size(c) == 0);
+        if (idle || c == NULL || !mqtt_is_connected()) return idle;
+        if ((xTaskGetTickCount() - start) >= pdMS_TO_TICKS(timeout_ms)) return false;
+        mqtt_queue_kick();
+        vTaskDelay(pdMS_TO_TICKS(50));
+    }
+}
+
+void mqtt_queue_kick(void)
+{
+    if (s_sender_task) xTaskNotifyGive(s_sender_task);
+}
@@ -0,0 +1,141 @@
+/*
+ * mqtt_rpc.c
+ *
+ * ThingsBoard server-side RPC over the already-open MQTT session. Requests
+ * arrive on v1/devices/me/rpc/request/<id> as {"method":"...","params":...};
+ * the method is looked up in a small fixed registry and the handler's JSON
+ * reply is published to v1/devices/me/rpc/response/<id>. Handlers run on the
+ * esp-mqtt task, so they must return quickly and must not block on the
+ * network.
+ */
+#include "mqtt.h"
+#include "mqtt_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include <cJSON.h>
+
+static const char *TAG = "mqtt_rpc";
+
+/* Maximum number of RPC methods that can be registered. */
+#ifndef MQTT_RPC_MAX_METHODS
+#define MQTT_RPC_MAX_METHODS 16
+#endif
+
+/* Size of the response buffer handed to RPC handlers. */
+#ifndef MQTT_RPC_MAX_RESPONSE
+#define MQTT_RPC_MAX_RESPONSE 256
+#endif
+
+typedef struct {
+    char method[32];
+    mqtt_rpc_handler_t handler;
+    void *user_ctx;
+} mqtt_rpc_entry_t;
+
+static mqtt_rpc_entry_t s_methods[MQTT_RPC_MAX_METHODS];
+static int s_method_count = 0;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+bool mqtt_rpc_register(const char *method, mqtt_rpc_handler_t handler, void *user_ctx)
+{
+    if (method == NULL || handler == NULL || strlen(method) >= sizeof(s_methods[0].method))
+    {
+        ESP_LOGE(TAG, "invalid RPC registration");
+        return false;
+    }
+
+    bool ok = true;
+    portENTER_CRITICAL(&s_lock);
+    int slot = -1;
+    for (int i = 0; i < s_method_count; ++i)
+    {
+        if (strcmp(s_methods[i].method, method) == 0) { slot = i; break; }
+    }
+    if (slot < 0)
+    {
+        if (s_method_count < MQTT_RPC_MAX_METHODS) slot = s_method_count++;
+        else ok = false;
+    }
+    if (ok)
+    {
+        strcpy(s_methods[slot].method, method);
+        s_methods[slot].handler = handler;
+        s_methods[slot].user_ctx = user_ctx;
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    if (!ok) ESP_LOGE(TAG, "RPC registry full; cannot register %s", method);
+    return ok;
+}
+
+static bool mqtt_rpc_lookup(const char *method, mqtt_rpc_entry_t *out)
+{
+    bool found = false;
+    portENTER_CRITICAL(&s_lock);
+    for (int i = 0; i < s_method_count; ++i)
+    {
+        if (strcmp(s_methods[i].method, method) == 0)
+        {
+            *out = s_methods[i];
+            found = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_lock);
+    return found;
+}
+
+void mqtt_rpc_handle_request(esp_mqtt_client_handle_t client, const char *topic, const char *payload)
+{
+    int64_t t0 = esp_timer_get_time();
+    const char *request_id = topic + strlen(MQTT_RPC_REQUEST_TOPIC_PREFIX);
+    if (client == NULL || *request_id == '\0' || strlen(request_id) > 16)
+    {
+        ESP_LOGW(TAG, "malformed RPC topic: %s", topic);
+        return;
+    }
+
+    char response[MQTT_RPC_MAX_RESPONSE];
+    response[0] = '\0';
+
+    cJSON *root = cJSON_Parse(payload);
+    cJSON *method = root ? cJSON_GetObjectItem(root, "method") : NULL;
+    if (!cJSON_IsString(method))
+    {
+        snprintf(response, sizeof(response), "{\"error\":\"malformed request\"}");
+    }
+    else
+    {
+        mqtt_rpc_entry_t entry;
+        if (!mqtt_rpc_lookup(method->valuestring, &entry))
+        {
+            ESP_LOGW(TAG, "unknown RPC method: %s", method->valuestring);
+            snprintf(response, sizeof(response), "{\"error\":\"unknown method\"}");
+        }
+        else
+        {
+            cJSON *params = cJSON_GetObjectItem(root, "params");
+            char *params_json = params ? cJSON_PrintUnformatted(params) : NULL;
+            if (!entry.handler(params_json ? params_json : "null", response, sizeof(response), entry.user_ctx) || response[0] == '\0')
+            {
+                // keep a handler-provided error object, otherwise report a generic failure
+                if (response[0] != '{') snprintf(response, sizeof(response), "{\"error\":\"%s failed\"}", entry.method);
+            }
+            free(params_json);
+        }
+    }
+
+    char rsp_topic[sizeof(MQTT_RPC_RESPONSE_TOPIC_PREFIX) + 16];
+    snprintf(rsp_topic, sizeof(rsp_topic), MQTT_RPC_RESPONSE_TOPIC_PREFIX "%s", request_id);
+    // this runs on the MQTT task, which must not publish directly (see mqtt_v5.c)
+    bool queued = mqtt_queue_push(MQTT_PRIO_ALERT, EGRESS_CLASS_NONE, rsp_topic, 0, response, strlen(response), 1, false);
+    ESP_LOGI(TAG, "RPC %s (id=%s) answered in %lld us (%s): %s",
+             cJSON_IsString(method) ? method->valuestring : "?", request_id,
+             (long long)(esp_timer_get_time() - t0), queued ? "queued" : "dropped", response);
+    cJSON_Delete(root);
+}
@@ -0,0 +1,337 @@
+/*
+ * mqtt_stats.c
+ *
+ * Publish round-trip accounting. Every QoS>0 publish is recorded with its
+ * msg_id and a timestamp in a small fixed table; the matching
+ * MQTT_EVENT_PUBLISHED (PUBACK) closes the entry and feeds a fixed-bucket
+ * latency histogram. Entries still open across a reconnect are counted as
+ * retransmitted (esp-mqtt resends them from its outbox); entries that are
+ * refused, deleted from the outbox or never acknowledged count as dropped.
+ *
+ * A timer periodically publishes a summary as telemetry so the numbers can
+ * be charted on ThingsBoard next to the sensor data.
+ */
+#include "mqtt.h"
+#include "mqtt_internal.h"
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/timers.h"
+
+static const char *TAG = "mqtt_stats";
+
+/* Number of publishes tracked concurrently while waiting for their PUBACK. */
+#ifndef MQTT_STATS_MAX_INFLIGHT
+#define MQTT_STATS_MAX_INFLIGHT 16
+#endif
+
+/* An entry not acknowledged within this time is counted as dropped. */
+#ifndef MQTT_STATS_ACK_TIMEOUT_MS
+#define MQTT_STATS_ACK_TIMEOUT_MS 30000
+#endif
+
+/* Period of the stats telemetry message (0 disables it). */
+#ifndef MQTT_STATS_PUBLISH_PERIOD_MS
+#define MQTT_STATS_PUBLISH_PERIOD_MS 60000
+#endif
+
+typedef struct {
+    int msg_id;         /* 0 == free slot */
+    int64_t sent_us;
+    int64_t queued_us;  /* when the message entered the publish queue */
+    int8_t lane;        /* publish queue lane, -1 when not sent from the queue */
+    bool resent;        /* already counted as retransmitted */
+} inflight_entry_t;
+
+static const uint32_t s_bucket_bounds_ms[MQTT_LATENCY_BUCKETS] = MQTT_LATENCY_BUCKET_BOUNDS_MS;
+static inflight_entry_t s_inflight[MQTT_STATS_MAX_INFLIGHT];
+static mqtt_publish_stats_t s_stats;
+static uint64_t s_latency_sum_ms = 0;
+static uint64_t s_lane_latency_sum_ms[MQTT_PRIO_COUNT];
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static TimerHandle_t s_publish_timer = NULL;
+
+// Must be called with s_lock held
+static void stats_expire_locked(int64_t now_us)
+{
+    for (int i = 0; i < MQTT_STATS_MAX_INFLIGHT; ++i)
+    {
+        if (s_inflight[i].msg_id != 0 && now_us - s_inflight[i].sent_us > (int64_t)MQTT_STATS_ACK_TIMEOUT_MS * 1000)
+        {
+            s_inflight[i].msg_id = 0;
+            s_stats.in_flight--;
+            s_stats.dropped++;
+        }
+    }
+}
+
+void mqtt_stats_on_publish(int msg_id)
+{
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&s_lock);
+    if (msg_id < 0)
+    {
+        // refused by the client (outbox full, not connected with skip-publish, ...)
+        s_stats.dropped++;
+        portEXIT_CRITICAL(&s_lock);
+        return;
+    }
+    s_stats.published++;
+    if (msg_id == 0)
+    {
+        // QoS 0: no acknowledgement will ever arrive
+        portEXIT_CRITICAL(&s_lock);
+        return;
+    }
+    stats_expire_locked(now);
+    int slot = -1;
+    int oldest = 0;
+    for (int i = 0; i < MQTT_STATS_MAX_INFLIGHT; ++i)
+    {
+        if (s_inflight[i].msg_id == 0) { slot = i; break; }
+        if (s_inflight[i].sent_us < s_inflight[oldest].sent_us) oldest = i;
+    }
+    if (slot < 0)
+    {
+        // table full: give up on the oldest entry rather than the newest
+        slot = oldest;
+        s_stats.in_flight--;
+        s_stats.dropped++;
+    }
+    s_inflight[slot].msg_id = msg_id;
+    s_inflight[slot].sent_us = now;
+    s_inflight[slot].lane = -1;
+    s_inflight[slot].resent = false;
+    s_stats.in_flight++;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+// Must be called with s_lock held
+static void stats_lane_delivered_locked(int lane, int64_t queued_us, int64_t now_us)
+{
+    uint32_t ms = (uint32_t)((now_us - queued_us) / 1000);
+    s_stats.lane_delivered[lane]++;
+    s_lane_latency_sum_ms[lane] += ms;
+    if (ms > s_stats.lane_latency_max_ms[lane]) s_stats.lane_latency_max_ms[lane] = ms;
+}
+
+void mqtt_stats_on_lane_sent(int msg_id, mqtt_prio_t lane, int64_t queued_us)
+{
+    if (msg_id < 0 || lane < 0 || lane >= MQTT_PRIO_COUNT) return;
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&s_lock);
+    if (msg_id == 0)
+    {
+        // QoS 0 counts as delivered once handed to the client
+        stats_lane_delivered_locked(lane, queued_us, now);
+    }
+    else
+    {
+        for (int i = 0; i < MQTT_STATS_MAX_INFLIGHT; ++i)
+        {
+            if (s_inflight[i].msg_id != msg_id) continue;
+            s_inflight[i].lane = (int8_t)lane;
+            s_inflight[i].queued_us = queued_us;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void mqtt_stats_on_ack(int msg_id)
+{
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&s_lock);
+    for (int i = 0; i < MQTT_STATS_MAX_INFLIGHT; ++i)
+    {
+        if (s_inflight[i].msg_id != msg_id || msg_id == 0) continue;
+        uint32_t ms = (uint32_t)((now - s_inflight[i].sent_us) / 1000);
+        int b = 0;
+        while (b < MQTT_LATENCY_BUCKETS - 1 && ms > s_bucket_bounds_ms[b]) b++;
+        s_stats.latency_hist[b]++;
+        if (s_stats.acked == 0 || ms < s_stats.latency_min_ms) s_stats.latency_min_ms = ms;
+        if (ms > s_stats.latency_max_ms) s_stats.latency_max_ms = ms;
+        s_latency_sum_ms += ms;
+        if (s_inflight[i].lane >= 0) stats_lane_delivered_locked(s_inflight[i].lane, s_inflight[i].queued_us, now);
+        s_stats.acked++;
+        s_stats.in_flight--;
+        s_inflight[i].msg_id = 0;
+        break;
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void mqtt_stats_on_deleted(int msg_id)
+{
+    portENTER_CRITICAL(&s_lock);
+    for (int i = 0; i < MQTT_STATS_MAX_INFLIGHT; ++i)
+    {
+        // an entry that already expired was counted as dropped then
+        if (s_inflight[i].msg_id == msg_id && msg_id != 0)
+        {
+            s_inflight[i].msg_id = 0;
+            s_stats.in_flight--;
+            s_stats.dropped++;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void mqtt_stats_on_reconnect(void)
+{
+    portENTER_CRITICAL(&s_lock);
+    for (int i = 0; i < MQTT_STATS_MAX_INFLIGHT; ++i)
+    {
+        if (s_inflight[i].msg_id != 0 && !s_inflight[i].resent)
+        {
+            s_inflight[i].resent = true;
+            s_stats.retransmitted++;
+        }
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void mqtt_stats_on_reason_code(int reason_code)
+{
+    if (reason_code == 0) return;
+    portENTER_CRITICAL(&s_lock);
+    s_stats.reason_codes++;
+    s_stats.last_reason_code = reason_code;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void mqtt_stats_on_alias_bytes(int32_t saved)
+{
+    portENTER_CRITICAL(&s_lock);
+    s_stats.alias_bytes_saved += saved;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void mqtt_stats_on_queue_drop(bool coalesced)
+{
+    portENTER_CRITICAL(&s_lock);
+    if (coalesced) s_stats.queue_coalesced++;
+    else s_stats.queue_dropped++;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void mqtt_get_publish_stats(mqtt_publish_stats_t *out)
+{
+    if (!out) return;
+    uint32_t depth = mqtt_queue_depth();
+    uint32_t failovers = 0;
+    int broker = mqtt_failover_active(&failovers);
+    portENTER_CRITICAL(&s_lock);
+    stats_expire_locked(esp_timer_get_time());
+    *out = s_stats;
+    out->latency_avg_ms = s_stats.acked ? (uint32_t)(s_latency_sum_ms / s_stats.acked) : 0;
+    for (int l = 0; l < MQTT_PRIO_COUNT; ++l)
+        out->lane_latency_avg_ms[l] = s_stats.lane_delivered[l] ? (uint32_t)(s_lane_latency_sum_ms[l] / s_stats.lane_delivered[l]) : 0;
+    out->queue_depth = depth;
+    out->broker_index = broker;
+    out->failovers = failovers;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+// Upper bound (ms) of the bucket holding the given percentile, 0 when empty.
+static uint32_t stats_percentile_ms(const mqtt_publish_stats_t *st, unsigned pct)
+{
+    if (st->acked == 0) return 0;
+    uint64_t target = ((uint64_t)st->acked * pct + 99) / 100;
+    uint64_t seen = 0;
+    for (int b = 0; b < MQTT_LATENCY_BUCKETS; ++b)
+    {
+        seen += st->latency_hist[b];
+        if (seen >= target) return b < MQTT_LATENCY_BUCKETS - 1 ? s_bucket_bounds_ms[b] : st->latency_max_ms;
+    }
+    return st->latency_max_ms;
+}
+
+/* The stats go out as two telemetry objects, each of which fits a publish
+ * queue slot even with every number at its widest. */
+#define STATS_FMT_DELIVERY                                                                                          \
+    "{\"mqtt_published\":%lu,\"mqtt_acked\":%lu,\"mqtt_inflight\":%lu,\"mqtt_retransmitted\":%lu,"                 \
+    "\"mqtt_dropped\":%lu,\"mqtt_lat_avg_ms\":%lu,\"mqtt_lat_max_ms\":%lu,\"mqtt_lat_p50_ms\":%lu,"                \
+    "\"mqtt_lat_p95_ms\":%lu,\"mqtt_lat_hist\":\"%s\"}"
+#define STATS_FMT_QUEUE                                                                                             \
+    "{\"mqtt_reason_codes\":%lu,\"mqtt_last_reason\":%ld,\"mqtt_alias_saved\":%ld,\"mqtt_queue_depth\":%lu,"       \
+    "\"mqtt_queue_dropped\":%lu,\"mqtt_queue_coalesced\":%lu,\"mqtt_broker\":%d,\"mqtt_failovers\":%lu,"           \
+    "\"mqtt_lane_lat_ms\":\"%s\"}"
+/* Widest 32-bit number with its sign, and the two nested lists with separators. */
+#define STATS_NUM_MAX 11
+#define STATS_HIST_MAX (MQTT_LATENCY_BUCKETS * STATS_NUM_MAX)
+#define STATS_LANES_MAX (MQTT_PRIO_COUNT * 2 * STATS_NUM_MAX)
+#define STATS_DELIVERY_MAX (sizeof(STATS_FMT_DELIVERY) + 9 * STATS_NUM_MAX + STATS_HIST_MAX)
+#define STATS_QUEUE_MAX (sizeof(STATS_FMT_QUEUE) + 8 * STATS_NUM_MAX + STATS_LANES_MAX)
+#define STATS_PAYLOAD_MAX (STATS_DELIVERY_MAX > STATS_QUEUE_MAX ? STATS_DELIVERY_MAX : STATS_QUEUE_MAX)
+_Static_assert(STATS_PAYLOAD_MAX <= MQTT_QUEUE_MAX_PAYLOAD, "stats telemetry must fit a publish queue slot");
+
+// PUBACK counters and latency.
+static int stats_format_delivery(const mqtt_publish_stats_t *st, char *buf, size_t len)
+{
+    char hist[STATS_HIST_MAX];
+    int off = 0;
+    for (int b = 0; b < MQTT_LATENCY_BUCKETS; ++b)
+    {
+        off += snprintf(hist + off, sizeof(hist) - (size_t)off, "%s%lu", b ? "," : "", (unsigned long)st->latency_hist[b]);
+    }
+    return snprintf(buf, len, STATS_FMT_DELIVERY, (unsigned long)st->published, (unsigned long)st->acked,
+                    (unsigned long)st->in_flight, (unsigned long)st->retransmitted, (unsigned long)st->dropped,
+                    (unsigned long)st->latency_avg_ms, (unsigned long)st->latency_max_ms,
+                    (unsigned long)stats_percentile_ms(st, 50), (unsigned long)stats_percentile_ms(st, 95), hist);
+}
+
+// Broker, publish queue and per-lane latency.
+static int stats_format_queue(const mqtt_publish_stats_t *st, char *buf, size_t len)
+{
+    // queue-to-PUBACK latency per lane as "avg/max" in ms: alert,ota,attributes,telemetry
+    char lanes[STATS_LANES_MAX];
+    int off = 0;
+    for (int l = 0; l < MQTT_PRIO_COUNT; ++l)
+    {
+        off += snprintf(lanes + off, sizeof(lanes) - (size_t)off, "%s%lu/%lu", l ? "," : "",
+                        (unsigned long)st->lane_latency_avg_ms[l], (unsigned long)st->lane_latency_max_ms[l]);
+    }
+    return snprintf(buf, len, STATS_FMT_QUEUE, (unsigned long)st->reason_codes, (long)st->last_reason_code,
+                    (long)st->alias_bytes_saved, (unsigned long)st->queue_depth, (unsigned long)st->queue_dropped,
+                    (unsigned long)st->queue_coalesced, (int)st->broker_index, (unsigned long)st->failovers, lanes);
+}
+
+// Publish one formatted part of the stats, or log why it cannot be.
+static void stats_send(const char *payload, int n, size_t size)
+{
+    if (n > 0 && (size_t)n < size) mqtt_publish_telemetry(payload);
+    else ESP_LOGW(TAG, "stats telemetry needs %d bytes, buffer has %u; not sent", n, (unsigned)size);
+}
+
+static void stats_publish_timer_cb(TimerHandle_t t)
+{
+    // timer callbacks run one at a time, so the buffer need not be on the timer task's stack
+    static char payload[STATS_PAYLOAD_MAX];
+    mqtt_publish_stats_t st;
+    mqtt_get_publish_stats(&st);
+    // Runs on the timer service task: the publish queue never waits on the network
+    stats_send(payload, stats_format_delivery(&st, payload, sizeof(payload)), sizeof(payload));
+    stats_send(payload, stats_format_queue(&st, payload, sizeof(payload)), sizeof(payload));
+}
+
+void mqtt_stats_start_reporting(void)
+{
+    if (MQTT_STATS_PUBLISH_PERIOD_MS == 0) return;
+    // the timer outlives mqtt_app_stop(); a later start just restarts it
+    if (!s_publish_timer)
+        s_publish_timer = xTimerCreate("mqtt_stats", pdMS_TO_TICKS(MQTT_STATS_PUBLISH_PERIOD_MS), pdTRUE, NULL, stats_publish_timer_cb);
+    if (!s_publish_timer || xTimerStart(s_publish_timer, 0) != pdPASS)
+    {
+        ESP_LOGW(TAG, "failed to start publish stats timer");
+    }
+}
+
+void mqtt_stats_stop_reporting(void)
+{
+    if (s_publish_timer) xTimerStop(s_publish_timer, 0);
+}
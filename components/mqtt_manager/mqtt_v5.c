@@ -0,0 +1,304 @@
+/*
+ * mqtt_v5.c
+ *
+ * Optional MQTT v5 transport features, enabled when esp-mqtt is built with
+ * CONFIG_MQTT_PROTOCOL_5 (override with -DMQTT_USE_V5=0/1):
+ *  - topic aliases: the first telemetry/attribute publish of a connection
+ *    carries the topic plus a 2-byte alias, later ones only the alias. The
+ *    bytes saved are counted in the publish stats. Only aliases up to the
+ *    Topic Alias Maximum of the broker's CONNACK are used (none if it sent
+ *    none). esp-mqtt keeps that value to itself but rejects a larger alias
+ *    when the publish properties are set, so the limit is found by setting
+ *    aliases 1, 2, ... once per connection; a rejected alias logs one
+ *    esp-mqtt error.
+ *  - message expiry: telemetry carries a message-expiry interval so the
+ *    broker discards readings instead of delivering them late.
+ *  - a session-expiry interval so the persistent session used by fast
+ *    resume survives deep sleep (v5 ends the session on disconnect
+ *    otherwise).
+ *
+ * Alias mappings only live as long as one network connection, and esp-mqtt
+ * resends unacknowledged messages from its outbox verbatim after a
+ * reconnect. Topic-less QoS 1 publishes still go through the outbox, so
+ * their msg_ids are remembered until the PUBACK; if any are left when the
+ * next connection comes up, mqtt_v5_on_connected() re-declares their aliases
+ * (an empty "{}" with topic and alias) before esp-mqtt resends them.
+ * Topic-less QoS 0 publishes are sent right away and never wait in the
+ * outbox.
+ *
+ * Publish properties are client-wide in esp-mqtt, so every publish, v5 or
+ * not, holds s_publish_lock from setting them to handing the message over.
+ * The MQTT task must not block on it (the holder may be waiting for the
+ * client's API lock), so event handlers publish through the queue.
+ *
+ * Without v5 every helper falls back to the plain 3.1.1 publish path.
+ */
+#include "mqtt.h"
+#include "mqtt_internal.h"
+
+#include <string.h>
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#if defined(CONFIG_MQTT_PROTOCOL_5) && !defined(MQTT_USE_V5)
+#define MQTT_USE_V5 1
+#endif
+#ifndef MQTT_USE_V5
+#define MQTT_USE_V5 0
+#endif
+#if MQTT_USE_V5 && !defined(CONFIG_MQTT_PROTOCOL_5)
+#error "MQTT_USE_V5 requires CONFIG_MQTT_PROTOCOL_5"
+#endif
+
+/* Use topic aliases for telemetry/attribute topics (v5 only). */
+#ifndef MQTT_V5_TOPIC_ALIAS
+#define MQTT_V5_TOPIC_ALIAS 1
+#endif
+
+/* Message-expiry interval (seconds) applied to telemetry publishes. */
+#ifndef MQTT_V5_TELEMETRY_EXPIRY_S
+#define MQTT_V5_TELEMETRY_EXPIRY_S 300
+#endif
+
+/* How long the broker keeps the session after a disconnect (seconds). */
+#ifndef MQTT_V5_SESSION_EXPIRY_S
+#define MQTT_V5_SESSION_EXPIRY_S (24 * 3600)
+#endif
+
+#if MQTT_USE_V5
+static const char *TAG = "mqtt_v5";
+
+/* Highest alias + 1; aliases are chosen in mqtt_internal.h. */
+#ifndef MQTT_V5_MAX_ALIASES
+#define MQTT_V5_MAX_ALIASES 4
+#endif
+
+/* Topic-less QoS 1 publishes that may still be resent from the outbox. */
+#ifndef MQTT_V5_TOPICLESS_TRACKED
+#define MQTT_V5_TOPICLESS_TRACKED 16
+#endif
+
+/* Bit set per alias once the topic/alias mapping was sent on this connection. */
+static uint32_t s_alias_established = 0;
+/* Highest alias the broker accepts on this connection, -1 until probed. */
+static volatile int s_alias_max = -1;
+/* Recursive: mqtt_v5_publish() holds it while calling the tracked publish helpers. */
+static SemaphoreHandle_t s_publish_lock = NULL;
+static int s_lock_depth = 0; /* only touched by the lock holder */
+/* Topic each alias stands for, kept to re-declare it on a new connection. */
+static char s_alias_topic[MQTT_V5_MAX_ALIASES][64];
+static struct {
+    int msg_id;
+    uint16_t alias;
+} s_topicless[MQTT_V5_TOPICLESS_TRACKED];
+static portMUX_TYPE s_topicless_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void topicless_remember(int msg_id, uint16_t alias)
+{
+    portENTER_CRITICAL(&s_topicless_lock);
+    for (int i = 0; i < MQTT_V5_TOPICLESS_TRACKED; ++i)
+    {
+        if (s_topicless[i].msg_id > 0) continue;
+        s_topicless[i].msg_id = msg_id;
+        s_topicless[i].alias = alias;
+        break;
+    }
+    portEXIT_CRITICAL(&s_topicless_lock);
+}
+
+// Find the broker's alias limit for this connection. Caller holds s_publish_lock.
+static int alias_max_locked(esp_mqtt_client_handle_t c)
+{
+    if (s_alias_max >= 0) return s_alias_max;
+    int max = 0;
+    while (MQTT_V5_TOPIC_ALIAS && max + 1 < MQTT_V5_MAX_ALIASES)
+    {
+        esp_mqtt5_publish_property_config_t prop = {.topic_alias = (uint16_t)(max + 1)};
+        if (esp_mqtt5_client_set_publish_property(c, &prop) != ESP_OK) break;
+        max++;
+    }
+    esp_mqtt5_publish_property_config_t none = {0};
+    esp_mqtt5_client_set_publish_property(c, &none);
+    ESP_LOGI(TAG, "broker accepts topic aliases up to %d", max);
+    s_alias_max = max;
+    return max;
+}
+
+static int topicless_pending(void)
+{
+    int n = 0;
+    portENTER_CRITICAL(&s_topicless_lock);
+    for (int i = 0; i < MQTT_V5_TOPICLESS_TRACKED; ++i) n += s_topicless[i].msg_id > 0;
+    portEXIT_CRITICAL(&s_topicless_lock);
+    return n;
+}
+#endif
+
+bool mqtt_v5_enabled(void)
+{
+    return MQTT_USE_V5;
+}
+
+void mqtt_v5_configure(esp_mqtt_client_config_t *cfg)
+{
+#if MQTT_USE_V5
+    cfg->session.protocol_ver = MQTT_PROTOCOL_V_5;
+    if (!s_publish_lock) s_publish_lock = xSemaphoreCreateRecursiveMutex();
+#else
+    (void)cfg;
+#endif
+}
+
+void mqtt_v5_after_init(esp_mqtt_client_handle_t c, bool persistent_session)
+{
+#if MQTT_USE_V5
+    esp_mqtt5_connection_property_config_t props = {
+        .session_expiry_interval = persistent_session ? MQTT_V5_SESSION_EXPIRY_S : 0,
+        .request_problem_info = true,
+    };
+    if (esp_mqtt5_client_set_connect_property(c, &props) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "failed to set MQTT v5 connect properties");
+    }
+    ESP_LOGI(TAG, "MQTT v5 enabled (session expiry=%us, telemetry expiry=%us, aliases=%d)",
+             (unsigned)props.session_expiry_interval, (unsigned)MQTT_V5_TELEMETRY_EXPIRY_S, MQTT_V5_TOPIC_ALIAS);
+#else
+    (void)c;
+    (void)persistent_session;
+#endif
+}
+
+void mqtt_v5_on_connection_changed(void)
+{
+#if MQTT_USE_V5
+    // aliases and their limit are scoped to a single network connection
+    s_alias_established = 0;
+    s_alias_max = -1;
+#endif
+}
+
+void mqtt_v5_on_connected(esp_mqtt_client_handle_t c)
+{
+#if MQTT_USE_V5
+    s_alias_established = 0;
+    s_alias_max = -1;
+    if (topicless_pending() == 0) return;
+    /* The sender task only publishes while connected, so it is normally idle
+     * here; if it holds the lock it may be waiting for the API lock we hold. */
+    if (xSemaphoreTakeRecursive(s_publish_lock, 0) != pdTRUE)
+    {
+        ESP_LOGW(TAG, "publish in progress; cannot re-declare aliases before the outbox resend");
+        return;
+    }
+    int max = alias_max_locked(c);
+    for (int i = 0; i < MQTT_V5_TOPICLESS_TRACKED; ++i)
+    {
+        uint16_t alias = s_topicless[i].alias;
+        if (s_topicless[i].msg_id <= 0 || (s_alias_established & (1u << alias))) continue;
+        esp_mqtt5_publish_property_config_t prop = {.topic_alias = alias};
+        if (alias > max || esp_mqtt5_client_set_publish_property(c, &prop) != ESP_OK)
+        {
+            ESP_LOGW(TAG, "broker no longer accepts alias %u; resent messages for %s will be refused", (unsigned)alias,
+                     s_alias_topic[alias]);
+            continue;
+        }
+        // an empty object is a no-op for ThingsBoard; it only carries the mapping
+        if (esp_mqtt_client_publish(c, s_alias_topic[alias], "{}", 2, 0, 0) >= 0)
+        {
+            s_alias_established |= 1u << alias;
+            ESP_LOGI(TAG, "re-declared alias %u (%s) for resent messages", (unsigned)alias, s_alias_topic[alias]);
+        }
+    }
+    xSemaphoreGiveRecursive(s_publish_lock);
+#else
+    (void)c;
+#endif
+}
+
+void mqtt_v5_on_ack(int msg_id)
+{
+#if MQTT_USE_V5
+    portENTER_CRITICAL(&s_topicless_lock);
+    for (int i = 0; i < MQTT_V5_TOPICLESS_TRACKED; ++i)
+        if (s_topicless[i].msg_id == msg_id) s_topicless[i].msg_id = 0;
+    portEXIT_CRITICAL(&s_topicless_lock);
+#else
+    (void)msg_id;
+#endif
+}
+
+void mqtt_v5_lock(esp_mqtt_client_handle_t c)
+{
+#if MQTT_USE_V5
+    if (!s_publish_lock) return;
+    xSemaphoreTakeRecursive(s_publish_lock, portMAX_DELAY);
+    // a plain publish must not pick up properties left by an earlier one
+    if (s_lock_depth++ == 0 && c)
+    {
+        esp_mqtt5_publish_property_config_t none = {0};
+        esp_mqtt5_client_set_publish_property(c, &none);
+    }
+#else
+    (void)c;
+#endif
+}
+
+void mqtt_v5_unlock(void)
+{
+#if MQTT_USE_V5
+    if (!s_publish_lock) return;
+    s_lock_depth--;
+    xSemaphoreGiveRecursive(s_publish_lock);
+#endif
+}
+
+int mqtt_v5_publish(esp_mqtt_client_handle_t c, uint16_t alias, const char *topic, const char *data, int len, int qos, bool expires)
+{
+#if MQTT_USE_V5
+    esp_mqtt5_publish_property_config_t prop = {
+        .message_expiry_interval = expires ? MQTT_V5_TELEMETRY_EXPIRY_S : 0,
+    };
+    bool use_alias = MQTT_V5_TOPIC_ALIAS && alias > 0 && alias < MQTT_V5_MAX_ALIASES &&
+                     strlen(topic) < sizeof(s_alias_topic[0]) && mqtt_is_connected();
+
+    mqtt_v5_lock(c);
+    use_alias = use_alias && alias <= alias_max_locked(c);
+    if (use_alias) prop.topic_alias = alias;
+    esp_err_t err = esp_mqtt5_client_set_publish_property(c, &prop);
+    if (err != ESP_OK && use_alias)
+    {
+        // send it with its full topic and leave the alias unestablished
+        ESP_LOGW(TAG, "alias %u rejected for %s; sending the full topic", (unsigned)alias, topic);
+        use_alias = false;
+        prop.topic_alias = 0;
+        err = esp_mqtt5_client_set_publish_property(c, &prop);
+    }
+    if (err != ESP_OK) ESP_LOGW(TAG, "failed to set publish properties for %s", topic);
+    // a QoS 1 message only drops its topic if it can be tracked until its PUBACK
+    bool topicless = use_alias && (s_alias_established & (1u << alias)) &&
+                     (qos == 0 || topicless_pending() < MQTT_V5_TOPICLESS_TRACKED);
+    /* Topic-less QoS 0 messages are sent right away instead of via the
+     * outbox, where nothing would re-declare their alias after a reconnect. */
+    int msg_id = topicless && qos == 0 ? mqtt_publish_tracked(c, "", data, len, 0, 0)
+                                       : mqtt_enqueue_tracked(c, topicless ? "" : topic, data, len, qos, 0);
+    if (msg_id >= 0 && use_alias)
+    {
+        // the alias property costs 3 bytes on every message that carries it
+        if (topicless) mqtt_stats_on_alias_bytes((int32_t)strlen(topic) - 3);
+        else
+        {
+            s_alias_established |= (1u << alias);
+            strcpy(s_alias_topic[alias], topic);
+            mqtt_stats_on_alias_bytes(-3);
+        }
+        if (topicless && qos > 0 && msg_id > 0) topicless_remember(msg_id, alias);
+    }
+    mqtt_v5_unlock();
+    return msg_id;
+#else
+    (void)alias;
+    (void)expires;
+    return mqtt_enqueue_tracked(c, topic, data, len, qos, 0);
+#endif
+}
@@ -1,4 +1,5 @@
 #include "ota_manager.h"
+#include "boot_config.h"
 #include <stdio.h>
 #include <string.h>
 #include "esp_log.h"
@@ -93,56 +94,22 @@ static void ota_retry_task(void *pvParameters)
     }
 }
 
-// small helper to read a file from mounted filesystem into a newly allocated buffer
-static char *read_file_to_buffer(const char *path)
+// CA PEM as read from the data partition at boot (see boot_config.h).
+// The buffer is shared and must not be freed; NULL if not found.
+static const char *load_ca_pem(void)
 {
-    FILE *f = fopen(path, "r");
-    if (!f)
-        return NULL;
-    if (fseek(f, 0, SEEK_END) != 0)
-    {
-        fclose(f);
-        return NULL;
-    }
-    long s = ftell(f);
-    if (s < 0)
-    {
-        fclose(f);
-        return NULL;
-    }
-    fseek(f, 0, SEEK_SET);
-    char *buf = malloc((size_t)s + 1);
-    if (!buf)
-    {
-        fclose(f);
-        return NULL;
-    }
-    size_t r = fread(buf, 1, (size_t)s, f);
-    buf[r] = '\0';
-    fclose(f);
-    return buf;
-}
-
-// Try to load a runtime CA PEM from the mounted filesystem.
-// Returns malloc'd buffer which the caller must free, or NULL if not found.
-static char *load_ca_pem(void)
-{
-    static const char *pem_candidates[] = { "/filesystem/ca_root.pem", "/filesystem/ca-root.pem", "/filesystem/cacert.pem", NULL };
-    for (const char **pp = pem_candidates; *pp; ++pp) {
-        char *buf = read_file_to_buffer(*pp);
-        if (buf) {
-            ESP_LOGI(TAG, "Loaded CA PEM from %s", *pp);
-            return buf;
-        }
-    }
-    ESP_LOGW(TAG, "No CA PEM found under /filesystem; will try global CA store if available");
-    return NULL;
+    const char *pem = boot_config_ca_pem(NULL);
+    if (!pem) ESP_LOGW(TAG, "No CA PEM found under /filesystem; will try global CA store if available");
+    return pem;
 }
 
 static int s_poll_minutes = 5; // default poll interval in minutes
 
-// optional MQTT telemetry publish function (implemented in mqtt_manager)
-extern void mqtt_publish_telemetry(const char *json_payload);
+// optional MQTT publish functions (implemented in mqtt_manager). OTA state
+// goes on the publish queue's OTA lane (MQTT_PRIO_OTA), after alerts and
+// ahead of attributes and regular telemetry.
+extern void mqtt_publish_ota_state(const char *json_payload);
+extern bool mqtt_publish_flush(uint32_t timeout_ms);
 
 int ota_manager_get_poll_minutes(void) { return s_poll_minutes; }
 
@@ -242,11 +209,11 @@ bool ota_manager_apply_fota_from_attributes(cJSON *root)
 
     // Download firmware to flash using OTA API
     // Attempt to load CA PEM from filesystem; fall back to global CA store
-    char *pem_buf = load_ca_pem();
+    const char *pem_buf = load_ca_pem();
     esp_http_client_config_t ota_http_cfg = {
         .url = url->valuestring,
         .use_global_ca_store = (pem_buf == NULL),
-        .cert_pem = (const char *)pem_buf,
+        .cert_pem = pem_buf,
     };
     esp_https_ota_config_t ota_cfg = {
         .http_config = &ota_http_cfg,
@@ -256,7 +223,6 @@ bool ota_manager_apply_fota_from_attributes(cJSON *root)
         ESP_LOGW(TAG, "Proceeding with OTA attempt even though system time may be invalid");
     }
     esp_err_t ret = esp_https_ota(&ota_cfg);
-    if (pem_buf) free(pem_buf);
     if (ret == ESP_OK)
     {
         ESP_LOGI(TAG, "OTA applied successfully, saving version and restarting");
@@ -445,13 +411,13 @@ bool ota_manager_download_and_apply_by_title(const char *tb_base_url, const char
     // Build URL: http(s)://<host>/api/v1/<ACCESS_TOKEN>/firmware?title=<TITLE>&version=<VERSION>
     snprintf(url, sizeof(url), "%s/api/v1/%s/firmware?title=%s&version=%s", tb_base_url, token, title, version);
 
-    char *pem_buf = load_ca_pem();
+    const char *pem_buf = load_ca_pem();
     esp_http_client_config_t cfg = {
         .url = url,
         .method = HTTP_METHOD_GET,
         .skip_cert_common_name_check = false,
         .use_global_ca_store = (pem_buf == NULL),
-        .cert_pem = (const char *)pem_buf,
+        .cert_pem = pem_buf,
     };
     esp_http_client_handle_t client = esp_http_client_init(&cfg);
     if (!client) {
@@ -488,7 +454,7 @@ bool ota_manager_download_and_apply_by_title(const char *tb_base_url, const char
         }
     }
 
-    mqtt_publish_telemetry("{\"fw_state\":\"DOWNLOADING\"}");
+    mqtt_publish_ota_state("{\"fw_state\":\"DOWNLOADING\"}");
 
     if (!ensure_sane_time(30)) {
         ESP_LOGW(TAG, "Proceeding with HTTP download even though system time may be invalid");
@@ -540,7 +506,7 @@ bool ota_manager_download_and_apply_by_title(const char *tb_base_url, const char
     if (total_read == 0) {
         ESP_LOGE(TAG, "Download produced zero bytes (empty payload)");
         /* publish a more specific telemetry error */
-        mqtt_publish_telemetry("{\"fw_state\":\"FAILED\",\"fw_error\":\"empty_download\"}");
+        mqtt_publish_ota_state("{\"fw_state\":\"FAILED\",\"fw_error\":\"empty_download\"}");
         /* include preview (if any) in log as hex for debugging */
         if (preview_len > 0) {
             char h[preview_len*2 + 1];
@@ -550,7 +516,7 @@ bool ota_manager_download_and_apply_by_title(const char *tb_base_url, const char
         goto cleanup_ota2;
     }
 
-    mqtt_publish_telemetry("{\"fw_state\":\"DOWNLOADED\"}");
+    mqtt_publish_ota_state("{\"fw_state\":\"DOWNLOADED\"}");
 
     if (md_info) {
         unsigned char sha[32];
@@ -560,23 +526,23 @@ bool ota_manager_download_and_apply_by_title(const char *tb_base_url, const char
         ESP_LOGI(TAG, "Computed SHA256: %s", sha_hex);
         if (expected_checksum && strcasecmp(expected_checksum, sha_hex) != 0) {
             ESP_LOGE(TAG, "Checksum mismatch: expected %s got %s", expected_checksum, sha_hex);
-            mqtt_publish_telemetry("{\"fw_state\":\"FAILED\",\"fw_error\":\"checksum_mismatch\"}");
+            mqtt_publish_ota_state("{\"fw_state\":\"FAILED\",\"fw_error\":\"checksum_mismatch\"}");
             goto cleanup_ota2;
         }
-        mqtt_publish_telemetry("{\"fw_state\":\"VERIFIED\"}");
+        mqtt_publish_ota_state("{\"fw_state\":\"VERIFIED\"}");
     }
 
     ret = esp_ota_end(ota_handle);
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "esp_ota_end failed: %s", esp_err_to_name(ret));
-        mqtt_publish_telemetry("{\"fw_state\":\"FAILED\",\"fw_error\":\"ota_end_failed\"}");
+        mqtt_publish_ota_state("{\"fw_state\":\"FAILED\",\"fw_error\":\"ota_end_failed\"}");
         goto cleanup_err2;
     }
 
     ret = esp_ota_set_boot_partition(update_partition);
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "esp_ota_set_boot_partition failed: %s", esp_err_to_name(ret));
-        mqtt_publish_telemetry("{\"fw_state\":\"FAILED\",\"fw_error\":\"set_boot_failed\"}");
+        mqtt_publish_ota_state("{\"fw_state\":\"FAILED\",\"fw_error\":\"set_boot_failed\"}");
         goto cleanup_err2;
     }
 
@@ -600,7 +566,9 @@ bool ota_manager_download_and_apply_by_title(const char *tb_base_url, const char
 
     char success_payload[128];
     snprintf(success_payload, sizeof(success_payload), "{\"current_fw_title\":\"%s\",\"current_fw_version\":\"%s\",\"fw_state\":\"UPDATED\"}", title, version);
-    mqtt_publish_telemetry(success_payload);
+    mqtt_publish_ota_state(success_payload);
+    // publishing is asynchronous; give the state a chance to leave before rebooting
+    mqtt_publish_flush(3000);
 
     ESP_LOGI(TAG, "OTA applied successfully, restarting");
     esp_restart();
@@ -612,7 +580,6 @@ cleanup_err2:
     /* Free md context unconditionally because md_ctx was initialized early */
     mbedtls_md_free(&md_ctx);
     esp_http_client_cleanup(client);
-    if (pem_buf) free(pem_buf);
     return false;
 }
 
@@ -633,7 +600,7 @@ static bool ota_manager_thingsboard_preflight(const char *tb_base_url, const cha
 
     char url[512];
     snprintf(url, sizeof(url), "%s/api/v1/%s/firmware?title=%s&version=%s", tb_base_url, token, title, version);
-    char *pem = load_ca_pem();
+    const char *pem = load_ca_pem();
     // Diagnostics: log basic info about the PEM we loaded
     if (pem) {
         size_t pem_len = strlen(pem);
@@ -663,7 +630,6 @@ static bool ota_manager_thingsboard_preflight(const char *tb_base_url, const cha
     };
     esp_http_client_handle_t client = esp_http_client_init(&cfg);
     if (!client) {
-        if (pem) free(pem);
         ESP_LOGW(TAG, "Preflight: failed to init http client");
         return false;
     }
@@ -671,7 +637,6 @@ static bool ota_manager_thingsboard_preflight(const char *tb_base_url, const cha
     int status = 0;
     if (err == ESP_OK) status = esp_http_client_get_status_code(client);
     esp_http_client_cleanup(client);
-    if (pem) free(pem);
     if (err == ESP_OK && status >= 200 && status < 400) {
         ESP_LOGI(TAG, "Preflight OK: %s returned HTTP %d", url, status);
         return true;
@@ -699,17 +664,16 @@ bool ota_manager_probe_thingsboard_firmware(const char *tb_base_url, const char
     for (const char **p = paths; *p; ++p) {
         char url[256];
         snprintf(url, sizeof(url), "%s%s%s/download", tb_base_url, *p, package_id);
-        char *pem_buf = load_ca_pem();
+        const char *pem_buf = load_ca_pem();
         esp_http_client_config_t cfg = {
             .url = url,
             .method = HTTP_METHOD_HEAD,
             .skip_cert_common_name_check = false,
             .use_global_ca_store = (pem_buf == NULL),
-            .cert_pem = (const char *)pem_buf,
+            .cert_pem = pem_buf,
         };
         esp_http_client_handle_t client = esp_http_client_init(&cfg);
         if (!client) {
-            if (pem_buf) free(pem_buf);
             continue;
         }
         // set Authorization header with token
@@ -721,14 +685,12 @@ bool ota_manager_probe_thingsboard_firmware(const char *tb_base_url, const char
             int status = esp_http_client_get_status_code(client);
             ESP_LOGI(TAG, "Probe URL %s returned HTTP %d", url, status);
             esp_http_client_cleanup(client);
-            if (pem_buf) free(pem_buf);
             if (status >= 200 && status < 400) return true;
             continue;
         } else {
             ESP_LOGW(TAG, "Probe URL %s failed: %s", url, esp_err_to_name(err));
         }
         esp_http_client_cleanup(client);
-        if (pem_buf) free(pem_buf);
     }
     ESP_LOGW(TAG, "No ThingsBoard firmware endpoint reachable for package %s", package_id);
     return false;
@@ -747,13 +709,13 @@ bool ota_manager_download_and_apply_from_thingsboard(const char *tb_base_url, co
     // prefer plugin endpoint first
     snprintf(url, sizeof(url), "%s/api/plugins/firmware/%s/download", tb_base_url, package_id);
 
-    char *pem_buf = load_ca_pem();
+    const char *pem_buf = load_ca_pem();
     esp_http_client_config_t cfg = {
         .url = url,
         .method = HTTP_METHOD_GET,
         .skip_cert_common_name_check = false,
         .use_global_ca_store = (pem_buf == NULL),
-        .cert_pem = (const char *)pem_buf,
+        .cert_pem = pem_buf,
     };
     esp_http_client_handle_t client = esp_http_client_init(&cfg);
     if (!client) {
@@ -790,7 +752,7 @@ bool ota_manager_download_and_apply_from_thingsboard(const char *tb_base_url, co
     }
 
     // Signal start
-    mqtt_publish_telemetry("{\"fw_state\":\"DOWNLOADING\"}");
+    mqtt_publish_ota_state("{\"fw_state\":\"DOWNLOADING\"}");
 
     if (!ensure_sane_time(30)) {
         ESP_LOGW(TAG, "Proceeding with HTTP download even though system time may be invalid");
@@ -843,7 +805,7 @@ bool ota_manager_download_and_apply_from_thingsboard(const char *tb_base_url, co
     ESP_LOGI(TAG, "Total bytes downloaded: %u", (unsigned)total_read);
     if (total_read == 0) {
         ESP_LOGE(TAG, "Download produced zero bytes (empty payload)");
-        mqtt_publish_telemetry("{\"fw_state\":\"FAILED\",\"fw_error\":\"empty_download\"}");
+        mqtt_publish_ota_state("{\"fw_state\":\"FAILED\",\"fw_error\":\"empty_download\"}");
         if (preview_len > 0) {
             char h[preview_len*2 + 1];
             for (size_t i = 0; i < preview_len; ++i) snprintf(h + i*2, 3, "%02x", preview[i]);
@@ -852,7 +814,7 @@ bool ota_manager_download_and_apply_from_thingsboard(const char *tb_base_url, co
         goto cleanup_ota;
     }
 
-    mqtt_publish_telemetry("{\"fw_state\":\"DOWNLOADED\"}");
+    mqtt_publish_ota_state("{\"fw_state\":\"DOWNLOADED\"}");
 
     // finish SHA
     unsigned char sha[32];
@@ -863,24 +825,24 @@ bool ota_manager_download_and_apply_from_thingsboard(const char *tb_base_url, co
         ESP_LOGI(TAG, "Computed SHA256: %s", sha_hex);
         if (expected_checksum && strcasecmp(expected_checksum, sha_hex) != 0) {
             ESP_LOGE(TAG, "Checksum mismatch: expected %s got %s", expected_checksum, sha_hex);
-            mqtt_publish_telemetry("{\"fw_state\":\"FAILED\",\"fw_error\":\"checksum_mismatch\"}");
+            mqtt_publish_ota_state("{\"fw_state\":\"FAILED\",\"fw_error\":\"checksum_mismatch\"}");
             goto cleanup_ota;
         }
-        mqtt_publish_telemetry("{\"fw_state\":\"VERIFIED\"}");
+        mqtt_publish_ota_state("{\"fw_state\":\"VERIFIED\"}");
     }
 
     // complete OTA
     ret = esp_ota_end(ota_handle);
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "esp_ota_end failed: %s", esp_err_to_name(ret));
-        mqtt_publish_telemetry("{\"fw_state\":\"FAILED\",\"fw_error\":\"ota_end_failed\"}");
+        mqtt_publish_ota_state("{\"fw_state\":\"FAILED\",\"fw_error\":\"ota_end_failed\"}");
         goto cleanup_err;
     }
 
     ret = esp_ota_set_boot_partition(update_partition);
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "esp_ota_set_boot_partition failed: %s", esp_err_to_name(ret));
-        mqtt_publish_telemetry("{\"fw_state\":\"FAILED\",\"fw_error\":\"set_boot_failed\"}");
+        mqtt_publish_ota_state("{\"fw_state\":\"FAILED\",\"fw_error\":\"set_boot_failed\"}");
         goto cleanup_err;
     }
 
@@ -907,10 +869,11 @@ bool ota_manager_download_and_apply_from_thingsboard(const char *tb_base_url, co
 
     char success_payload[128];
     snprintf(success_payload, sizeof(success_payload), "{\"current_fw_title\":\"%s\",\"current_fw_version\":\"%s\",\"fw_state\":\"UPDATED\"}", package_id, expected_checksum ? expected_checksum : "");
-    mqtt_publish_telemetry(success_payload);
+    mqtt_publish_ota_state(success_payload);
+    // publishing is asynchronous; give the state a chance to leave before rebooting
+    mqtt_publish_flush(3000);
 
     ESP_LOGI(TAG, "OTA applied successfully, restarting");
-    if (pem_buf) free(pem_buf);
     esp_restart();
     return true; // not reached
 
@@ -920,6 +883,5 @@ cleanup_err:
     /* md_ctx was initialized early; free unconditionally */
     mbedtls_md_free(&md_ctx);
     esp_http_client_cleanup(client);
-    if (pem_buf) free(pem_buf);
     return false;
 }
@@ -0,0 +1,145 @@
+/*
+ * boot_config.c
+ *
+ * One opendir/readdir pass over the data partition root; each entry whose
+ * name is a known config file is read with a single fopen/fread into a
+ * heap buffer that is never freed or modified. FAT without long names may
+ * report names in upper case, so they are matched case-insensitively.
+ * Files that are absent cost nothing beyond the directory listing, unlike
+ * the probing fopen() of every candidate name this replaces. A CA PEM in
+ * the memory-mapped asset partition wins over one on FAT, which is then
+ * not read at all.
+ */
+#include "boot_config.h"
+#include "assets.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "esp_log.h"
+
+static const char *TAG = "boot_config";
+
+/* Files worth keeping in RAM; anything else on the partition is left alone. */
+static const char *const s_known[] = {
+    "wifi.txt", "mqtt.txt", "tele.txt", "sleep.txt", "ca_root.pem", "ca-root.pem", "cacert.pem",
+};
+#define BOOT_CONFIG_FILES (sizeof(s_known) / sizeof(s_known[0]))
+/* Larger files are not configuration; skip them rather than filling the heap. */
+#define BOOT_CONFIG_MAX_FILE 16384
+
+typedef struct {
+    char *data;
+    size_t len;
+} boot_config_file_t;
+
+static const char *const s_pem_names[] = { "ca_root.pem", "ca-root.pem", "cacert.pem" };
+#define BOOT_CONFIG_PEMS (sizeof(s_pem_names) / sizeof(s_pem_names[0]))
+
+static boot_config_file_t s_files[BOOT_CONFIG_FILES];
+static char s_root[32];
+static bool s_loaded;
+
+static char *read_whole(const char *path, size_t *out_len)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+    char *buf = NULL;
+    long size = -1;
+    if (fseek(f, 0, SEEK_END) == 0) size = ftell(f);
+    if (size >= 0 && size <= BOOT_CONFIG_MAX_FILE && fseek(f, 0, SEEK_SET) == 0) buf = malloc((size_t)size + 1);
+    if (buf)
+    {
+        size_t rd = fread(buf, 1, (size_t)size, f);
+        buf[rd] = '\0';
+        *out_len = rd;
+    }
+    fclose(f);
+    return buf;
+}
+
+bool boot_config_load(const char *root)
+{
+    if (s_loaded) return true;
+    if (!root || strlen(root) >= sizeof(s_root)) return false;
+    snprintf(s_root, sizeof(s_root), "%s", root);
+
+    bool pem_in_assets = assets_init() && boot_config_ca_pem(NULL) != NULL;
+
+    DIR *d = opendir(root);
+    if (!d)
+    {
+        ESP_LOGW(TAG, "Failed to open directory %s", root);
+        return false;
+    }
+    int opened = 0;
+    size_t bytes = 0;
+    struct dirent *ent;
+    ESP_LOGI(TAG, "Listing %s:", root);
+    while ((ent = readdir(d)) != NULL)
+    {
+        ESP_LOGI(TAG, "  %s", ent->d_name);
+        for (size_t i = 0; i < BOOT_CONFIG_FILES; ++i)
+        {
+            if (s_files[i].data || strcasecmp(ent->d_name, s_known[i]) != 0) continue;
+            if (pem_in_assets && strstr(s_known[i], ".pem")) continue;
+            char path[64];
+            snprintf(path, sizeof(path), "%s/%s", root, s_known[i]);
+            s_files[i].data = read_whole(path, &s_files[i].len);
+            opened++;
+            if (s_files[i].data) bytes += s_files[i].len;
+            else ESP_LOGW(TAG, "Could not read %s", path);
+        }
+    }
+    closedir(d);
+    s_loaded = true;
+    ESP_LOGI(TAG, "Read %d config files (%u bytes) in one directory pass", opened, (unsigned)bytes);
+    return true;
+}
+
+const char *boot_config_get(const char *path, size_t *len)
+{
+    if (!path || !s_loaded) return NULL;
+    // accept both "<root>/<name>" and a bare name
+    size_t root_len = strlen(s_root);
+    const char *name = path;
+    if (strncmp(path, s_root, root_len) == 0 && path[root_len] == '/') name = path + root_len + 1;
+    for (size_t i = 0; i < BOOT_CONFIG_FILES; ++i)
+    {
+        if (strcmp(name, s_known[i]) != 0 || !s_files[i].data) continue;
+        if (len) *len = s_files[i].len;
+        return s_files[i].data;
+    }
+    return NULL;
+}
+
+const char *boot_config_ca_pem(size_t *len)
+{
+    for (size_t i = 0; i < BOOT_CONFIG_PEMS; ++i)
+    {
+        const char *pem = assets_get(s_pem_names[i], len);
+        if (pem && pem[0]) return pem;
+    }
+    for (size_t i = 0; i < BOOT_CONFIG_PEMS; ++i)
+    {
+        const char *pem = boot_config_get(s_pem_names[i], len);
+        if (pem && pem[0]) return pem;
+    }
+    return NULL;
+}
+
+bool boot_config_next_line(const char **text, char *line, size_t len)
+{
+    const char *p = *text;
+    if (!p || !*p) return false;
+    size_t n = strcspn(p, "\n");
+    size_t copy = n;
+    if (copy > 0 && p[copy - 1] == '\r') copy--;
+    if (copy >= len) copy = len - 1;
+    memcpy(line, p, copy);
+    line[copy] = '\0';
+    *text = p[n] ? p + n + 1 : p + n;
+    return true;
+}
@@ -0,0 +1,228 @@
+/*
+ * config_store.c
+ *
+ * The whole store is one NVS blob: a small header and an int64 per key.
+ * NVS writes the new blob before it drops the old one, so a power loss
+ * during a commit leaves either the previous or the new record, never a
+ * mix of both. The header carries a format version, the number of keys
+ * written and a mask of the keys that were ever set; keys added after a
+ * record was written keep their default until they are first set.
+ *
+ * config_store_commit_later() is write-behind: it wakes a low-priority
+ * writer task that waits CONFIG_STORE_WRITE_BEHIND_MS before committing,
+ * so a burst of changes (a Telegram poll that advances the cursor several
+ * times) costs one flash write, and the caller never waits for flash.
+ * Settings a user changes are committed at once instead, so the reply can
+ * say whether they were saved. A failed commit is retried every
+ * CONFIG_STORE_RETRY_MS while changes are pending. deepsleep_manager
+ * commits whatever is still pending before the chip sleeps, and a
+ * shutdown handler does the same on esp_restart().
+ */
+#include "config_store.h"
+
+#include <stddef.h>
+#include <string.h>
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "nvs.h"
+
+static const char *TAG = "config_store";
+
+#define CONFIG_STORE_NAMESPACE "config"
+#define CONFIG_STORE_KEY "store"
+#define CONFIG_STORE_VERSION 1
+/* Coalescing window of config_store_commit_later(). */
+#ifndef CONFIG_STORE_WRITE_BEHIND_MS
+#define CONFIG_STORE_WRITE_BEHIND_MS 5000
+#endif
+/* Delay before the writer task retries a failed commit. */
+#ifndef CONFIG_STORE_RETRY_MS
+#define CONFIG_STORE_RETRY_MS 30000
+#endif
+/* Keys a record can hold (the width of set_mask). */
+#define CONFIG_STORE_MAX_KEYS 32
+
+typedef struct {
+    uint16_t version;
+    uint8_t count;       /* values that follow */
+    uint8_t reserved;
+    uint32_t set_mask;   /* bit i: key i was set at least once */
+    int64_t values[CONFIG_STORE_MAX_KEYS]; /* only `count` are stored */
+} config_record_t;
+
+_Static_assert(CONFIG_KEY_COUNT <= CONFIG_STORE_MAX_KEYS, "too many config keys");
+
+static config_record_t s_cache;
+static uint32_t s_changes;      /* bumped by every set */
+static uint32_t s_committed;    /* s_changes at the last successful commit */
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t s_commit_mutex;
+static TaskHandle_t s_writer;
+
+static void config_store_writer_task(void *arg)
+{
+    for (;;)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        // changes made during the window go out with this write
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_STORE_WRITE_BEHIND_MS));
+        ulTaskNotifyTake(pdTRUE, 0);
+        // keep retrying a failed write (NVS full, flash error) while the changes are still unsaved
+        while (!config_store_commit() && config_store_pending())
+        {
+            ESP_LOGW(TAG, "changes not saved; retrying in %d ms", CONFIG_STORE_RETRY_MS);
+            vTaskDelay(pdMS_TO_TICKS(CONFIG_STORE_RETRY_MS));
+            ulTaskNotifyTake(pdTRUE, 0);
+        }
+    }
+}
+
+static void config_store_on_shutdown(void)
+{
+    config_store_commit();
+}
+
+bool config_store_init(void)
+{
+    if (!s_commit_mutex) s_commit_mutex = xSemaphoreCreateMutex();
+    if (!s_writer && xTaskCreate(config_store_writer_task, "cfg_writer", 3072, NULL, tskIDLE_PRIORITY + 1, &s_writer) != pdPASS)
+    {
+        s_writer = NULL;
+        ESP_LOGW(TAG, "no writer task; changes are committed synchronously");
+    }
+    static bool s_shutdown_registered;
+    if (!s_shutdown_registered) s_shutdown_registered = esp_register_shutdown_handler(config_store_on_shutdown) == ESP_OK;
+    memset(&s_cache, 0, sizeof(s_cache));
+    s_cache.version = CONFIG_STORE_VERSION;
+    s_cache.count = CONFIG_KEY_COUNT;
+
+    nvs_handle_t nh;
+    esp_err_t err = nvs_open(CONFIG_STORE_NAMESPACE, NVS_READONLY, &nh);
+    if (err != ESP_OK)
+    {
+        // namespace not created yet: nothing was ever committed
+        ESP_LOGI(TAG, "no stored config, using defaults");
+        return s_commit_mutex != NULL;
+    }
+    config_record_t rec;
+    size_t len = sizeof(rec);
+    err = nvs_get_blob(nh, CONFIG_STORE_KEY, &rec, &len);
+    nvs_close(nh);
+
+    size_t header = offsetof(config_record_t, values);
+    if (err != ESP_OK || len < header || rec.version != CONFIG_STORE_VERSION ||
+        len < header + (size_t)rec.count * sizeof(int64_t))
+    {
+        if (err != ESP_ERR_NVS_NOT_FOUND) ESP_LOGW(TAG, "stored config unreadable (%s), using defaults", esp_err_to_name(err));
+        return s_commit_mutex != NULL;
+    }
+    // a record from newer firmware may hold more keys; the first ones still match
+    int n = rec.count < CONFIG_KEY_COUNT ? rec.count : CONFIG_KEY_COUNT;
+    memcpy(s_cache.values, rec.values, (size_t)n * sizeof(int64_t));
+    s_cache.set_mask = rec.set_mask & (uint32_t)((1ull << n) - 1);
+    ESP_LOGI(TAG, "loaded %d stored keys", n);
+    return s_commit_mutex != NULL;
+}
+
+bool config_store_has(config_key_t key)
+{
+    if (key >= CONFIG_KEY_COUNT) return false;
+    return (s_cache.set_mask >> key) & 1;
+}
+
+int64_t config_store_get_i64(config_key_t key)
+{
+    if (key >= CONFIG_KEY_COUNT) return 0;
+    // 64-bit loads are not atomic on this target
+    portENTER_CRITICAL(&s_lock);
+    int64_t v = s_cache.values[key];
+    portEXIT_CRITICAL(&s_lock);
+    return v;
+}
+
+uint64_t config_store_get_u64(config_key_t key)
+{
+    return (uint64_t)config_store_get_i64(key);
+}
+
+bool config_store_get_bool(config_key_t key)
+{
+    return config_store_get_i64(key) != 0;
+}
+
+void config_store_set_i64(config_key_t key, int64_t value)
+{
+    if (key >= CONFIG_KEY_COUNT) return;
+    portENTER_CRITICAL(&s_lock);
+    if (s_cache.values[key] != value || !((s_cache.set_mask >> key) & 1))
+    {
+        s_cache.values[key] = value;
+        s_cache.set_mask |= 1u << key;
+        s_changes++;
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void config_store_set_u64(config_key_t key, uint64_t value)
+{
+    config_store_set_i64(key, (int64_t)value);
+}
+
+void config_store_set_bool(config_key_t key, bool value)
+{
+    config_store_set_i64(key, value ? 1 : 0);
+}
+
+bool config_store_commit(void)
+{
+    if (!s_commit_mutex) return false;
+    xSemaphoreTake(s_commit_mutex, portMAX_DELAY);
+
+    config_record_t rec;
+    portENTER_CRITICAL(&s_lock);
+    uint32_t changes = s_changes;
+    rec = s_cache;
+    portEXIT_CRITICAL(&s_lock);
+    if (changes == s_committed)
+    {
+        xSemaphoreGive(s_commit_mutex);
+        return true;
+    }
+
+    nvs_handle_t nh;
+    esp_err_t err = nvs_open(CONFIG_STORE_NAMESPACE, NVS_READWRITE, &nh);
+    if (err == ESP_OK)
+    {
+        err = nvs_set_blob(nh, CONFIG_STORE_KEY, &rec, offsetof(config_record_t, values[CONFIG_KEY_COUNT]));
+        if (err == ESP_OK) err = nvs_commit(nh);
+        nvs_close(nh);
+    }
+    if (err == ESP_OK) s_committed = changes;
+    xSemaphoreGive(s_commit_mutex);
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "commit failed: %s", esp_err_to_name(err));
+        return false;
+    }
+    ESP_LOGD(TAG, "committed %lu changes", (unsigned long)changes);
+    return true;
+}
+
+void config_store_commit_later(void)
+{
+    if (s_writer) xTaskNotifyGive(s_writer);
+    else config_store_commit();
+}
+
+bool config_store_pending(void)
+{
+    portENTER_CRITICAL(&s_lock);
+    bool pending = s_changes != s_committed;
+    portEXIT_CRITICAL(&s_lock);
+    return pending;
+}
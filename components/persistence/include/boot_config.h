@@ -0,0 +1,50 @@
+/*
+ * boot_config.h
+ *
+ * The configuration files on the data partition (wifi.txt, mqtt.txt,
+ * tele.txt, the CA PEM, ...) are read once at boot, in a single pass over
+ * the directory, into RAM that stays unchanged afterwards. Components look
+ * their files up here instead of opening them again.
+ */
+
+#ifndef BOOT_CONFIG_H
+#define BOOT_CONFIG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * List `root` once and read every known config file found there. Call
+ * once, after storage_mount(); later calls do nothing.
+ */
+bool boot_config_load(const char *root);
+
+/**
+ * Contents of the config file at `path` (e.g. "/filesystem/mqtt.txt") as
+ * read at boot, NUL-terminated, or NULL if it was not present. The
+ * pointer stays valid for the lifetime of the firmware.
+ */
+const char *boot_config_get(const char *path, size_t *len);
+
+/**
+ * The CA PEM: the first of ca_root.pem, ca-root.pem and cacert.pem found
+ * in the asset partition, else on the data partition at boot, or NULL.
+ * Never free the result.
+ */
+const char *boot_config_ca_pem(size_t *len);
+
+/**
+ * Copy the next line of `*text` (without the line ending) into `line`
+ * and advance `*text` past it. Returns false at the end of the text.
+ */
+bool boot_config_next_line(const char **text, char *line, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BOOT_CONFIG_H
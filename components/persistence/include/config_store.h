@@ -0,0 +1,72 @@
+/*
+ * config_store.h
+ *
+ * Typed key-value store for the settings the firmware changes at runtime
+ * (deep-sleep settings, the Telegram update cursor). All values live in a
+ * RAM cache, so reads are a table lookup; setters only touch the cache and
+ * config_store_commit() writes every pending change to NVS in one blob
+ * write, which NVS replaces atomically. config_store_commit_later() does
+ * the same in the background after a short coalescing window.
+ */
+
+#ifndef CONFIG_STORE_H
+#define CONFIG_STORE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Keys are stored by position: only ever append new keys (before
+ * CONFIG_KEY_COUNT) so records written by older firmware stay readable.
+ */
+typedef enum {
+    CONFIG_SLEEP_INTERVAL_MS,     /* deep-sleep wake interval, 0 = none */
+    CONFIG_SLEEP_IDLE_TIMEOUT_MS, /* time awake before sleeping */
+    CONFIG_SLEEP_ENABLED,         /* 0 or 1 */
+    CONFIG_TELEGRAM_LAST_UPDATE,  /* highest processed Telegram update_id */
+    CONFIG_SLEEP_BATCH_WAKES,     /* timer wakes per upload, 0 or 1 = every wake */
+    CONFIG_KEY_COUNT
+} config_key_t;
+
+/** Load the stored record into the cache. Call after nvs_flash_init(). */
+bool config_store_init(void);
+
+/** True if `key` was ever set (on this device), false if it has its default. */
+bool config_store_has(config_key_t key);
+
+int64_t config_store_get_i64(config_key_t key);
+uint64_t config_store_get_u64(config_key_t key);
+bool config_store_get_bool(config_key_t key);
+
+/** Update the cache; the value reaches flash with the next commit. */
+void config_store_set_i64(config_key_t key, int64_t value);
+void config_store_set_u64(config_key_t key, uint64_t value);
+void config_store_set_bool(config_key_t key, bool value);
+
+/**
+ * Write all pending changes in one NVS commit. Returns true if there was
+ * nothing to write or the write succeeded; on failure the changes stay
+ * pending.
+ */
+bool config_store_commit(void);
+
+/**
+ * Commit in the background after CONFIG_STORE_WRITE_BEHIND_MS; further
+ * changes within that window share the write. Pending changes are written
+ * on esp_restart(), but not before deep sleep or on power loss: call
+ * config_store_commit() before sleeping.
+ */
+void config_store_commit_later(void);
+
+/** True if the cache holds changes that are not on flash yet. */
+bool config_store_pending(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CONFIG_STORE_H
@@ -32,10 +32,18 @@ struct persistence_config {
 void fat32_mount(const char *mountpoint, const char *partition);
 
 /**
- * Read a persisted config from `path`. On success returns true and fills
- * `config` with allocated strings which must be freed by
- * `persistence_config_free()`; on failure returns false and leaves `config`
- * untouched.
+ * Mount the data partition `partition` on `mountpoint` with the storage
+ * backend selected at build time: FAT (fat32_mount) by default, LittleFS
+ * when the component is built with PERSISTENCE_LITTLEFS. Paths and the rest
+ * of this API are the same for both. Aborts on failure like fat32_mount.
+ */
+void storage_mount(const char *mountpoint, const char *partition);
+
+/**
+ * Read a persisted config from `path`, as loaded by boot_config_load(). On
+ * success returns true and fills `config` with allocated strings which must
+ * be freed by `persistence_config_free()`; on failure returns false and
+ * leaves `config` untouched.
  */
 bool persistence_read_config(const char *path, struct persistence_config *config);
 
@@ -1,8 +1,16 @@
 #include "persistence.h"
+#include "boot_config.h"
 
 #include "esp_log.h"
 #include "esp_vfs.h"
 #include "esp_vfs_fat.h"
+#if PERSISTENCE_LITTLEFS
+#if __has_include("esp_littlefs.h")
+#include "esp_littlefs.h"
+#else
+#error "PERSISTENCE_LITTLEFS needs the joltwallet/littlefs component (idf.py add-dependency joltwallet/littlefs)"
+#endif
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,36 +38,44 @@ void fat32_mount(const char *mountpoint, const char *partition)
     ESP_LOGI(TAG, "Mounted FAT32 `%s' on `%s'", partition, mountpoint);
 }
 
+/*
+ * storage_mount
+ * Mount the data partition with the backend chosen at build time: FAT over
+ * wear levelling by default, LittleFS when built with PERSISTENCE_LITTLEFS.
+ * Either way files are reached through the same VFS paths, so callers keep
+ * using fopen() & co. on `mountpoint`.
+ */
+void storage_mount(const char *mountpoint, const char *partition)
+{
+#if PERSISTENCE_LITTLEFS
+    const esp_vfs_littlefs_conf_t conf = {
+        .base_path = mountpoint,
+        .partition_label = partition,
+        .format_if_mount_failed = false,
+        .dont_mount = false,
+    };
+    ESP_ERROR_CHECK(esp_vfs_littlefs_register(&conf));
+    size_t total = 0, used = 0;
+    if (esp_littlefs_info(partition, &total, &used) == ESP_OK)
+        ESP_LOGI(TAG, "Mounted LittleFS `%s' on `%s' (%u/%u bytes used)", partition, mountpoint, (unsigned)used, (unsigned)total);
+#else
+    fat32_mount(mountpoint, partition);
+#endif
+}
+
 /*
  * persistence_read_config
- * Reads a simple two-line file containing SSID and password. Allocates
- * two buffers on success and stores them into the provided `config`.
- * The caller must free them using persistence_config_free().
+ * Parses a simple two-line file containing SSID and password, as read at
+ * boot by boot_config_load(). Allocates two buffers on success and stores
+ * them into the provided `config`. The caller must free them using
+ * persistence_config_free().
  */
 bool persistence_read_config(const char *path, struct persistence_config *config)
 {
-    ESP_LOGI(TAG, "Reading config file `%s'...", path);
-    FILE *file = fopen(path, "r");
-    if (file == NULL) {
-        ESP_LOGE(TAG, "Error opening config file `%s' for reading", path);
-        return false;
-    }
-
-    if (fseek(file, 0, SEEK_END) != 0) {
-        ESP_LOGE(TAG, "Failed to seek end of file `%s'", path);
-        fclose(file);
-        return false;
-    }
-    long ft = ftell(file);
-    if (ft < 0) {
-        ESP_LOGE(TAG, "ftell failed for `%s'", path);
-        fclose(file);
-        return false;
-    }
-    size_t file_size = (size_t)ft;
-    if (fseek(file, 0, SEEK_SET) != 0) {
-        ESP_LOGE(TAG, "Failed to rewind file `%s'", path);
-        fclose(file);
+    size_t file_size = 0;
+    const char *text = boot_config_get(path, &file_size);
+    if (text == NULL) {
+        ESP_LOGE(TAG, "Config file `%s' not found", path);
         return false;
     }
 
@@ -68,26 +84,18 @@ bool persistence_read_config(const char *path, struct persistence_config *config
     char *password = calloc(1, file_size + 1);
     if (!ssid || !password) {
         ESP_LOGE(TAG, "Out of memory allocating config buffers");
-        fclose(file);
         free(ssid);
         free(password);
         return false;
     }
 
-    if (fgets(ssid, (int)file_size + 1, file) == NULL || fgets(password, (int)file_size + 1, file) == NULL) {
+    if (!boot_config_next_line(&text, ssid, file_size + 1) || !boot_config_next_line(&text, password, file_size + 1)) {
         ESP_LOGE(TAG, "Error reading config file `%s', file may be corrupted or too short", path);
-        fclose(file);
         free(ssid);
         free(password);
         return false;
     }
 
-    fclose(file);
-
-    /* strip trailing newline characters */
-    ssid[strcspn(ssid, "\r\n")] = '\0';
-    password[strcspn(password, "\r\n")] = '\0';
-
     config->ssid = ssid;
     config->password = password;
 
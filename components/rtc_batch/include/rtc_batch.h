@@ -0,0 +1,82 @@
+/*
+ * rtc_batch.h
+ *
+ * A ring of sensor readings in RTC slow memory that survives deep sleep
+ * (and software resets), so a timer wake can take a sample and go straight
+ * back to sleep without bringing up WiFi. A later wake publishes the whole
+ * batch. Each reading already carries its telemetry seq and timestamp, so
+ * publishing it late, or twice, is the same as publishing it on time.
+ */
+
+#ifndef RTC_BATCH_H
+#define RTC_BATCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Readings the ring holds; when full, the oldest is overwritten. */
+#ifndef RTC_BATCH_CAPACITY
+#define RTC_BATCH_CAPACITY 32
+#endif
+#define RTC_BATCH_CHANNELS 3
+
+typedef struct {
+    int64_t ts_ms;     /* Unix ms, or 0 if the clock was not set */
+    uint32_t seq;      /* telemetry seq the reading was stamped with */
+    uint8_t present;   /* bit i: values[i] is valid */
+    uint8_t flags;     /* reserved, 0 */
+    uint16_t reserved;
+    int32_t values[RTC_BATCH_CHANNELS];
+} rtc_batch_record_t;
+
+/**
+ * Check the ring left in RTC memory and count this boot. The ring is kept
+ * after a deep-sleep wake if its CRC and boot count check out, and after a
+ * software reset or crash if its CRC does; after power-on or brownout it
+ * is cleared. Call once, early in app_main().
+ */
+bool rtc_batch_init(void);
+
+/** Append a reading. Returns false if the oldest one had to be dropped. */
+bool rtc_batch_push(const rtc_batch_record_t *rec);
+
+/** Readings held. */
+uint16_t rtc_batch_count(void);
+
+/** Copy the `i`-th oldest reading; false if there is none. */
+bool rtc_batch_peek(uint16_t i, rtc_batch_record_t *out);
+
+/** Drop the `n` oldest readings once they have been delivered. */
+void rtc_batch_consume(uint16_t n);
+
+/**
+ * Count a wake and decide whether it should upload: true on every
+ * `wakes_per_upload`-th call. The count restarts on true, so after a
+ * failed upload the next attempt is the next upload wake, not every wake;
+ * meanwhile the ring keeps the newest RTC_BATCH_CAPACITY readings.
+ */
+bool rtc_batch_upload_due(uint32_t wakes_per_upload);
+
+/**
+ * Record whether the alert condition holds for the latest sample; returns
+ * true when that differs from the previous call, so a wake can react to
+ * the condition starting or ending rather than to every sample while it
+ * lasts. The state survives deep sleep with the ring.
+ */
+bool rtc_batch_set_alert(bool active);
+
+/** Readings overwritten before they were delivered, since the ring was cleared. */
+uint32_t rtc_batch_dropped(void);
+
+/** Boots (wakes included) since the ring was last cleared. */
+uint32_t rtc_batch_boot_count(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // RTC_BATCH_H
@@ -0,0 +1,170 @@
+/*
+ * rtc_batch.c
+ *
+ * The ring lives in RTC_NOINIT memory: the bootloader leaves it alone on
+ * every reset, so it outlives deep sleep and crashes, but after power-on
+ * it holds garbage. It is trusted only if its magic, layout size and CRC
+ * match. The boot count stored in the ring is also mirrored in plain
+ * RTC_DATA, which survives deep sleep only; on a deep-sleep wake the two
+ * must agree, which rejects a ring written by a different image or not
+ * updated before the last sleep. After a software reset the mirror is
+ * reloaded from the image, so there the CRC has to do.
+ */
+#include "rtc_batch.h"
+
+#include <stddef.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+
+static const char *TAG = "rtc_batch";
+
+#define RTC_BATCH_MAGIC 0x31544252u /* "RBT1" */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t crc;            /* CRC-32 of everything after this field */
+    uint32_t layout;         /* sizeof(rtc_batch_t) of the writer */
+    uint32_t boot_count;
+    uint32_t wakes;          /* wakes since the last upload wake */
+    uint32_t dropped;
+    uint32_t alert;          /* alert condition seen on the last sample */
+    uint16_t head;           /* slot of the oldest reading */
+    uint16_t count;
+    rtc_batch_record_t rec[RTC_BATCH_CAPACITY];
+} rtc_batch_t;
+
+static RTC_NOINIT_ATTR rtc_batch_t s_ring;
+static RTC_DATA_ATTR uint32_t s_boot_mirror;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static uint32_t ring_crc(void)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)&s_ring + offsetof(rtc_batch_t, layout),
+                            sizeof(s_ring) - offsetof(rtc_batch_t, layout));
+}
+
+// Called with s_lock held after every change.
+static void ring_seal(void)
+{
+    s_ring.crc = ring_crc();
+}
+
+static const char *ring_check(esp_reset_reason_t reason)
+{
+    if (reason == ESP_RST_POWERON || reason == ESP_RST_BROWNOUT || reason == ESP_RST_UNKNOWN) return "power-on";
+    if (s_ring.magic != RTC_BATCH_MAGIC || s_ring.layout != sizeof(s_ring)) return "no ring";
+    if (s_ring.head >= RTC_BATCH_CAPACITY || s_ring.count > RTC_BATCH_CAPACITY || s_ring.crc != ring_crc()) return "CRC mismatch";
+    if (reason == ESP_RST_DEEPSLEEP && s_ring.boot_count != s_boot_mirror) return "boot count mismatch";
+    return NULL;
+}
+
+bool rtc_batch_init(void)
+{
+    esp_reset_reason_t reason = esp_reset_reason();
+    const char *why = ring_check(reason);
+    portENTER_CRITICAL(&s_lock);
+    if (why)
+    {
+        memset(&s_ring, 0, sizeof(s_ring));
+        s_ring.magic = RTC_BATCH_MAGIC;
+        s_ring.layout = sizeof(s_ring);
+    }
+    s_boot_mirror = ++s_ring.boot_count;
+    ring_seal();
+    portEXIT_CRITICAL(&s_lock);
+
+    if (why) ESP_LOGI(TAG, "ring cleared (%s)", why);
+    else ESP_LOGI(TAG, "kept %u readings, boot %lu, %lu wakes since upload", (unsigned)s_ring.count,
+                  (unsigned long)s_ring.boot_count, (unsigned long)s_ring.wakes);
+    return true;
+}
+
+bool rtc_batch_push(const rtc_batch_record_t *rec)
+{
+    if (!rec) return false;
+    bool kept_all = true;
+    portENTER_CRITICAL(&s_lock);
+    if (s_ring.count == RTC_BATCH_CAPACITY)
+    {
+        s_ring.head = (s_ring.head + 1) % RTC_BATCH_CAPACITY;
+        s_ring.count--;
+        s_ring.dropped++;
+        kept_all = false;
+    }
+    s_ring.rec[(s_ring.head + s_ring.count) % RTC_BATCH_CAPACITY] = *rec;
+    s_ring.count++;
+    ring_seal();
+    portEXIT_CRITICAL(&s_lock);
+    return kept_all;
+}
+
+uint16_t rtc_batch_count(void)
+{
+    portENTER_CRITICAL(&s_lock);
+    uint16_t n = s_ring.count;
+    portEXIT_CRITICAL(&s_lock);
+    return n;
+}
+
+bool rtc_batch_peek(uint16_t i, rtc_batch_record_t *out)
+{
+    if (!out) return false;
+    portENTER_CRITICAL(&s_lock);
+    bool ok = i < s_ring.count;
+    if (ok) *out = s_ring.rec[(s_ring.head + i) % RTC_BATCH_CAPACITY];
+    portEXIT_CRITICAL(&s_lock);
+    return ok;
+}
+
+void rtc_batch_consume(uint16_t n)
+{
+    portENTER_CRITICAL(&s_lock);
+    if (n > s_ring.count) n = s_ring.count;
+    s_ring.head = (s_ring.head + n) % RTC_BATCH_CAPACITY;
+    s_ring.count -= n;
+    ring_seal();
+    portEXIT_CRITICAL(&s_lock);
+}
+
+bool rtc_batch_upload_due(uint32_t wakes_per_upload)
+{
+    portENTER_CRITICAL(&s_lock);
+    bool due = ++s_ring.wakes >= wakes_per_upload;
+    if (due) s_ring.wakes = 0;
+    ring_seal();
+    portEXIT_CRITICAL(&s_lock);
+    return due;
+}
+
+bool rtc_batch_set_alert(bool active)
+{
+    portENTER_CRITICAL(&s_lock);
+    bool changed = s_ring.alert != (uint32_t)active;
+    if (changed)
+    {
+        s_ring.alert = active;
+        ring_seal();
+    }
+    portEXIT_CRITICAL(&s_lock);
+    return changed;
+}
+
+uint32_t rtc_batch_dropped(void)
+{
+    portENTER_CRITICAL(&s_lock);
+    uint32_t n = s_ring.dropped;
+    portEXIT_CRITICAL(&s_lock);
+    return n;
+}
+
+uint32_t rtc_batch_boot_count(void)
+{
+    portENTER_CRITICAL(&s_lock);
+    uint32_t n = s_ring.boot_count;
+    portEXIT_CRITICAL(&s_lock);
+    return n;
+}
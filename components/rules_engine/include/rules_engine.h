@@ -0,0 +1,71 @@
+/*
+ * rules_engine.h
+ *
+ * On-device threshold rules evaluated on every sample, configured through
+ * the ThingsBoard shared attribute "rules". Rules are compiled once into a
+ * fixed table; evaluating a sample allocates nothing.
+ *
+ * Rule syntax (one per line or separated by ';'; the attribute may also
+ * be a JSON array of rule strings):
+ *
+ *   <channel> [delta] <op> <number> [for <n>ms|s|m] [-> <action> [<arg>]]
+ *
+ *   op:      <  <=  >  >=  ==  !=
+ *   delta:   compare |value - previous value| instead of the value
+ *   for:     the condition must hold continuously this long
+ *   action:  alert (default)  urgent telemetry {"rule":"<text>", ...}
+ *            rate <ms>        change the sampling period
+ *            telegram         notify the Telegram admin chat
+ *
+ * e.g. "distance_mm < 300 for 2s; voltage_mV delta > 200 -> telegram"
+ *
+ * A rule fires once when its condition becomes (and stays) true and re-arms
+ * when the condition is false again. With the clock set, a hold continues
+ * across deep sleep (judged from the samples taken on each wake).
+ */
+
+#ifndef RULES_ENGINE_H
+#define RULES_ENGINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    RULE_ACTION_ALERT = 0,
+    RULE_ACTION_RATE,
+    RULE_ACTION_TELEGRAM,
+    RULE_ACTION_COUNT
+} rule_action_t;
+
+/**
+ * Called from rules_engine_evaluate() (the sampling task) when a rule
+ * fires. `arg` is the action argument (the period for RULE_ACTION_RATE),
+ * `rule_text` the rule as configured and `value` the triggering value.
+ */
+typedef void (*rules_action_cb_t)(rule_action_t action, int32_t arg, const char *rule_text, int32_t value, void *user_ctx);
+
+/**
+ * Name the sample channels (index = position in the values passed to
+ * rules_engine_evaluate()) and subscribe to the "rules" shared attribute.
+ * Rules compiled before a deep sleep are kept in RTC memory.
+ */
+bool rules_engine_init(const char *const *channels, uint8_t count, rules_action_cb_t cb, void *user_ctx);
+
+/**
+ * Compile `text` and replace the active rules. Returns the number of rules
+ * loaded, or -1 (active rules unchanged) when any rule fails to parse.
+ */
+int rules_engine_load(const char *text);
+
+/** Evaluate one sample; bit i of `present_mask` marks values[i] as valid. */
+void rules_engine_evaluate(const int32_t *values, uint32_t present_mask);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // RULES_ENGINE_H
@@ -0,0 +1,384 @@
+/*
+ * rules_engine.c
+ *
+ * Rules are parsed once (when the "rules" attribute arrives) into a fixed
+ * table of {channel, op, threshold, hold time, action} rows. The table and
+ * each row's runtime state live in RTC memory, so the rules keep working
+ * across deep sleep even when the fast MQTT resume skips the attribute
+ * request. Evaluation walks the table under a spinlock and collects the
+ * rules that fired; their actions run after the lock is released.
+ *
+ * A hold ("for 10m") starts on the wall clock when it is set, so it runs
+ * on across deep sleep: a sleeping node samples once per wake, and the
+ * hold completes on the first wake after it has elapsed if every sample
+ * in between met the condition. Without a valid clock the hold is timed
+ * on the uptime clock and starts over after a wake.
+ */
+#include "rules_engine.h"
+#include "mqtt.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include <sys/time.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include <cJSON.h>
+
+static const char *TAG = "rules";
+
+#ifndef RULES_MAX
+#define RULES_MAX 8
+#endif
+/* Rule text kept for alerts and notifications (truncated). */
+#define RULES_TEXT_LEN 48
+#define RULES_MAX_CHANNELS 8
+#define RULES_SRC_MAX 512
+#define RULES_RTC_MAGIC 0x52554C32u /* "RUL2" */
+/* time() below this has not been set (SNTP or the RTC). */
+#define RULES_MIN_VALID_TIME 1600000000
+
+typedef enum { OP_LT, OP_LE, OP_GT, OP_GE, OP_EQ, OP_NE } rule_op_t;
+
+typedef struct {
+    uint8_t channel;
+    uint8_t op;
+    uint8_t action;
+    bool delta;
+    int32_t threshold;
+    int32_t arg;
+    uint32_t hold_ms;
+    /* runtime state */
+    int64_t since_us;       /* when the condition became true, 0 = false */
+    bool since_wall;        /* since_us is Unix time, else uptime */
+    int32_t prev;           /* previous value, for delta rules */
+    bool have_prev;
+    bool fired;             /* fired and not yet re-armed */
+    char text[RULES_TEXT_LEN];
+} rule_t;
+
+typedef struct {
+    uint32_t magic;
+    uint8_t count;
+    rule_t rules[RULES_MAX];
+} rules_table_t;
+
+static RTC_DATA_ATTR rules_table_t s_table;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static const char *const *s_channels;
+static uint8_t s_channel_count;
+static rules_action_cb_t s_cb;
+static void *s_cb_ctx;
+
+// Unix time in us, or 0 while the clock has not been set.
+static int64_t wall_us(void)
+{
+    if (time(NULL) < RULES_MIN_VALID_TIME) return 0;
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static const char *skip_ws(const char *p)
+{
+    while (*p == ' ' || *p == '\t') p++;
+    return p;
+}
+
+// Read an identifier into `out`; returns the position after it.
+static const char *read_word(const char *p, char *out, size_t len)
+{
+    size_t n = 0;
+    p = skip_ws(p);
+    while ((isalnum((unsigned char)*p) || *p == '_') && n + 1 < len) out[n++] = *p++;
+    out[n] = '\0';
+    return p;
+}
+
+static bool read_int(const char **pp, int32_t *out)
+{
+    const char *p = skip_ws(*pp);
+    char *end;
+    long v = strtol(p, &end, 10);
+    if (end == p) return false;
+    *out = (int32_t)v;
+    *pp = end;
+    return true;
+}
+
+// Compile one rule (NUL-terminated) into `r`.
+static bool rule_parse(const char *src, rule_t *r)
+{
+    memset(r, 0, sizeof(*r));
+    char word[32];
+    const char *p = read_word(src, word, sizeof(word));
+
+    int ch = -1;
+    for (int i = 0; i < s_channel_count; ++i)
+        if (strcmp(word, s_channels[i]) == 0) ch = i;
+    if (ch < 0)
+    {
+        ESP_LOGW(TAG, "unknown channel '%s' in \"%s\"", word, src);
+        return false;
+    }
+    r->channel = (uint8_t)ch;
+
+    const char *q = read_word(p, word, sizeof(word));
+    if (strcmp(word, "delta") == 0)
+    {
+        r->delta = true;
+        p = q;
+    }
+
+    p = skip_ws(p);
+    if (p[0] == '<' && p[1] == '=') { r->op = OP_LE; p += 2; }
+    else if (p[0] == '>' && p[1] == '=') { r->op = OP_GE; p += 2; }
+    else if (p[0] == '=' && p[1] == '=') { r->op = OP_EQ; p += 2; }
+    else if (p[0] == '!' && p[1] == '=') { r->op = OP_NE; p += 2; }
+    else if (p[0] == '<') { r->op = OP_LT; p++; }
+    else if (p[0] == '>') { r->op = OP_GT; p++; }
+    else
+    {
+        ESP_LOGW(TAG, "missing comparison in \"%s\"", src);
+        return false;
+    }
+    if (!read_int(&p, &r->threshold))
+    {
+        ESP_LOGW(TAG, "missing threshold in \"%s\"", src);
+        return false;
+    }
+
+    q = read_word(p, word, sizeof(word));
+    if (strcmp(word, "for") == 0)
+    {
+        int32_t n;
+        p = q;
+        if (!read_int(&p, &n) || n < 0) return false;
+        p = read_word(p, word, sizeof(word));
+        if (strcmp(word, "ms") == 0) r->hold_ms = (uint32_t)n;
+        else if (strcmp(word, "s") == 0 || word[0] == '\0') r->hold_ms = (uint32_t)n * 1000;
+        else if (strcmp(word, "m") == 0) r->hold_ms = (uint32_t)n * 60000;
+        else
+        {
+            ESP_LOGW(TAG, "bad duration unit '%s' in \"%s\"", word, src);
+            return false;
+        }
+    }
+
+    p = skip_ws(p);
+    r->action = RULE_ACTION_ALERT;
+    if (p[0] == '-' && p[1] == '>')
+    {
+        p = read_word(p + 2, word, sizeof(word));
+        if (strcmp(word, "alert") == 0) r->action = RULE_ACTION_ALERT;
+        else if (strcmp(word, "telegram") == 0) r->action = RULE_ACTION_TELEGRAM;
+        else if (strcmp(word, "rate") == 0)
+        {
+            r->action = RULE_ACTION_RATE;
+            if (!read_int(&p, &r->arg) || r->arg <= 0)
+            {
+                ESP_LOGW(TAG, "rate needs a period in ms in \"%s\"", src);
+                return false;
+            }
+        }
+        else
+        {
+            ESP_LOGW(TAG, "unknown action '%s' in \"%s\"", word, src);
+            return false;
+        }
+    }
+    if (*skip_ws(p) != '\0')
+    {
+        ESP_LOGW(TAG, "trailing text in \"%s\"", src);
+        return false;
+    }
+
+    // keep a printable copy; quotes would break the alert JSON
+    size_t n = 0;
+    for (const char *s = skip_ws(src); *s && n + 1 < sizeof(r->text); ++s)
+        r->text[n++] = (*s == '"' || *s == '\\') ? '\'' : *s;
+    while (n > 0 && r->text[n - 1] == ' ') n--;
+    r->text[n] = '\0';
+    return true;
+}
+
+int rules_engine_load(const char *text)
+{
+    if (!text) text = "";
+    static rules_table_t next; /* only the MQTT task loads rules */
+    memset(&next, 0, sizeof(next));
+    next.magic = RULES_RTC_MAGIC;
+
+    const char *p = text;
+    while (*p)
+    {
+        size_t len = strcspn(p, ";\n");
+        char src[96];
+        if (len >= sizeof(src))
+        {
+            ESP_LOGW(TAG, "rule too long: %.*s", (int)len, p);
+            return -1;
+        }
+        memcpy(src, p, len);
+        src[len] = '\0';
+        p += len;
+        if (*p) p++;
+        if (*skip_ws(src) == '\0') continue;
+        if (next.count >= RULES_MAX)
+        {
+            ESP_LOGW(TAG, "more than %d rules", RULES_MAX);
+            return -1;
+        }
+        if (!rule_parse(src, &next.rules[next.count])) return -1;
+        next.count++;
+    }
+
+    portENTER_CRITICAL(&s_lock);
+    s_table = next;
+    portEXIT_CRITICAL(&s_lock);
+    ESP_LOGI(TAG, "%u rules active", (unsigned)next.count);
+    return next.count;
+}
+
+// "rules" is either one string or an array of rule strings.
+static void rules_attribute_handler(const char *key, const char *value_json, void *ctx)
+{
+    (void)key;
+    (void)ctx;
+    cJSON *v = cJSON_Parse(value_json);
+    if (!v) return;
+    char src[RULES_SRC_MAX];
+    size_t off = 0;
+    bool truncated = false;
+    src[0] = '\0';
+    if (cJSON_IsString(v))
+    {
+        off = (size_t)snprintf(src, sizeof(src), "%s", cJSON_GetStringValue(v));
+        truncated = off >= sizeof(src);
+    }
+    else if (cJSON_IsArray(v))
+    {
+        cJSON *it;
+        cJSON_ArrayForEach(it, v)
+        {
+            if (!cJSON_IsString(it)) continue;
+            int n = snprintf(src + off, sizeof(src) - off, "%s;", cJSON_GetStringValue(it));
+            if (n < 0 || (size_t)n >= sizeof(src) - off)
+            {
+                truncated = true;
+                break;
+            }
+            off += (size_t)n;
+        }
+    }
+    cJSON_Delete(v);
+    // a cut-off rule could still parse, as a different rule
+    if (truncated)
+    {
+        ESP_LOGE(TAG, "rules attribute longer than %u bytes rejected; keeping the previous rules", (unsigned)(sizeof(src) - 1));
+        return;
+    }
+    if (rules_engine_load(src) < 0) ESP_LOGE(TAG, "rules attribute rejected; keeping the previous rules");
+}
+
+static bool rule_compare(int64_t x, const rule_t *r)
+{
+    switch (r->op)
+    {
+    case OP_LT: return x < r->threshold;
+    case OP_LE: return x <= r->threshold;
+    case OP_GT: return x > r->threshold;
+    case OP_GE: return x >= r->threshold;
+    case OP_EQ: return x == r->threshold;
+    default: return x != r->threshold;
+    }
+}
+
+void rules_engine_evaluate(const int32_t *values, uint32_t present_mask)
+{
+    struct {
+        uint8_t action;
+        int32_t arg;
+        int32_t value;
+        char text[RULES_TEXT_LEN];
+    } fired[RULES_MAX];
+    int nfired = 0;
+    int64_t now = esp_timer_get_time();
+    int64_t wall = wall_us();
+
+    portENTER_CRITICAL(&s_lock);
+    for (int i = 0; i < s_table.count; ++i)
+    {
+        rule_t *r = &s_table.rules[i];
+        bool present = (present_mask >> r->channel) & 1;
+        int32_t v = present ? values[r->channel] : 0;
+        bool cond = present;
+        int64_t x = v;
+        if (r->delta)
+        {
+            cond = present && r->have_prev;
+            x = (int64_t)v - r->prev;
+            if (x < 0) x = -x;
+            r->prev = v;
+            r->have_prev = present;
+        }
+        if (!cond || !rule_compare(x, r))
+        {
+            r->since_us = 0;
+            r->fired = false;
+            continue;
+        }
+        // a wall-clock start is only usable while the clock is valid
+        if (r->since_us != 0 && r->since_wall && !wall) r->since_us = 0;
+        if (r->since_us == 0)
+        {
+            r->since_wall = wall != 0;
+            r->since_us = wall ? wall : (now > 0 ? now : 1);
+        }
+        if (!r->fired && (r->since_wall ? wall : now) - r->since_us >= (int64_t)r->hold_ms * 1000)
+        {
+            r->fired = true;
+            fired[nfired].action = r->action;
+            fired[nfired].arg = r->arg;
+            fired[nfired].value = v;
+            memcpy(fired[nfired].text, r->text, sizeof(r->text));
+            nfired++;
+        }
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    for (int i = 0; i < nfired; ++i)
+    {
+        ESP_LOGI(TAG, "rule fired: %s (value %ld)", fired[i].text, (long)fired[i].value);
+        if (s_cb) s_cb((rule_action_t)fired[i].action, fired[i].arg, fired[i].text, fired[i].value, s_cb_ctx);
+    }
+}
+
+bool rules_engine_init(const char *const *channels, uint8_t count, rules_action_cb_t cb, void *user_ctx)
+{
+    if (!channels || count == 0 || count > RULES_MAX_CHANNELS) return false;
+    s_channels = channels;
+    s_channel_count = count;
+    s_cb = cb;
+    s_cb_ctx = user_ctx;
+
+    if (s_table.magic != RULES_RTC_MAGIC || esp_reset_reason() != ESP_RST_DEEPSLEEP)
+    {
+        memset(&s_table, 0, sizeof(s_table));
+        s_table.magic = RULES_RTC_MAGIC;
+    }
+    else
+    {
+        // the uptime clock restarted: holds timed on it start over, wall-clock
+        // holds keep running, fired rules stay quiet
+        for (int i = 0; i < s_table.count; ++i)
+            if (!s_table.rules[i].since_wall) s_table.rules[i].since_us = 0;
+        ESP_LOGI(TAG, "%u rules restored after deep sleep", (unsigned)s_table.count);
+    }
+    return mqtt_register_attribute_handler("rules", rules_attribute_handler, NULL);
+}
@@ -23,14 +23,26 @@ bool telegram_init_from_file(const char *token_file_path);
 void telegram_start(void);
 
 /**
- * Register a message handler called for each incoming update.
+ * Register a message handler called for each incoming update that is not a
+ * built-in command (plain text and unknown '/' commands).
  * Handler signature: (chat_id, text, user_ctx)
  */
 void telegram_register_message_handler(void (*handler)(int64_t, const char *, void *), void *user_ctx);
 
-/** Blocking send of a text message to `chat_id`. Returns true on success. */
+/**
+ * Blocking send of a text message to `chat_id`. Returns true on success.
+ * Sends are paced by the egress governor (EGRESS_CLASS_TELEGRAM); a message
+ * that finds no budget within TELEGRAM_EGRESS_WAIT_MS is dropped.
+ */
 bool telegram_send_message(int64_t chat_id, const char *text);
 
+/**
+ * Queue `text` for the admin chat (tele.txt line 2) and return at once; a
+ * background task sends it. Returns false when no admin chat is
+ * configured or the queue is full. Texts are truncated to 159 bytes.
+ */
+bool telegram_notify_admin(const char *text);
+
 #ifdef __cplusplus
 }
 #endif
@@ -12,15 +12,20 @@
 #include "esp_sntp.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
 /* Deepsleep manager API (persisted sleep interval/idle timeout) */
 #include "deepsleep_manager.h"
+#include "egress_governor.h"
+#include "config_store.h"
+#include "boot_config.h"
 
 /*
  * telegram_manager
  * ----------------
  * Small, self-contained Telegram long-poll client used in this project.
  * Responsibilities:
- *  - Load bot token and persisted last_update_id from `tele.txt` (third line)
+ *  - Load the bot token from `tele.txt` and the persisted last_update_id
+ *    from the config store
  *  - Perform a network/TLS preflight (SNTP, getMe) and a short initial
  *    getUpdates sync to advance the cursor without replying to historical
  *    messages.
@@ -36,21 +41,15 @@
  *    allows shipping CA bundles via the filesystem.
  */
 
-/* Filesystem root used for runtime CA PEM discovery. Duplicate of the
- * definition in main.c; keeping here makes this TU self-contained. */
+/* Filesystem root, for log messages. Duplicate of the definition in
+ * main.c; keeping here makes this TU self-contained. */
 #ifndef FILESYSTEM_ROOT
 #define FILESYSTEM_ROOT "/filesystem"
 #endif
 
-/* PEM candidate paths (attempted in order). */
-#ifndef PEM_CANDIDATE1
-#define PEM_CANDIDATE1 FILESYSTEM_ROOT "/ca_root.pem"
-#endif
-#ifndef PEM_CANDIDATE2
-#define PEM_CANDIDATE2 FILESYSTEM_ROOT "/ca-root.pem"
-#endif
-#ifndef PEM_CANDIDATE3
-#define PEM_CANDIDATE3 FILESYSTEM_ROOT "/cacert.pem"
+/* How long a reply may wait for Telegram egress budget before it is dropped. */
+#ifndef TELEGRAM_EGRESS_WAIT_MS
+#define TELEGRAM_EGRESS_WAIT_MS 10000
 #endif
 
 /* Local logging tag for this component */
@@ -58,8 +57,15 @@ static const char *TAG = "telegram";
 
 /* Persistence and state variables used by the module */
 static char bot_token[256] = "";
-static char tele_file_path[512] = ""; /* path to tele.txt for persistence */
 static int64_t last_update_id = 0;
+static int64_t admin_chat_id = 0; /* from tele.txt line 2, 0 = none */
+
+/* Admin notifications waiting for the notify task. */
+#ifndef TELEGRAM_NOTIFY_QUEUE_LEN
+#define TELEGRAM_NOTIFY_QUEUE_LEN 4
+#endif
+#define TELEGRAM_NOTIFY_MAX_TEXT 160
+static QueueHandle_t notify_queue = NULL;
 
 /* Optional message handler registered by the application */
 static void (*msg_handler)(int64_t, const char *, void *) = NULL;
@@ -91,42 +97,33 @@ static void dns_connect_test(const char *host, const char *port)
 
 bool telegram_init_from_file(const char *token_file_path)
 {
-    FILE *f = fopen(token_file_path, "r");
-    if (!f) return false;
-    if (fgets(bot_token, sizeof(bot_token), f) == NULL)
-    {
-        fclose(f);
-        return false;
-    }
-    // Try to read an optional third line that contains the persisted last_update_id
+    const char *text = boot_config_get(token_file_path, NULL);
+    if (!text || !boot_config_next_line(&text, bot_token, sizeof(bot_token))) return false;
     // token file layout (lines):
     // 1: bot token
     // 2: (optional) admin chat id or comment
-    // 3: (optional) persisted last_update_id
-    // Copy the token file path for future writes
-    strncpy(tele_file_path, token_file_path, sizeof(tele_file_path) - 1);
+    // 3: (optional) last_update_id, only read by older firmware; imported once
     // consume second line if present
     char buf[128];
-    if (fgets(buf, sizeof(buf), f) != NULL) {
-        // second line present; attempt to read third line
-        if (fgets(buf, sizeof(buf), f) != NULL) {
-            // trim newline and parse as int64
-            buf[strcspn(buf, "\r\n")] = '\0';
-            if (buf[0] != '\0') {
-                int64_t persisted = 0;
-                // use sscanf to allow large numbers
-                if (sscanf(buf, "%lld", (long long *)&persisted) == 1) {
-                    last_update_id = persisted;
-                    ESP_LOGI(TAG, "Loaded persisted last_update_id=%lld from %s", (long long)last_update_id, token_file_path);
-                } else {
-                    ESP_LOGI(TAG, "No valid persisted last_update_id in %s (third line)", token_file_path);
-                }
+    if (boot_config_next_line(&text, buf, sizeof(buf))) {
+        // second line present: a numeric chat id receives admin notifications
+        long long chat = 0;
+        if (sscanf(buf, "%lld", &chat) == 1 && chat != 0) {
+            admin_chat_id = chat;
+            ESP_LOGI(TAG, "Admin chat id %lld loaded from %s", chat, token_file_path);
+        }
+        // attempt to read third line (cursor written by older firmware)
+        if (boot_config_next_line(&text, buf, sizeof(buf)) && !config_store_has(CONFIG_TELEGRAM_LAST_UPDATE)) {
+            long long persisted = 0;
+            if (buf[0] != '\0' && sscanf(buf, "%lld", &persisted) == 1) {
+                config_store_set_i64(CONFIG_TELEGRAM_LAST_UPDATE, persisted);
+                config_store_commit();
+                ESP_LOGI(TAG, "Imported last_update_id=%lld from %s", persisted, token_file_path);
             }
         }
     }
-    fclose(f);
-    // remove trailing newline
-    bot_token[strcspn(bot_token, "\r\n")] = '\0';
+    last_update_id = config_store_get_i64(CONFIG_TELEGRAM_LAST_UPDATE);
+    if (last_update_id) ESP_LOGI(TAG, "Loaded persisted last_update_id=%lld", (long long)last_update_id);
     ESP_LOGI(TAG, "Telegram token loaded (len=%d)", (int)strlen(bot_token));
     return true;
 }
@@ -166,30 +163,8 @@ static bool http_get(const char *url, char **out, int *out_len)
         }
     }
 
-    /* Load CA PEM from the mounted data partition. We try a few
-     * candidate filenames and use the first one found. The returned buffer
-     * is malloc'd and must be freed after esp_http_client_cleanup(). */
-    static const char *pem_candidates[] = { PEM_CANDIDATE1, PEM_CANDIDATE2, PEM_CANDIDATE3, NULL };
-    char *pem_buf = NULL;
-    size_t pem_len = 0;
-    for (const char **pp = pem_candidates; *pp; ++pp) {
-        FILE *f = fopen(*pp, "rb");
-        if (!f) continue;
-        fseek(f, 0, SEEK_END);
-        long s = ftell(f);
-        fseek(f, 0, SEEK_SET);
-        if (s <= 0) { fclose(f); continue; }
-        pem_buf = malloc((size_t)s + 1);
-        if (!pem_buf) { fclose(f); break; }
-        size_t r = fread(pem_buf, 1, (size_t)s, f);
-        pem_buf[r] = '\0';
-        fclose(f);
-        pem_len = r;
-        ESP_LOGI(TAG, "Loaded CA PEM from %s (bytes=%d)", *pp, (int)pem_len);
-        /* NOTE: runtime x509 parsing removed per user request. We simply
-         * load the PEM and hand it to esp_http_client via config.cert_pem. */
-        break;
-    }
+    /* CA PEM as read from the data partition at boot; shared, never freed. */
+    const char *pem_buf = boot_config_ca_pem(NULL);
     if (!pem_buf) {
         ESP_LOGE(TAG, "No CA PEM found under %s; cannot perform TLS requests", FILESYSTEM_ROOT);
         return false;
@@ -208,7 +183,6 @@ static bool http_get(const char *url, char **out, int *out_len)
     if (err != ESP_OK) {
         ESP_LOGW(TAG, "http_get open failed for %s: %s", url, esp_err_to_name(err));
         esp_http_client_cleanup(client);
-        free(pem_buf);
         return false;
     }
 
@@ -271,7 +245,6 @@ static bool http_get(const char *url, char **out, int *out_len)
     if (out_len) *out_len = (int)total;
     esp_http_client_close(client);
     esp_http_client_cleanup(client);
-    free(pem_buf);
     return true;
 }
 
@@ -404,38 +377,12 @@ static void process_updates(char **update_positions, int update_count, bool igno
     }
 }
 
-// Persist the highest processed update id into the third line of tele.txt (atomic tmp+rename).
-static bool persist_last_update_id(int64_t new_last_update_id)
+// Persist the highest processed update id in the config store. The write
+// is coalesced with later polls; deep sleep and restarts flush it.
+static void persist_last_update_id(int64_t new_last_update_id)
 {
-    if (tele_file_path[0] == '\0') return false;
-    FILE *fr = fopen(tele_file_path, "r");
-    char first[256] = ""; char second[256] = "";
-    if (fr) {
-        if (fgets(first, sizeof(first), fr) == NULL) first[0] = '\0';
-        if (fgets(second, sizeof(second), fr) == NULL) second[0] = '\0';
-        fclose(fr);
-    }
-
-    /* Direct write to tele_file_path (user requested no .tmp usage). This
-     * overwrites the file with up-to-date first/second lines and the new
-     * persisted id on the third line. This is not atomic but avoids issues
-     * with creating temporary files on some filesystems. */
-    FILE *fw = fopen(tele_file_path, "w");
-    if (!fw) {
-        ESP_LOGW(TAG, "Failed to open %s for writing persisted last_update_id (errno=%d %s)", tele_file_path, errno, strerror(errno));
-        return false;
-    }
-    // ensure first line ends with newline
-    if (first[0] != '\0' && first[strlen(first)-1] != '\n') fprintf(fw, "%s\n", first);
-    else if (first[0] != '\0') fprintf(fw, "%s", first);
-    // second line
-    if (second[0] != '\0' && second[strlen(second)-1] != '\n') fprintf(fw, "%s\n", second);
-    else if (second[0] != '\0') fprintf(fw, "%s", second);
-    // write third line as the persisted id
-    fprintf(fw, "%lld\n", (long long)new_last_update_id);
-    fclose(fw);
-    ESP_LOGI(TAG, "Persisted last_update_id=%lld to %s (direct write)", (long long)new_last_update_id, tele_file_path);
-    return true;
+    config_store_set_i64(CONFIG_TELEGRAM_LAST_UPDATE, new_last_update_id);
+    config_store_commit_later();
 }
 
 // Centralized handler for incoming text messages (keeps telegram_task concise)
@@ -467,7 +414,7 @@ static void handle_incoming_message(int64_t chat_id, const char *text)
             char rsp[128]; snprintf(rsp, sizeof(rsp), "deepsleep interval set to %llu ms", (unsigned long long)val);
             telegram_send_message(chat_id, rsp);
         } else {
-            telegram_send_message(chat_id, "Failed to persist deepsleep interval.");
+            telegram_send_message(chat_id, "deepsleep interval set, but saving it failed; retrying in the background.");
         }
         return;
     }
@@ -488,7 +435,7 @@ static void handle_incoming_message(int64_t chat_id, const char *text)
             char rsp[128]; snprintf(rsp, sizeof(rsp), "idle timeout set to %llu ms", (unsigned long long)val);
             telegram_send_message(chat_id, rsp);
         } else {
-            telegram_send_message(chat_id, "Failed to persist idle timeout.");
+            telegram_send_message(chat_id, "idle timeout set, but saving it failed; retrying in the background.");
         }
         return;
     }
@@ -499,7 +446,7 @@ static void handle_incoming_message(int64_t chat_id, const char *text)
         const char *arg = text + cmdlen; while (*arg == ' ') arg++;
         if (strncasecmp(arg, "off", 3) == 0) {
             if (deepsleep_manager_set_enabled(false)) telegram_send_message(chat_id, "deepsleep disabled");
-            else telegram_send_message(chat_id, "Failed to disable deepsleep.");
+            else telegram_send_message(chat_id, "deepsleep disabled, but saving it failed; retrying in the background.");
             return;
         } else if (strncasecmp(arg, "on", 2) == 0) {
             uint64_t ms = deepsleep_manager_get_interval_ms();
@@ -510,7 +457,7 @@ static void handle_incoming_message(int64_t chat_id, const char *text)
                     char rsp2[128]; snprintf(rsp2, sizeof(rsp2), "deepsleep enabled (interval: %llu ms)", (unsigned long long)ms);
                     telegram_send_message(chat_id, rsp2);
                 } else {
-                    telegram_send_message(chat_id, "Failed to enable deepsleep.");
+                    telegram_send_message(chat_id, "deepsleep enabled, but saving it failed; retrying in the background.");
                 }
             }
             return;
@@ -560,8 +507,9 @@ static void handle_incoming_message(int64_t chat_id, const char *text)
         return;
     }
 
-    // Unknown command
-    telegram_send_message(chat_id, "Unknown command");
+    // Not a built-in command: the application may know it
+    if (msg_handler) msg_handler(chat_id, text, msg_ctx);
+    else telegram_send_message(chat_id, "Unknown command");
 }
 
 static void telegram_task(void *arg)
@@ -696,9 +644,7 @@ static void telegram_task(void *arg)
         // After processing all returned updates, persist the highest update_id
         if (max_processed_uid > last_update_id) {
             last_update_id = max_processed_uid;
-            if (!persist_last_update_id(last_update_id)) {
-                ESP_LOGW(TAG, "persist_last_update_id failed for %lld", (long long)last_update_id);
-            }
+            persist_last_update_id(last_update_id);
         }
 
         if (resp) { free(resp); resp = NULL; }
@@ -835,6 +781,40 @@ void telegram_start(void)
     xTaskCreate(telegram_task, "telegram_task", 6 * 1024, NULL, tskIDLE_PRIORITY + 1, NULL);
 }
 
+// Sends queued admin notifications so callers never wait on the network.
+static void telegram_notify_task(void *arg)
+{
+    (void)arg;
+    char text[TELEGRAM_NOTIFY_MAX_TEXT];
+    for (;;) {
+        if (xQueueReceive(notify_queue, text, portMAX_DELAY) == pdTRUE) {
+            telegram_send_message(admin_chat_id, text);
+        }
+    }
+}
+
+bool telegram_notify_admin(const char *text)
+{
+    if (!text || admin_chat_id == 0 || bot_token[0] == '\0') return false;
+    if (!notify_queue) {
+        // first use: the queue and its sender task are created lazily
+        notify_queue = xQueueCreate(TELEGRAM_NOTIFY_QUEUE_LEN, TELEGRAM_NOTIFY_MAX_TEXT);
+        if (!notify_queue) return false;
+        if (xTaskCreate(telegram_notify_task, "tg_notify", 6 * 1024, NULL, tskIDLE_PRIORITY + 1, NULL) != pdPASS) {
+            vQueueDelete(notify_queue);
+            notify_queue = NULL;
+            return false;
+        }
+    }
+    char msg[TELEGRAM_NOTIFY_MAX_TEXT];
+    snprintf(msg, sizeof(msg), "%s", text);
+    if (xQueueSend(notify_queue, msg, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "notify queue full; dropping admin notification");
+        return false;
+    }
+    return true;
+}
+
 bool telegram_send_message(int64_t chat_id, const char *text)
 {
     char *url = NULL;
@@ -870,6 +850,14 @@ bool telegram_send_message(int64_t chat_id, const char *text)
     url = malloc((size_t)need);
     if (!url) { free(encoded); return false; }
     snprintf(url, need, fmt, bot_token, (long long)chat_id, encoded);
+    // share the link fairly: bursts of replies (command storms) are paced
+    // by the egress governor instead of going out back to back
+    if (!egress_consume_wait(EGRESS_CLASS_TELEGRAM, (size_t)need, TELEGRAM_EGRESS_WAIT_MS)) {
+        ESP_LOGW(TAG, "dropping message to chat=%lld: Telegram egress budget exhausted", (long long)chat_id);
+        free(url);
+        free(encoded);
+        return false;
+    }
     char *tmp = NULL; int tl = 0;
     bool ok = http_get(url, &tmp, &tl);
     if (!ok) {
@@ -0,0 +1,124 @@
+/*
+ * telemetry.h
+ *
+ * Telemetry records with a persistent sequence number. Every record sent to
+ * ThingsBoard carries a "seq" value that increases by one per record across
+ * reboots and deep sleep, so missing ranges can be found on the server
+ * (see tools/seq_gap_check.py).
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Restore the sequence counter. After a deep-sleep wake it continues from
+ * RTC memory; after any other reset it resumes from the NVS checkpoint.
+ * Call once after nvs_flash_init().
+ */
+bool telemetry_init(void);
+
+/** Reserve and return the next sequence number. */
+uint32_t telemetry_next_seq(void);
+
+/** The sequence number handed out most recently (the last record's seq). */
+uint32_t telemetry_last_seq(void);
+
+/**
+ * Format a ThingsBoard telemetry record
+ * {"ts":<ms>,"values":{<values>,"seq":<seq>}} into `buf`. `values_json` is a
+ * JSON object. `ts_ms` == 0 omits the timestamp (server time is used).
+ * Returns the length written, or -1 if the record does not fit.
+ */
+int telemetry_format_record(char *buf, size_t len, uint32_t seq, int64_t ts_ms, const char *values_json);
+
+/**
+ * Stamp `values_json` with the next sequence number and the current time
+ * (when the clock has been set) and queue it for MQTT. Replaying a
+ * formatted record is idempotent: ThingsBoard stores one value per key and
+ * timestamp.
+ */
+bool telemetry_publish(const char *values_json);
+
+/**
+ * Like telemetry_publish(), for records that must reach the server within
+ * a second (threshold breaches). The record takes the next sequence number
+ * as usual, but it is sent ahead of bulk telemetry: at QoS 1 on the MQTT
+ * alert lane, or by sending the pending CoAP/HTTP batch immediately.
+ */
+bool telemetry_publish_urgent(const char *values_json);
+
+/**
+ * Queue a record already formatted by telemetry_format_record(), e.g. one
+ * kept across deep sleep, on the active transport; its seq and timestamp
+ * are kept. Returns false if the transport had no room for it.
+ */
+bool telemetry_publish_record(const char *record);
+
+typedef enum {
+    TELEMETRY_LANE_BULK = 0,
+    TELEMETRY_LANE_URGENT,
+    TELEMETRY_LANE_COUNT
+} telemetry_lane_t;
+
+/** Delivery latency of one lane, from submit to acknowledgement. */
+typedef struct {
+    uint32_t delivered;
+    uint32_t last_ms;
+    uint32_t avg_ms;
+    uint32_t max_ms;
+} telemetry_lane_stats_t;
+
+/**
+ * Latency of the CoAP/HTTP batches per lane. Over MQTT the same split is
+ * reported per publish-queue lane (mqtt_lane_lat_ms in the stats message).
+ */
+void telemetry_get_lane_stats(telemetry_lane_t lane, telemetry_lane_stats_t *out);
+
+/**
+ * Enable the HTTP fallback: while MQTT is down, records are batched and
+ * POSTed to <base_url>/api/v1/<access_token>/telemetry instead
+ * (e.g. base_url "https://demo.thingsboard.io").
+ */
+bool telemetry_http_init(const char *base_url, const char *access_token);
+
+/**
+ * Send telemetry over the ThingsBoard CoAP API instead of MQTT. `host` is
+ * "name[:port]" (default port 5683). Records are batched into one UDP
+ * datagram; `confirmable` requests an ACK (with retransmission) for each
+ * batch. MQTT, where it is started, keeps serving attributes, RPC and OTA.
+ */
+bool telemetry_coap_init(const char *host, const char *access_token, bool confirmable);
+
+/**
+ * Enable the compact binary stream (see telemetry_binary.c for the format):
+ * samples of `channels` integer values are packed into blocks and each
+ * block is published to `topic`. Independent of the ThingsBoard records.
+ */
+bool telemetry_binary_init(const char *topic, uint8_t channels);
+
+/**
+ * Add one sample timestamped now. Bit i of `present_mask` marks values[i]
+ * as valid; absent channels cost nothing after the mask.
+ */
+bool telemetry_binary_append(const int32_t *values, uint32_t present_mask);
+
+/**
+ * Wait up to `timeout_ms` until pending telemetry has left the device on
+ * the active transport (CoAP batch acknowledged, or MQTT queue drained).
+ * Call before deep sleep.
+ */
+bool telemetry_flush(uint32_t timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TELEMETRY_H
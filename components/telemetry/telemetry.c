@@ -0,0 +1,223 @@
+/*
+ * telemetry.c
+ *
+ * Boot-spanning telemetry sequence numbers. The live counter sits in RTC
+ * memory so deep-sleep cycles cost no flash writes. NVS only holds a
+ * checkpoint that is always ahead of the counter: whenever the counter
+ * reaches it, the next TELEMETRY_SEQ_STRIDE numbers are reserved with one
+ * NVS write. After a power loss or crash the counter restarts at the
+ * checkpoint, so numbers are never reused; the skipped tail of the last
+ * reserved block shows up as a gap ending on a multiple of the stride,
+ * which the gap checker reports as a reboot rather than lost data.
+ */
+#include "telemetry.h"
+#include "telemetry_internal.h"
+#include "mqtt.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "nvs.h"
+
+static const char *TAG = "telemetry";
+
+/* Sequence numbers reserved per NVS checkpoint write. */
+#ifndef TELEMETRY_SEQ_STRIDE
+#define TELEMETRY_SEQ_STRIDE 64
+#endif
+
+/* Largest formatted record (values plus envelope). */
+#ifndef TELEMETRY_MAX_RECORD
+#define TELEMETRY_MAX_RECORD 384
+#endif
+
+#define TELEMETRY_NVS_NAMESPACE "telemetry"
+#define TELEMETRY_NVS_KEY_CKPT "seq_ckpt"
+#define TELEMETRY_RTC_MAGIC 0x53455131u /* "SEQ1" */
+
+/* Any wall-clock time before this means SNTP has not run yet. */
+#define TELEMETRY_MIN_VALID_TIME 1600000000
+
+typedef struct {
+    uint32_t magic;
+    uint32_t next;       /* next sequence number to hand out */
+    uint32_t reserved;   /* checkpoint stored in NVS (exclusive upper bound) */
+} telemetry_seq_state_t;
+
+static RTC_DATA_ATTR telemetry_seq_state_t s_seq;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static telemetry_lane_stats_t s_lane_stats[TELEMETRY_LANE_COUNT];
+static uint64_t s_lane_latency_sum_ms[TELEMETRY_LANE_COUNT];
+
+static bool telemetry_store_checkpoint(uint32_t value)
+{
+    nvs_handle_t nh;
+    esp_err_t err = nvs_open(TELEMETRY_NVS_NAMESPACE, NVS_READWRITE, &nh);
+    if (err == ESP_OK)
+    {
+        err = nvs_set_u32(nh, TELEMETRY_NVS_KEY_CKPT, value);
+        if (err == ESP_OK) err = nvs_commit(nh);
+        nvs_close(nh);
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "failed to store seq checkpoint %lu: %s", (unsigned long)value, esp_err_to_name(err));
+        return false;
+    }
+    return true;
+}
+
+bool telemetry_init(void)
+{
+    if (s_seq.magic == TELEMETRY_RTC_MAGIC && esp_reset_reason() == ESP_RST_DEEPSLEEP)
+    {
+        ESP_LOGI(TAG, "seq continues at %lu after deep sleep", (unsigned long)s_seq.next);
+        return true;
+    }
+
+    uint32_t ckpt = 0;
+    nvs_handle_t nh;
+    if (nvs_open(TELEMETRY_NVS_NAMESPACE, NVS_READONLY, &nh) == ESP_OK)
+    {
+        nvs_get_u32(nh, TELEMETRY_NVS_KEY_CKPT, &ckpt);
+        nvs_close(nh);
+    }
+    s_seq.magic = TELEMETRY_RTC_MAGIC;
+    s_seq.next = ckpt;
+    s_seq.reserved = ckpt + TELEMETRY_SEQ_STRIDE;
+    ESP_LOGI(TAG, "seq starts at %lu (checkpoint)", (unsigned long)ckpt);
+    return telemetry_store_checkpoint(s_seq.reserved);
+}
+
+uint32_t telemetry_next_seq(void)
+{
+    bool extend = false;
+    uint32_t seq, reserved = 0;
+    portENTER_CRITICAL(&s_lock);
+    seq = s_seq.next++;
+    if (s_seq.next >= s_seq.reserved)
+    {
+        s_seq.reserved += TELEMETRY_SEQ_STRIDE;
+        reserved = s_seq.reserved;
+        extend = true;
+    }
+    portEXIT_CRITICAL(&s_lock);
+    // a failed write only widens the gap after the next power loss
+    if (extend) telemetry_store_checkpoint(reserved);
+    return seq;
+}
+
+uint32_t telemetry_last_seq(void)
+{
+    portENTER_CRITICAL(&s_lock);
+    uint32_t seq = s_seq.next - 1;
+    portEXIT_CRITICAL(&s_lock);
+    return seq;
+}
+
+int telemetry_format_record(char *buf, size_t len, uint32_t seq, int64_t ts_ms, const char *values_json)
+{
+    if (!buf || !values_json) return -1;
+    // splice "seq" in front of the closing brace of the values object
+    const char *open = strchr(values_json, '{');
+    const char *close = strrchr(values_json, '}');
+    if (!open || !close || close < open) return -1;
+    const char *body = open + 1;
+    int body_len = (int)(close - body);
+    bool empty = strspn(body, " \t\r\n") >= (size_t)body_len;
+
+    int n;
+    if (ts_ms > 0)
+        n = snprintf(buf, len, "{\"ts\":%lld,\"values\":{%.*s%s\"seq\":%lu}}", (long long)ts_ms, body_len, body,
+                     empty ? "" : ",", (unsigned long)seq);
+    else
+        n = snprintf(buf, len, "{%.*s%s\"seq\":%lu}", body_len, body, empty ? "" : ",", (unsigned long)seq);
+    return (n > 0 && (size_t)n < len) ? n : -1;
+}
+
+// Hand a formatted record to the active transport.
+static bool telemetry_route(const char *record, bool urgent)
+{
+    if (telemetry_coap_active()) return telemetry_coap_enqueue(record, strlen(record), urgent);
+    if (telemetry_http_active()) return telemetry_http_enqueue(record, strlen(record), urgent);
+    if (urgent) mqtt_publish_alert(record);
+    else mqtt_publish_telemetry(record);
+    return true;
+}
+
+// Stamp, then hand the record to the active transport. Urgent records go
+// out at once: the batching sinks send their pending batch immediately and
+// MQTT uses the alert lane. Either way the record keeps its place in the
+// seq-numbered stream.
+static bool telemetry_submit(const char *values_json, bool urgent)
+{
+    int64_t ts_ms = 0;
+    time_t now = time(NULL);
+    if (now >= TELEMETRY_MIN_VALID_TIME)
+    {
+        struct timespec tsp;
+        clock_gettime(CLOCK_REALTIME, &tsp);
+        ts_ms = (int64_t)tsp.tv_sec * 1000 + tsp.tv_nsec / 1000000;
+    }
+
+    char record[TELEMETRY_MAX_RECORD];
+    uint32_t seq = telemetry_next_seq();
+    if (telemetry_format_record(record, sizeof(record), seq, ts_ms, values_json) < 0)
+    {
+        // the number is consumed anyway; the server sees an honest gap
+        ESP_LOGE(TAG, "record %lu does not fit %d bytes", (unsigned long)seq, TELEMETRY_MAX_RECORD);
+        return false;
+    }
+    return telemetry_route(record, urgent);
+}
+
+bool telemetry_publish(const char *values_json)
+{
+    return telemetry_submit(values_json, false);
+}
+
+bool telemetry_publish_urgent(const char *values_json)
+{
+    return telemetry_submit(values_json, true);
+}
+
+bool telemetry_publish_record(const char *record)
+{
+    return record && telemetry_route(record, false);
+}
+
+void telemetry_lane_delivered(telemetry_lane_t lane, uint32_t latency_ms)
+{
+    if (lane < 0 || lane >= TELEMETRY_LANE_COUNT) return;
+    portENTER_CRITICAL(&s_lock);
+    telemetry_lane_stats_t *st = &s_lane_stats[lane];
+    st->delivered++;
+    st->last_ms = latency_ms;
+    if (latency_ms > st->max_ms) st->max_ms = latency_ms;
+    s_lane_latency_sum_ms[lane] += latency_ms;
+    st->avg_ms = (uint32_t)(s_lane_latency_sum_ms[lane] / st->delivered);
+    portEXIT_CRITICAL(&s_lock);
+    if (lane == TELEMETRY_LANE_URGENT)
+        ESP_LOGI(TAG, "urgent record delivered in %lu ms", (unsigned long)latency_ms);
+}
+
+void telemetry_get_lane_stats(telemetry_lane_t lane, telemetry_lane_stats_t *out)
+{
+    if (!out) return;
+    memset(out, 0, sizeof(*out));
+    if (lane < 0 || lane >= TELEMETRY_LANE_COUNT) return;
+    portENTER_CRITICAL(&s_lock);
+    *out = s_lane_stats[lane];
+    portEXIT_CRITICAL(&s_lock);
+}
+
+bool telemetry_flush(uint32_t timeout_ms)
+{
+    telemetry_binary_flush();
+    if (telemetry_coap_active()) return telemetry_coap_flush(timeout_ms);
+    return mqtt_publish_flush(timeout_ms);
+}
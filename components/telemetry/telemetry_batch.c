@@ -0,0 +1,103 @@
+/*
+ * telemetry_batch.c
+ *
+ * JSON-array batch buffer shared by the HTTP and CoAP telemetry sinks.
+ * Producers append formatted records; the sink's flush task copies the
+ * batch out, sends it, and only then removes what it sent, so records
+ * appended during a send are kept and a failed send loses nothing.
+ */
+#include "telemetry_internal.h"
+
+#include <string.h>
+#include "esp_timer.h"
+
+bool telemetry_batch_init(telemetry_batch_t *b, size_t capacity, uint32_t max_records)
+{
+    memset(b, 0, sizeof(*b));
+    b->buf = malloc(capacity);
+    b->lock = xSemaphoreCreateMutex();
+    if (!b->buf || !b->lock) return false;
+    b->capacity = capacity;
+    b->max_records = max_records;
+    return true;
+}
+
+bool telemetry_batch_append(telemetry_batch_t *b, const char *record, size_t len, bool urgent, bool *full)
+{
+    bool ok = false;
+    xSemaphoreTake(b->lock, portMAX_DELAY);
+    // '[' or ',' before the record plus room for the closing ']'
+    if (b->len + 1 + len + 1 <= b->capacity)
+    {
+        b->buf[b->len++] = b->records ? ',' : '[';
+        memcpy(b->buf + b->len, record, len);
+        b->len += len;
+        if (b->records++ == 0) b->first_us = esp_timer_get_time();
+        if (urgent && b->urgent_at == 0)
+        {
+            b->urgent_at = b->records;
+            b->urgent_us = esp_timer_get_time();
+        }
+        ok = true;
+    }
+    *full = b->urgent_at || b->records >= b->max_records || b->len + TELEMETRY_BATCH_HEADROOM > b->capacity;
+    xSemaphoreGive(b->lock);
+    return ok;
+}
+
+uint32_t telemetry_batch_pending(telemetry_batch_t *b, uint32_t *age_ms, bool *full)
+{
+    xSemaphoreTake(b->lock, portMAX_DELAY);
+    uint32_t records = b->records;
+    *age_ms = records ? (uint32_t)((esp_timer_get_time() - b->first_us) / 1000) : 0;
+    *full = b->urgent_at || b->records >= b->max_records || b->len + TELEMETRY_BATCH_HEADROOM > b->capacity;
+    xSemaphoreGive(b->lock);
+    return records;
+}
+
+size_t telemetry_batch_copy(telemetry_batch_t *b, char *out, uint32_t *records)
+{
+    xSemaphoreTake(b->lock, portMAX_DELAY);
+    size_t len = b->len;
+    *records = b->records;
+    memcpy(out, b->buf, len);
+    xSemaphoreGive(b->lock);
+    if (*records == 0) return 0;
+    out[len++] = ']';
+    return len;
+}
+
+void telemetry_batch_consume(telemetry_batch_t *b, size_t sent_len, uint32_t records)
+{
+    int64_t now = esp_timer_get_time();
+    xSemaphoreTake(b->lock, portMAX_DELAY);
+    uint32_t bulk_ms = (uint32_t)((now - b->first_us) / 1000);
+    uint32_t urgent_ms = UINT32_MAX;
+    if (b->urgent_at)
+    {
+        if (b->urgent_at <= records)
+        {
+            urgent_ms = (uint32_t)((now - b->urgent_us) / 1000);
+            b->urgent_at = 0;
+        }
+        else
+        {
+            b->urgent_at -= records; /* arrived after the copy; still pending */
+        }
+    }
+    size_t body = sent_len - 1; /* without the closing ']' */
+    size_t rest = b->len - body;
+    if (rest > 0)
+    {
+        // records appended meanwhile move to the front
+        memmove(b->buf, b->buf + body, rest);
+        b->buf[0] = '['; /* was the ',' after the sent records */
+        b->first_us = now;
+    }
+    b->len = rest;
+    b->records -= records;
+    xSemaphoreGive(b->lock);
+
+    telemetry_lane_delivered(TELEMETRY_LANE_BULK, bulk_ms);
+    if (urgent_ms != UINT32_MAX) telemetry_lane_delivered(TELEMETRY_LANE_URGENT, urgent_ms);
+}
@@ -0,0 +1,240 @@
+/*
+ * telemetry_binary.c
+ *
+ * Compact binary telemetry stream for backends other than ThingsBoard.
+ * Integer samples (a fixed set of channels per stream) are packed into
+ * blocks in the style of Facebook's Gorilla TSDB: timestamps as
+ * delta-of-delta, channel values as the delta to the channel's previous
+ * value, both zigzag-mapped and written with a short prefix code, so a
+ * regular sampling period costs one bit and a steady channel one bit.
+ * Each block is published as one MQTT message to the configured topic.
+ *
+ * Block layout (multi-byte header fields little-endian):
+ *   0  'G'            magic
+ *   1  1              format version
+ *   2  flags          bit 0: timestamps are Unix ms, else ms since boot
+ *   3  channels       number of channels (1..TELEMETRY_BIN_MAX_CHANNELS)
+ *   4  u32 block      block number, continues across deep sleep
+ *   8  i64 t0         base timestamp in ms
+ *  16  u16 samples    number of samples in the block
+ *  18  bit stream, MSB first; per sample:
+ *        code(zigzag(dod))                 dod = (t - prev_t) - prev_delta
+ *        '0' | '1' + <channels> bits       presence mask unchanged / new mask
+ *        code(zigzag(v - prev_v))          for each present channel
+ *      with prev_t = t0, prev_delta = 0, prev_v = 0 and an empty mask before
+ *      the first sample. The prefix code is
+ *        '0'               0
+ *        '10'   + 6 bits   < 2^6
+ *        '110'  + 13 bits  < 2^13
+ *        '1110' + 20 bits  < 2^20
+ *        '1111' + 40 bits  otherwise
+ *
+ * tools/telemetry_bin_decode.py decodes blocks on the host.
+ */
+#include "telemetry.h"
+#include "mqtt.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+static const char *TAG = "telemetry_bin";
+
+/* Largest block; one MQTT message. */
+#ifndef TELEMETRY_BIN_MAX_BYTES
+#define TELEMETRY_BIN_MAX_BYTES 512
+#endif
+#ifndef TELEMETRY_BIN_MAX_SAMPLES
+#define TELEMETRY_BIN_MAX_SAMPLES 64
+#endif
+/* Publish a partial block once its first sample is this old. */
+#ifndef TELEMETRY_BIN_FLUSH_MS
+#define TELEMETRY_BIN_FLUSH_MS 60000
+#endif
+
+#define TELEMETRY_BIN_MAX_CHANNELS 8
+#define TELEMETRY_BIN_MAGIC 'G'
+#define TELEMETRY_BIN_VERSION 1
+#define TELEMETRY_BIN_FLAG_WALLCLOCK 0x01
+#define TELEMETRY_BIN_HEADER_LEN 18
+/* Worst-case bits for one sample: timestamp, new mask, every channel at 44 bits. */
+#define TELEMETRY_BIN_SAMPLE_MAX_BITS(n) (44 + 1 + (n) + (n) * 44)
+
+/* Any wall-clock time before this means SNTP has not run yet. */
+#define TELEMETRY_BIN_MIN_VALID_TIME 1600000000
+
+typedef struct {
+    uint8_t buf[TELEMETRY_BIN_MAX_BYTES];
+    size_t bits;            /* bits written, header included */
+    uint16_t samples;
+    uint8_t channels;
+    uint8_t flags;
+    int64_t t0;
+    int64_t prev_t;
+    int64_t prev_delta;
+    uint32_t prev_mask;
+    int32_t prev_v[TELEMETRY_BIN_MAX_CHANNELS];
+    int64_t started_us;     /* uptime of the first sample */
+} telemetry_bin_block_t;
+
+static RTC_DATA_ATTR uint32_t s_block_no;
+static telemetry_bin_block_t s_block;
+static SemaphoreHandle_t s_lock = NULL;
+static char s_topic[64];
+
+static void bin_put_bits(telemetry_bin_block_t *b, uint64_t value, unsigned count)
+{
+    while (count--)
+    {
+        size_t byte = b->bits >> 3;
+        uint8_t mask = (uint8_t)(0x80 >> (b->bits & 7));
+        if ((value >> count) & 1) b->buf[byte] |= mask;
+        else b->buf[byte] &= (uint8_t)~mask;
+        b->bits++;
+    }
+}
+
+static uint64_t bin_zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static void bin_put_code(telemetry_bin_block_t *b, int64_t value)
+{
+    uint64_t z = bin_zigzag(value);
+    if (z == 0) bin_put_bits(b, 0x0, 1);
+    else if (z < (1u << 6)) { bin_put_bits(b, 0x2, 2); bin_put_bits(b, z, 6); }
+    else if (z < (1u << 13)) { bin_put_bits(b, 0x6, 3); bin_put_bits(b, z, 13); }
+    else if (z < (1u << 20)) { bin_put_bits(b, 0xE, 4); bin_put_bits(b, z, 20); }
+    else { bin_put_bits(b, 0xF, 4); bin_put_bits(b, z, 40); }
+}
+
+static void bin_put_le(uint8_t *p, uint64_t v, int bytes)
+{
+    for (int i = 0; i < bytes; ++i) p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static void bin_block_start(telemetry_bin_block_t *b, uint8_t channels, uint8_t flags, int64_t t0)
+{
+    memset(b, 0, sizeof(*b));
+    b->channels = channels;
+    b->flags = flags;
+    b->t0 = b->prev_t = t0;
+    b->bits = TELEMETRY_BIN_HEADER_LEN * 8;
+    b->started_us = esp_timer_get_time();
+}
+
+static void bin_block_append(telemetry_bin_block_t *b, int64_t t, const int32_t *values, uint32_t mask)
+{
+    int64_t delta = t - b->prev_t;
+    bin_put_code(b, delta - b->prev_delta);
+    b->prev_t = t;
+    b->prev_delta = delta;
+
+    mask &= (1u << b->channels) - 1;
+    if (mask == b->prev_mask) bin_put_bits(b, 0, 1);
+    else
+    {
+        bin_put_bits(b, 1, 1);
+        bin_put_bits(b, mask, b->channels);
+        b->prev_mask = mask;
+    }
+    for (int c = 0; c < b->channels; ++c)
+    {
+        if (!(mask & (1u << c))) continue;
+        bin_put_code(b, (int64_t)values[c] - b->prev_v[c]);
+        b->prev_v[c] = values[c];
+    }
+    b->samples++;
+}
+
+// Fill in the header; returns the block length in bytes.
+static size_t bin_block_finish(telemetry_bin_block_t *b, uint32_t block_no)
+{
+    b->buf[0] = TELEMETRY_BIN_MAGIC;
+    b->buf[1] = TELEMETRY_BIN_VERSION;
+    b->buf[2] = b->flags;
+    b->buf[3] = b->channels;
+    bin_put_le(b->buf + 4, block_no, 4);
+    bin_put_le(b->buf + 8, (uint64_t)b->t0, 8);
+    bin_put_le(b->buf + 16, b->samples, 2);
+    size_t len = (b->bits + 7) / 8;
+    // zero the padding of the last byte
+    if (b->bits & 7) b->buf[len - 1] &= (uint8_t)(0xFF00 >> (b->bits & 7));
+    return len;
+}
+
+// Publish and reset the pending block. Caller holds s_lock.
+static void bin_publish_locked(void)
+{
+    if (s_block.samples == 0) return;
+    size_t len = bin_block_finish(&s_block, s_block_no++);
+    if (!mqtt_publish_raw(s_topic, s_block.buf, len, 1, MQTT_PRIO_TELEMETRY))
+        ESP_LOGW(TAG, "queue full; dropped block of %u samples", (unsigned)s_block.samples);
+    else
+        ESP_LOGI(TAG, "queued block %lu: %u samples in %u bytes", (unsigned long)(s_block_no - 1),
+                 (unsigned)s_block.samples, (unsigned)len);
+    s_block.samples = 0;
+}
+
+static int64_t bin_now_ms(uint8_t *flags)
+{
+    if (time(NULL) >= TELEMETRY_BIN_MIN_VALID_TIME)
+    {
+        struct timespec tsp;
+        clock_gettime(CLOCK_REALTIME, &tsp);
+        *flags = TELEMETRY_BIN_FLAG_WALLCLOCK;
+        return (int64_t)tsp.tv_sec * 1000 + tsp.tv_nsec / 1000000;
+    }
+    *flags = 0;
+    return esp_timer_get_time() / 1000;
+}
+
+bool telemetry_binary_init(const char *topic, uint8_t channels)
+{
+    if (s_lock) return true;
+    if (!topic || !topic[0] || strlen(topic) >= sizeof(s_topic)) return false;
+    if (channels == 0 || channels > TELEMETRY_BIN_MAX_CHANNELS) return false;
+    s_lock = xSemaphoreCreateMutex();
+    if (!s_lock) return false;
+    if (esp_reset_reason() != ESP_RST_DEEPSLEEP) s_block_no = 0;
+    snprintf(s_topic, sizeof(s_topic), "%s", topic);
+    s_block.channels = channels;
+    ESP_LOGI(TAG, "binary telemetry on %s (%u channels)", s_topic, (unsigned)channels);
+    return true;
+}
+
+bool telemetry_binary_append(const int32_t *values, uint32_t present_mask)
+{
+    if (!s_lock || !values) return false;
+    uint8_t flags;
+    int64_t now = bin_now_ms(&flags);
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    uint8_t channels = s_block.channels;
+    // a clock that became valid (or a step backwards) starts a new block
+    if (s_block.samples && (flags != s_block.flags || now < s_block.prev_t)) bin_publish_locked();
+    if (s_block.samples == 0) bin_block_start(&s_block, channels, flags, now);
+    bin_block_append(&s_block, now, values, present_mask);
+
+    bool full = s_block.samples >= TELEMETRY_BIN_MAX_SAMPLES ||
+                s_block.bits + TELEMETRY_BIN_SAMPLE_MAX_BITS(channels) > TELEMETRY_BIN_MAX_BYTES * 8;
+    bool stale = esp_timer_get_time() - s_block.started_us >= (int64_t)TELEMETRY_BIN_FLUSH_MS * 1000;
+    if (full || stale) bin_publish_locked();
+    xSemaphoreGive(s_lock);
+    return true;
+}
+
+void telemetry_binary_flush(void)
+{
+    if (!s_lock) return;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    bin_publish_locked();
+    xSemaphoreGive(s_lock);
+}
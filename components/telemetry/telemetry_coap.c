@@ -0,0 +1,284 @@
+/*
+ * telemetry_coap.c
+ *
+ * Telemetry over the ThingsBoard CoAP device API for battery nodes: a
+ * single UDP datagram per batch, POSTed to
+ * coap://<host>:5683/api/v1/<token>/telemetry, with no TCP/TLS/MQTT
+ * connection to set up after a wake. Once telemetry_coap_init() has been
+ * called, telemetry_publish() routes records here instead of MQTT.
+ *
+ * Only the part of RFC 7252 needed for this is implemented: POST requests
+ * with Uri-Path and Content-Format options, confirmable messages with the
+ * standard exponential retransmission (ACK_TIMEOUT 2 s, MAX_RETRANSMIT 4)
+ * and piggybacked responses, or non-confirmable fire-and-forget messages.
+ * Batches are limited to one datagram (no block-wise transfer).
+ */
+#include "telemetry.h"
+#include "telemetry_internal.h"
+#include "egress_governor.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+
+static const char *TAG = "telemetry_coap";
+
+/* Largest batch payload; keeps each request in one unfragmented datagram. */
+#ifndef TELEMETRY_COAP_MAX_PAYLOAD
+#define TELEMETRY_COAP_MAX_PAYLOAD 1024
+#endif
+#ifndef TELEMETRY_COAP_BATCH_RECORDS
+#define TELEMETRY_COAP_BATCH_RECORDS 8
+#endif
+/* Send a partial batch once its oldest record is this old. */
+#ifndef TELEMETRY_COAP_FLUSH_MS
+#define TELEMETRY_COAP_FLUSH_MS 5000
+#endif
+
+#define COAP_DEFAULT_PORT 5683
+#define COAP_ACK_TIMEOUT_MS 2000
+#define COAP_MAX_RETRANSMIT 4
+
+#define COAP_TYPE_CON 0
+#define COAP_TYPE_NON 1
+#define COAP_TYPE_ACK 2
+#define COAP_TYPE_RST 3
+#define COAP_CODE_POST 0x02
+#define COAP_OPTION_URI_PATH 11
+#define COAP_OPTION_CONTENT_FORMAT 12
+#define COAP_FORMAT_JSON 50
+#define COAP_TOKEN_LEN 4
+/* header + token + options (4 path segments, content format) + marker */
+#define COAP_MAX_OVERHEAD 192
+
+static int s_sock = -1;
+static bool s_confirmable = true;
+static char s_token[128];
+static uint16_t s_msg_id;
+static TaskHandle_t s_task = NULL;
+static volatile bool s_flush_now = false;
+static telemetry_batch_t s_batch;
+static char s_body[TELEMETRY_COAP_MAX_PAYLOAD + 1];
+static uint8_t s_pdu[TELEMETRY_COAP_MAX_PAYLOAD + 1 + COAP_MAX_OVERHEAD];
+
+bool telemetry_coap_active(void)
+{
+    return s_task != NULL;
+}
+
+bool telemetry_coap_enqueue(const char *record, size_t len, bool urgent)
+{
+    bool full = false;
+    bool ok = telemetry_batch_append(&s_batch, record, len, urgent, &full);
+    if (!ok) ESP_LOGW(TAG, "CoAP batch full; dropping record");
+    if (full) xTaskNotifyGive(s_task);
+    return ok;
+}
+
+// Append one option; `*last` is the previous option number (delta encoding).
+static uint8_t *coap_put_option(uint8_t *p, uint16_t *last, uint16_t number, const void *value, size_t len)
+{
+    uint16_t delta = number - *last;
+    *last = number;
+    uint8_t *hdr = p++;
+    uint8_t nibble_d, nibble_l;
+    if (delta < 13) nibble_d = (uint8_t)delta;
+    else { nibble_d = 13; *p++ = (uint8_t)(delta - 13); }
+    if (len < 13) nibble_l = (uint8_t)len;
+    else if (len < 269) { nibble_l = 13; *p++ = (uint8_t)(len - 13); }
+    else { nibble_l = 14; *p++ = (uint8_t)((len - 269) >> 8); *p++ = (uint8_t)(len - 269); }
+    *hdr = (uint8_t)(nibble_d << 4 | nibble_l);
+    memcpy(p, value, len);
+    return p + len;
+}
+
+// Build a POST /api/v1/<token>/telemetry request; returns its length.
+static size_t coap_build_post(uint8_t *pdu, uint16_t msg_id, const uint8_t *tok, const char *payload, size_t payload_len)
+{
+    uint8_t *p = pdu;
+    *p++ = (uint8_t)(1 << 6 | (s_confirmable ? COAP_TYPE_CON : COAP_TYPE_NON) << 4 | COAP_TOKEN_LEN);
+    *p++ = COAP_CODE_POST;
+    *p++ = (uint8_t)(msg_id >> 8);
+    *p++ = (uint8_t)msg_id;
+    memcpy(p, tok, COAP_TOKEN_LEN);
+    p += COAP_TOKEN_LEN;
+
+    uint16_t last = 0;
+    const char *path[] = { "api", "v1", s_token, "telemetry" };
+    for (size_t i = 0; i < sizeof(path) / sizeof(path[0]); ++i)
+        p = coap_put_option(p, &last, COAP_OPTION_URI_PATH, path[i], strlen(path[i]));
+    uint8_t fmt = COAP_FORMAT_JSON;
+    p = coap_put_option(p, &last, COAP_OPTION_CONTENT_FORMAT, &fmt, 1);
+
+    *p++ = 0xFF; /* payload marker */
+    memcpy(p, payload, payload_len);
+    return (size_t)(p - pdu) + payload_len;
+}
+
+// Send one batch. Confirmable requests wait for the ACK, retransmitting
+// with a doubling timeout; any 2.xx response (or an empty ACK announcing a
+// separate response) counts as delivered.
+static bool coap_send_batch(const char *payload, size_t payload_len)
+{
+    uint16_t msg_id = s_msg_id++;
+    uint8_t tok[COAP_TOKEN_LEN];
+    esp_fill_random(tok, sizeof(tok));
+    size_t len = coap_build_post(s_pdu, msg_id, tok, payload, payload_len);
+
+    int64_t t0 = esp_timer_get_time();
+    uint32_t timeout_ms = COAP_ACK_TIMEOUT_MS;
+    for (int attempt = 0; attempt <= COAP_MAX_RETRANSMIT; ++attempt)
+    {
+        if (send(s_sock, s_pdu, len, 0) < 0)
+        {
+            ESP_LOGW(TAG, "send failed: errno %d", errno);
+            return false;
+        }
+        if (!s_confirmable) return true;
+
+        int64_t deadline = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+        for (;;)
+        {
+            int64_t left_us = deadline - esp_timer_get_time();
+            if (left_us <= 0) break;
+            struct timeval tv = { .tv_sec = left_us / 1000000, .tv_usec = left_us % 1000000 };
+            setsockopt(s_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            uint8_t rsp[64];
+            int n = recv(s_sock, rsp, sizeof(rsp), 0);
+            if (n < 4) continue;
+            uint8_t type = (rsp[0] >> 4) & 0x3;
+            uint8_t tkl = rsp[0] & 0x0F;
+            uint16_t rsp_id = (uint16_t)(rsp[2] << 8 | rsp[3]);
+            if (rsp_id != msg_id) continue; /* late ACK of an earlier request */
+            /* A piggybacked response echoes our token (RFC 7252 5.3.2); only
+             * an empty ACK or RST carries none. */
+            bool empty = rsp[1] == 0 && tkl == 0;
+            if (!empty && (tkl != COAP_TOKEN_LEN || n < 4 + tkl || memcmp(rsp + 4, tok, COAP_TOKEN_LEN) != 0))
+            {
+                ESP_LOGW(TAG, "ignoring response %u with a foreign token", (unsigned)rsp_id);
+                continue;
+            }
+            if (type == COAP_TYPE_RST)
+            {
+                ESP_LOGW(TAG, "server reset the request");
+                return false;
+            }
+            if (type != COAP_TYPE_ACK) continue;
+            uint8_t code = rsp[1];
+            if (code != 0 && (code >> 5) != 2)
+            {
+                ESP_LOGW(TAG, "server answered %u.%02u", (unsigned)(code >> 5), (unsigned)(code & 0x1F));
+                return false;
+            }
+            ESP_LOGI(TAG, "batch acknowledged in %lld ms", (long long)((esp_timer_get_time() - t0) / 1000));
+            return true;
+        }
+        timeout_ms *= 2;
+    }
+    ESP_LOGW(TAG, "no ACK after %d retransmissions", COAP_MAX_RETRANSMIT);
+    return false;
+}
+
+static void telemetry_coap_task(void *arg)
+{
+    (void)arg;
+    uint32_t wait_ms = TELEMETRY_COAP_FLUSH_MS;
+    for (;;)
+    {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait_ms));
+        wait_ms = TELEMETRY_COAP_FLUSH_MS;
+        uint32_t age_ms = 0;
+        bool full = false;
+        uint32_t records = telemetry_batch_pending(&s_batch, &age_ms, &full);
+        if (records == 0) continue;
+        if (!full && !s_flush_now && age_ms < TELEMETRY_COAP_FLUSH_MS)
+        {
+            wait_ms = TELEMETRY_COAP_FLUSH_MS - age_ms;
+            continue;
+        }
+        size_t len = telemetry_batch_copy(&s_batch, s_body, &records);
+        if (!egress_consume_wait(EGRESS_CLASS_TELEMETRY, len, TELEMETRY_COAP_FLUSH_MS))
+        {
+            // keep the batch (and any flush request) and try again shortly
+            ESP_LOGW(TAG, "telemetry egress budget exhausted; deferring %lu records", (unsigned long)records);
+            wait_ms = COAP_ACK_TIMEOUT_MS;
+            continue;
+        }
+        s_flush_now = false;
+        if (coap_send_batch(s_body, len))
+            telemetry_batch_consume(&s_batch, len, records);
+        else
+            wait_ms = COAP_ACK_TIMEOUT_MS * 4; /* keep the batch and retry */
+    }
+}
+
+bool telemetry_coap_flush(uint32_t timeout_ms)
+{
+    if (!s_task) return true;
+    int64_t deadline = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+    uint32_t age_ms = 0;
+    bool full = false;
+    while (telemetry_batch_pending(&s_batch, &age_ms, &full) > 0)
+    {
+        if (esp_timer_get_time() >= deadline) return false;
+        // send whatever is pending without waiting for the batch to fill
+        s_flush_now = true;
+        xTaskNotifyGive(s_task);
+        vTaskDelay(pdMS_TO_TICKS(20));
+    }
+    return true;
+}
+
+bool telemetry_coap_init(const char *host, const char *access_token, bool confirmable)
+{
+    if (s_task) return true;
+    if (!host || !access_token || strlen(access_token) >= sizeof(s_token)) return false;
+
+    char name[64];
+    char port_str[6];
+    const char *colon = strrchr(host, ':');
+    size_t n = colon ? (size_t)(colon - host) : strlen(host);
+    if (n == 0 || n >= sizeof(name)) return false;
+    memcpy(name, host, n);
+    name[n] = '\0';
+    if (colon) snprintf(port_str, sizeof(port_str), "%s", colon + 1);
+    else snprintf(port_str, sizeof(port_str), "%d", COAP_DEFAULT_PORT);
+
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_DGRAM };
+    struct addrinfo *res = NULL;
+    if (getaddrinfo(name, port_str, &hints, &res) != 0 || res == NULL)
+    {
+        ESP_LOGE(TAG, "cannot resolve %s", name);
+        return false;
+    }
+    s_sock = socket(res->ai_family, res->ai_socktype, 0);
+    // connect() fixes the peer so send/recv need no address and stray datagrams are filtered
+    bool ok = s_sock >= 0 && connect(s_sock, res->ai_addr, res->ai_addrlen) == 0;
+    freeaddrinfo(res);
+    if (!ok || !telemetry_batch_init(&s_batch, TELEMETRY_COAP_MAX_PAYLOAD, TELEMETRY_COAP_BATCH_RECORDS))
+    {
+        ESP_LOGE(TAG, "failed to set up CoAP socket");
+        if (s_sock >= 0) close(s_sock);
+        s_sock = -1;
+        return false;
+    }
+
+    strcpy(s_token, access_token);
+    s_confirmable = confirmable;
+    s_msg_id = (uint16_t)esp_random();
+    if (xTaskCreate(telemetry_coap_task, "tele_coap", 4 * 1024, NULL, tskIDLE_PRIORITY + 2, &s_task) != pdPASS)
+    {
+        ESP_LOGE(TAG, "failed to create CoAP task");
+        s_task = NULL;
+        return false;
+    }
+    ESP_LOGI(TAG, "telemetry over CoAP to %s:%s (%s)", name, port_str, confirmable ? "confirmable" : "non-confirmable");
+    return true;
+}
@@ -0,0 +1,174 @@
+/*
+ * telemetry_http.c
+ *
+ * Fallback telemetry sink over the ThingsBoard device HTTP API. While MQTT
+ * has been down for TELEMETRY_HTTP_FALLBACK_MS, telemetry_publish() hands
+ * records here instead. They are collected into a JSON array and POSTed
+ * to <base>/api/v1/<token>/telemetry in batches by a flush task. One
+ * esp_http_client handle with keep-alive is reused for every POST, so the
+ * TLS handshake is paid once per outage rather than per batch. A failed
+ * batch is kept and retried; records that arrive while the buffer is full
+ * are dropped (their seq numbers show the gap).
+ */
+#include "telemetry.h"
+#include "telemetry_internal.h"
+#include "mqtt.h"
+#include "egress_governor.h"
+#include "esp_crt_bundle.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_http_client.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+static const char *TAG = "telemetry_http";
+
+/* Switch to HTTP once MQTT has been disconnected this long. */
+#ifndef TELEMETRY_HTTP_FALLBACK_MS
+#define TELEMETRY_HTTP_FALLBACK_MS 60000
+#endif
+
+/* Batch limits: POST when either is reached, or after TELEMETRY_HTTP_FLUSH_MS. */
+#ifndef TELEMETRY_HTTP_BATCH_BYTES
+#define TELEMETRY_HTTP_BATCH_BYTES 4096
+#endif
+#ifndef TELEMETRY_HTTP_BATCH_RECORDS
+#define TELEMETRY_HTTP_BATCH_RECORDS 16
+#endif
+#ifndef TELEMETRY_HTTP_FLUSH_MS
+#define TELEMETRY_HTTP_FLUSH_MS 30000
+#endif
+
+/* Back-off after a failed POST. */
+#ifndef TELEMETRY_HTTP_RETRY_MS
+#define TELEMETRY_HTTP_RETRY_MS 15000
+#endif
+
+#ifndef TELEMETRY_HTTP_TIMEOUT_MS
+#define TELEMETRY_HTTP_TIMEOUT_MS 10000
+#endif
+
+static char *s_url = NULL;
+static esp_http_client_handle_t s_http = NULL;
+static TaskHandle_t s_task = NULL;
+static telemetry_batch_t s_batch;
+/* Copy being POSTed; only touched by the flush task. */
+static char s_body[TELEMETRY_HTTP_BATCH_BYTES + 1];
+
+bool telemetry_http_active(void)
+{
+    return s_task != NULL && mqtt_disconnected_ms() >= TELEMETRY_HTTP_FALLBACK_MS;
+}
+
+bool telemetry_http_enqueue(const char *record, size_t len, bool urgent)
+{
+    bool full = false;
+    bool ok = telemetry_batch_append(&s_batch, record, len, urgent, &full);
+    if (!ok) ESP_LOGW(TAG, "HTTP batch full; dropping record");
+    if (full) xTaskNotifyGive(s_task);
+    return ok;
+}
+
+// POST the pending batch. The batch is only cleared once the server took it.
+static bool telemetry_http_flush(void)
+{
+    uint32_t records = 0;
+    size_t len = telemetry_batch_copy(&s_batch, s_body, &records);
+    if (len == 0) return true;
+
+    if (!egress_consume_wait(EGRESS_CLASS_TELEMETRY, len, TELEMETRY_HTTP_RETRY_MS))
+    {
+        // the batch stays pending; the task retries after TELEMETRY_HTTP_RETRY_MS
+        ESP_LOGW(TAG, "telemetry egress budget exhausted; deferring %lu records", (unsigned long)records);
+        return false;
+    }
+    esp_http_client_set_post_field(s_http, s_body, (int)len);
+    esp_err_t err = esp_http_client_perform(s_http);
+    int status = err == ESP_OK ? esp_http_client_get_status_code(s_http) : 0;
+    if (err != ESP_OK || status != 200)
+    {
+        if (status == 401) ESP_LOGE(TAG, "HTTP telemetry rejected: invalid access token");
+        else ESP_LOGW(TAG, "HTTP telemetry POST failed (%s, status %d); keeping %lu records",
+                      esp_err_to_name(err), status, (unsigned long)records);
+        // drop the connection so the next attempt starts a fresh one
+        esp_http_client_close(s_http);
+        return false;
+    }
+
+    telemetry_batch_consume(&s_batch, len, records);
+    ESP_LOGI(TAG, "posted %lu records (%u bytes) over HTTP", (unsigned long)records, (unsigned)len);
+    return true;
+}
+
+static void telemetry_http_task(void *arg)
+{
+    (void)arg;
+    uint32_t wait_ms = TELEMETRY_HTTP_FLUSH_MS;
+    for (;;)
+    {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait_ms));
+        wait_ms = TELEMETRY_HTTP_FLUSH_MS;
+
+        uint32_t age_ms = 0;
+        bool full = false;
+        uint32_t records = telemetry_batch_pending(&s_batch, &age_ms, &full);
+        bool due = full || age_ms >= TELEMETRY_HTTP_FLUSH_MS;
+
+        // send what is left as soon as MQTT is back, so HTTP can go idle
+        if (records && (due || mqtt_is_connected()))
+        {
+            if (!telemetry_http_flush()) wait_ms = TELEMETRY_HTTP_RETRY_MS;
+        }
+        else if (records == 0 && mqtt_is_connected())
+        {
+            esp_http_client_close(s_http); /* release the idle connection */
+        }
+        else if (records)
+        {
+            wait_ms = TELEMETRY_HTTP_FLUSH_MS - age_ms;
+        }
+    }
+}
+
+bool telemetry_http_init(const char *base_url, const char *access_token)
+{
+    if (s_task) return true;
+    if (!base_url || !access_token || !access_token[0]) return false;
+
+    size_t need = strlen(base_url) + strlen(access_token) + sizeof("/api/v1//telemetry");
+    s_url = malloc(need);
+    if (!s_url) return false;
+    snprintf(s_url, need, "%s/api/v1/%s/telemetry", base_url, access_token);
+
+    esp_http_client_config_t cfg = {
+        .url = s_url,
+        .method = HTTP_METHOD_POST,
+        .timeout_ms = TELEMETRY_HTTP_TIMEOUT_MS,
+        .keep_alive_enable = true,
+    };
+    if (strncmp(base_url, "https://", 8) == 0)
+    {
+        cfg.cert_pem = esp_crt_bundle_get();
+        cfg.use_global_ca_store = cfg.cert_pem == NULL;
+    }
+    s_http = esp_http_client_init(&cfg);
+    if (!s_http || !telemetry_batch_init(&s_batch, TELEMETRY_HTTP_BATCH_BYTES, TELEMETRY_HTTP_BATCH_RECORDS))
+    {
+        ESP_LOGE(TAG, "failed to create HTTP client");
+        return false;
+    }
+    esp_http_client_set_header(s_http, "Content-Type", "application/json");
+
+    if (xTaskCreate(telemetry_http_task, "tele_http", 6 * 1024, NULL, tskIDLE_PRIORITY + 1, &s_task) != pdPASS)
+    {
+        ESP_LOGE(TAG, "failed to create HTTP telemetry task");
+        s_task = NULL;
+        return false;
+    }
+    ESP_LOGI(TAG, "HTTP fallback ready (%s, after %d ms without MQTT)", base_url, TELEMETRY_HTTP_FALLBACK_MS);
+    return true;
+}
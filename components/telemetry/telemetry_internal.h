@@ -0,0 +1,73 @@
+/*
+ * telemetry_internal.h
+ *
+ * Private interfaces shared between the translation units of the telemetry
+ * component. Not part of the public API (see include/telemetry.h).
+ */
+
+#ifndef TELEMETRY_INTERNAL_H
+#define TELEMETRY_INTERNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "telemetry.h"
+
+/* A batch counts as full once less than this many bytes are left. */
+#define TELEMETRY_BATCH_HEADROOM 128
+
+/* Pending records as a JSON array without the closing bracket (telemetry_batch.c). */
+typedef struct {
+    char *buf;
+    size_t capacity;
+    size_t len;
+    uint32_t records;
+    uint32_t max_records;
+    int64_t first_us;      /* when the oldest pending record was added */
+    uint32_t urgent_at;    /* 1-based index of the first pending urgent record, 0 = none */
+    int64_t urgent_us;     /* when that record was added */
+    SemaphoreHandle_t lock;
+} telemetry_batch_t;
+
+bool telemetry_batch_init(telemetry_batch_t *b, size_t capacity, uint32_t max_records);
+/**
+ * Append a record; false when it does not fit. `full` reports whether a
+ * flush is due, which is always the case while an urgent record is pending.
+ */
+bool telemetry_batch_append(telemetry_batch_t *b, const char *record, size_t len, bool urgent, bool *full);
+/** Number of pending records, the age of the oldest and whether a flush is due. */
+uint32_t telemetry_batch_pending(telemetry_batch_t *b, uint32_t *age_ms, bool *full);
+/**
+ * Copy the batch as a complete JSON array into `out` (capacity + 1 bytes).
+ * Returns its length, 0 when empty.
+ */
+size_t telemetry_batch_copy(telemetry_batch_t *b, char *out, uint32_t *records);
+/**
+ * Remove a batch returned by telemetry_batch_copy() once it was delivered,
+ * and account its latency to the bulk and (if it held one) urgent lanes.
+ */
+void telemetry_batch_consume(telemetry_batch_t *b, size_t sent_len, uint32_t records);
+
+/* Lane latency accounting (telemetry.c) */
+void telemetry_lane_delivered(telemetry_lane_t lane, uint32_t latency_ms);
+
+/* HTTP fallback sink (telemetry_http.c) */
+/** True when records should go over HTTP because MQTT is unhealthy. */
+bool telemetry_http_active(void);
+/** Append one formatted record to the pending HTTP batch. */
+bool telemetry_http_enqueue(const char *record, size_t len, bool urgent);
+
+/* CoAP sink (telemetry_coap.c) */
+/** True when CoAP has been configured as the telemetry transport. */
+bool telemetry_coap_active(void);
+bool telemetry_coap_enqueue(const char *record, size_t len, bool urgent);
+bool telemetry_coap_flush(uint32_t timeout_ms);
+
+/* Binary stream (telemetry_binary.c) */
+/** Publish the pending binary block, if any. */
+void telemetry_binary_flush(void);
+
+#endif // TELEMETRY_INTERNAL_H
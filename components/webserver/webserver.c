@@ -2,8 +2,10 @@
  * webserver.c
  *
  * Small HTTP server used to present an index page and accept a config POST
- * (ssid/password). The implementation favours clarity and safe error
- * handling (no crashing asserts on malformed requests).
+ * (ssid/password). The page comes from the asset partition if it holds
+ * one, else from the file given to webserver_start(). The implementation
+ * favours clarity and safe error handling (no crashing asserts on
+ * malformed requests).
  */
 
 #include "webserver.h"
@@ -11,17 +13,21 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/time.h>
 #include "esp_err.h"
 #include "esp_http_server.h"
 #include "esp_log.h"
 #include "esp_system.h"
 
+#include "assets.h"
+#include "history.h"
 #include "persistence.h"
 
 static const char *TAG = "webserver";
 
 static esp_err_t webserver_index_handler(httpd_req_t *req);
 static esp_err_t webserver_update_handler(httpd_req_t *req);
+static esp_err_t webserver_history_handler(httpd_req_t *req);
 
 struct webserver_handle *webserver_start(const char *index_path, const char *config_path)
 {
@@ -74,9 +80,16 @@ struct webserver_handle *webserver_start(const char *index_path, const char *con
         .handler = webserver_update_handler,
         .user_ctx = webserver_handle,
     };
+    httpd_uri_t history_handler = {
+        .uri = "/history",
+        .method = HTTP_GET,
+        .handler = webserver_history_handler,
+        .user_ctx = webserver_handle,
+    };
 
     httpd_register_uri_handler(server, &get_handler);
     httpd_register_uri_handler(server, &post_handler);
+    httpd_register_uri_handler(server, &history_handler);
 
     ESP_LOGI(TAG, "Webserver started");
     return webserver_handle;
@@ -102,6 +115,15 @@ static esp_err_t webserver_index_handler(httpd_req_t *req)
         return ESP_ERR_INVALID_ARG;
     }
 
+    // served straight from the mapped asset partition when it has the page
+    size_t asset_len = 0;
+    const char *asset = assets_get("index.htm", &asset_len);
+    if (asset) {
+        ESP_LOGI(TAG, "GET %s (asset)", req->uri);
+        httpd_resp_send(req, asset, (ssize_t)asset_len);
+        return ESP_OK;
+    }
+
     FILE *index_file = fopen(ctx->index_path, "r");
     if (index_file == NULL)
     {
@@ -224,4 +246,59 @@ static esp_err_t webserver_update_handler(httpd_req_t *req)
     xEventGroupSetBits(ctx->event_group, WEBSERVER_POST_EVENT);
 
     return ESP_OK;
-}
\ No newline at end of file
+}
+
+// Send one CSV line per query point; stop if the client went away.
+static bool webserver_history_point(int64_t ts_ms, int32_t value, uint32_t samples, void *user_ctx)
+{
+    char line[64];
+    int len = snprintf(line, sizeof(line), "%lld,%ld,%lu\n", (long long)ts_ms, (long)value, (unsigned long)samples);
+    return httpd_resp_send_chunk(user_ctx, line, len) == ESP_OK;
+}
+
+/*
+ * GET /history?metric=<channel>[&from=<ms>][&to=<ms>][&step=<ms>][&agg=mean|min|max|count]
+ * Streams the query result as CSV (ts,value,samples). Times are Unix ms;
+ * `to` defaults to now and `from` to 24 hours before it, `step` to one
+ * hour (0 returns the raw samples).
+ */
+static esp_err_t webserver_history_handler(httpd_req_t *req)
+{
+    static const char *const agg_names[] = { "mean", "min", "max", "count" };
+    char query[160] = "", metric[24] = "", value[24];
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    int64_t to = (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    int64_t from;
+    uint32_t step = 3600000;
+    int agg = HISTORY_AGG_MEAN;
+
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK ||
+        httpd_query_key_value(query, "metric", metric, sizeof(metric)) != ESP_OK)
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "metric is required");
+        return ESP_FAIL;
+    }
+    if (httpd_query_key_value(query, "to", value, sizeof(value)) == ESP_OK) to = strtoll(value, NULL, 10);
+    from = to - 86400000;
+    if (httpd_query_key_value(query, "from", value, sizeof(value)) == ESP_OK) from = strtoll(value, NULL, 10);
+    if (httpd_query_key_value(query, "step", value, sizeof(value)) == ESP_OK) step = strtoul(value, NULL, 10);
+    if (httpd_query_key_value(query, "agg", value, sizeof(value)) == ESP_OK) {
+        agg = -1;
+        for (int i = 0; i < 4; ++i)
+            if (strcmp(value, agg_names[i]) == 0) agg = i;
+    }
+    if (agg < 0 || from >= to) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "bad agg or time range");
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "GET %s", req->uri);
+    httpd_resp_set_type(req, "text/csv");
+    httpd_resp_send_chunk(req, "ts,value,samples\n", HTTPD_RESP_USE_STRLEN);
+    if (history_query(metric, from, to, step, (history_agg_t)agg, webserver_history_point, req) < 0) {
+        ESP_LOGW(TAG, "history query for unknown metric '%s'", metric);
+    }
+    httpd_resp_send_chunk(req, NULL, 0);
+    return ESP_OK;
+}
@@ -4,15 +4,26 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 #include <stdio.h>
-#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "esp_attr.h"
 #include "esp_log.h"
 #include "esp_event.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
 #include "nvs_flash.h"
+#include <cJSON.h>
 #include "esp_adc/adc_cali.h"
 
 #include "persistence.h"
+#include "config_store.h"
+#include "boot_config.h"
+#include "assets.h"
 #include "webserver.h"
 #include "wifi.h"
 #include "adc_manager.h"
@@ -21,6 +32,11 @@
 #include "deepsleep_manager.h"
 #include "hcsr04.h"
 #include "ota_manager.h"
+#include "telemetry.h"
+#include "device_attributes.h"
+#include "rules_engine.h"
+#include "history.h"
+#include "rtc_batch.h"
 #if __has_include("esp_crt_bundle.h")
 #include "esp_crt_bundle.h"
 #define HAVE_ESP_CRT_BUNDLE 1
@@ -43,6 +59,46 @@ const static char *TAG = "HITO 5";
 #define FILESYSTEM_PARTITION "storage"
 #define INDEX_FILE_PATH (FILESYSTEM_ROOT "/index.htm")
 #define MQTT_CREDENTIALS_PATH (FILESYSTEM_ROOT "/mqtt.txt")
+/* ThingsBoard HTTP device API used when MQTT is unreachable */
+#ifndef TB_HTTP_BASE_URL
+#define TB_HTTP_BASE_URL "https://demo.thingsboard.io"
+#endif
+/* Define (e.g. -DTB_COAP_HOST=\"demo.thingsboard.io\") to send telemetry
+ * over CoAP/UDP instead of MQTT; TB_COAP_CONFIRMABLE=0 skips the ACKs. */
+#ifndef TB_COAP_CONFIRMABLE
+#define TB_COAP_CONFIRMABLE 1
+#endif
+/* How long a CoAP wake waits for the server to acknowledge its batches. */
+#ifndef COAP_WAKE_FLUSH_MS
+#define COAP_WAKE_FLUSH_MS 8000
+#endif
+/* A distance below this (mm) is a threshold breach: the sample that enters
+ * or leaves the breach is sent on the urgent telemetry lane (0 disables). */
+#ifndef ALERT_DISTANCE_MM
+#define ALERT_DISTANCE_MM 200
+#endif
+/* After an MQTT outage at least this long (ms), the samples taken during it
+ * are replayed from the flash history once the broker is back. */
+#ifndef HISTORY_REPLAY_MIN_OUTAGE_MS
+#define HISTORY_REPLAY_MIN_OUTAGE_MS 30000
+#endif
+/* Telemetry lane slots the replay leaves free for live samples. */
+#ifndef HISTORY_REPLAY_LANE_HEADROOM
+#define HISTORY_REPLAY_LANE_HEADROOM 2
+#endif
+/* RTC batch upload: records in flight at once, how long to wait for their
+ * PUBACKs, and rounds without progress before giving up until the next connect */
+#ifndef BATCH_UPLOAD_WINDOW
+#define BATCH_UPLOAD_WINDOW 4
+#endif
+#ifndef BATCH_UPLOAD_ACK_MS
+#define BATCH_UPLOAD_ACK_MS 10000
+#endif
+#ifndef BATCH_UPLOAD_STALLS
+#define BATCH_UPLOAD_STALLS 3
+#endif
+/* Define (e.g. -DTELEMETRY_BIN_TOPIC=\"site1/sensors/bin\") to also publish
+ * samples as compact binary blocks for our own ingest pipeline. */
 #define WIFI_CREDENTIALS_PATH (FILESYSTEM_ROOT "/wifi.txt")
 
 #define AP_SSID "SBC25M02B"
@@ -52,101 +108,631 @@ const static char *TAG = "HITO 5";
 #define ADC_CHANNEL ADC_CHANNEL_4
 #define ADC_ATTEN ADC_ATTEN_DB_12
 
+#define SAMPLE_PERIOD_DEFAULT_MS 5000
+#define SAMPLE_PERIOD_MIN_MS 200
+#define SAMPLE_PERIOD_MAX_MS 3600000
+#define BURST_MAX_SAMPLES 50
+#define BURST_MIN_INTERVAL_MS 50
 
-void app_main(void)
+// Sampling state shared between the main loop and the RPC handlers (which run
+// on the MQTT task). The main loop is woken with a task notification whenever
+// an RPC changes it so new settings apply immediately.
+static volatile uint32_t s_sample_period_ms = SAMPLE_PERIOD_DEFAULT_MS;
+static volatile uint32_t s_burst_remaining = 0;
+static volatile uint32_t s_burst_interval_ms = 0;
+static bool s_distance_breach = false;
+static TaskHandle_t s_main_task = NULL;
+
+/* ------------------------------------------------------------------------
+ * ThingsBoard server-side RPC commands (see mqtt_rpc_register). These mirror
+ * the Telegram deep-sleep commands and add sampling controls; answers are
+ * sent on the open MQTT session so round trips stay well under a second.
+ * ------------------------------------------------------------------------ */
+
+// Parse an RPC params value that is either a bare number or {"<key>":number}.
+static bool rpc_params_get_u64(const char *params, const char *key, uint64_t *out)
 {
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
-    nvs_flash_init();
-    fat32_mount(FILESYSTEM_ROOT, FILESYSTEM_PARTITION);
-
-    // Log presence of common CA PEM filenames in the mounted filesystem so we
-    // can quickly diagnose whether the data partition contains the expected
-    // CA bundle that TLS needs.
-    const char *pem_candidates[] = {FILESYSTEM_ROOT "/ca_root.pem", FILESYSTEM_ROOT "/ca-root.pem", FILESYSTEM_ROOT "/cacert.pem", NULL};
-    for (const char **pp = pem_candidates; *pp; ++pp) {
-        FILE *f = fopen(*pp, "rb");
-        if (f) {
-            fseek(f, 0, SEEK_END);
-            long s = ftell(f);
-            fclose(f);
-            ESP_LOGI(TAG, "Found CA PEM candidate: %s (bytes=%ld)", *pp, s);
-        } else {
-            ESP_LOGI(TAG, "CA PEM candidate not found: %s", *pp);
+    cJSON *root = cJSON_Parse(params);
+    if (!root) return false;
+    cJSON *item = cJSON_IsNumber(root) ? root : cJSON_GetObjectItem(root, key);
+    bool ok = cJSON_IsNumber(item) && item->valuedouble >= 0;
+    if (ok) *out = (uint64_t)item->valuedouble;
+    cJSON_Delete(root);
+    return ok;
+}
+
+static bool rpc_get_deep_sleep_status(const char *params, char *rsp, size_t rsp_len, void *ctx)
+{
+    snprintf(rsp, rsp_len, "{\"enabled\":%s,\"interval_ms\":%llu,\"idle_timeout_ms\":%llu,\"batch_wakes\":%lu,\"batched\":%u}",
+             deepsleep_manager_is_enabled() ? "true" : "false",
+             (unsigned long long)deepsleep_manager_get_interval_ms(),
+             (unsigned long long)deepsleep_manager_get_idle_timeout_ms(),
+             (unsigned long)deepsleep_manager_get_batch_wakes(), (unsigned)rtc_batch_count());
+    return true;
+}
+
+static bool rpc_set_deep_sleep_duration(const char *params, char *rsp, size_t rsp_len, void *ctx)
+{
+    uint64_t ms = 0;
+    if (!rpc_params_get_u64(params, "ms", &ms) || ms < 1000ULL || ms > 604800000ULL) {
+        snprintf(rsp, rsp_len, "{\"error\":\"ms must be between 1000 and 604800000\"}");
+        return false;
+    }
+    if (!deepsleep_manager_set_interval_ms(ms)) return false;
+    snprintf(rsp, rsp_len, "{\"interval_ms\":%llu}", (unsigned long long)ms);
+    return true;
+}
+
+static bool rpc_set_deep_sleep_delay(const char *params, char *rsp, size_t rsp_len, void *ctx)
+{
+    uint64_t ms = 0;
+    if (!rpc_params_get_u64(params, "ms", &ms) || ms < 100ULL || ms > 86400000ULL) {
+        snprintf(rsp, rsp_len, "{\"error\":\"ms must be between 100 and 86400000\"}");
+        return false;
+    }
+    if (!deepsleep_manager_set_idle_timeout_ms(ms)) return false;
+    snprintf(rsp, rsp_len, "{\"idle_timeout_ms\":%llu}", (unsigned long long)ms);
+    return true;
+}
+
+static bool rpc_set_deep_sleep(const char *params, char *rsp, size_t rsp_len, void *ctx)
+{
+    cJSON *root = cJSON_Parse(params);
+    cJSON *item = (root && cJSON_IsBool(root)) ? root : cJSON_GetObjectItem(root, "enabled");
+    if (!cJSON_IsBool(item)) {
+        cJSON_Delete(root);
+        snprintf(rsp, rsp_len, "{\"error\":\"params must be true/false\"}");
+        return false;
+    }
+    bool enable = cJSON_IsTrue(item);
+    cJSON_Delete(root);
+    if (enable && deepsleep_manager_get_interval_ms() == 0) {
+        snprintf(rsp, rsp_len, "{\"error\":\"no interval set\"}");
+        return false;
+    }
+    if (!deepsleep_manager_set_enabled(enable)) return false;
+    snprintf(rsp, rsp_len, "{\"enabled\":%s}", enable ? "true" : "false");
+    return true;
+}
+
+static bool rpc_set_deep_sleep_batch(const char *params, char *rsp, size_t rsp_len, void *ctx)
+{
+    uint64_t wakes = 0;
+    if (!rpc_params_get_u64(params, "wakes", &wakes) || wakes < 1 || wakes > RTC_BATCH_CAPACITY) {
+        snprintf(rsp, rsp_len, "{\"error\":\"wakes must be between 1 and %d\"}", RTC_BATCH_CAPACITY);
+        return false;
+    }
+    if (!deepsleep_manager_set_batch_wakes((uint32_t)wakes)) return false;
+    snprintf(rsp, rsp_len, "{\"batch_wakes\":%lu}", (unsigned long)wakes);
+    return true;
+}
+
+// Force sleep from a short-lived task so the RPC response can leave first.
+static void rpc_deep_sleep_task(void *arg)
+{
+    vTaskDelay(pdMS_TO_TICKS(500));
+    telemetry_flush(2000);
+    deepsleep_manager_force_sleep();
+    vTaskDelete(NULL);
+}
+
+static bool rpc_deep_sleep(const char *params, char *rsp, size_t rsp_len, void *ctx)
+{
+    uint64_t ms = deepsleep_manager_get_interval_ms();
+    if (ms == 0 || !deepsleep_manager_is_enabled()) {
+        snprintf(rsp, rsp_len, "{\"error\":\"deep sleep disabled or no interval set\"}");
+        return false;
+    }
+    if (xTaskCreate(rpc_deep_sleep_task, "rpc_sleep", 2048, NULL, tskIDLE_PRIORITY + 1, NULL) != pdPASS) return false;
+    snprintf(rsp, rsp_len, "{\"sleeping_ms\":%llu}", (unsigned long long)ms);
+    return true;
+}
+
+static bool rpc_set_sampling_rate(const char *params, char *rsp, size_t rsp_len, void *ctx)
+{
+    uint64_t ms = 0;
+    if (!rpc_params_get_u64(params, "ms", &ms) || ms < SAMPLE_PERIOD_MIN_MS || ms > SAMPLE_PERIOD_MAX_MS) {
+        snprintf(rsp, rsp_len, "{\"error\":\"ms must be between %d and %d\"}", SAMPLE_PERIOD_MIN_MS, SAMPLE_PERIOD_MAX_MS);
+        return false;
+    }
+    s_sample_period_ms = (uint32_t)ms;
+    if (s_main_task) xTaskNotifyGive(s_main_task);
+    snprintf(rsp, rsp_len, "{\"sample_period_ms\":%lu}", (unsigned long)s_sample_period_ms);
+    return true;
+}
+
+static bool rpc_capture_burst(const char *params, char *rsp, size_t rsp_len, void *ctx)
+{
+    uint64_t count = 10, interval = 200;
+    cJSON *root = cJSON_Parse(params);
+    if (cJSON_IsNumber(root)) {
+        count = (uint64_t)root->valuedouble;
+    } else if (cJSON_IsObject(root)) {
+        cJSON *c = cJSON_GetObjectItem(root, "count");
+        cJSON *i = cJSON_GetObjectItem(root, "interval_ms");
+        if (cJSON_IsNumber(c)) count = (uint64_t)c->valuedouble;
+        if (cJSON_IsNumber(i)) interval = (uint64_t)i->valuedouble;
+    }
+    cJSON_Delete(root);
+    if (count == 0 || count > BURST_MAX_SAMPLES || interval < BURST_MIN_INTERVAL_MS || interval > SAMPLE_PERIOD_MAX_MS) {
+        snprintf(rsp, rsp_len, "{\"error\":\"count must be 1..%d, interval_ms >= %d\"}", BURST_MAX_SAMPLES, BURST_MIN_INTERVAL_MS);
+        return false;
+    }
+    s_burst_interval_ms = (uint32_t)interval;
+    // the notification below triggers the first sample immediately
+    s_burst_remaining = (uint32_t)count - 1;
+    if (s_main_task) xTaskNotifyGive(s_main_task);
+    snprintf(rsp, rsp_len, "{\"count\":%lu,\"interval_ms\":%lu}", (unsigned long)count, (unsigned long)interval);
+    return true;
+}
+
+static bool rpc_get_status(const char *params, char *rsp, size_t rsp_len, void *ctx)
+{
+    snprintf(rsp, rsp_len,
+             "{\"uptime_s\":%lld,\"free_heap\":%lu,\"min_free_heap\":%lu,\"sample_period_ms\":%lu,\"burst_remaining\":%lu,\"deepsleep_enabled\":%s}",
+             (long long)(esp_timer_get_time() / 1000000), (unsigned long)esp_get_free_heap_size(),
+             (unsigned long)esp_get_minimum_free_heap_size(), (unsigned long)s_sample_period_ms,
+             (unsigned long)s_burst_remaining, deepsleep_manager_is_enabled() ? "true" : "false");
+    return true;
+}
+
+/* Sample channels in the order used by the binary stream, the rules engine
+ * and the flash history. */
+static const char *const s_sample_channels[] = { "voltage_mV", "ohms", "distance_mm" };
+
+// Unix time in ms, or 0 while the clock has not been set.
+static int64_t wallclock_ms(void)
+{
+    if (time(NULL) < 1600000000) return 0;
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+// Keep the sample (with the seq it was just published under) in the flash log.
+static void history_append_sample(const int32_t *values, uint32_t present, bool urgent)
+{
+    history_record_t rec = {
+        .seq = telemetry_last_seq(),
+        .present = (uint8_t)present,
+        .flags = urgent ? HISTORY_FLAG_URGENT : 0,
+    };
+    memcpy(rec.values, values, 3 * sizeof(int32_t));
+    rec.ts_ms = wallclock_ms();
+    if (rec.ts_ms) {
+        rec.flags |= HISTORY_FLAG_WALLCLOCK;
+    } else {
+        rec.ts_ms = esp_timer_get_time() / 1000;
+    }
+    history_append(&rec);
+}
+
+// {"voltage_mV":...,"ohms":...} with the channels marked in `present`; -1 if empty or too long.
+static int format_sample_json(char *buf, size_t size, const int32_t *values, uint32_t present)
+{
+    int len = 0;
+    for (int c = 0; c < 3; ++c) {
+        if (!((present >> c) & 1)) continue;
+        len += snprintf(buf + len, size - len, "%s\"%s\":%ld", len ? "," : "{", s_sample_channels[c], (long)values[c]);
+    }
+    if (len == 0 || len + 2 > (int)size) return -1;
+    buf[len++] = '}';
+    buf[len] = '\0';
+    return len;
+}
+
+// Read every sensor once: voltage, resistance and (bit 2 of *present) distance.
+static bool read_sample(adc_manager_handle_t *adc_handle, int32_t *sample, uint32_t *present)
+{
+    int adc_raw, voltage;
+    bool have_adc = adc_manager_read_raw(adc_handle, &adc_raw) == ESP_OK;
+    device_attributes_set_bool(DEVICE_ATTR_ADC_OK, have_adc);
+    if (!have_adc) return false;
+    ESP_LOGI(TAG, "ADC Raw Data: %d", adc_raw);
+    if (adc_manager_read_voltage(adc_handle, &voltage) != ESP_OK) return false;
+
+    int resistance = adc_manager_calc_ohm(adc_raw);
+    ESP_LOGI(TAG, "Voltage: %d mV, Resistance: %.3f kOhm", voltage, resistance / 1000.0);
+
+    // read HC-SR04 distance (optional)
+    uint32_t distance_mm = 0;
+    bool have_distance = hcsr04_read_mm(&distance_mm);
+    device_attributes_set_bool(DEVICE_ATTR_DISTANCE_OK, have_distance);
+
+    sample[0] = voltage;
+    sample[1] = resistance;
+    sample[2] = (int32_t)distance_mm;
+    *present = have_distance ? 0x7 : 0x3;
+    return true;
+}
+
+/* ------------------------------------------------------------------------
+ * Backlog replay: samples taken while MQTT was down (longer than the
+ * telemetry queue can cover) are read back from the flash history and
+ * republished with their original seq and timestamp once the broker is
+ * reachable again. ThingsBoard keys telemetry by ts, so samples that did
+ * make it through are just overwritten with the same values.
+ * ------------------------------------------------------------------------ */
+
+// Start of the outage still to be replayed (Unix ms, 0 = none).
+static RTC_DATA_ATTR int64_t s_replay_from_ms;
+static int64_t s_replay_t0, s_replay_t1;
+static volatile bool s_replay_running;
+
+// Called per sample: remember when a long enough outage began.
+static void history_note_outage(void)
+{
+    uint32_t off = mqtt_disconnected_ms();
+    int64_t now = wallclock_ms();
+    if (s_replay_from_ms || off == UINT32_MAX || off < HISTORY_REPLAY_MIN_OUTAGE_MS || !now) return;
+    s_replay_from_ms = now - off;
+    ESP_LOGI(TAG, "MQTT down for %lu ms; samples will be replayed", (unsigned long)off);
+}
+
+static void history_replay_task(void *arg)
+{
+    history_cursor_t cur;
+    history_record_t rec;
+    char values[128], record[192];
+    int sent = 0;
+
+    bool ok = history_cursor_seek(&cur, HISTORY_TIER_RAW, s_replay_t0);
+    while (ok && history_read(&cur, &rec)) {
+        if (rec.ts_ms >= s_replay_t1) break;
+        if (rec.ts_ms < s_replay_t0 || !(rec.flags & HISTORY_FLAG_WALLCLOCK)) continue;
+        if (format_sample_json(values, sizeof(values), rec.values, rec.present) < 0) continue;
+        if (telemetry_format_record(record, sizeof(record), rec.seq, rec.ts_ms, values) < 0) continue;
+        // a full lane would drop its oldest record, so wait for the sender to make room
+        while (mqtt_is_connected() && mqtt_queue_free(MQTT_PRIO_TELEMETRY) < HISTORY_REPLAY_LANE_HEADROOM)
+            vTaskDelay(pdMS_TO_TICKS(50));
+        if (!mqtt_is_connected()) {
+            // carry on from here after the next connect
+            if (!s_replay_from_ms || rec.ts_ms < s_replay_from_ms) s_replay_from_ms = rec.ts_ms;
+            break;
         }
+        mqtt_publish_telemetry(record);
+        // keep the outbox small; wait for the broker every few records
+        if (++sent % 20 == 0) mqtt_publish_flush(5000);
+    }
+    ESP_LOGI(TAG, "Replayed %d samples from the MQTT outage", sent);
+    s_replay_running = false;
+    vTaskDelete(NULL);
+}
+
+// MQTT connected callback; must not block, so the replay runs in its own task.
+static void history_replay_on_connected(bool session_resumed, void *ctx)
+{
+    if (!s_replay_from_ms || s_replay_running) return;
+    s_replay_t0 = s_replay_from_ms;
+    s_replay_t1 = wallclock_ms();
+    s_replay_from_ms = 0;
+    if (!s_replay_t1) return;
+    s_replay_running = true;
+    if (xTaskCreate(history_replay_task, "hist_replay", 4096, NULL, tskIDLE_PRIORITY + 2, NULL) != pdPASS)
+        s_replay_running = false;
+}
+
+/* ------------------------------------------------------------------------
+ * Batched deep sleep: with setDeepSleepBatch N > 1, a timer wake only
+ * takes one sample into the RTC batch (components/rtc_batch) and sleeps
+ * again, without mounting storage or starting WiFi. Every Nth wake, or a
+ * wake whose sample starts or ends an alert threshold breach, boots fully;
+ * once MQTT is up the batch is published at QoS 1 a few records at a time,
+ * with each sample's own seq and timestamp, and a record is dropped from
+ * the ring only after the broker has acknowledged it.
+ * ------------------------------------------------------------------------ */
+
+static volatile bool s_batch_running;
+
+// Called early in app_main; does not return on a sample-only wake.
+static void batch_sample_only_wake(adc_manager_handle_t *adc_handle)
+{
+    uint32_t wakes = deepsleep_manager_get_batch_wakes();
+    if (wakes <= 1 || esp_reset_reason() != ESP_RST_DEEPSLEEP || !deepsleep_manager_is_enabled()) return;
+
+    int32_t sample[3];
+    uint32_t present = 0;
+    bool edge = false;
+    if (read_sample(adc_handle, sample, &present)) {
+        rtc_batch_record_t rec = {
+            .ts_ms = wallclock_ms(),
+            .seq = telemetry_next_seq(),
+            .present = (uint8_t)present,
+        };
+        memcpy(rec.values, sample, sizeof(rec.values));
+        if (!rtc_batch_push(&rec)) ESP_LOGW(TAG, "RTC batch full; oldest sample dropped");
+        history_append_sample(sample, present, false);
+        // boot fully when a breach starts or ends, not on every sample while it lasts
+        if (present & 0x4) edge = rtc_batch_set_alert(sample[2] < ALERT_DISTANCE_MM);
     }
-    // List directory contents to help debug which files are present on the data partition
-    DIR *d = opendir(FILESYSTEM_ROOT);
-    if (d) {
-        struct dirent *ent;
-        ESP_LOGI(TAG, "Listing %s:", FILESYSTEM_ROOT);
-        while ((ent = readdir(d)) != NULL) {
-            ESP_LOGI(TAG, "  %s", ent->d_name);
+    if (rtc_batch_upload_due(wakes) || edge) {
+        ESP_LOGI(TAG, "Upload wake: %u batched samples%s", (unsigned)rtc_batch_count(), edge ? " (threshold crossed)" : "");
+        return;
+    }
+    ESP_LOGI(TAG, "Sample-only wake: %u samples batched", (unsigned)rtc_batch_count());
+    deepsleep_manager_force_sleep();
+}
+
+static void batch_upload_task(void *arg)
+{
+    rtc_batch_record_t rec;
+    char values[128], record[192];
+    uint32_t tickets[BATCH_UPLOAD_WINDOW];
+    uint16_t done = 0;
+    int stalls = 0;
+
+    while (mqtt_is_connected() && rtc_batch_count() > 0 && stalls < BATCH_UPLOAD_STALLS) {
+        // a full telemetry lane drops its oldest record, so never queue more
+        // than it has room for, and leave a slot for live samples
+        uint32_t room = mqtt_queue_free(MQTT_PRIO_TELEMETRY);
+        uint16_t n = 0;
+        while (n < BATCH_UPLOAD_WINDOW && n + 1 < room && rtc_batch_peek(n, &rec)) {
+            tickets[n] = 0; // 0: cannot be formatted, nothing to send
+            if (format_sample_json(values, sizeof(values), rec.values, rec.present) >= 0 &&
+                telemetry_format_record(record, sizeof(record), rec.seq, rec.ts_ms, values) >= 0) {
+                tickets[n] = mqtt_publish_telemetry_confirmed(record);
+                if (!tickets[n]) break;
+            }
+            n++;
+        }
+        if (n == 0) {
+            vTaskDelay(pdMS_TO_TICKS(100));
+            continue;
+        }
+
+        // drop the records the broker acknowledged, up to the first that is not
+        int64_t deadline = esp_timer_get_time() + (int64_t)BATCH_UPLOAD_ACK_MS * 1000;
+        uint16_t acked;
+        bool pending;
+        do {
+            vTaskDelay(pdMS_TO_TICKS(20));
+            acked = 0;
+            pending = false;
+            for (uint16_t i = 0; i < n; i++) {
+                mqtt_delivery_t st = tickets[i] ? mqtt_delivery_state(tickets[i]) : MQTT_DELIVERY_ACKED;
+                if (st == MQTT_DELIVERY_PENDING) pending = true;
+                if (st == MQTT_DELIVERY_ACKED && acked == i) acked++;
+            }
+        } while (pending && esp_timer_get_time() < deadline);
+        rtc_batch_consume(acked);
+        done += acked;
+        stalls = acked < n ? stalls + 1 : 0;
+    }
+    ESP_LOGI(TAG, "Uploaded %u batched samples, %u left", (unsigned)done, (unsigned)rtc_batch_count());
+    s_batch_running = false;
+    vTaskDelete(NULL);
+}
+
+// MQTT connected callback; must not block, so the upload runs in its own task.
+static void batch_upload_on_connected(bool session_resumed, void *ctx)
+{
+    if (s_batch_running || rtc_batch_count() == 0) return;
+    s_batch_running = true;
+    if (xTaskCreate(batch_upload_task, "batch_upload", 4096, NULL, tskIDLE_PRIORITY + 2, NULL) != pdPASS)
+        s_batch_running = false;
+}
+
+#ifdef TB_COAP_HOST
+/* ------------------------------------------------------------------------
+ * CoAP wakes: a deep-sleep timer wake sends the RTC batch and its own
+ * sample over CoAP and sleeps again without starting the MQTT client, so it
+ * pays no TCP/MQTT connect. Other boots start MQTT as usual for attributes,
+ * RPC and OTA. deepsleep_manager logs the wake-to-sleep time of both kinds.
+ * ------------------------------------------------------------------------ */
+
+// Called once WiFi is up; does not return when the wake was handled.
+static void coap_wake(adc_manager_handle_t *adc_handle)
+{
+    if (esp_reset_reason() != ESP_RST_DEEPSLEEP || !deepsleep_manager_is_enabled()) return;
+    // the access token is the first line of mqtt.txt
+    const char *text = boot_config_get(MQTT_CREDENTIALS_PATH, NULL);
+    char token[128];
+    if (!text || !boot_config_next_line(&text, token, sizeof(token)) || !token[0]) return;
+    if (!telemetry_coap_init(TB_COAP_HOST, token, TB_COAP_CONFIRMABLE)) return;
+
+    // batched samples first, dropped from the ring once the server has them
+    rtc_batch_record_t rec;
+    char values[128], record[192];
+    uint16_t queued = 0, uploaded = 0;
+    bool ok = true;
+    while (ok && rtc_batch_peek(queued, &rec)) {
+        bool fits = format_sample_json(values, sizeof(values), rec.values, rec.present) > 0 &&
+                    telemetry_format_record(record, sizeof(record), rec.seq, rec.ts_ms, values) > 0;
+        if (fits && !telemetry_publish_record(record) && queued > 0) {
+            // CoAP batch full: send it, then retry this sample
+            ok = telemetry_flush(COAP_WAKE_FLUSH_MS);
+            if (ok) {
+                rtc_batch_consume(queued);
+                uploaded += queued;
+                queued = 0;
+            }
+            continue;
         }
-        closedir(d);
+        queued++;
+    }
+    if (ok && queued && telemetry_flush(COAP_WAKE_FLUSH_MS)) {
+        rtc_batch_consume(queued);
+        uploaded += queued;
+    }
+
+    // with batching on, this wake's sample is already in the ring
+    int32_t sample[3];
+    uint32_t present = 0;
+    char payload[192];
+    if (deepsleep_manager_get_batch_wakes() <= 1 && read_sample(adc_handle, sample, &present) &&
+        format_sample_json(payload, sizeof(payload), sample, present) > 0) {
+        telemetry_publish(payload);
+        history_append_sample(sample, present, false);
+        if (!telemetry_flush(COAP_WAKE_FLUSH_MS)) {
+            // keep it for the next wake, under the seq it was sent with
+            rtc_batch_record_t keep = { .ts_ms = wallclock_ms(), .seq = telemetry_last_seq(), .present = (uint8_t)present };
+            memcpy(keep.values, sample, sizeof(keep.values));
+            rtc_batch_push(&keep);
+        }
+    }
+    ESP_LOGI(TAG, "CoAP wake: %u batched samples uploaded, %u kept", (unsigned)uploaded, (unsigned)rtc_batch_count());
+    deepsleep_manager_force_sleep();
+}
+#endif
+
+/* ------------------------------------------------------------------------
+ * Telegram "/history <metric> [hours] [mean|min|max|count]": about 24
+ * points over the last `hours` (default 24), read from the flash history.
+ * ------------------------------------------------------------------------ */
+
+typedef struct {
+    char text[1024];
+    size_t len;
+} tg_history_reply_t;
+
+static bool tg_history_point(int64_t ts_ms, int32_t value, uint32_t samples, void *user_ctx)
+{
+    tg_history_reply_t *r = user_ctx;
+    time_t t = (time_t)(ts_ms / 1000);
+    struct tm tm;
+    localtime_r(&t, &tm);
+    r->len += (size_t)snprintf(r->text + r->len, sizeof(r->text) - r->len, "%02d/%02d %02d:%02d  %ld\n",
+                               tm.tm_mday, tm.tm_mon + 1, tm.tm_hour, tm.tm_min, (long)value);
+    return r->len + 32 < sizeof(r->text);
+}
+
+static void tg_history_command(int64_t chat_id, const char *args)
+{
+    static const char *const agg_names[] = { "mean", "min", "max", "count" };
+    static const uint32_t steps_ms[] = { 60000, 300000, 900000, 3600000, 21600000, 86400000 };
+    char metric[24] = "", agg_name[8] = "mean";
+    int hours = 24;
+    sscanf(args, "%23s %d %7s", metric, &hours, agg_name);
+
+    int agg = -1;
+    for (int i = 0; i < 4; ++i)
+        if (strcmp(agg_name, agg_names[i]) == 0) agg = i;
+    int64_t now = wallclock_ms();
+    if (!metric[0] || hours <= 0 || hours > 24 * 366 || agg < 0) {
+        telegram_send_message(chat_id, "Usage: /history <voltage_mV|ohms|distance_mm> [hours] [mean|min|max|count]");
+        return;
+    }
+    if (!now) {
+        telegram_send_message(chat_id, "Clock not set yet");
+        return;
+    }
+
+    int64_t span = (int64_t)hours * 3600000;
+    uint32_t step = steps_ms[5];
+    for (int i = 4; i >= 0 && span / steps_ms[i] <= 24; --i) step = steps_ms[i];
+
+    static tg_history_reply_t reply; /* only the Telegram task runs commands */
+    reply.len = (size_t)snprintf(reply.text, sizeof(reply.text), "%s %s, last %dh (step %lu min):\n",
+                                 metric, agg_name, hours, (unsigned long)(step / 60000));
+    int n = history_query(metric, now - span, now, step, (history_agg_t)agg, tg_history_point, &reply);
+    if (n < 0) {
+        telegram_send_message(chat_id, "Unknown metric");
+    } else if (n == 0) {
+        telegram_send_message(chat_id, "No history for that range");
     } else {
-        ESP_LOGW(TAG, "Failed to open directory %s for listing", FILESYSTEM_ROOT);
+        telegram_send_message(chat_id, reply.text);
     }
+}
 
-    // Read and log tele.txt (masked token + persisted id) to help debug Telegram issues
-    {
-        const char *tele_path = FILESYSTEM_ROOT "/tele.txt";
-        FILE *tf = fopen(tele_path, "r");
-        if (tf) {
-            char line1[256] = "";
-            char line2[256] = "";
-            char line3[256] = "";
-            if (fgets(line1, sizeof(line1), tf) == NULL) line1[0] = '\0';
-            if (fgets(line2, sizeof(line2), tf) == NULL) line2[0] = '\0';
-            if (fgets(line3, sizeof(line3), tf) == NULL) line3[0] = '\0';
-            fclose(tf);
-            // trim newlines
-            line1[strcspn(line1, "\r\n")] = '\0';
-            line2[strcspn(line2, "\r\n")] = '\0';
-            line3[strcspn(line3, "\r\n")] = '\0';
-            if (line1[0] != '\0') {
-                size_t L = strlen(line1);
-                char masked[64];
-                if (L <= 12) {
-                    int show = (int)L;
-                    snprintf(masked, sizeof(masked), "<redacted:%.*s>", show, line1);
-                } else {
-                    // show first 6 + last 6
-                    snprintf(masked, sizeof(masked), "%.*s...%.*s", 6, line1, 6, line1 + L - 6);
-                }
-                long long persisted = 0;
-                if (line3[0] != '\0') sscanf(line3, "%lld", &persisted);
-                ESP_LOGI(TAG, "Found %s (masked token: %s, persisted_last_update_id=%lld)", tele_path, masked, persisted);
+// Actions of the local rules engine (shared attribute "rules"); runs on
+// the sampling task, so nothing here may block on the network.
+static void on_rule_fired(rule_action_t action, int32_t arg, const char *rule, int32_t value, void *ctx)
+{
+    char msg[128];
+    switch (action) {
+    case RULE_ACTION_ALERT:
+        snprintf(msg, sizeof(msg), "{\"rule\":\"%s\",\"rule_value\":%ld}", rule, (long)value);
+        telemetry_publish_urgent(msg);
+        break;
+    case RULE_ACTION_RATE:
+        if (arg >= SAMPLE_PERIOD_MIN_MS && arg <= SAMPLE_PERIOD_MAX_MS) {
+            s_sample_period_ms = (uint32_t)arg;
+            ESP_LOGI(TAG, "rule set sample period to %ld ms", (long)arg);
+        }
+        break;
+    case RULE_ACTION_TELEGRAM:
+        snprintf(msg, sizeof(msg), "Rule fired: %s (value %ld)", rule, (long)value);
+        telegram_notify_admin(msg);
+        break;
+    default:
+        break;
+    }
+}
+
+static void register_rpc_commands(void)
+{
+    mqtt_rpc_register("getDeepSleepStatus", rpc_get_deep_sleep_status, NULL);
+    mqtt_rpc_register("setDeepSleepDuration", rpc_set_deep_sleep_duration, NULL);
+    mqtt_rpc_register("setDeepSleepDelay", rpc_set_deep_sleep_delay, NULL);
+    mqtt_rpc_register("setDeepSleep", rpc_set_deep_sleep, NULL);
+    mqtt_rpc_register("deepSleep", rpc_deep_sleep, NULL);
+    mqtt_rpc_register("setDeepSleepBatch", rpc_set_deep_sleep_batch, NULL);
+    mqtt_rpc_register("setSamplingRate", rpc_set_sampling_rate, NULL);
+    mqtt_rpc_register("captureBurst", rpc_capture_burst, NULL);
+    mqtt_rpc_register("getStatus", rpc_get_status, NULL);
+}
+
+
+void app_main(void)
+{
+    ESP_ERROR_CHECK(esp_event_loop_create_default());
+    nvs_flash_init();
+    config_store_init();
+    telemetry_init();
+    device_attributes_init();
+    history_init(s_sample_channels, 3);
+    rtc_batch_init();
+
+    // Initialize ADC for LDR readings
+    adc_manager_handle_t *adc_handle = adc_manager_init(ADC_CHANNEL, ADC_ATTEN);
+
+    // Initialize HC-SR04 sensor: trigger GPIO4, echo GPIO5 per user request
+    if (!hcsr04_init(4, 5)) {
+        ESP_LOGW(TAG, "HC-SR04 initialization failed; distance will be unavailable");
+    }
+
+    // Batched deep sleep: most timer wakes end here, back asleep.
+    if (adc_handle) batch_sample_only_wake(adc_handle);
+
+    storage_mount(FILESYSTEM_ROOT, FILESYSTEM_PARTITION);
+
+    // Map the read-only asset partition, then read every config file once;
+    // components look them up from flash or RAM.
+    assets_init();
+    boot_config_load(FILESYSTEM_ROOT);
+
+    // Log tele.txt (masked token) to help debug Telegram issues
+    const char *tele = boot_config_get(FILESYSTEM_ROOT "/tele.txt", NULL);
+    if (tele) {
+        char token[256];
+        if (boot_config_next_line(&tele, token, sizeof(token)) && token[0] != '\0') {
+            size_t L = strlen(token);
+            char masked[64];
+            if (L <= 12) {
+                snprintf(masked, sizeof(masked), "<redacted:%.*s>", (int)L, token);
             } else {
-                ESP_LOGI(TAG, "%s exists but token line is empty", tele_path);
+                // show first 6 + last 6
+                snprintf(masked, sizeof(masked), "%.*s...%.*s", 6, token, 6, token + L - 6);
             }
+            ESP_LOGI(TAG, "Found %s (masked token: %s)", FILESYSTEM_ROOT "/tele.txt", masked);
         } else {
-            ESP_LOGI(TAG, "%s not present on data partition", FILESYSTEM_ROOT "/tele.txt");
+            ESP_LOGI(TAG, "%s exists but token line is empty", FILESYSTEM_ROOT "/tele.txt");
         }
+    } else {
+        ESP_LOGI(TAG, "%s not present on data partition", FILESYSTEM_ROOT "/tele.txt");
     }
 
-    // Check for a CA PEM directly on the mounted filesystem and, if found,
-    // register it with the upstream esp_crt_bundle via esp_crt_bundle_set().
-    const char *pem_candidates2[] = {FILESYSTEM_ROOT "/ca_root.pem", FILESYSTEM_ROOT "/ca-root.pem", FILESYSTEM_ROOT "/cacert.pem", NULL};
-    bool pem_found = false;
-    for (const char **pp = pem_candidates2; *pp; ++pp) {
-        FILE *f = fopen(*pp, "rb");
-        if (!f) continue;
-        // find file size
-        fseek(f, 0, SEEK_END);
-        long s = ftell(f);
-        fseek(f, 0, SEEK_SET);
-        if (s <= 0) { fclose(f); continue; }
-        char *full = malloc((size_t)s + 1);
-        if (!full) { fclose(f); break; }
-        size_t r = fread(full, 1, (size_t)s, f);
-        full[r] = '\0';
-        fclose(f);
-        ESP_LOGI(TAG, "Found PEM at %s (bytes=%d)", *pp, (int)r);
+    // Register the CA PEM from the data partition with the upstream
+    // esp_crt_bundle via esp_crt_bundle_set().
+    size_t pem_len = 0;
+    const char *pem = boot_config_ca_pem(&pem_len);
+    if (pem) {
+        ESP_LOGI(TAG, "Found CA PEM (bytes=%d)", (int)pem_len);
         #if defined(HAVE_ESP_CRT_BUNDLE)
             /* esp_crt_bundle_set expects 'const uint8_t *' (unsigned char pointer).
-             * Our `full` buffer is a char*, so cast to avoid signedness warnings
+             * Our buffer is a char*, so cast to avoid signedness warnings
              * which are treated as errors (-Werror=pointer-sign). */
-            if (esp_crt_bundle_set((const uint8_t *)full, r) == ESP_OK) {
+            if (esp_crt_bundle_set((const uint8_t *)pem, pem_len) == ESP_OK) {
                 ESP_LOGI(TAG, "Registered filesystem PEM with esp_crt_bundle");
             } else {
                 ESP_LOGW(TAG, "Failed to register filesystem PEM with esp_crt_bundle");
@@ -154,11 +740,7 @@ void app_main(void)
         #else
             ESP_LOGI(TAG, "esp_crt_bundle not available at compile time; skipping registration");
         #endif
-        free(full);
-        pem_found = true;
-        break;
-    }
-    if (!pem_found) {
+    } else {
         ESP_LOGW(TAG, "No PEM file found under %s", FILESYSTEM_ROOT);
     }
 
@@ -167,15 +749,13 @@ void app_main(void)
     // OTA manager is attribute-driven; OTA initialization is handled when
     // MQTT is connected and attributes are retrieved.
 
-    // Log partition table layout for OTA debugging
-    ESP_LOGI(TAG, "Partition table layout (4MB flash):");
-    ESP_LOGI(TAG, "  nvs      @ 0x9000   size 0x6000");
-    ESP_LOGI(TAG, "  phy_init @ 0xf000   size 0x1000");
-    ESP_LOGI(TAG, "  otadata  @ 0x10000  size 0x2000");
-    ESP_LOGI(TAG, "  factory  @ 0x12000  size 0x100000");
-    ESP_LOGI(TAG, "  ota_0    @ 0x112000 size 0x100000");
-    ESP_LOGI(TAG, "  ota_1    @ 0x212000 size 0x100000");
-    ESP_LOGI(TAG, "  storage  @ 0x312000 size 0xEE000");
+    // Log the partition table on flash (not partitions.csv) for OTA debugging
+    ESP_LOGI(TAG, "Partition table layout:");
+    for (esp_partition_iterator_t it = esp_partition_find(ESP_PARTITION_TYPE_ANY, ESP_PARTITION_SUBTYPE_ANY, NULL); it;
+         it = esp_partition_next(it)) {
+        const esp_partition_t *part = esp_partition_get(it);
+        ESP_LOGI(TAG, "  %-8s @ 0x%-6lx size 0x%lx", part->label, (unsigned long)part->address, (unsigned long)part->size);
+    }
 
     struct persistence_config wifi_network_config;
     if (!persistence_read_config(WIFI_CREDENTIALS_PATH, &wifi_network_config) ||
@@ -204,9 +784,28 @@ void app_main(void)
     }
     persistence_config_free(&wifi_network_config);
 
+#ifdef TB_COAP_HOST
+    // Timer wakes send over CoAP and sleep again without MQTT.
+    if (adc_handle) coap_wake(adc_handle);
+#endif
+
     /* Start MQTT only after station is configured and connected */
+    s_main_task = xTaskGetCurrentTaskHandle();
+    register_rpc_commands();
+    rules_engine_init(s_sample_channels, 3, on_rule_fired, NULL);
+    mqtt_register_connected_callback(history_replay_on_connected, NULL);
+    mqtt_register_connected_callback(batch_upload_on_connected, NULL);
     if (!mqtt_app_start_from_file("mqtt://demo.thingsboard.io", MQTT_CREDENTIALS_PATH)) {
         ESP_LOGW(TAG, "MQTT not started from file %s", MQTT_CREDENTIALS_PATH);
+    } else {
+        // telemetry falls back to HTTPS batches while MQTT cannot connect
+        telemetry_http_init(TB_HTTP_BASE_URL, mqtt_get_access_token());
+#ifdef TB_COAP_HOST
+        telemetry_coap_init(TB_COAP_HOST, mqtt_get_access_token(), TB_COAP_CONFIRMABLE);
+#endif
+#ifdef TELEMETRY_BIN_TOPIC
+        telemetry_binary_init(TELEMETRY_BIN_TOPIC, 3); /* s_sample_channels */
+#endif
     }
 
     // initialize deepsleep manager (reads stored interval)
@@ -220,9 +819,12 @@ void app_main(void)
         {
             (void)user_ctx;
             if (!text) return;
-            if (text[0] == '/')
+            if (strncmp(text, "/history", 8) == 0 && (text[8] == ' ' || text[8] == '\0'))
+            {
+                tg_history_command(chat_id, text + 8);
+            }
+            else if (text[0] == '/')
             {
-                // you can extend command handling here; for now reply unknown command
                 telegram_send_message(chat_id, "Unknown command");
             }
             else
@@ -234,56 +836,48 @@ void app_main(void)
         telegram_start();
     }
 
-    // Initialize ADC for LDR readings
-    adc_manager_handle_t *adc_handle = adc_manager_init(ADC_CHANNEL, ADC_ATTEN);
     if (adc_handle == NULL)
     {
         ESP_LOGE(TAG, "Failed to initialize ADC");
         return;
     }
 
-    // Initialize HC-SR04 sensor: trigger GPIO4, echo GPIO5 per user request
-    if (!hcsr04_init(4, 5)) {
-        ESP_LOGW(TAG, "HC-SR04 initialization failed; distance will be unavailable");
-    }
-
-    int adc_raw, voltage;
-
     while (1)
     {
-        if (adc_manager_read_raw(adc_handle, &adc_raw) == ESP_OK)
+        device_attributes_refresh();
+        int32_t sample[3];
+        uint32_t present = 0;
+        char payload[192];
+        // publish telemetry JSON to ThingsBoard
+        if (read_sample(adc_handle, sample, &present) && format_sample_json(payload, sizeof(payload), sample, present) > 0)
         {
-            ESP_LOGI(TAG, "ADC Raw Data: %d", adc_raw);
-
-            if (adc_manager_read_voltage(adc_handle, &voltage) == ESP_OK)
-            {
-                int resistance = adc_manager_calc_ohm(adc_raw);
-                ESP_LOGI(TAG, "Voltage: %d mV, Resistance: %.3f kOhm", voltage, resistance / 1000.0);
-
-                // read HC-SR04 distance (optional)
-                uint32_t distance_mm = 0;
-                bool have_distance = hcsr04_read_mm(&distance_mm);
-
-                // publish telemetry JSON to ThingsBoard
-                char payload[192];
-                int len;
-                if (have_distance) {
-                    /* cast to unsigned long for portability with printf format */
-                    len = snprintf(payload, sizeof(payload), "{\"voltage_mV\":%d,\"ohms\":%d,\"distance_mm\":%lu}", voltage, resistance, (unsigned long)distance_mm);
-                } else {
-                    len = snprintf(payload, sizeof(payload), "{\"voltage_mV\":%d,\"ohms\":%d}", voltage, resistance);
-                }
-                    if (len > 0 && len < sizeof(payload))
-                    {
-                        mqtt_publish_telemetry(payload);
-                        // after publishing, do not immediately enter deep sleep here.
-                        // Deep-sleep will be triggered by the idle countdown started
-                        // after the Telegram initial sync, or by an explicit /deepsleep
-                        // command which uses deepsleep_manager_force_sleep().
-                    }
+            bool breach = (present & 0x4) && sample[2] < ALERT_DISTANCE_MM;
+            bool urgent = breach != s_distance_breach;
+            s_distance_breach = breach;
+            // sample-only wakes compare against the state this boot leaves behind
+            if (present & 0x4) rtc_batch_set_alert(breach);
+            if (urgent) {
+                telemetry_publish_urgent(payload);
+            } else {
+                telemetry_publish(payload);
             }
+            history_append_sample(sample, present, urgent);
+            history_note_outage();
+            telemetry_binary_append(sample, present);
+            rules_engine_evaluate(sample, present);
+            // after publishing, do not immediately enter deep sleep here.
+            // Deep-sleep will be triggered by the idle countdown started
+            // after the Telegram initial sync, or by an explicit /deepsleep
+            // command which uses deepsleep_manager_force_sleep().
+        }
+        // Wait for the next sample; an RPC that changes the rate or starts a
+        // burst notifies this task so the new setting takes effect at once.
+        uint32_t wait_ms = s_sample_period_ms;
+        if (s_burst_remaining > 0) {
+            s_burst_remaining--;
+            wait_ms = s_burst_interval_ms;
         }
-        vTaskDelay(pdMS_TO_TICKS(5000));
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait_ms));
     }
 
     // Clean up (not reached in this case)
@@ -0,0 +1,220 @@
+/*
+ * failover_test.c
+ *
+ * Host test for components/mqtt_manager/mqtt_failover.c with two brokers.
+ * The brokers are real TCP listeners on 127.0.0.1, so the fail-back probes
+ * go through the component's own connect code. The esp-mqtt client is
+ * simulated: it connects to the active broker when its listener is up and
+ * reports a failed attempt otherwise. Time is virtual; every vTaskDelay()
+ * of the monitor task advances the clock and steps the simulation.
+ *
+ * Scenario: connect to the primary, close the primary's listener and expect
+ * the switch to the secondary, reopen it and expect the switch back once
+ * its hold-down has passed and the probes succeed.
+ *
+ * Build and run from the repository root:
+ *   cc -O2 -Itools/failover_test/host_include -Icomponents/mqtt_manager/include \
+ *      -Icomponents/mqtt_manager -Icomponents/egress_governor/include \
+ *      tools/failover_test/failover_test.c components/mqtt_manager/mqtt_failover.c -o /tmp/failover_test
+ *   /tmp/failover_test
+ */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/task.h"
+#include "mqtt_internal.h"
+
+typedef struct {
+    const char *name;
+    uint16_t port;
+    int fd; /* listening socket, -1 while the broker is down */
+    char uri[64];
+} broker_t;
+
+static broker_t s_broker[2] = { { "primary", 0, -1, "" }, { "secondary", 0, -1, "" } };
+static int64_t s_now_us;
+static TaskFunction_t s_task_fn;
+static jmp_buf s_done;
+static int s_failures;
+
+/* Simulated esp-mqtt client */
+static const char *s_client_uri;
+static bool s_connected;
+
+/* ---- host stand-ins ---- */
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *fmt, ...)
+{
+    if (level == ESP_LOG_DEBUG) return;
+    va_list ap;
+    va_start(ap, fmt);
+    printf("%7.1f s %s: ", s_now_us / 1e6, tag);
+    vprintf(fmt, ap);
+    printf("\n");
+    va_end(ap);
+}
+
+int64_t esp_timer_get_time(void)
+{
+    return s_now_us;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t prio, TaskHandle_t *handle)
+{
+    s_task_fn = fn;
+    *handle = (TaskHandle_t)fn;
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    s_task_fn = NULL;
+}
+
+bool mqtt_is_connected(void)
+{
+    return s_connected;
+}
+
+void mqtt_reconnect_to(const char *uri, const char *access_token)
+{
+    s_client_uri = uri;
+    s_connected = false;
+}
+
+/* ---- brokers ---- */
+
+static void broker_up(broker_t *b)
+{
+    struct sockaddr_in a = { .sin_family = AF_INET, .sin_port = htons(b->port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    int one = 1;
+    b->fd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(b->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (b->fd < 0 || bind(b->fd, (struct sockaddr *)&a, sizeof(a)) != 0 || listen(b->fd, 4) != 0)
+    {
+        perror("listen");
+        exit(2);
+    }
+    socklen_t len = sizeof(a);
+    getsockname(b->fd, (struct sockaddr *)&a, &len);
+    b->port = ntohs(a.sin_port);
+    snprintf(b->uri, sizeof(b->uri), "mqtt://127.0.0.1:%u", (unsigned)b->port);
+    printf("%7.1f s test: %s broker up on port %u\n", s_now_us / 1e6, b->name, (unsigned)b->port);
+}
+
+static void broker_down(broker_t *b)
+{
+    close(b->fd);
+    b->fd = -1;
+    printf("%7.1f s test: %s broker down\n", s_now_us / 1e6, b->name);
+}
+
+static bool broker_is_up(const char *uri)
+{
+    for (int i = 0; i < 2; i++)
+        if (strcmp(uri, s_broker[i].uri) == 0) return s_broker[i].fd >= 0;
+    return false;
+}
+
+// One step of the simulated client, mirroring what mqtt.c reports from esp-mqtt events.
+static void client_step(void)
+{
+    if (s_connected && !broker_is_up(s_client_uri))
+    {
+        s_connected = false;
+        mqtt_failover_on_disconnected();
+    }
+    else if (!s_connected)
+    {
+        mqtt_failover_on_attempt();
+        if (broker_is_up(s_client_uri))
+        {
+            s_connected = true;
+            mqtt_failover_on_connected();
+        }
+        else
+        {
+            mqtt_failover_on_error(true);
+        }
+    }
+}
+
+/* ---- scenario ---- */
+
+typedef struct {
+    int64_t at_s;
+    const char *what;
+    int expect_active; /* -1: no check */
+    uint32_t expect_failovers;
+} step_t;
+
+static const step_t s_steps[] = {
+    { 30, "connected to the primary", 0, 0 },
+    { 40, "primary goes down", -1, 0 },
+    { 120, "switched to the secondary", 1, 1 },
+    { 170, "still on the secondary while the primary is down", 1, 1 },
+    { 180, "primary comes back", -1, 0 },
+    { 480, "switched back to the primary", 0, 2 },
+};
+static size_t s_step;
+
+static void check(const step_t *st)
+{
+    uint32_t failovers;
+    int active = mqtt_failover_active(&failovers);
+    bool ok = active == st->expect_active && failovers == st->expect_failovers && s_connected &&
+              strcmp(s_client_uri, s_broker[active].uri) == 0;
+    printf("%7.1f s test: %s: %s (active=%d failovers=%u connected=%d)\n", s_now_us / 1e6, st->what,
+           ok ? "ok" : "FAILED", active, (unsigned)failovers, s_connected);
+    if (!ok) s_failures++;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    s_now_us += (int64_t)ticks * 1000;
+    client_step();
+    while (s_step < sizeof(s_steps) / sizeof(s_steps[0]) && s_now_us >= s_steps[s_step].at_s * 1000000)
+    {
+        const step_t *st = &s_steps[s_step++];
+        if (st->expect_active >= 0) check(st);
+        else if (strstr(st->what, "down")) broker_down(&s_broker[0]);
+        else broker_up(&s_broker[0]);
+    }
+    if (s_step == sizeof(s_steps) / sizeof(s_steps[0])) longjmp(s_done, 1);
+}
+
+int main(void)
+{
+    broker_up(&s_broker[0]);
+    broker_up(&s_broker[1]);
+    mqtt_failover_reset();
+    mqtt_failover_add(s_broker[0].uri, "token-a", 0);
+    mqtt_failover_add(s_broker[1].uri, "token-b", 1);
+
+    const char *uri, *token;
+    if (!mqtt_failover_select(&uri, &token) || strcmp(uri, s_broker[0].uri) != 0)
+    {
+        printf("FAILED: initial selection is not the primary\n");
+        return 1;
+    }
+    s_client_uri = uri;
+    mqtt_failover_start();
+    if (!s_task_fn)
+    {
+        printf("FAILED: monitor task not started for two brokers\n");
+        return 1;
+    }
+    if (setjmp(s_done) == 0) s_task_fn(NULL);
+
+    printf("%s\n", s_failures ? "FAILED" : "ok");
+    return s_failures ? 1 : 0;
+}
@@ -0,0 +1,12 @@
+/* Host stand-in for the FreeRTOS header, enough to build mqtt_failover.c. */
+#pragma once
+#include <stdint.h>
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(mux) ((void)(mux))
+#define portEXIT_CRITICAL(mux) ((void)(mux))
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define pdPASS 1
@@ -0,0 +1,9 @@
+/* Host stand-in for the FreeRTOS header, enough to build mqtt_failover.c. */
+#pragma once
+#include "FreeRTOS.h"
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+#define tskIDLE_PRIORITY 0
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t prio, TaskHandle_t *handle);
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
@@ -0,0 +1,3 @@
+/* Host stand-in: lwIP's resolver API is the POSIX one. */
+#pragma once
+#include <netdb.h>
@@ -0,0 +1,7 @@
+/* Host stand-in: lwIP's BSD socket API is the POSIX one. */
+#pragma once
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
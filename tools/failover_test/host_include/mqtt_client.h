@@ -0,0 +1,4 @@
+/* Host stand-in for the esp-mqtt header, enough to include mqtt_internal.h. */
+#pragma once
+typedef struct esp_mqtt_client *esp_mqtt_client_handle_t;
+typedef struct esp_mqtt_client_config esp_mqtt_client_config_t;
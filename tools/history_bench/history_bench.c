@@ -0,0 +1,431 @@
+/*
+ * history_bench.c
+ *
+ * Host benchmark for components/history: fills an emulated 384 KiB
+ * "history" partition with a synthetic month of 5 s light/distance
+ * samples, then runs typical history_query() calls on a steady channel and
+ * on one with gaps (a probe that drops out for minutes at a time, so
+ * rollup buckets hold it for only some of their samples). Eight hours
+ * before the end the node reboots without a clock and logs two hours of
+ * samples with ms-since-boot timestamps before SNTP comes back, as
+ * main.c does. For each query it reports the points returned, flash reads,
+ * bytes read and host time, checks the number of points and their values
+ * against the aggregates of the generated wall-clock samples, and compares
+ * with a linear scan of the raw tier. A short run with a reboot early on,
+ * where whole segments start with boot-relative rows, is checked first on
+ * an empty partition.
+ *
+ * Build and run from the repository root:
+ *   cc -O2 -Itools/history_bench/host_include -Icomponents/history/include \
+ *      tools/history_bench/history_bench.c components/history/history.c -lm -o /tmp/history_bench
+ *   /tmp/history_bench [days]
+ */
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "esp_system.h"
+#include "freertos/semphr.h"
+#include "history.h"
+
+#define PART_SIZE 0x60000
+#define PERIOD_MS 5000
+/* Samples logged with ms-since-boot timestamps, and where in the trace. */
+#define BOOT_ROWS 1500
+#define BOOT_AT_FROM_END (8 * 3600 * 1000 / PERIOD_MS)
+
+static uint8_t s_flash[PART_SIZE];
+static const esp_partition_t s_part = { .type = ESP_PARTITION_TYPE_DATA, .size = PART_SIZE, .label = "history" };
+static struct {
+    unsigned long reads, read_bytes, write_bytes, erases;
+} s_io;
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label)
+{
+    return &s_part;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *part, size_t offset, void *dst, size_t len)
+{
+    if (offset + len > PART_SIZE) return ESP_FAIL;
+    memcpy(dst, s_flash + offset, len);
+    s_io.reads++;
+    s_io.read_bytes += len;
+    return ESP_OK;
+}
+
+// NOR flash: programming only clears bits
+esp_err_t esp_partition_write(const esp_partition_t *part, size_t offset, const void *src, size_t len)
+{
+    if (offset + len > PART_SIZE) return ESP_FAIL;
+    for (size_t i = 0; i < len; ++i) s_flash[offset + i] &= ((const uint8_t *)src)[i];
+    s_io.write_bytes += len;
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *part, size_t offset, size_t len)
+{
+    if (offset % 4096 || len % 4096 || offset + len > PART_SIZE) return ESP_FAIL;
+    memset(s_flash + offset, 0xFF, len);
+    s_io.erases += len / 4096;
+    return ESP_OK;
+}
+
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len)
+{
+    crc = ~crc;
+    while (len--)
+    {
+        crc ^= *buf++;
+        for (int k = 0; k < 8; ++k) crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+    }
+    return ~crc;
+}
+
+uint16_t esp_rom_crc16_le(uint16_t crc, const uint8_t *buf, uint32_t len)
+{
+    crc = (uint16_t)~crc;
+    while (len--)
+    {
+        crc ^= *buf++;
+        for (int k = 0; k < 8; ++k) crc = crc & 1 ? (uint16_t)((crc >> 1) ^ 0x8408) : (uint16_t)(crc >> 1);
+    }
+    return (uint16_t)~crc;
+}
+
+esp_reset_reason_t esp_reset_reason(void) { return ESP_RST_POWERON; }
+SemaphoreHandle_t xSemaphoreCreateMutex(void) { return (SemaphoreHandle_t)1; }
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks) { return 1; }
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem) { return 1; }
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *fmt, ...)
+{
+    if (level > ESP_LOG_WARN) return;
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "%s: ", tag);
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+}
+
+/* ---- synthetic samples ---- */
+
+static const char *const s_channels[] = { "voltage_mV", "ohms", "distance_mm", "probe_dC" };
+static history_record_t *s_trace;
+static size_t s_count;
+static size_t s_boot_at;     /* s_trace index the boot-relative rows are logged before */
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Daylight cycle on the LDR, a door opening every 10 minutes, sensor noise and timer jitter.
+// The temperature probe is missing for one 3 minute stretch in five and drops 10% of its readings.
+static void make_trace(int days)
+{
+    s_count = (size_t)days * 86400 * 1000 / PERIOD_MS;
+    s_trace = calloc(s_count, sizeof(*s_trace));
+    srand(1);
+    int64_t ts = 1700000000000LL;
+    s_boot_at = s_count > 2 * BOOT_AT_FROM_END ? s_count - BOOT_AT_FROM_END : 0;
+    for (size_t i = 0; i < s_count; ++i)
+    {
+        history_record_t *r = &s_trace[i];
+        ts += PERIOD_MS + rand() % 7 - 3;
+        // the boot-relative rows take the place of this stretch of wall-clock time
+        if (s_boot_at && i == s_boot_at) ts += (int64_t)BOOT_ROWS * PERIOD_MS;
+        double lux = 0.5 + 0.5 * sin(2 * M_PI * (double)(ts % 86400000) / 86400000.0);
+        int ohms = (int)(2000 + 40000 * (1 - lux)) + rand() % 121 - 60;
+        r->ts_ms = ts;
+        r->seq = (uint32_t)i;
+        r->flags = HISTORY_FLAG_WALLCLOCK;
+        r->values[0] = (int)(3300.0 * 10000 / (10000 + ohms)) + rand() % 5 - 2;
+        r->values[1] = ohms;
+        r->present = 0x3;
+        if (rand() % 50)
+        {
+            r->values[2] = 850 + ((i / 120) % 2 ? 400 : 0) + rand() % 9 - 4;
+            r->present |= 0x4;
+        }
+        if ((i / 37) % 5 && rand() % 10)
+        {
+            r->values[3] = 215 + (int)(40 * sin(2 * M_PI * (double)(ts % 86400000) / 86400000.0)) + rand() % 5 - 2;
+            r->present |= 0x8;
+        }
+    }
+}
+
+/* ---- queries ---- */
+
+typedef struct {
+    int64_t ts;
+    int32_t value;
+    uint32_t samples;
+} point_t;
+
+typedef struct {
+    point_t pts[4096];
+    int n;
+} points_t;
+
+static bool collect(int64_t ts_ms, int32_t value, uint32_t samples, void *ctx)
+{
+    points_t *p = ctx;
+    if (p->n < (int)(sizeof(p->pts) / sizeof(p->pts[0]))) p->pts[p->n++] = (point_t){ ts_ms, value, samples };
+    return true;
+}
+
+// A sample logged before SNTP: the same kind of reading, stamped with ms since boot.
+static void append_boot_rows(void)
+{
+    for (int k = 0; k < BOOT_ROWS; ++k)
+    {
+        history_record_t rec = { .ts_ms = 3000 + (int64_t)k * PERIOD_MS, .seq = 5000000 + k, .present = 0x7 };
+        rec.values[0] = 1650 + rand() % 5 - 2;
+        rec.values[1] = 10000 + rand() % 121 - 60;
+        rec.values[2] = 850 + rand() % 9 - 4;
+        history_append(&rec);
+    }
+}
+
+// Points a query over [t0, t1) should return: steps with samples of channel `ch`.
+static int reference_points(int ch, int64_t t0, int64_t t1, uint32_t step)
+{
+    int n = 0;
+    int64_t last = 0;
+    for (size_t i = 0; i < s_count; ++i)
+    {
+        const history_record_t *r = &s_trace[i];
+        if (r->ts_ms < t0 || r->ts_ms >= t1 || !(r->present & (1u << ch))) continue;
+        int64_t start = step ? r->ts_ms - r->ts_ms % step : r->ts_ms;
+        if (!n || start != last) n++;
+        last = start;
+    }
+    return n;
+}
+
+// Aggregate of the generated samples of channel `ch` over [t, t + step).
+static bool reference(int ch, int64_t t, uint32_t step, history_agg_t agg, int32_t *out, uint32_t *n_out)
+{
+    size_t lo = 0, hi = s_count;
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (s_trace[mid].ts_ms < t) lo = mid + 1;
+        else hi = mid;
+    }
+    int64_t sum = 0;
+    uint32_t n = 0;
+    int32_t mn = 0, mx = 0;
+    for (size_t i = lo; i < s_count && s_trace[i].ts_ms < t + (step ? step : 1); ++i)
+    {
+        if (!(s_trace[i].present & (1u << ch))) continue;
+        int32_t v = s_trace[i].values[ch];
+        if (!n || v < mn) mn = v;
+        if (!n || v > mx) mx = v;
+        sum += v;
+        n++;
+    }
+    if (!n) return false;
+    *n_out = n;
+    switch (agg)
+    {
+    case HISTORY_AGG_MIN: *out = mn; break;
+    case HISTORY_AGG_MAX: *out = mx; break;
+    case HISTORY_AGG_COUNT: *out = (int32_t)n; break;
+    default: *out = (int32_t)llround((double)sum / n); break;
+    }
+    return true;
+}
+
+// Same query by decoding the raw tier from its oldest sample.
+static int linear_scan(int ch, int64_t t0, int64_t t1, uint32_t step, history_agg_t agg, points_t *out)
+{
+    history_cursor_t cur;
+    history_record_t rec;
+    history_cursor_oldest(&cur, HISTORY_TIER_RAW);
+    int64_t start = 0, sum = 0;
+    uint32_t n = 0;
+    int32_t mn = 0, mx = 0;
+    out->n = 0;
+    while (history_read(&cur, &rec))
+    {
+        if (!(rec.flags & HISTORY_FLAG_WALLCLOCK) || rec.ts_ms < t0 || !(rec.present & (1u << ch))) continue;
+        if (rec.ts_ms >= t1) break;
+        int64_t s = step ? rec.ts_ms - rec.ts_ms % step : rec.ts_ms;
+        if (n && s != start)
+        {
+            collect(start, agg == HISTORY_AGG_MIN ? mn : agg == HISTORY_AGG_MAX ? mx : agg == HISTORY_AGG_COUNT ? (int32_t)n : (int32_t)llround((double)sum / n), n, out);
+            n = 0;
+            sum = 0;
+        }
+        int32_t v = rec.values[ch];
+        if (!n || v < mn) mn = v;
+        if (!n || v > mx) mx = v;
+        start = s;
+        sum += v;
+        n++;
+    }
+    if (n) collect(start, agg == HISTORY_AGG_MIN ? mn : agg == HISTORY_AGG_MAX ? mx : agg == HISTORY_AGG_COUNT ? (int32_t)n : (int32_t)llround((double)sum / n), n, out);
+    return out->n;
+}
+
+static bool count_point(int64_t ts_ms, int32_t value, uint32_t samples, void *ctx)
+{
+    uint32_t *n = ctx;
+    n[0]++;
+    n[1] += samples;
+    return true;
+}
+
+// 3000 wall-clock samples, 1500 stamped with ms since boot, 3000 more wall-clock ones,
+// then queries over the first stretch on every tier. Needs a fresh partition.
+static int mixed_clock_check(void)
+{
+    memset(s_flash, 0xFF, sizeof(s_flash));
+    if (!history_init(s_channels, 4)) return 1;
+    const int64_t t0 = 1700000000000LL;
+    history_record_t rec = { .present = 0x3, .values = { 1650, 10000 } };
+    for (int i = 0; i < 7500; ++i)
+    {
+        bool boot = i >= 3000 && i < 4500;
+        rec.seq = (uint32_t)i;
+        rec.flags = boot ? 0 : HISTORY_FLAG_WALLCLOCK;
+        rec.ts_ms = boot ? 3000 + (int64_t)(i - 3000) * PERIOD_MS : t0 + (int64_t)i * PERIOD_MS;
+        history_append(&rec);
+    }
+    static const uint32_t steps[] = { 0, 60000, 900000, 3600000 };
+    int failures = 0;
+    printf("mixed clocks: 3000 wall-clock, 1500 boot-relative, 3000 wall-clock samples\n");
+    for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); ++i)
+    {
+        uint32_t got[2] = { 0, 0 };
+        history_query("ohms", t0, t0 + 3000LL * PERIOD_MS, steps[i], HISTORY_AGG_MEAN, count_point, got);
+        int64_t last = t0 + 2999LL * PERIOD_MS;
+        uint32_t want = steps[i] ? (uint32_t)((last - last % steps[i] - (t0 - t0 % steps[i])) / steps[i] + 1) : 3000;
+        bool ok = got[0] == want && got[1] == 3000;
+        printf("  first stretch, step %7lu ms: %5lu points, %4lu samples (want %lu, 3000) %s\n", (unsigned long)steps[i],
+               (unsigned long)got[0], (unsigned long)got[1], (unsigned long)want, ok ? "ok" : "FAILED");
+        if (!ok) failures++;
+    }
+    return failures ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    // the mixed-clock run needs the component and the partition to itself
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0)
+    {
+        int rc = mixed_clock_check();
+        fflush(stdout);
+        _exit(rc);
+    }
+    int status = 1;
+    if (child < 0 || waitpid(child, &status, 0) != child) status = 1;
+    bool mixed_ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    printf("\n");
+
+    int days = argc > 1 ? atoi(argv[1]) : 30;
+    if (days <= 0) days = 30;
+    memset(s_flash, 0xFF, sizeof(s_flash));
+    make_trace(days);
+    if (!history_init(s_channels, 4))
+    {
+        fprintf(stderr, "history_init failed\n");
+        return 1;
+    }
+
+    double t = now_us();
+    for (size_t i = 0; i < s_count; ++i)
+    {
+        if (s_boot_at && i == s_boot_at) append_boot_rows();
+        history_append(&s_trace[i]);
+    }
+    t = now_us() - t;
+    printf("appended %zu samples (%d days at %d ms, %d of them before SNTP): %.2f us/sample on the host, %lu KiB programmed, %lu sector erases\n",
+           s_count + (s_boot_at ? BOOT_ROWS : 0), days, PERIOD_MS, s_boot_at ? BOOT_ROWS : 0, t / s_count, s_io.write_bytes / 1024, s_io.erases);
+    static const char *const tier_names[] = { "raw", "minute", "hour" };
+    for (int tier = 0; tier < HISTORY_TIER_COUNT; ++tier)
+    {
+        history_stats_t st;
+        history_get_stats((history_tier_t)tier, &st);
+        printf("  %-6s %3lu sectors, %4lu/%4lu blocks, %.1f bits/row\n", tier_names[tier], (unsigned long)st.sectors,
+               (unsigned long)st.blocks, (unsigned long)st.capacity,
+               st.sealed_samples ? st.sealed_bytes * 8.0 / st.sealed_samples : 0.0);
+    }
+
+    int64_t end = s_trace[s_count - 1].ts_ms + 1;
+    const struct {
+        const char *name;
+        int64_t span;
+        uint32_t step;
+        history_agg_t agg;
+        bool linear;             /* also time a linear scan of the raw tier */
+    } queries[] = {
+        { "last hour, raw", 3600000LL, 0, HISTORY_AGG_MEAN, true },
+        { "last 12 h, raw", 12 * 3600000LL, 0, HISTORY_AGG_MEAN, false },
+        { "last 24 h, 15 min mean", 86400000LL, 900000, HISTORY_AGG_MEAN, true },
+        { "last 24 h, 1 h max", 86400000LL, 3600000, HISTORY_AGG_MAX, true },
+        { "last 7 days, 1 h mean", 7 * 86400000LL, 3600000, HISTORY_AGG_MEAN, false },
+        { "last 30 days, 1 day min", 30 * 86400000LL, 86400000, HISTORY_AGG_MIN, false },
+        { "last 7 days, 1 h count", 7 * 86400000LL, 3600000, HISTORY_AGG_COUNT, false },
+    };
+    static const int metrics[] = { 1, 2, 3 }; /* ohms, distance_mm (~2% absent), probe_dC */
+
+    static points_t got, lin;
+    int failures = 0;
+    for (size_t m = 0; m < sizeof(metrics) / sizeof(metrics[0]); ++m)
+    {
+        int ch = metrics[m];
+        char title[40];
+        snprintf(title, sizeof(title), "query (%s)", s_channels[ch]);
+        printf("\n%-26s %6s %7s %9s %9s %9s\n", title, "points", "reads", "bytes", "host us", "checked");
+        for (size_t q = 0; q < sizeof(queries) / sizeof(queries[0]); ++q)
+        {
+            int64_t t0 = end - queries[q].span;
+            got.n = 0;
+            memset(&s_io, 0, sizeof(s_io));
+            t = now_us();
+            int n = history_query(s_channels[ch], t0, end, queries[q].step, queries[q].agg, collect, &got);
+            t = now_us() - t;
+            // the first step may start before the data the tier still holds
+            int want_points = reference_points(ch, t0, end, queries[q].step);
+            int bad = abs(want_points - n);
+            for (int i = 1; i < got.n; ++i)
+            {
+                int32_t want;
+                uint32_t samples;
+                bool ok = reference(ch, got.pts[i].ts, queries[q].step, queries[q].agg, &want, &samples);
+                int32_t tol = queries[q].agg == HISTORY_AGG_MEAN ? 1 : 0;
+                if (!ok || abs(got.pts[i].value - want) > tol || got.pts[i].samples != samples) bad++;
+            }
+            failures += bad;
+            printf("%-26s %6d %7lu %9lu %9.0f %6d bad\n", queries[q].name, n, s_io.reads, s_io.read_bytes, t, bad);
+            if (n != want_points) printf("%-26s %6d expected\n", "", want_points);
+            if (!queries[q].linear) continue;
+            memset(&s_io, 0, sizeof(s_io));
+            t = now_us();
+            linear_scan(ch, t0, end, queries[q].step, queries[q].agg, &lin);
+            t = now_us() - t;
+            printf("%-26s %6d %7lu %9lu %9.0f\n", "  linear raw scan", lin.n, s_io.reads, s_io.read_bytes, t);
+        }
+    }
+    if (!mixed_ok) failures++;
+    printf("\n%s\n", failures ? "MISMATCHES" : "all points match the generated samples");
+    free(s_trace);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,4 @@
+/* Host stand-in for the ESP-IDF header, enough to build components/history. */
+#pragma once
+#define RTC_DATA_ATTR
+#define RTC_NOINIT_ATTR
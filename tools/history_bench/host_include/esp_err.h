@@ -0,0 +1,6 @@
+/* Host stand-in for the ESP-IDF header, enough to build components/history. */
+#pragma once
+#include <stdint.h>
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
@@ -0,0 +1,6 @@
+/* Host stand-in for the ESP-IDF header, enough to build components/history. */
+#pragma once
+#include <stdint.h>
+typedef int BaseType_t;
+typedef uint32_t TickType_t;
+#define portMAX_DELAY 0xFFFFFFFFu
@@ -0,0 +1,7 @@
+/* Host stand-in for the ESP-IDF header, enough to build components/history. */
+#pragma once
+#include "FreeRTOS.h"
+typedef void *SemaphoreHandle_t;
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem);
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""Packer for the read-only asset partition.
+
+Builds the image that components/assets/assets.c maps from the "assets"
+partition: a header, an index of {name, offset, size} entries and the
+file data, each file followed by a NUL so text assets can be used as C
+strings in place. The layout is documented at the top of assets.c.
+
+The main component runs this at build time and flashes the result with
+`idf.py flash`; it can also be run by hand:
+
+  pack_assets.py -o assets.bin filesystem/index.htm filesystem/ca_root.pem
+  pack_assets.py --list assets.bin          print the index of an image
+  [--size 0x10000]                          partition size the image must fit
+"""
+
+import argparse
+import os
+import struct
+import sys
+import zlib
+
+MAGIC = 0x31545341  # "AST1"
+VERSION = 1
+HEADER = struct.Struct("<IHHII")
+ENTRY = struct.Struct("<24sII")
+NAME_LEN = 24
+
+
+def pack(files):
+    """files: list of (name, bytes). Returns the image bytes."""
+    names = set()
+    for name, _ in files:
+        if len(name.encode()) >= NAME_LEN:
+            raise ValueError("asset name too long: %s" % name)
+        if name in names:
+            raise ValueError("duplicate asset: %s" % name)
+        names.add(name)
+
+    offset = HEADER.size + ENTRY.size * len(files)
+    index, data = b"", b""
+    for name, body in files:
+        index += ENTRY.pack(name.encode(), offset + len(data), len(body))
+        blob = body + b"\0"
+        blob += b"\0" * (-len(blob) % 4)
+        data += blob
+    body = index + data
+    size = HEADER.size + len(body)
+    return HEADER.pack(MAGIC, VERSION, len(files), size, zlib.crc32(body)) + body
+
+
+def unpack(image):
+    """Returns [(name, bytes)]; raises ValueError for a damaged image."""
+    magic, version, count, size, crc = HEADER.unpack_from(image)
+    if magic != MAGIC or version != VERSION:
+        raise ValueError("not an asset image")
+    if size > len(image) or zlib.crc32(image[HEADER.size:size]) != crc:
+        raise ValueError("bad size or CRC")
+    files = []
+    for i in range(count):
+        raw, off, length = ENTRY.unpack_from(image, HEADER.size + i * ENTRY.size)
+        files.append((raw.rstrip(b"\0").decode(), image[off:off + length]))
+    return files
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("files", nargs="*", help="files to pack; stored under their base name")
+    ap.add_argument("-o", "--output", help="image to write")
+    ap.add_argument("--size", type=lambda s: int(s, 0), default=0x10000, help="partition size")
+    ap.add_argument("--list", metavar="IMAGE", help="print the index of an image and exit")
+    args = ap.parse_args()
+
+    if args.list:
+        with open(args.list, "rb") as f:
+            for name, body in unpack(f.read()):
+                print("%-24s %7d" % (name, len(body)))
+        return 0
+
+    if not args.output:
+        ap.error("-o is required")
+    files = []
+    for path in args.files:
+        if not os.path.isfile(path):
+            print("pack_assets: skipping missing %s" % path, file=sys.stderr)
+            continue
+        with open(path, "rb") as f:
+            files.append((os.path.basename(path), f.read()))
+    image = pack(files)
+    if len(image) > args.size:
+        print("pack_assets: image is %d bytes, partition holds %d" % (len(image), args.size), file=sys.stderr)
+        return 1
+    assert unpack(image) == files
+    with open(args.output, "wb") as f:
+        f.write(image)
+    print("pack_assets: %d files, %d bytes -> %s" % (len(files), len(image), args.output))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+"""Check exported telemetry for missing and duplicated sequence numbers.
+
+Every telemetry record carries a boot-spanning "seq" key (components/telemetry).
+This script reads an export of that key and reports:
+
+  * gaps      - seq ranges that never reached the server
+  * reboots   - gaps ending on a multiple of the checkpoint stride; after a
+                power loss the device skips the rest of its reserved block,
+                so these are expected and do not mean lost readings
+  * duplicates - one seq stored under different timestamps (a record sent
+                twice with a new timestamp). The same seq and timestamp
+                seen twice is an idempotent replay and is ignored.
+
+Accepted inputs (format picked from the content):
+  * ThingsBoard REST response of
+    /api/plugins/telemetry/DEVICE/<id>/values/timeseries?keys=seq&...
+    i.e. {"seq": [{"ts": 1700000000000, "value": "42"}, ...]}
+  * a JSON list or JSON lines of records, either {"ts":..,"values":{"seq":..}}
+    or flat {"ts":..,"seq":..}
+  * CSV with a "seq" column and an optional "ts"/"Timestamp" column
+    (ThingsBoard widget export)
+
+Usage: seq_gap_check.py [--stride 64] export.json [more files...]
+Exit status is 1 when unexplained gaps or duplicates are found.
+"""
+
+import argparse
+import csv
+import io
+import json
+import sys
+
+
+def _record(obj):
+    """Return (seq, ts) from one record dict, or None."""
+    values = obj.get("values", obj)
+    if "seq" not in values:
+        return None
+    return int(values["seq"]), obj.get("ts")
+
+
+def parse(text):
+    text = text.strip()
+    if not text:
+        return []
+    if text[0] in "[{":
+        try:
+            data = json.loads(text)
+        except json.JSONDecodeError:
+            data = [json.loads(line) for line in text.splitlines() if line.strip()]
+        if isinstance(data, dict) and isinstance(data.get("seq"), list):
+            return [(int(p["value"]), p.get("ts")) for p in data["seq"]]
+        if isinstance(data, dict):
+            data = [data]
+        return [r for r in (_record(o) for o in data) if r is not None]
+
+    rows = csv.DictReader(io.StringIO(text))
+    out = []
+    for row in rows:
+        seq = row.get("seq")
+        if seq in (None, ""):
+            continue
+        ts = row.get("ts") or row.get("Timestamp")
+        out.append((int(float(seq)), ts))
+    return out
+
+
+def check(records, stride):
+    by_seq = {}
+    for seq, ts in records:
+        by_seq.setdefault(seq, set()).add(ts)
+
+    duplicates = {s: sorted(map(str, t)) for s, t in by_seq.items() if len(t) > 1}
+    seqs = sorted(by_seq)
+    gaps, reboots = [], []
+    for prev, cur in zip(seqs, seqs[1:]):
+        if cur - prev > 1:
+            rng = (prev + 1, cur - 1)
+            # restart from the NVS checkpoint: the next block starts on a stride boundary
+            if stride and cur % stride == 0 and cur - prev <= stride:
+                reboots.append(rng)
+            else:
+                gaps.append(rng)
+    return seqs, gaps, reboots, duplicates
+
+
+def main(argv=None):
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("files", nargs="+", help="exported telemetry ('-' for stdin)")
+    ap.add_argument("--stride", type=int, default=64, help="TELEMETRY_SEQ_STRIDE of the firmware (0 disables reboot detection)")
+    args = ap.parse_args(argv)
+
+    records = []
+    for path in args.files:
+        if path == "-":
+            records += parse(sys.stdin.read())
+        else:
+            with open(path, encoding="utf-8") as f:
+                records += parse(f.read())
+
+    seqs, gaps, reboots, duplicates = check(records, args.stride)
+    if not seqs:
+        print("no seq values found")
+        return 1
+
+    missing = sum(b - a + 1 for a, b in gaps)
+    print(f"records: {len(records)}  unique seq: {len(seqs)}  range: {seqs[0]}..{seqs[-1]}")
+    for a, b in gaps:
+        print(f"gap: {a}..{b} ({b - a + 1} missing)")
+    for a, b in reboots:
+        print(f"reboot skip: {a}..{b}")
+    for s, ts in sorted(duplicates.items()):
+        print(f"duplicate: seq {s} at ts {', '.join(ts)}")
+    print(f"missing: {missing}  reboot skips: {len(reboots)}  duplicates: {len(duplicates)}")
+    return 1 if gaps or duplicates else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,272 @@
+#!/usr/bin/env python3
+"""Small-file rewrite cost of the two storage backends of components/persistence.
+
+Neither FatFs/wear_levelling nor LittleFS runs on the host here, so this is
+a model: it replays, operation by operation, the flash traffic each stack
+issues for fopen("w") / fwrite / fclose of one small file, on an emulated
+NOR flash that counts erases, programmed bytes and read bytes and charges
+datasheet timings for them. The sequences follow the ESP-IDF v5.3 sources
+and the esp_littlefs defaults:
+
+  FAT   FatFs, one shared sector window, 4096-byte sectors, 2 FATs (as
+        fat32_mount configures it); every sector write goes through
+        wear_levelling, which erases before writing and moves its dummy
+        sector every 16 erases.
+  LFS   LittleFS 2.x, 4096-byte blocks, 128-byte prog/read size, 512-byte
+        cache (files up to 512 bytes are inlined in the directory's
+        metadata pair), mtime attribute set by a second commit on close;
+        the metadata log is compacted into the other block of the pair
+        when it is full. Block-cycle relocation is not modelled.
+
+Timings are W25Q32-class typicals (sector erase 45 ms, page program 0.4 ms,
+30 us first byte + 2.5 us per byte for short programs, 40 MHz quad read).
+Besides latency and bytes written it reports the "torn window": how long a
+power cut during the rewrite leaves the file empty or half-written. It is
+derived from the same replay: the file is split into the parts a remount
+reads (FAT: directory entry, FAT chain, data; LittleFS: the metadata pair),
+each either old, new, something in between, or garbage while its sector is
+erased and programmed, and a cut is harmless only while all parts are old
+or all are new. All figures are model estimates, not measurements.
+
+  storage_bench.py [-n REWRITES] [--sizes 24,96,480,1400] [--files 6]
+"""
+
+import argparse
+import sys
+
+SECTOR = 4096
+PAGE = 256
+T_ERASE_MS = 45.0
+T_PAGE_MS = 0.4
+T_BYTE1_MS = 0.030
+T_BYTEN_MS = 0.0025
+READ_BPS = 20e6
+
+
+class TornWindow:
+    """Time during which a power cut would leave the file neither old nor new."""
+
+    def __init__(self, parts):
+        self.parts = dict.fromkeys(parts, "old")
+        self.ms = 0.0
+
+    def set(self, part, state):
+        self.parts[part] = state
+
+    def intact(self):
+        states = set(self.parts.values())
+        return states == {"old"} or states == {"new"}
+
+    def advance(self, ms):
+        if not self.intact():
+            self.ms += ms
+
+
+class Flash:
+    """NOR flash cost counter; contents are not stored."""
+
+    def __init__(self):
+        self.erases = self.prog_bytes = self.read_bytes = 0
+        self.ms = 0.0
+        self.torn = TornWindow(())
+
+    def spend(self, ms):
+        self.ms += ms
+        self.torn.advance(ms)
+
+    def erase(self, n=1):
+        self.erases += n
+        self.spend(T_ERASE_MS * n)
+
+    def program(self, addr, size):
+        self.prog_bytes += size
+        while size > 0:
+            chunk = min(size, PAGE - addr % PAGE)
+            self.spend(min(T_PAGE_MS, T_BYTE1_MS + T_BYTEN_MS * (chunk - 1)))
+            addr += chunk
+            size -= chunk
+
+    def read(self, size):
+        self.read_bytes += size
+        self.spend(size / READ_BPS * 1000.0)
+
+
+class WearLevelling:
+    """ESP-IDF wear_levelling: erase + write per sector, dummy move every `updaterate`."""
+
+    def __init__(self, flash, sectors, updaterate=16):
+        self.flash, self.sectors, self.updaterate = flash, sectors, updaterate
+        self.access = self.pos = 0
+
+    def write_sector(self, part=None, state=None):
+        """Rewrite one sector; `part` of the file is garbage until it holds `state`."""
+        if part:
+            self.flash.torn.set(part, "garbage")
+        self.flash.erase()
+        self.flash.program(0, SECTOR)
+        if part:
+            self.flash.torn.set(part, state)
+        self.access += 1
+        if self.access >= self.updaterate:
+            self.access = 0
+            # copy the neighbour into the dummy sector, then record the new position in both state copies
+            self.flash.read(SECTOR)
+            self.flash.erase()
+            self.flash.program(0, SECTOR)
+            self.flash.program(self.pos * 16 % SECTOR, 16)
+            self.flash.program(self.pos * 16 % SECTOR, 16)
+            self.pos += 1
+            if self.pos % (SECTOR // 16 - 2) == 0:
+                self.flash.erase(2)
+                self.flash.program(0, 64)
+                self.flash.program(0, 64)
+
+    def read_sector(self):
+        self.flash.read(SECTOR)
+
+
+class FatFs:
+    """FatFs with one sector window (FF_FS_TINY=0: files have their own buffer)."""
+
+    FAT, DIR, DATA = "fat", "dir", "data"
+    PARTS = (FAT, DIR, DATA)
+
+    def __init__(self, wl):
+        self.wl = wl
+        self.win, self.dirty, self.pending = None, False, None
+
+    def move_window(self, sect):
+        if sect == self.win:
+            return
+        self.sync_window()
+        self.wl.read_sector()
+        self.win = sect
+
+    def mark(self, state):
+        """Change the sector in the window; it reaches flash on the next sync."""
+        self.dirty, self.pending = True, state
+
+    def sync_window(self):
+        if self.dirty:
+            self.wl.write_sector(self.win, self.pending)
+            if self.win == self.FAT:
+                self.wl.write_sector()  # second FAT copy; mount reads the first
+            self.dirty = False
+
+    def rewrite(self, size):
+        # f_open(FA_CREATE_ALWAYS): truncate the entry, free the old chain
+        self.move_window(self.DIR)
+        self.mark("empty")
+        self.move_window(self.FAT)  # remove_chain
+        self.mark("freed")
+        self.move_window(self.DIR)
+        # f_write: allocate clusters; data stays in the file buffer until full
+        self.move_window(self.FAT)
+        self.mark("new")
+        clusters = (size + SECTOR - 1) // SECTOR
+        for _ in range(clusters - 1):
+            self.wl.write_sector(self.DATA, "partial")
+        # f_close -> f_sync: last data sector, then the directory entry
+        self.wl.write_sector(self.DATA, "new")
+        self.move_window(self.DIR)
+        self.mark("new")
+        self.sync_window()
+
+
+class LittleFs:
+    """LittleFS metadata pair for one directory holding `files` small files."""
+
+    PROG = 128
+    INLINE_MAX = 512
+    PARTS = ("meta",)
+
+    def __init__(self, flash, files, size):
+        self.flash = flash
+        # live entries per file: name tag + name, struct tag + inline data/ctz, mtime attr
+        self.others = (files - 1) * (4 + 9 + 4 + 64 + 8) + (4 + 8 + 4 + 24)  # + superblock entries
+        self.used = SECTOR  # force a compaction on the first commit
+        self.size = size
+        self.addr = 0
+
+    def live_bytes(self):
+        inline = self.size if self.size <= self.INLINE_MAX else 8
+        return self.others + 4 + 9 + 4 + inline + 8
+
+    def program_commit(self, nbytes):
+        nbytes = -(-nbytes // self.PROG) * self.PROG
+        self.flash.program(self.addr + self.used, nbytes)
+        self.used += nbytes
+
+    def commit(self, payload, state=None):
+        """Append a commit; a mount ignores it until its CRC tag is programmed."""
+        need = -(-(payload + 8) // self.PROG) * self.PROG  # entries + CRC tag, padded to prog size
+        if self.used + need > SECTOR:
+            # compact into the other block of the pair: erase it, write the revision count and the live entries;
+            # the current block keeps the valid revision until the new one is complete
+            self.flash.erase()
+            self.addr = SECTOR - self.addr
+            self.used = 0
+            self.program_commit(4 + self.live_bytes() + 8)
+        self.flash.read(self.PROG)
+        self.program_commit(payload + 8)
+        if state:
+            self.flash.torn.set("meta", state)
+
+    def rewrite(self, size):
+        self.flash.read(self.used)  # lfs_dir_find walks the metadata log
+        if size > self.INLINE_MAX:
+            # CTZ file: data goes to freshly erased blocks first
+            blocks = (size + SECTOR - 1) // SECTOR
+            self.flash.erase(blocks)
+            self.flash.program(0, -(-size // self.PROG) * self.PROG)
+            struct = 4 + 8
+        else:
+            struct = 4 + size
+        self.commit(struct, "new")  # lfs_file_close: one atomic commit
+        self.commit(4 + 4)  # esp_littlefs sets the mtime attribute afterwards
+
+
+def run(backend, size, files, rewrites):
+    flash = Flash()
+    fs = FatFs(WearLevelling(flash, 64)) if backend == "fat" else LittleFs(flash, files, size)
+    fs.rewrite(size)  # warm-up (first LittleFS compaction)
+    lat, torn = [], []
+    start = (flash.erases, flash.prog_bytes, flash.read_bytes)
+    for _ in range(rewrites):
+        t0 = flash.ms
+        flash.torn = TornWindow(fs.PARTS)  # the previous version is the old one
+        fs.rewrite(size)
+        lat.append(flash.ms - t0)
+        torn.append(flash.torn.ms)
+        if not flash.torn.intact():
+            raise AssertionError(f"{backend}: file not intact after the rewrite: {flash.torn.parts}")
+    lat.sort()
+    return {
+        "mean": sum(lat) / len(lat),
+        "p99": lat[min(len(lat) - 1, int(len(lat) * 0.99))],
+        "erases": (flash.erases - start[0]) / rewrites,
+        "prog": (flash.prog_bytes - start[1]) / rewrites,
+        "read": (flash.read_bytes - start[2]) / rewrites,
+        "torn": max(torn),
+    }
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("-n", "--rewrites", type=int, default=1000)
+    ap.add_argument("--sizes", default="24,96,480,1400", help="file sizes in bytes")
+    ap.add_argument("--files", type=int, default=6, help="files in the directory")
+    args = ap.parse_args()
+
+    print("%-5s %6s %9s %9s %8s %10s %9s %7s %9s" %
+          ("fs", "bytes", "mean ms", "p99 ms", "erases", "written B", "read B", "amp", "torn ms"))
+    for size in (int(s) for s in args.sizes.split(",")):
+        for backend in ("fat", "lfs"):
+            r = run(backend, size, args.files, args.rewrites)
+            print("%-5s %6d %9.1f %9.1f %8.2f %10.0f %9.0f %6.0fx %9.1f" %
+                  (backend, size, r["mean"], r["p99"], r["erases"], r["prog"], r["read"], r["prog"] / size, r["torn"]))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
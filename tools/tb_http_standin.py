@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+"""Local stand-in for the ThingsBoard device HTTP telemetry API.
+
+Accepts POST /api/v1/<token>/telemetry with a JSON object or array (the
+batches sent by components/telemetry/telemetry_http.c). Each record is
+appended to --out as one JSON line, which tools/seq_gap_check.py reads
+directly. HTTP/1.1 keep-alive is supported, so the log shows whether the
+device reuses one connection across batches.
+
+Build the firmware with TB_HTTP_BASE_URL set to http://<host-ip>:8080 and
+point mqtt.txt at an unreachable broker to exercise the fallback.
+
+Usage: tb_http_standin.py [--port 8080] [--token TOKEN] [--fail-every N] [--out records.jsonl]
+"""
+
+import argparse
+import json
+import sys
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+
+def make_handler(args):
+    state = {"posts": 0}
+
+    class Handler(BaseHTTPRequestHandler):
+        protocol_version = "HTTP/1.1"
+
+        def _reply(self, status, body=b""):
+            self.send_response(status)
+            self.send_header("Content-Length", str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+
+        def do_POST(self):
+            parts = self.path.strip("/").split("/")
+            length = int(self.headers.get("Content-Length", 0))
+            body = self.rfile.read(length)
+            if len(parts) != 4 or parts[:2] != ["api", "v1"] or parts[3] != "telemetry":
+                return self._reply(404)
+            if args.token and parts[2] != args.token:
+                return self._reply(401)
+            state["posts"] += 1
+            if args.fail_every and state["posts"] % args.fail_every == 0:
+                self.log_message("simulating failure for post %d", state["posts"])
+                return self._reply(503)
+            try:
+                data = json.loads(body)
+            except json.JSONDecodeError:
+                return self._reply(400)
+            records = data if isinstance(data, list) else [data]
+            with open(args.out, "a", encoding="utf-8") as f:
+                for r in records:
+                    f.write(json.dumps(r) + "\n")
+            self.log_message("post %d from port %d: %d records", state["posts"], self.client_address[1], len(records))
+            self._reply(200)
+
+    return Handler
+
+
+def main(argv=None):
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--port", type=int, default=8080)
+    ap.add_argument("--token", help="only accept this access token")
+    ap.add_argument("--fail-every", type=int, default=0, help="answer every Nth POST with 503")
+    ap.add_argument("--out", default="records.jsonl")
+    args = ap.parse_args(argv)
+    server = ThreadingHTTPServer(("0.0.0.0", args.port), make_handler(args))
+    print(f"listening on :{args.port}, writing {args.out}", file=sys.stderr)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
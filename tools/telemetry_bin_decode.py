@@ -0,0 +1,265 @@
+#!/usr/bin/env python3
+"""Decoder for the compact binary telemetry blocks.
+
+The firmware (components/telemetry/telemetry_binary.c) packs integer
+samples with delta-of-delta timestamps and zigzag-coded value deltas and
+publishes one block per MQTT message to TELEMETRY_BIN_TOPIC. The block
+layout is documented at the top of that file.
+
+Use as a library:
+
+    from telemetry_bin_decode import decode_block
+    block = decode_block(payload)   # {"block": n, "wallclock": bool, "samples": [...]}
+
+Each sample is {"ts": ms, "values": {name: int}}; channels absent in a
+sample are left out. encode_block() is a reference encoder producing
+byte-identical output, used by --selftest.
+
+Usage:
+  telemetry_bin_decode.py FILE...            decode raw block files (JSON lines out)
+  telemetry_bin_decode.py --hex HEX...       decode hex-encoded blocks
+  telemetry_bin_decode.py --selftest         round-trip synthetic light/distance traces
+  telemetry_bin_decode.py --expect JSONL FILE...
+                                             check decoded blocks against the samples the
+                                             encoder was given (tools/telemetry_bin_test)
+  [--channels voltage_mV,ohms,distance_mm]   channel names, in firmware order
+"""
+
+import argparse
+import json
+import math
+import random
+import struct
+import sys
+
+MAGIC = ord("G")
+VERSION = 1
+FLAG_WALLCLOCK = 0x01
+HEADER = struct.Struct("<BBBBIqH")
+DEFAULT_CHANNELS = ["voltage_mV", "ohms", "distance_mm"]
+
+# (prefix, prefix bits, payload bits); the last entry takes everything else
+CODES = [(0b10, 2, 6), (0b110, 3, 13), (0b1110, 4, 20), (0b1111, 4, 40)]
+
+
+def _zigzag(v):
+    return (v << 1) ^ (v >> 63)
+
+
+def _unzigzag(z):
+    return (z >> 1) ^ -(z & 1)
+
+
+class _BitReader:
+    def __init__(self, data, pos_bits):
+        self.data = data
+        self.pos = pos_bits
+
+    def bits(self, n):
+        v = 0
+        for _ in range(n):
+            byte = self.pos >> 3
+            if byte >= len(self.data):
+                raise ValueError("truncated block")
+            v = (v << 1) | ((self.data[byte] >> (7 - (self.pos & 7))) & 1)
+            self.pos += 1
+        return v
+
+    def code(self):
+        if self.bits(1) == 0:
+            return 0
+        for i, (_, _, payload) in enumerate(CODES):
+            if i == len(CODES) - 1 or self.bits(1) == 0:
+                return _unzigzag(self.bits(payload))
+        raise AssertionError("unreachable")
+
+
+class _BitWriter:
+    def __init__(self):
+        self.out = bytearray()
+        self.n = 0
+
+    def bits(self, value, count):
+        for i in range(count - 1, -1, -1):
+            if self.n & 7 == 0:
+                self.out.append(0)
+            if (value >> i) & 1:
+                self.out[-1] |= 0x80 >> (self.n & 7)
+            self.n += 1
+
+    def code(self, value):
+        z = _zigzag(value)
+        if z == 0:
+            self.bits(0, 1)
+            return
+        for prefix, plen, payload in CODES:
+            if z < (1 << payload) or payload == CODES[-1][2]:
+                self.bits(prefix, plen)
+                self.bits(z, payload)
+                return
+
+
+def decode_block(data, channels=None):
+    """Decode one block (bytes) into a dict."""
+    if len(data) < HEADER.size:
+        raise ValueError("block shorter than its header")
+    magic, version, flags, nch, block_no, t0, count = HEADER.unpack_from(data)
+    if magic != MAGIC or version != VERSION:
+        raise ValueError(f"not a version {VERSION} block (magic {magic:#x}, version {version})")
+    names = list(channels or DEFAULT_CHANNELS)
+    names += [f"ch{i}" for i in range(len(names), nch)]
+
+    r = _BitReader(data, HEADER.size * 8)
+    prev_t, prev_delta, mask = t0, 0, 0
+    prev_v = [0] * nch
+    samples = []
+    for _ in range(count):
+        delta = prev_delta + r.code()
+        t = prev_t + delta
+        prev_t, prev_delta = t, delta
+        if r.bits(1):
+            mask = r.bits(nch)
+        values = {}
+        for c in range(nch):
+            if mask & (1 << c):
+                prev_v[c] += r.code()
+                values[names[c]] = prev_v[c]
+        samples.append({"ts": t, "values": values})
+    return {"block": block_no, "wallclock": bool(flags & FLAG_WALLCLOCK), "samples": samples}
+
+
+def encode_block(samples, nch, block_no=0, wallclock=True):
+    """Reference encoder: samples are (ts_ms, [values], present_mask) tuples."""
+    t0 = samples[0][0] if samples else 0
+    w = _BitWriter()
+    prev_t, prev_delta, prev_mask = t0, 0, 0
+    prev_v = [0] * nch
+    for t, values, mask in samples:
+        delta = t - prev_t
+        w.code(delta - prev_delta)
+        prev_t, prev_delta = t, delta
+        mask &= (1 << nch) - 1
+        if mask == prev_mask:
+            w.bits(0, 1)
+        else:
+            w.bits(1, 1)
+            w.bits(mask, nch)
+            prev_mask = mask
+        for c in range(nch):
+            if mask & (1 << c):
+                w.code(values[c] - prev_v[c])
+                prev_v[c] = values[c]
+    header = HEADER.pack(MAGIC, VERSION, FLAG_WALLCLOCK if wallclock else 0, nch, block_no, t0, len(samples))
+    return header + bytes(w.out)
+
+
+def _synthetic_trace(n, seed, period_ms=1000):
+    """Light (LDR) and ultrasonic distance readings with sensor noise and jitter."""
+    rnd = random.Random(seed)
+    t = 1_700_000_000_000
+    out = []
+    for i in range(n):
+        t += period_ms + rnd.randint(-3, 3)
+        lux = 0.5 + 0.5 * math.sin(i / 300.0)
+        ohms = int(2000 + 40000 * (1 - lux)) + rnd.randint(-60, 60)
+        mv = int(3300 * 10000 / (10000 + ohms)) + rnd.randint(-2, 2)
+        have_distance = rnd.random() > 0.02
+        dist = 850 + (400 if (i // 120) % 2 else 0) + rnd.randint(-4, 4)
+        out.append((t, [mv, ohms, dist], 0x7 if have_distance else 0x3))
+    return out
+
+
+def _json_size(samples, seq0=0):
+    total = 0
+    for i, (t, v, mask) in enumerate(samples):
+        values = {"voltage_mV": v[0], "ohms": v[1]}
+        if mask & 4:
+            values["distance_mm"] = v[2]
+        values["seq"] = seq0 + i
+        total += len(json.dumps({"ts": t, "values": values}, separators=(",", ":")))
+    return total
+
+
+def selftest():
+    ok = True
+    for seed in range(5):
+        trace = _synthetic_trace(64 * 20, seed)
+        packed = 0
+        for b in range(0, len(trace), 64):
+            chunk = trace[b:b + 64]
+            blob = encode_block(chunk, 3, block_no=b // 64)
+            packed += len(blob)
+            got = decode_block(blob)
+            want = [{"ts": t, "values": {DEFAULT_CHANNELS[c]: v[c] for c in range(3) if m & (1 << c)}}
+                    for t, v, m in chunk]
+            if got["samples"] != want or got["block"] != b // 64:
+                print(f"seed {seed} block {b // 64}: round trip mismatch", file=sys.stderr)
+                ok = False
+        raw = _json_size(trace)
+        print(f"seed {seed}: {len(trace)} samples, JSON {raw} B, binary {packed} B, "
+              f"{raw / packed:.1f}x smaller ({packed * 8 / len(trace):.1f} bits/sample)")
+    # edge cases: extreme deltas, clock steps, empty masks
+    edge = [(0, [0, 0, 0], 0), (5, [2**31 - 1, -2**31, 7], 7), (4, [-2**31, 2**31 - 1, 7], 5),
+            (10**10, [1, 2, 3], 7), (10**10 + 1, [1, 2, 3], 0)]
+    got = decode_block(encode_block(edge, 3, wallclock=False))
+    if [s["ts"] for s in got["samples"]] != [e[0] for e in edge] or got["wallclock"]:
+        print("edge case timestamps mismatch", file=sys.stderr)
+        ok = False
+    if got["samples"][1]["values"] != {"voltage_mV": 2**31 - 1, "ohms": -2**31, "distance_mm": 7}:
+        print("edge case values mismatch", file=sys.stderr)
+        ok = False
+    print("selftest", "passed" if ok else "FAILED")
+    return 0 if ok else 1
+
+
+def check_expected(blocks, path):
+    """Compare the samples of consecutive blocks with JSON lines {"wallclock", "ts", "values"}."""
+    with open(path) as f:
+        want = [json.loads(line) for line in f if line.strip()]
+    got = [{"wallclock": b["wallclock"], "ts": s["ts"], "values": s["values"]} for b in blocks for s in b["samples"]]
+    ok = True
+    for i, b in enumerate(blocks[1:], start=1):
+        if b["block"] != blocks[0]["block"] + i:
+            print(f"block {i}: number {b['block']}, expected {blocks[0]['block'] + i}", file=sys.stderr)
+            ok = False
+    for i, (g, w) in enumerate(zip(got, want)):
+        if g != w:
+            print(f"sample {i}: decoded {g}, expected {w}", file=sys.stderr)
+            ok = False
+            break
+    if len(got) != len(want):
+        print(f"decoded {len(got)} samples, expected {len(want)}", file=sys.stderr)
+        ok = False
+    print(f"{len(blocks)} blocks, {len(got)} samples:", "match" if ok else "MISMATCH")
+    return 0 if ok else 1
+
+
+def main(argv=None):
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("files", nargs="*")
+    ap.add_argument("--hex", nargs="*", default=[])
+    ap.add_argument("--channels", default=",".join(DEFAULT_CHANNELS))
+    ap.add_argument("--selftest", action="store_true")
+    ap.add_argument("--expect", metavar="JSONL", help="check the decoded samples against this file")
+    args = ap.parse_args(argv)
+    if args.selftest:
+        return selftest()
+
+    names = [c for c in args.channels.split(",") if c]
+    blobs = [bytes.fromhex(h) for h in args.hex]
+    for path in args.files:
+        with open(path, "rb") as f:
+            blobs.append(f.read())
+    if not blobs:
+        ap.error("nothing to decode")
+    if args.expect:
+        return check_expected([decode_block(blob, names) for blob in blobs], args.expect)
+    for blob in blobs:
+        block = decode_block(blob, names)
+        for s in block["samples"]:
+            print(json.dumps({"block": block["block"], **s}))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,4 @@
+/* Host stand-in for the ESP-IDF header, enough to build components/telemetry/telemetry_binary.c. */
+#pragma once
+typedef enum { ESP_RST_UNKNOWN, ESP_RST_POWERON, ESP_RST_SW, ESP_RST_PANIC, ESP_RST_DEEPSLEEP } esp_reset_reason_t;
+esp_reset_reason_t esp_reset_reason(void);
@@ -0,0 +1,4 @@
+/* Host stand-in for the ESP-IDF header, enough to build components/telemetry/telemetry_binary.c. */
+#pragma once
+#include <stdint.h>
+int64_t esp_timer_get_time(void);
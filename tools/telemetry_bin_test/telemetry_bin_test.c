@@ -0,0 +1,224 @@
+/*
+ * telemetry_bin_test.c
+ *
+ * Host build of components/telemetry/telemetry_binary.c: feeds samples
+ * through telemetry_binary_append() and writes every block the encoder
+ * publishes to OUTDIR/block-NNN.bin, and the samples it was given to
+ * OUTDIR/expected.jsonl. tools/telemetry_bin_decode.py --expect then
+ * decodes the blocks and checks them against the samples, so the C
+ * encoder and the Python decoder are tested against each other.
+ *
+ * The clock is simulated: time() and clock_gettime() are renamed at build
+ * time so the test can run with and without a valid wall clock, and step
+ * it backwards. The trace covers jittered periods, a distance channel
+ * that is absent in ~2% of samples, deltas large enough to fill a block
+ * by size before it reaches 64 samples, int32 extremes, empty masks, a
+ * clock that becomes valid, a clock step backwards and a stale block.
+ *
+ * Build and run from the repository root:
+ *   cc -O2 -Itools/telemetry_bin_test/host_include -Icomponents/telemetry/include -Icomponents/telemetry \
+ *      -Icomponents/mqtt_manager/include -Dtime=host_time -Dclock_gettime=host_clock_gettime \
+ *      tools/telemetry_bin_test/telemetry_bin_test.c components/telemetry/telemetry_binary.c \
+ *      -o /tmp/telemetry_bin_test
+ *   /tmp/telemetry_bin_test /tmp/bin_blocks
+ *   tools/telemetry_bin_decode.py --expect /tmp/bin_blocks/expected.jsonl /tmp/bin_blocks/block-*.bin
+ */
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/semphr.h"
+#include "mqtt.h"
+#include "telemetry.h"
+#include "telemetry_internal.h"
+
+#define TOPIC "site/test/bin"
+#define MAX_BLOCK_BYTES 512
+
+static const char *s_dir;
+static FILE *s_expected;
+static unsigned s_blocks;
+static size_t s_block_bytes;
+static unsigned s_samples;
+static int s_failures;
+
+/* Simulated clocks; s_wall_ms == 0 means SNTP has not run yet. */
+static int64_t s_uptime_us = 3000000;
+static int64_t s_wall_ms;
+
+/* ---- host stand-ins ---- */
+
+esp_reset_reason_t esp_reset_reason(void) { return ESP_RST_POWERON; }
+SemaphoreHandle_t xSemaphoreCreateMutex(void) { return (SemaphoreHandle_t)1; }
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks) { return 1; }
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem) { return 1; }
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *fmt, ...)
+{
+    if (level > ESP_LOG_WARN) return;
+    va_list ap;
+    va_start(ap, fmt);
+    printf("%s: ", tag);
+    vprintf(fmt, ap);
+    printf("\n");
+    va_end(ap);
+}
+
+int64_t esp_timer_get_time(void)
+{
+    return s_uptime_us;
+}
+
+time_t host_time(time_t *out)
+{
+    time_t t = s_wall_ms ? (time_t)(s_wall_ms / 1000) : 1000;
+    if (out) *out = t;
+    return t;
+}
+
+int host_clock_gettime(clockid_t id, struct timespec *tsp)
+{
+    tsp->tv_sec = (time_t)(s_wall_ms / 1000);
+    tsp->tv_nsec = (long)(s_wall_ms % 1000) * 1000000;
+    return 0;
+}
+
+bool mqtt_publish_raw(const char *topic, const void *data, size_t len, int qos, mqtt_prio_t lane)
+{
+    if (strcmp(topic, TOPIC) != 0 || len > MAX_BLOCK_BYTES || qos != 1 || lane != MQTT_PRIO_TELEMETRY)
+    {
+        printf("FAILED: block %u published to %s, %zu bytes, qos %d, lane %d\n", s_blocks, topic, len, qos, (int)lane);
+        s_failures++;
+    }
+    char path[512];
+    snprintf(path, sizeof(path), "%s/block-%03u.bin", s_dir, s_blocks++);
+    FILE *f = fopen(path, "wb");
+    if (!f || fwrite(data, 1, len, f) != len)
+    {
+        perror(path);
+        exit(2);
+    }
+    fclose(f);
+    s_block_bytes += len;
+    return true;
+}
+
+/* ---- trace ---- */
+
+static const char *s_names[] = { "voltage_mV", "ohms", "distance_mm" };
+
+static void sample(const int32_t *v, uint32_t mask)
+{
+    int64_t ts = s_wall_ms ? s_wall_ms : s_uptime_us / 1000;
+    telemetry_binary_append(v, mask);
+    fprintf(s_expected, "{\"wallclock\": %s, \"ts\": %lld, \"values\": {", s_wall_ms ? "true" : "false", (long long)ts);
+    const char *sep = "";
+    for (int c = 0; c < 3; ++c)
+    {
+        if (!(mask & (1u << c))) continue;
+        fprintf(s_expected, "%s\"%s\": %ld", sep, s_names[c], (long)v[c]);
+        sep = ", ";
+    }
+    fprintf(s_expected, "}}\n");
+    s_samples++;
+}
+
+static void advance(int64_t ms)
+{
+    s_uptime_us += ms * 1000;
+    if (s_wall_ms) s_wall_ms += ms;
+}
+
+static int jitter(int n)
+{
+    return rand() % (2 * n + 1) - n;
+}
+
+// Light (LDR) and ultrasonic distance readings, as in telemetry_bin_decode.py's selftest.
+static void light_trace(int n, int period_ms)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        advance(period_ms + jitter(3));
+        int32_t ohms = 2000 + (i % 600 < 300 ? 40 * (i % 300) : 12000 - 40 * (i % 300)) + jitter(60);
+        int32_t v[3] = { 3300 * 10000 / (10000 + ohms) + jitter(2), ohms, 850 + ((i / 120) % 2 ? 400 : 0) + jitter(4) };
+        sample(v, rand() % 50 ? 0x7 : 0x3);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s OUTDIR\n", argv[0]);
+        return 2;
+    }
+    s_dir = argv[1];
+    if (mkdir(s_dir, 0755) != 0 && errno != EEXIST)
+    {
+        perror(s_dir);
+        return 2;
+    }
+    char path[512];
+    snprintf(path, sizeof(path), "%s/expected.jsonl", s_dir);
+    s_expected = fopen(path, "w");
+    if (!s_expected)
+    {
+        perror(path);
+        return 2;
+    }
+    srand(1);
+    if (!telemetry_binary_init(TOPIC, 3))
+    {
+        printf("FAILED: telemetry_binary_init\n");
+        return 1;
+    }
+
+    // before SNTP: ms since boot, 5 s period
+    light_trace(150, 5000);
+
+    // clock set: the next sample starts a wall-clock block; 0.5 s period fills blocks by count
+    s_wall_ms = 1700000000000LL;
+    light_trace(200, 500);
+
+    // noisy channel: blocks fill by size, not by sample count
+    for (int i = 0; i < 80; ++i)
+    {
+        advance(1000 + jitter(400));
+        int32_t v[3] = { (rand() % 2000000) - 1000000, rand() % 9000000, rand() % 4000 };
+        sample(v, 0x7);
+    }
+
+    // extremes and empty masks
+    const int32_t ext[][3] = { { INT32_MAX, INT32_MIN, 0 }, { INT32_MIN, INT32_MAX, 7 }, { 0, 0, 0 }, { 1, 2, 3 } };
+    const uint32_t ext_mask[] = { 0x7, 0x5, 0x0, 0x2 };
+    for (int i = 0; i < 4; ++i)
+    {
+        advance(i == 2 ? 3600000 : 1);
+        sample(ext[i], ext_mask[i]);
+    }
+
+    // clock stepped back by an hour: a new block
+    s_wall_ms -= 3600000;
+    light_trace(10, 1000);
+
+    // a block older than TELEMETRY_BIN_FLUSH_MS is published on the next append
+    advance(61000);
+    light_trace(3, 1000);
+
+    telemetry_binary_flush();
+    fclose(s_expected);
+
+    if (s_blocks == 0 || s_samples == 0) s_failures++;
+    printf("%u samples in %u blocks, %zu bytes (%.1f bits/sample)\n", s_samples, s_blocks, s_block_bytes,
+           s_block_bytes * 8.0 / s_samples);
+    printf("%s\n", s_failures ? "FAILED" : "ok");
+    return s_failures ? 1 : 0;
+}
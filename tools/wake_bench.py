@@ -0,0 +1,245 @@
+#!/usr/bin/env python3
+"""Network part of a battery wake: CoAP batch vs. MQTT connect + publish.
+
+Replays what one timer wake puts on the wire, with the firmware's framing:
+
+  coap  one confirmable POST /api/v1/<token>/telemetry carrying the batch as
+        a JSON array (components/telemetry/telemetry_coap.c), until its ACK
+  mqtt  TCP connect, CONNECT/CONNACK, one QoS 1 PUBLISH per record (sent
+        back to back, as the publish queue does), all PUBACKs, DISCONNECT
+
+and reports the time from the first packet until the device could sleep.
+WiFi association and sensor reads come on top and are the same for both;
+on the device, deepsleep_manager logs the whole "Awake for N ms".
+
+By default both sides run against built-in stand-ins on 127.0.0.1 that
+hold every response back by --rtt-ms to model the WiFi/WAN round trip. A
+stand-in cannot delay the kernel's SYN-ACK, so one RTT is added for the TCP
+handshake, and --tls-rtts more for an mqtts handshake (2 for TLS 1.2).
+With --coap-server / --mqtt-server real servers are used instead, e.g. a
+local libcoap `coap-server` and mosquitto; no delay is added to those.
+
+  wake_bench.py [--wakes 20] [--records 8] [--rtt-ms 40] [--tls-rtts 0]
+                [--coap-server HOST:PORT] [--mqtt-server HOST:PORT]
+"""
+
+import argparse
+import json
+import os
+import socket
+import struct
+import sys
+import threading
+import time
+
+TOKEN = "wakebenchtoken00000"
+
+
+def records(n, seq0=1000):
+    ts = int(time.time() * 1000)
+    return [json.dumps({"ts": ts + i * 5000, "values": {"voltage_mV": 1650 + i, "ohms": 10234 + 7 * i,
+                                                       "distance_mm": 812 - i, "seq": seq0 + i}},
+                       separators=(",", ":")) for i in range(n)]
+
+
+# ---- CoAP (RFC 7252), same encoding as telemetry_coap.c ----
+
+def coap_option(last, number, value):
+    delta, length = number - last, len(value)
+    out = bytearray([0])
+    nd = delta if delta < 13 else 13
+    nl = length if length < 13 else 13 if length < 269 else 14
+    if nd == 13:
+        out.append(delta - 13)
+    if nl == 13:
+        out.append(length - 13)
+    elif nl == 14:
+        out += struct.pack(">H", length - 269)
+    out[0] = nd << 4 | nl
+    return bytes(out) + value
+
+
+def coap_post(msg_id, token, payload):
+    pdu = bytearray([1 << 6 | 0 << 4 | len(token), 0x02]) + struct.pack(">H", msg_id) + token
+    last = 0
+    for seg in (b"api", b"v1", TOKEN.encode(), b"telemetry"):
+        pdu += coap_option(last, 11, seg)
+        last = 11
+    pdu += coap_option(last, 12, bytes([50]))
+    return bytes(pdu) + b"\xff" + payload
+
+
+def coap_wake(addr, batch):
+    payload = ("[" + ",".join(batch) + "]").encode()
+    msg_id, token = int.from_bytes(os.urandom(2), "big"), os.urandom(4)
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.connect(addr)
+    pdu = coap_post(msg_id, token, payload)
+    t0 = time.perf_counter()
+    timeout = 2.0
+    for _ in range(5):
+        s.send(pdu)
+        s.settimeout(timeout)
+        try:
+            while True:
+                rsp = s.recv(1500)
+                tkl = rsp[0] & 0x0F
+                if struct.unpack(">H", rsp[2:4])[0] == msg_id and (rsp[1] == 0 or rsp[4:4 + tkl] == token):
+                    s.close()
+                    return (time.perf_counter() - t0) * 1000, len(pdu)
+        except socket.timeout:
+            timeout *= 2
+    s.close()
+    raise RuntimeError("no CoAP ACK")
+
+
+def coap_standin(sock, rtt):
+    while True:
+        req, peer = sock.recvfrom(2048)
+        tkl = req[0] & 0x0F
+        time.sleep(rtt)
+        # piggybacked 2.04 Changed with the request's message ID and token
+        sock.sendto(bytes([1 << 6 | 2 << 4 | tkl, 0x44]) + req[2:4] + req[4:4 + tkl], peer)
+
+
+# ---- MQTT 3.1.1 ----
+
+def mqtt_len(n):
+    out = bytearray()
+    while True:
+        b, n = n % 128, n // 128
+        out.append(b | (0x80 if n else 0))
+        if not n:
+            return bytes(out)
+
+
+def mqtt_str(s):
+    return struct.pack(">H", len(s)) + s
+
+
+def mqtt_packet(kind, body):
+    return bytes([kind]) + mqtt_len(len(body)) + body
+
+
+def mqtt_read(sock):
+    head = sock.recv(1)
+    if not head:
+        return None, b""
+    n, mult = 0, 1
+    while True:
+        b = sock.recv(1)[0]
+        n += (b & 0x7F) * mult
+        mult *= 128
+        if not b & 0x80:
+            break
+    body = b""
+    while len(body) < n:
+        body += sock.recv(n - len(body))
+    return head[0], body
+
+
+def mqtt_wake(addr, batch, extra_rtts, rtt):
+    t0 = time.perf_counter()
+    s = socket.create_connection(addr)
+    s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    time.sleep(extra_rtts * rtt)
+    # level 4, flags: username + clean session; ThingsBoard takes the token as username
+    connect = mqtt_str(b"MQTT") + bytes([4, 0x82]) + struct.pack(">H", 60) + mqtt_str(b"wakebench") + mqtt_str(TOKEN.encode())
+    s.sendall(mqtt_packet(0x10, connect))
+    kind, _ = mqtt_read(s)
+    if kind != 0x20:
+        raise RuntimeError("no CONNACK")
+    wire = 2 + len(connect)
+    for i, rec in enumerate(batch, start=1):
+        pkt = mqtt_packet(0x32, mqtt_str(b"v1/devices/me/telemetry") + struct.pack(">H", i) + rec.encode())
+        wire += len(pkt)
+        s.sendall(pkt)
+    acked = 0
+    while acked < len(batch):
+        kind, _ = mqtt_read(s)
+        if kind == 0x40:
+            acked += 1
+    s.sendall(b"\xe0\x00")
+    s.close()
+    return (time.perf_counter() - t0) * 1000, wire
+
+
+def mqtt_standin_client(conn, rtt):
+    conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    with conn:
+        while True:
+            kind, body = mqtt_read(conn)
+            if kind is None or kind == 0xE0:
+                return
+            if kind == 0x10:
+                time.sleep(rtt)
+                conn.sendall(b"\x20\x02\x00\x00")
+            elif kind >> 4 == 3:
+                topic_len = struct.unpack(">H", body[:2])[0]
+                pid = body[2 + topic_len:4 + topic_len]
+                threading.Timer(rtt, conn.sendall, args=(b"\x40\x02" + pid,)).start()
+
+
+def mqtt_standin(sock, rtt):
+    while True:
+        conn, _ = sock.accept()
+        threading.Thread(target=mqtt_standin_client, args=(conn, rtt), daemon=True).start()
+
+
+def parse_addr(text):
+    host, _, port = text.rpartition(":")
+    return host, int(port)
+
+
+def stats(samples):
+    samples = sorted(samples)
+    return sum(samples) / len(samples), samples[min(len(samples) - 1, int(len(samples) * 0.95))]
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--wakes", type=int, default=20)
+    ap.add_argument("--records", type=int, default=8, help="records sent per wake (CoAP batch size)")
+    ap.add_argument("--rtt-ms", type=float, default=40.0, help="round trip added by the stand-ins")
+    ap.add_argument("--tls-rtts", type=int, default=0, help="extra round trips for an mqtts handshake")
+    ap.add_argument("--coap-server", help="HOST:PORT of a real CoAP server (e.g. libcoap coap-server)")
+    ap.add_argument("--mqtt-server", help="HOST:PORT of a real MQTT broker")
+    args = ap.parse_args()
+    rtt = args.rtt_ms / 1000.0
+
+    if args.coap_server:
+        coap_addr, coap_rtt = parse_addr(args.coap_server), 0.0
+    else:
+        u = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        u.bind(("127.0.0.1", 0))
+        threading.Thread(target=coap_standin, args=(u, rtt), daemon=True).start()
+        coap_addr, coap_rtt = u.getsockname(), rtt
+    if args.mqtt_server:
+        mqtt_addr, mqtt_rtt = parse_addr(args.mqtt_server), 0.0
+    else:
+        t = socket.socket()
+        t.bind(("127.0.0.1", 0))
+        t.listen(4)
+        threading.Thread(target=mqtt_standin, args=(t, rtt), daemon=True).start()
+        mqtt_addr, mqtt_rtt = t.getsockname(), rtt
+
+    results = {"coap": [], "mqtt": []}
+    wire = {}
+    for w in range(args.wakes):
+        batch = records(args.records, seq0=1000 + w * args.records)
+        ms, wire["coap"] = coap_wake(coap_addr, batch)
+        results["coap"].append(ms)
+        ms, wire["mqtt"] = mqtt_wake(mqtt_addr, batch, (1 + args.tls_rtts) if not args.mqtt_server else args.tls_rtts, mqtt_rtt)
+        results["mqtt"].append(ms)
+
+    print("%d wakes, %d records each, rtt %s" % (args.wakes, args.records,
+                                                 "%.0f ms (stand-ins)" % args.rtt_ms if not (args.coap_server and args.mqtt_server) else "of the real servers"))
+    print("%-5s %9s %9s %10s" % ("", "mean ms", "p95 ms", "sent B"))
+    for name in ("coap", "mqtt"):
+        mean, p95 = stats(results[name])
+        print("%-5s %9.1f %9.1f %10d" % (name, mean, p95, wire[name]))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())